@@ -1,4 +1,17 @@
 call cl2008.cmd
-cl /MP4 /nologo /EHsc /I. /Feluascript_unittest_vs2008.exe /DWIN32 ^
-  luascript\luascript.cpp luascript\luascript_unittest.cpp runner.cpp ^
-  luascript\lua\lua-files.c gtest\gtest-all.cc
+cl /MP4 /nologo /EHsc /I. /Feembed.exe /DWIN32 ^
+  embed.cpp luascript\luascript.cpp luascript\lua\lua-files.c
+embed.exe lib\lualibs.cpp lib\base64.lua lib\hex.lua lib\percent.lua ^
+  lib\smart_hex_dump.lua
+cd luascript\lua
+cl /MP4 /nologo /Fe..\..\luac.exe /DWIN32 ^
+  luac.c print.c native.c lapi.c lauxlib.c lcode.c ldebug.c ldo.c ^
+  ldump.c lfunc.c lgc.c ljit.c llex.c lmem.c lnative.c lobject.c ^
+  lopcodes.c lopt.c lparser.c lstate.c lstring.c ltable.c ltm.c ^
+  lundump.c lvm.c lzio.c
+cd ..\..
+luac.exe -c native_test -o luascript\native_test.c luascript\native_test.lua
+cl /MP4 /nologo /EHsc /I. /Iluascript\lua /Feluascript_unittest_vs2008.exe ^
+  /DWIN32 luascript\luascript.cpp luascript\luascript_unittest.cpp ^
+  runner.cpp luascript\lua\lua-files.c luascript\native_test.c ^
+  lib\lualibs.cpp gtest\gtest-all.cc
@@ -0,0 +1,88 @@
+// Copyright (c) 2009 by Alexander Demin
+
+// Precompiles Lua modules into a C++ source file of byte arrays, so that
+// programs can preload them without lexing and parsing at startup:
+//
+//   embed lib/lualibs.cpp lib/base64.lua lib/hex.lua ...
+//
+// The bytecode matches the interpreter this tool is built with, so the
+// file is generated as part of the build, not kept in the tree. Modules
+// are dumped as images into arrays of words, which keeps them aligned:
+// every state preloading them then shares their code in place.
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "luascript/luascript.h"
+
+namespace {
+
+// Module name of a file: its base name without the extension.
+std::string module_name(const std::string& path) {
+  size_t begin = path.find_last_of("/\\");
+  begin = begin == std::string::npos ? 0 : begin + 1;
+  size_t end = path.rfind('.');
+  if (end == std::string::npos || end < begin)
+    end = path.size();
+  return path.substr(begin, end - begin);
+}
+
+// Words are written in the host byte order, as the bytecode itself.
+void write_array(std::ofstream& os, const std::string& name,
+                 const std::string& code) {
+  os << "const unsigned int " << name << "[] = {";
+  for (size_t i = 0; i < code.size(); i += 4) {
+    unsigned int word = 0;
+    std::memcpy(&word, code.data() + i,
+                code.size() - i < 4 ? code.size() - i : 4);
+    char hex[16];
+    std::sprintf(hex, "0x%08x,", word);
+    os << (i % 24 == 0 ? "\n  " : " ") << hex;
+  }
+  os << "\n};\n\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s output.cpp module.lua...\n", argv[0]);
+    return 1;
+  }
+  try {
+    lua script;
+    std::vector<size_t> sizes;
+    std::ofstream os(argv[1]);
+    os << "// Generated by embed.cpp. Do not edit.\n\n"
+       << "#include \"lib/lualibs.h\"\n\n"
+       << "namespace {\n\n";
+    for (int i = 2; i < argc; ++i) {
+      script.set_variable<lua::string_arg_t>("path", argv[i]);
+      script.exec("chunk = assert(loadfile(path))");
+      std::string code = script.dump_image("chunk");
+      sizes.push_back(code.size());
+      write_array(os, "module_" + module_name(argv[i]), code);
+    }
+    os << "}  // namespace\n\n"
+       << "const lualib_t lualibs[] = {\n";
+    for (int i = 2; i < argc; ++i) {
+      std::string name = module_name(argv[i]);
+      os << "  {\"" << name << "\", "
+         << "reinterpret_cast<const unsigned char*>(module_" << name << "), "
+         << sizes[i - 2] << "},\n";
+    }
+    os << "  {0, 0, 0}\n"
+       << "};\n";
+    if (!os) {
+      std::fprintf(stderr, "%s: cannot write %s\n", argv[0], argv[1]);
+      return 1;
+    }
+  } catch(const lua::exception& e) {
+    std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+// Copyright (c) 2009 by Alexander Demin
+
+#ifndef _LUALIBS_H
+#define _LUALIBS_H
+
+#include <cstddef>
+
+// Modules of lib/*.lua, precompiled at build time by embed.cpp into
+// lib/lualibs.cpp. Preload them with lua::preload(): their code is
+// aligned images, shared by all the states instead of copied.
+struct lualib_t {
+  const char* name;
+  const unsigned char* code;
+  size_t size;
+};
+
+// Ends with an entry of null name.
+extern const lualib_t lualibs[];
+
+#endif
@@ -11,10 +11,13 @@
 #include "ldump.c"
 #include "lfunc.c"
 #include "lgc.c"
+#include "ljit.c"
 #include "llex.c"
 #include "lmem.c"
+#include "lnative.c"
 #include "lobject.c"
 #include "lopcodes.c"
+#include "lopt.c"
 #include "lparser.c"
 #include "lstate.c"
 #include "lstring.c"
@@ -26,6 +29,7 @@
 
 #include "lauxlib.c"
 #include "lbaselib.c"
+#include "lbuflib.c"
 #include "ldblib.c"
 #include "liolib.c"
 #include "linit.c"
@@ -21,7 +21,9 @@
 #include "lfunc.h"
 #include "lgc.h"
 #include "lmem.h"
+#include "lnative.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
@@ -500,6 +502,37 @@ LUA_API void lua_pushcclosure (lua_State *L, lua_CFunction fn, int n) {
 }
 
 
+LUA_API void lua_setlight (lua_State *L, int idx, lua_CFunction light,
+                           int nargs) {
+  StkId o;
+  lua_lock(L);
+  o = index2adr(L, idx);
+  api_check(L, iscfunction(o));
+  api_check(L, 0 <= nargs && nargs <= LUA_MINSTACK);
+  clvalue(o)->c.light = light;
+  clvalue(o)->c.nlight = cast_byte(nargs);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_setbuiltins (lua_State *L, int idx, const char *lib) {
+  StkId t;
+  int b;
+  lua_lock(L);
+  t = index2adr(L, idx);
+  api_check(L, ttistable(t));
+  for (b = BUILTIN_NONE+1; b < NUM_BUILTINS; b++) {
+    if (strcmp(luaP_builtins[b].lib, lib) == 0) {
+      TString *name = luaS_new(L, luaP_builtins[b].name);
+      const TValue *f = luaH_getstr(hvalue(t), name);
+      if (iscfunction(f))
+        clvalue(f)->c.builtin = cast_byte(b);
+    }
+  }
+  lua_unlock(L);
+}
+
+
 LUA_API void lua_pushboolean (lua_State *L, int b) {
   lua_lock(L);
   setbvalue(L->top, (b != 0));  /* ensure that true is 1 */
@@ -887,6 +920,85 @@ LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data) {
 }
 
 
+/*
+** like lua_dump, in the image format: vectors are aligned so that
+** lua_loadimage can use them without copying
+*/
+LUA_API int lua_dumpimage (lua_State *L, lua_Writer writer, void *data) {
+  int status;
+  TValue *o;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  o = L->top - 1;
+  if (isLfunction(o))
+    status = luaU_dumpimage(L, clvalue(o)->l.p, writer, data);
+  else
+    status = 1;
+  lua_unlock(L);
+  return status;
+}
+
+
+typedef struct LoadImage {
+  const char *s;
+  size_t size;
+} LoadImage;
+
+
+static const char *getimage (lua_State *L, void *ud, size_t *size) {
+  LoadImage *li = (LoadImage *)ud;
+  (void)L;
+  if (li->size == 0) return NULL;
+  *size = li->size;
+  li->size = 0;
+  return li->s;
+}
+
+
+/*
+** loads a chunk held in memory that outlives the state, such as a
+** constant array: the code of an image (see lua_dumpimage) is not copied
+** and is shared by every state loading it
+*/
+LUA_API int lua_loadimage (lua_State *L, const char *image, size_t size,
+                           const char *chunkname) {
+  ZIO z;
+  int status;
+  LoadImage li;
+  lua_lock(L);
+  if (!chunkname) chunkname = "?";
+  li.s = image;
+  li.size = size;
+  luaZ_init(L, &z, getimage, &li);
+  z.inplace = 1;
+  status = luaD_protectedparser(L, &z, chunkname);
+  lua_unlock(L);
+  return status;
+}
+
+
+/*
+** loads a chunk translated to C by luac -c: its functions then run their
+** C code instead of being interpreted, while hooks are off
+*/
+LUA_API int lua_loadnative (lua_State *L, const lua_Native *n) {
+  int status = lua_loadimage(L, cast(const char *, n->image), n->size,
+                             n->name);
+  if (status == 0) {
+    lua_lock(L);
+    if (!luaN_bind(clvalue(L->top - 1)->l.p, n->code, n->ncode)) {
+      setsvalue2s(L, L->top - 1, luaS_newliteral(L,
+                  "native code does not match its bytecode"));
+      status = LUA_ERRSYNTAX;
+    }
+    else
+      *n->vm = &luaN_vm;
+    lua_unlock(L);
+  }
+  return status;
+}
+
+
 LUA_API int  lua_status (lua_State *L) {
   return L->status;
 }
@@ -948,6 +1060,15 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       g->gcstepmul = data;
       break;
     }
+    case LUA_GCCOMPACT: {
+      lu_mem before;
+      luaC_fullgc(L);
+      before = g->totalbytes;
+      luaC_compact(L);
+      /* released memory is expressed in Kbytes */
+      res = (g->totalbytes < before) ? cast_int((before-g->totalbytes) >> 10) : 0;
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1014,6 +1135,65 @@ LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
 }
 
 
+/*
+** turns on or off the optimizer for the chunks loaded from source;
+** returns the previous setting
+*/
+LUA_API int lua_setoptimize (lua_State *L, int on) {
+  int old;
+  lua_lock(L);
+  old = G(L)->optimize;
+  G(L)->optimize = cast_byte(on != 0);
+  lua_unlock(L);
+  return old;
+}
+
+
+/*
+** makes threads start with stacks of `stacksize' slots and `cisize'
+** call frames, and grows the stacks of `L' to that now: a deep call
+** chain of threads thus presized runs without moving their stacks
+*/
+LUA_API void lua_setstacksizes (lua_State *L, int stacksize, int cisize) {
+  global_State *g;
+  lua_lock(L);
+  g = G(L);
+  g->stacksize = (stacksize > BASIC_STACK_SIZE) ? stacksize : BASIC_STACK_SIZE;
+  g->cisize = (cisize > BASIC_CI_SIZE) ? cisize : BASIC_CI_SIZE;
+  if (g->cisize > LUAI_MAXCALLS) g->cisize = LUAI_MAXCALLS;
+  if (L->stacksize < g->stacksize + EXTRA_STACK)
+    luaD_reallocstack(L, g->stacksize);
+  if (L->size_ci < g->cisize)
+    luaD_reallocCI(L, g->cisize);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_getstackstats (lua_State *L, lua_StackStats *stats) {
+  lua_lock(L);
+  *stats = G(L)->stackstats;
+  lua_unlock(L);
+}
+
+
+/*
+** turns on or off the trace compiler of hot loops (a no-op when it is
+** not built in); returns the previous setting
+*/
+LUA_API int lua_setjit (lua_State *L, int on) {
+  int old;
+  lua_lock(L);
+  old = G(L)->jit;
+#if defined(LUA_USE_JIT)
+  G(L)->jit = cast_byte(on != 0);
+#else
+  UNUSED(on);
+#endif
+  lua_unlock(L);
+  return old;
+}
+
+
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
   lua_lock(L);
   G(L)->ud = ud;
@@ -1022,6 +1202,42 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
 }
 
 
+static const lu_byte arraysizes[] = {
+  0, sizeof(unsigned char), sizeof(LUAI_INT32), sizeof(double)
+};
+
+
+LUA_API lua_Array *lua_newarray (lua_State *L, int kind, size_t n) {
+  Udata *u;
+  lua_Array *a;
+  api_check(L, LUA_ARRAYUINT8 <= kind && kind <= LUA_ARRAYFLOAT64);
+  lua_lock(L);
+  luaC_checkGC(L);
+  if (n > (MAX_SIZET - sizeof(lua_Array)) / arraysizes[kind])
+    luaM_toobig(L);
+  u = luaS_newudata(L, sizeof(lua_Array) + n * arraysizes[kind],
+                    getcurrenv(L));
+  u->uv.array = cast_byte(kind);
+  a = arrayvalue(u);
+  a->data = a + 1;
+  a->n = n;
+  a->readonly = 0;
+  memset(a->data, 0, n * arraysizes[kind]);
+  setuvalue(L, L->top, u);
+  api_incr_top(L);
+  lua_unlock(L);
+  return a;
+}
+
+
+LUA_API lua_Array *lua_toarray (lua_State *L, int idx, int *kind) {
+  StkId o = index2adr(L, idx);
+  if (!ttisuserdata(o) || uvalue(o)->array == 0) return NULL;
+  if (kind) *kind = uvalue(o)->array;
+  return arrayvalue(rawuvalue(o));
+}
+
+
 LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
   Udata *u;
   lua_lock(L);
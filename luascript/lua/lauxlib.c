@@ -268,6 +268,16 @@ LUALIB_API void luaI_openlib (lua_State *L, const char *libname,
 }
 
 
+/* sets the light entries of functions of the table on the top */
+LUALIB_API void luaL_setlights (lua_State *L, const luaL_Light *l) {
+  for (; l->name; l++) {
+    lua_getfield(L, -1, l->name);
+    lua_setlight(L, -1, l->light, l->nargs);
+    lua_pop(L, 1);
+  }
+}
+
+
 
 /*
 ** {======================================================
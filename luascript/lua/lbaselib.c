@@ -192,9 +192,9 @@ static int luaB_gcinfo (lua_State *L) {
 
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
-    "count", "step", "setpause", "setstepmul", NULL};
+    "count", "step", "setpause", "setstepmul", "compact", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
-    LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL};
+    LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL, LUA_GCCOMPACT};
   int o = luaL_checkoption(L, 1, "collect", opts);
   int ex = luaL_optint(L, 2, 0);
   int res = lua_gc(L, optsnum[o], ex);
@@ -276,8 +276,18 @@ static int load_aux (lua_State *L, int status) {
 
 static int luaB_loadstring (lua_State *L) {
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
-  const char *chunkname = luaL_optstring(L, 2, s);
+  int kind;
+  const char *s, *chunkname;
+  lua_Array *a = lua_toarray(L, 1, &kind);
+  if (a != NULL && kind == LUA_ARRAYUINT8) {  /* e.g. a file from io.mmap */
+    s = (const char *)a->data;
+    l = a->n;
+    chunkname = luaL_optstring(L, 2, "=(buffer)");
+  }
+  else {
+    s = luaL_checklstring(L, 1, &l);
+    chunkname = luaL_optstring(L, 2, s);
+  }
   return load_aux(L, luaL_loadbuffer(L, s, l, chunkname));
 }
 
@@ -629,6 +639,7 @@ static void base_open (lua_State *L) {
   lua_setglobal(L, "_G");
   /* open lib into global table */
   luaL_register(L, "_G", base_funcs);
+  lua_setbuiltins(L, -1, "_G");
   lua_pushliteral(L, LUA_VERSION);
   lua_setglobal(L, "_VERSION");  /* set global _VERSION */
   /* `ipairs' and `pairs' need auxliliary functions as upvalues */
@@ -0,0 +1,246 @@
+/*
+** $Id: lbuflib.c $
+** Typed arrays (uint8, int32 and float64 buffers)
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stddef.h>
+#include <string.h>
+
+#define lbuflib_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+#define LUA_BUFFERHANDLE	"buffer"
+
+
+static const char *const kindnames[] = {"uint8", "int32", "float64", NULL};
+
+static const size_t kindsizes[] = {
+  0, sizeof(unsigned char), sizeof(LUAI_INT32), sizeof(double)
+};
+
+
+
+/*
+** only arrays made by this library: mapped files and line views may
+** release their memory while a slice still points into it
+*/
+static lua_Array *checkbuffer (lua_State *L, int narg, int *kind) {
+  lua_Array *a;
+  luaL_checkudata(L, narg, LUA_BUFFERHANDLE);
+  a = lua_toarray(L, narg, kind);
+  if (a == NULL) luaL_typerror(L, narg, LUA_BUFFERHANDLE);
+  return a;
+}
+
+
+static lua_Array *checkwritable (lua_State *L, int narg, int *kind) {
+  lua_Array *a = checkbuffer(L, narg, kind);
+  if (a->readonly) luaL_argerror(L, narg, "read-only buffer");
+  return a;
+}
+
+
+static lua_Array *newbuffer (lua_State *L, int kind, size_t n) {
+  lua_Array *a = lua_newarray(L, kind, n);
+  luaL_getmetatable(L, LUA_BUFFERHANDLE);
+  lua_setmetatable(L, -2);
+  return a;
+}
+
+
+static void setelem (lua_Array *a, int kind, size_t i, lua_Number v) {
+  switch (kind) {
+    case LUA_ARRAYUINT8: {
+      lua_Integer e;
+      lua_number2integer(e, v);
+      ((unsigned char *)a->data)[i] = (unsigned char)e;
+      break;
+    }
+    case LUA_ARRAYINT32: {
+      lua_Integer e;
+      lua_number2integer(e, v);
+      ((LUAI_INT32 *)a->data)[i] = (LUAI_INT32)e;
+      break;
+    }
+    default:
+      ((double *)a->data)[i] = (double)v;
+      break;
+  }
+}
+
+
+static ptrdiff_t relindex (ptrdiff_t pos, size_t len) {
+  /* relative position: negative means back from end */
+  if (pos < 0) pos += (ptrdiff_t)len + 1;
+  return (pos >= 0) ? pos : 0;
+}
+
+
+/*
+** translate optional arguments `i' and `j' into a range of elements;
+** returns the number of elements, with the first one in `*start'
+*/
+static size_t getrange (lua_State *L, lua_Array *a, int narg, size_t *start) {
+  ptrdiff_t i = relindex(luaL_optinteger(L, narg, 1), a->n);
+  ptrdiff_t j = relindex(luaL_optinteger(L, narg+1, -1), a->n);
+  if (i < 1) i = 1;
+  if (i > (ptrdiff_t)a->n + 1) i = (ptrdiff_t)a->n + 1;  /* start in range */
+  if (j > (ptrdiff_t)a->n) j = (ptrdiff_t)a->n;
+  *start = (size_t)(i - 1);
+  return (i <= j) ? (size_t)(j - i + 1) : 0;
+}
+
+
+static int buf_new (lua_State *L) {
+  int kind = luaL_checkoption(L, 1, NULL, kindnames) + 1;
+  if (lua_istable(L, 2)) {
+    size_t i, n = lua_objlen(L, 2);
+    lua_Array *a = newbuffer(L, kind, n);
+    for (i = 0; i < n; i++) {
+      lua_rawgeti(L, 2, (int)i + 1);
+      if (!lua_isnumber(L, -1))
+        luaL_error(L, "number expected at index %d", (int)i + 1);
+      setelem(a, kind, i, lua_tonumber(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  else {
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n >= 0, 2, "invalid size");
+    newbuffer(L, kind, (size_t)n);
+  }
+  return 1;
+}
+
+
+static int buf_fromstring (lua_State *L) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  int kind = luaL_checkoption(L, 2, "uint8", kindnames) + 1;
+  lua_Array *a;
+  luaL_argcheck(L, l % kindsizes[kind] == 0, 1,
+                "length is not a multiple of the element size");
+  a = newbuffer(L, kind, l / kindsizes[kind]);
+  memcpy(a->data, s, l);
+  return 1;
+}
+
+
+static int buf_tostring (lua_State *L) {
+  int kind;
+  lua_Array *a = checkbuffer(L, 1, &kind);
+  size_t start;
+  size_t n = getrange(L, a, 2, &start);
+  lua_pushlstring(L, (const char *)a->data + start * kindsizes[kind],
+                  n * kindsizes[kind]);
+  return 1;
+}
+
+
+/*
+** a slice shares the storage of its parent, which is kept alive
+** through the environment of the slice
+*/
+static int buf_slice (lua_State *L) {
+  int kind = 0;
+  lua_Array *a = checkbuffer(L, 1, &kind);
+  size_t start;
+  size_t n = getrange(L, a, 2, &start);
+  lua_Array *s = newbuffer(L, kind, 0);
+  s->data = (char *)a->data + start * kindsizes[kind];
+  s->n = n;
+  s->readonly = a->readonly;
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+
+static int buf_fill (lua_State *L) {
+  int kind;
+  lua_Array *a = checkwritable(L, 1, &kind);
+  lua_Number v = luaL_checknumber(L, 2);
+  size_t i, start;
+  size_t n = getrange(L, a, 3, &start);
+  if (n == 0) return 0;  /* empty range */
+  if (kind == LUA_ARRAYUINT8) {
+    setelem(a, kind, start, v);
+    memset((unsigned char *)a->data + start,
+           ((unsigned char *)a->data)[start], n);
+  }
+  else {
+    for (i = start; i < start + n; i++)
+      setelem(a, kind, i, v);
+  }
+  return 0;
+}
+
+
+static int buf_type (lua_State *L) {
+  int kind = 0;
+  checkbuffer(L, 1, &kind);
+  lua_pushstring(L, kindnames[kind - 1]);
+  return 1;
+}
+
+
+/*
+** reached only when the VM could not store the element directly
+*/
+static int buf_newindex (lua_State *L) {
+  int kind;
+  lua_Array *a = checkwritable(L, 1, &kind);
+  lua_Number k = luaL_checknumber(L, 2);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, (lua_Number)i == k && 1 <= i && (size_t)i <= a->n, 2,
+                "index out of range");
+  setelem(a, kind, (size_t)(i - 1), luaL_checknumber(L, 3));
+  return 0;
+}
+
+
+static const luaL_Reg buflib[] = {
+  {"fromstring", buf_fromstring},
+  {"new", buf_new},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg bufmeta[] = {
+  {"fill", buf_fill},
+  {"slice", buf_slice},
+  {"tostring", buf_tostring},
+  {"type", buf_type},
+  {"__newindex", buf_newindex},
+  {NULL, NULL}
+};
+
+
+static void createbufmeta (lua_State *L) {
+  luaL_newmetatable(L, LUA_BUFFERHANDLE);  /* create metatable for buffers */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_register(L, NULL, bufmeta);  /* buffer methods */
+  lua_pop(L, 1);
+}
+
+
+/*
+** Open buffer library
+*/
+LUALIB_API int luaopen_buffer (lua_State *L) {
+  createbufmeta(L);
+  luaL_register(L, LUA_BUFLIBNAME, buflib);
+  return 1;
+}
+
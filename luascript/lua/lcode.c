@@ -6,6 +6,7 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 
 #define lcode_c
 #define LUA_CORE
@@ -67,7 +68,12 @@ int luaK_jump (FuncState *fs) {
 
 
 void luaK_ret (FuncState *fs, int first, int nret) {
-  luaK_codeABC(fs, OP_RETURN, first, nret+1, 0);
+  if (nret == 0)
+    luaK_codeABC(fs, OP_RETURN0, 0, 0, 0);
+  else if (nret == 1)
+    luaK_codeABC(fs, OP_RETURN1, first, 0, 0);
+  else
+    luaK_codeABC(fs, OP_RETURN, first, nret+1, 0);
 }
 
 
@@ -277,9 +283,40 @@ static int nilK (FuncState *fs) {
 }
 
 
+/*
+** the builtin (see luaP_builtins) that a call of `lib.name' may be: `lib'
+** is "string" for methods of strings, and "_G" for globals
+*/
+int luaK_builtin (const char *lib, TString *name) {
+  int b;
+  for (b = BUILTIN_NONE+1; b < NUM_BUILTINS; b++) {
+    if (strcmp(getstr(name), luaP_builtins[b].name) == 0 &&
+        strcmp(lib, luaP_builtins[b].lib) == 0)
+      return b;
+  }
+  return BUILTIN_NONE;
+}
+
+
+/* a call of a builtin for one result becomes OP_CALLB */
+static void callbuiltin (FuncState *fs, expdesc *e) {
+  Instruction *pc = &getcode(fs, e);
+  int b = e->u.s.aux;
+  int nargs = GETARG_B(*pc) - 1;
+  if (b != BUILTIN_NONE && GET_OPCODE(*pc) == OP_CALL &&
+      luaP_builtins[b].minargs <= nargs && nargs <= luaP_builtins[b].maxargs) {
+    SET_OPCODE(*pc, OP_CALLB);
+    SETARG_C(*pc, b);
+  }
+}
+
+
 void luaK_setreturns (FuncState *fs, expdesc *e, int nresults) {
   if (e->k == VCALL) {  /* expression is an open function call? */
+    lua_assert(GET_OPCODE(getcode(fs, e)) == OP_CALL ||
+               GET_OPCODE(getcode(fs, e)) == OP_SELECT);
     SETARG_C(getcode(fs, e), nresults+1);
+    if (nresults == 1) callbuiltin(fs, e);
   }
   else if (e->k == VVARARG) {
     SETARG_B(getcode(fs, e), nresults+1);
@@ -291,6 +328,7 @@ void luaK_setreturns (FuncState *fs, expdesc *e, int nresults) {
 
 void luaK_setoneret (FuncState *fs, expdesc *e) {
   if (e->k == VCALL) {  /* expression is an open function call? */
+    callbuiltin(fs, e);
     e->k = VNONRELOC;
     e->u.s.info = GETARG_A(getcode(fs, e));
   }
@@ -273,14 +273,19 @@ LUA_API int lua_getinfo (lua_State *L, const char *what, lua_Debug *ar) {
 
 
 
+#define isreturn(i)	(GET_OPCODE(i) == OP_RETURN || \
+	GET_OPCODE(i) == OP_RETURN0 || GET_OPCODE(i) == OP_RETURN1)
+
 static int precheck (const Proto *pt) {
   check(pt->maxstacksize <= MAXSTACK);
   check(pt->numparams+(pt->is_vararg & VARARG_HASARG) <= pt->maxstacksize);
   check(!(pt->is_vararg & VARARG_NEEDSARG) ||
               (pt->is_vararg & VARARG_HASARG));
+  check(!(pt->is_vararg & VARARG_UNUSED) ||
+              (pt->is_vararg & VARARG_ISVARARG));
   check(pt->sizeupvalues <= pt->nups);
   check(pt->sizelineinfo == pt->sizecode || pt->sizelineinfo == 0);
-  check(pt->sizecode > 0 && GET_OPCODE(pt->code[pt->sizecode-1]) == OP_RETURN);
+  check(pt->sizecode > 0 && isreturn(pt->code[pt->sizecode-1]));
   return 1;
 }
 
@@ -434,11 +439,26 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
         if (reg >= a) last = pc;  /* affect all registers above base */
         break;
       }
+      case OP_CALLB: {
+        check(b != 0);
+        checkreg(pt, a+b-1);
+        check(BUILTIN_NONE < c && c < NUM_BUILTINS);
+        if (reg >= a) last = pc;  /* may be a call */
+        break;
+      }
       case OP_RETURN: {
         b--;  /* b = num. returns */
         if (b > 0) checkreg(pt, a+b-1);
         break;
       }
+      case OP_RETURN0: {
+        check(a == 0);
+        break;
+      }
+      case OP_RETURN1: {
+        checkreg(pt, a);
+        break;
+      }
       case OP_SETLIST: {
         if (b > 0) checkreg(pt, a + b);
         if (c == 0) {
@@ -462,12 +482,25 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
       }
       case OP_VARARG: {
         check((pt->is_vararg & VARARG_ISVARARG) &&
-             !(pt->is_vararg & VARARG_NEEDSARG));
+             !(pt->is_vararg & (VARARG_NEEDSARG | VARARG_UNUSED)));
         b--;
         if (b == LUA_MULTRET) check(checkopenop(pt, pc));
         checkreg(pt, a+b-1);
         break;
       }
+      case OP_SELECT: {
+        check((pt->is_vararg & VARARG_ISVARARG) &&
+             !(pt->is_vararg & (VARARG_NEEDSARG | VARARG_UNUSED)));
+        checkreg(pt, a+1);
+        c--;  /* c = num. returns */
+        if (c == LUA_MULTRET) {
+          check(checkopenop(pt, pc));
+        }
+        else if (c != 0)
+          checkreg(pt, a+c-1);
+        if (reg >= a) last = pc;  /* may be a call */
+        break;
+      }
       default: break;
     }
   }
@@ -548,6 +581,7 @@ static const char *getfuncname (lua_State *L, CallInfo *ci, const char **name) {
   ci--;  /* calling function */
   i = ci_func(ci)->l.p->code[currentpc(L, ci)];
   if (GET_OPCODE(i) == OP_CALL || GET_OPCODE(i) == OP_TAILCALL ||
+      GET_OPCODE(i) == OP_CALLB || GET_OPCODE(i) == OP_SELECT ||
       GET_OPCODE(i) == OP_TFORLOOP)
     return getobjname(L, ci, GETARG_A(i), name);
   else
@@ -21,6 +21,7 @@
 #include "lmem.h"
 #include "lobject.h"
 #include "lopcodes.h"
+#include "lopt.h"
 #include "lparser.h"
 #include "lstate.h"
 #include "lstring.h"
@@ -127,13 +128,16 @@ static void correctstack (lua_State *L, TValue *oldstack) {
   CallInfo *ci;
   GCObject *up;
   L->top = (L->top - oldstack) + L->stack;
-  for (up = L->openupval; up != NULL; up = up->gch.next)
+  for (up = L->openupval; up != NULL; up = up->gch.next) {
     gco2uv(up)->v = (gco2uv(up)->v - oldstack) + L->stack;
+    G(L)->stackstats.fixups++;
+  }
   for (ci = L->base_ci; ci <= L->ci; ci++) {
     ci->top = (ci->top - oldstack) + L->stack;
     ci->base = (ci->base - oldstack) + L->stack;
     ci->func = (ci->func - oldstack) + L->stack;
   }
+  G(L)->stackstats.fixups += cast(unsigned long, L->ci - L->base_ci + 1);
   L->base = (L->base - oldstack) + L->stack;
 }
 
@@ -141,17 +145,23 @@ static void correctstack (lua_State *L, TValue *oldstack) {
 void luaD_reallocstack (lua_State *L, int newsize) {
   TValue *oldstack = L->stack;
   int realsize = newsize + 1 + EXTRA_STACK;
+  lua_StackStats *stats = &G(L)->stackstats;
   lua_assert(L->stack_last - L->stack == L->stacksize - EXTRA_STACK - 1);
   luaM_reallocvector(L, L->stack, L->stacksize, realsize, TValue);
   L->stacksize = realsize;
   L->stack_last = L->stack+newsize;
   correctstack(L, oldstack);
+  stats->stackreallocs++;
+  if (stats->maxstack < realsize) stats->maxstack = realsize;
 }
 
 
 void luaD_reallocCI (lua_State *L, int newsize) {
   CallInfo *oldci = L->base_ci;
+  lua_StackStats *stats = &G(L)->stackstats;
   luaM_reallocvector(L, L->base_ci, L->size_ci, newsize, CallInfo);
+  stats->cireallocs++;
+  if (stats->maxci < newsize) stats->maxci = newsize;
   L->size_ci = newsize;
   L->ci = (L->ci - oldci) + L->base_ci;
   L->end_ci = L->base_ci + L->size_ci - 1;
@@ -275,7 +285,7 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
     Proto *p = cl->p;
     luaD_checkstack(L, p->maxstacksize);
     func = restorestack(L, funcr);
-    if (!p->is_vararg) {  /* no varargs? */
+    if (luaD_fixedargs(p)) {  /* no varargs? */
       base = func + 1;
       if (L->top > base + p->numparams)
         L->top = base + p->numparams;
@@ -360,6 +370,48 @@ int luaD_poscall (lua_State *L, StkId firstResult) {
 }
 
 
+/*
+** Call C function `func' through its light entry (see lua_setlight),
+** without a CallInfo: the current frame lends its base and top for the
+** call. Returns 0, leaving the stack as it was, when the entry does not
+** take these arguments; `func' must then be called as usual.
+*/
+int luaD_lightcall (lua_State *L, StkId func, int nresults) {
+  CClosure *cl = &clvalue(func)->c;
+  ptrdiff_t funcr = savestack(L, func);
+  ptrdiff_t base = savestack(L, L->ci->base);
+  ptrdiff_t top = savestack(L, L->ci->top);
+  int nargs = cast_int(L->top - func) - 1;
+  StkId res;
+  int n, i;
+  if (nargs > cl->nlight || L->stack_last - L->top <= cl->nlight + LUA_MINSTACK)
+    return 0;
+  for (i = nargs; i < cl->nlight; i++)  /* complete missing arguments */
+    setnilvalue(L->top++);
+  L->base = L->ci->base = func + 1;
+  if (L->ci->top < L->top + LUA_MINSTACK)  /* never below the caller's frame */
+    L->ci->top = L->top + LUA_MINSTACK;  /* (a GC would shrink the stack) */
+  lua_unlock(L);
+  n = (*cl->light)(L);
+  lua_lock(L);
+  L->base = L->ci->base = restorestack(L, base);  /* the stack may have moved */
+  L->ci->top = restorestack(L, top);
+  res = restorestack(L, funcr);
+  if (n == LUA_LIGHTFAIL) {
+    L->top = res + 1 + nargs;
+    return 0;
+  }
+  lua_assert(0 <= n && n <= L->top - (res + 1));
+  /* move results to correct place */
+  for (i = nresults, func = L->top - n; i != 0 && func < L->top; i--)
+    setobjs2s(L, res++, func++);
+  while (i-- > 0)
+    setnilvalue(res++);
+  L->top = res;
+  return 1;
+}
+
+
 /*
 ** Call a function (C or Lua). The function to be called is at *func.
 ** The arguments are on the stack, right after the function.
@@ -394,6 +446,8 @@ static void resume (lua_State *L, void *ud) {
     if (!f_isLua(ci)) {  /* `common' yield? */
       /* finish interrupted execution of `OP_CALL' */
       lua_assert(GET_OPCODE(*((ci-1)->savedpc - 1)) == OP_CALL ||
+                 GET_OPCODE(*((ci-1)->savedpc - 1)) == OP_CALLB ||
+                 GET_OPCODE(*((ci-1)->savedpc - 1)) == OP_SELECT ||
                  GET_OPCODE(*((ci-1)->savedpc - 1)) == OP_TAILCALL);
       if (luaD_poscall(L, firstArg))  /* complete it... */
         L->top = L->ci->top;  /* and correct top if not multiple results */
@@ -452,6 +506,15 @@ LUA_API int lua_yield (lua_State *L, int nresults) {
 }
 
 
+/*
+** true when `lua_yield' would not fail: `L' is a coroutine running
+** without a C call (pcall, metamethod, ...) between it and its resume
+*/
+LUA_API int lua_isyieldable (lua_State *L) {
+  return L != G(L)->mainthread && L->nCcalls <= L->baseCcalls;
+}
+
+
 int luaD_pcall (lua_State *L, Pfunc func, void *u,
                 ptrdiff_t old_top, ptrdiff_t ef) {
   int status;
@@ -496,6 +559,8 @@ static void f_parser (lua_State *L, void *ud) {
   luaC_checkGC(L);
   tf = ((c == LUA_SIGNATURE[0]) ? luaU_undump : luaY_parser)(L, p->z,
                                                              &p->buff, p->name);
+  if (c != LUA_SIGNATURE[0] && G(L)->optimize)
+    luaK_optimize(L, tf, &p->buff);  /* fresh code from the parser */
   cl = luaF_newLclosure(L, tf->nups, hvalue(gt(L)));
   cl->l.p = tf;
   for (i = 0; i < tf->nups; i++)  /* initialize eventual upvalues */
@@ -34,6 +34,16 @@
 #define PCRYIELD	2	/* C funtion yielded */
 
 
+/* do calls of `p' keep its fixed parameters only, in place? */
+#define luaD_fixedargs(p)	(!(p)->is_vararg || \
+	((p)->is_vararg & VARARG_UNUSED))
+
+
+/* can `f' be called through its light entry? */
+#define luaD_canlight(L,f)	(iscfunction(f) && clvalue(f)->c.light != NULL && \
+	!((L)->hookmask & (LUA_MASKCALL | LUA_MASKRET)))
+
+
 /* type of protected functions, to be ran by `runprotected' */
 typedef void (*Pfunc) (lua_State *L, void *ud);
 
@@ -44,6 +54,7 @@ LUAI_FUNC void luaD_call (lua_State *L, StkId func, int nResults);
 LUAI_FUNC int luaD_pcall (lua_State *L, Pfunc func, void *u,
                                         ptrdiff_t oldtop, ptrdiff_t ef);
 LUAI_FUNC int luaD_poscall (lua_State *L, StkId firstResult);
+LUAI_FUNC int luaD_lightcall (lua_State *L, StkId func, int nresults);
 LUAI_FUNC void luaD_reallocCI (lua_State *L, int newsize);
 LUAI_FUNC void luaD_reallocstack (lua_State *L, int newsize);
 LUAI_FUNC void luaD_growstack (lua_State *L, int n);
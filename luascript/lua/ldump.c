@@ -21,6 +21,8 @@ typedef struct {
  void* data;
  int strip;
  int status;
+ int image;				/* writing in the LUAC_IMAGE format? */
+ size_t pos;				/* bytes written so far */
 } DumpState;
 
 #define DumpMem(b,n,size,D)	DumpBlock(b,(n)*(size),D)
@@ -33,6 +35,7 @@ static void DumpBlock(const void* b, size_t size, DumpState* D)
   lua_unlock(D->L);
   D->status=(*D->writer)(D->L,b,size,D->data);
   lua_lock(D->L);
+  D->pos+=size;
  }
 }
 
@@ -55,6 +58,13 @@ static void DumpNumber(lua_Number x, DumpState* D)
 static void DumpVector(const void* b, int n, size_t size, DumpState* D)
 {
  DumpInt(n,D);
+ if (D->image)				/* align the elements */
+ {
+  static const char zeros[8]={0,0,0,0,0,0,0,0};
+  size_t pad=(size-D->pos%size)%size;
+  lua_assert(size<=sizeof(zeros));
+  DumpBlock(zeros,pad,D);
+ }
  DumpMem(b,n,size,D);
 }
 
@@ -144,13 +154,11 @@ static void DumpHeader(DumpState* D)
 {
  char h[LUAC_HEADERSIZE];
  luaU_header(h);
+ if (D->image) h[sizeof(LUA_SIGNATURE)]=(char)LUAC_IMAGE;	/* format */
  DumpBlock(h,LUAC_HEADERSIZE,D);
 }
 
-/*
-** dump Lua function as precompiled chunk
-*/
-int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip)
+static int Dump(lua_State* L, const Proto* f, lua_Writer w, void* data, int strip, int image)
 {
  DumpState D;
  D.L=L;
@@ -158,7 +166,25 @@ int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip
  D.data=data;
  D.strip=strip;
  D.status=0;
+ D.image=image;
+ D.pos=0;
  DumpHeader(&D);
  DumpFunction(f,NULL,&D);
  return D.status;
 }
+
+/*
+** dump Lua function as precompiled chunk
+*/
+int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip)
+{
+ return Dump(L,f,w,data,strip,0);
+}
+
+/*
+** dump Lua function as an image
+*/
+int luaU_dumpimage (lua_State* L, const Proto* f, lua_Writer w, void* data)
+{
+ return Dump(L,f,w,data,0,1);
+}
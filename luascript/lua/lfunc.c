@@ -14,6 +14,7 @@
 
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -26,6 +27,9 @@ Closure *luaF_newCclosure (lua_State *L, int nelems, Table *e) {
   c->c.isC = 1;
   c->c.env = e;
   c->c.nupvalues = cast_byte(nelems);
+  c->c.light = NULL;
+  c->c.nlight = 0;
+  c->c.builtin = 0;
   return c;
 }
 
@@ -128,6 +132,8 @@ Proto *luaF_newproto (lua_State *L) {
   f->numparams = 0;
   f->is_vararg = 0;
   f->maxstacksize = 0;
+  f->shared = 0;
+  f->native = NULL;
   f->lineinfo = NULL;
   f->sizelocvars = 0;
   f->locvars = NULL;
@@ -139,10 +145,15 @@ Proto *luaF_newproto (lua_State *L) {
 
 
 void luaF_freeproto (lua_State *L, Proto *f) {
-  luaM_freearray(L, f->code, f->sizecode, Instruction);
+#if defined(LUA_USE_JIT)
+  luaJ_freeproto(L, f);  /* drop the traces of its loops */
+#endif
+  if (!(f->shared & PROTO_SHAREDCODE))
+    luaM_freearray(L, f->code, f->sizecode, Instruction);
   luaM_freearray(L, f->p, f->sizep, Proto *);
   luaM_freearray(L, f->k, f->sizek, TValue);
-  luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
+  if (!(f->shared & PROTO_SHAREDLINEINFO))
+    luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
   luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
   luaM_freearray(L, f->upvalues, f->sizeupvalues, TString *);
   luaM_free(L, f);
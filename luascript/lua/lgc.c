@@ -155,31 +155,33 @@ size_t luaC_separateudata (lua_State *L, int all) {
 }
 
 
-static int traversetable (global_State *g, Table *h) {
-  int i;
-  int weakkey = 0;
-  int weakvalue = 0;
-  const TValue *mode;
-  if (h->metatable)
-    markobject(g, h->metatable);
-  mode = gfasttm(g, h->metatable, TM_MODE);
-  if (mode && ttisstring(mode)) {  /* is there a weak mode? */
-    weakkey = (strchr(svalue(mode), 'k') != NULL);
-    weakvalue = (strchr(svalue(mode), 'v') != NULL);
-    if (weakkey || weakvalue) {  /* is really weak? */
-      h->marked &= ~(KEYWEAK | VALUEWEAK);  /* clear bits */
-      h->marked |= cast_byte((weakkey << KEYWEAKBIT) |
-                             (weakvalue << VALUEWEAKBIT));
-      h->gclist = g->weak;  /* must be cleared after GC, ... */
-      g->weak = obj2gco(h);  /* ... so put in the appropriate list */
-    }
-  }
-  if (weakkey && weakvalue) return 1;
-  if (!weakvalue) {
-    i = h->sizearray;
-    while (i--)
-      markvalue(g, &h->array[i]);
+static void linkweak (GCObject **list, Table *h, int bits) {
+  h->marked |= cast_byte(bits);
+  h->gclist = *list;
+  *list = obj2gco(h);
+}
+
+
+/*
+** check a weak reference met during traversal. Strings are `values', so
+** they are marked and never removed. Returns 1 if the reference may have
+** to be cleared at the end of the cycle
+*/
+static int weakref (const TValue *o) {
+  if (!iscollectable(o)) return 0;
+  if (ttisstring(o)) {
+    stringmark(rawtsvalue(o));
+    return 0;
   }
+  return iswhite(gcvalue(o)) ||
+    (ttisuserdata(o) && isfinalized(uvalue(o)));
+}
+
+
+static void traversestrongtable (global_State *g, Table *h) {
+  int i = h->sizearray;
+  while (i--)
+    markvalue(g, &h->array[i]);
   i = sizenode(h);
   while (i--) {
     Node *n = gnode(h, i);
@@ -188,11 +190,147 @@ static int traversetable (global_State *g, Table *h) {
       removeentry(n);  /* remove empty entries */
     else {
       lua_assert(!ttisnil(gkey(n)));
-      if (!weakkey) markvalue(g, gkey(n));
-      if (!weakvalue) markvalue(g, gval(n));
+      markvalue(g, gkey(n));
+      markvalue(g, gval(n));
+    }
+  }
+}
+
+
+static void traverseweakvalue (global_State *g, Table *h) {
+  int clears = 0;  /* true if some value may be cleared */
+  int i = h->sizearray;
+  while (i--)
+    clears |= weakref(&h->array[i]);
+  i = sizenode(h);
+  while (i--) {
+    Node *n = gnode(h, i);
+    if (ttisnil(gval(n)))
+      removeentry(n);  /* remove empty entries */
+    else {
+      markvalue(g, gkey(n));
+      clears |= weakref(gval(n));
+    }
+  }
+  if (clears)
+    linkweak(&g->weak, h, VALUEWEAK);
+}
+
+
+/*
+** traverse a table with weak keys and strong values: a value is marked
+** only once its key is marked (ephemeron). Entries with an unmarked key
+** and an unmarked value keep the table in list `ephemeron', to be
+** visited again until no more values get marked. Returns 1 if some
+** value was marked
+*/
+static int traverseephemeron (global_State *g, Table *h) {
+  int marked = 0;  /* true if some value was marked */
+  int pending = 0;  /* true if some entry waits for its key */
+  int clears = 0;  /* true if some key may be cleared */
+  int i = h->sizearray;
+  while (i--) {  /* array part has numeric keys, so it is strong */
+    TValue *o = &h->array[i];
+    if (valiswhite(o)) {
+      marked = 1;
+      reallymarkobject(g, gcvalue(o));
+    }
+  }
+  i = sizenode(h);
+  while (i--) {
+    Node *n = gnode(h, i);
+    if (ttisnil(gval(n)))
+      removeentry(n);  /* remove empty entries */
+    else if (weakref(key2tval(n))) {  /* key not marked (yet)? */
+      clears = 1;
+      if (valiswhite(gval(n)))
+        pending = 1;
+    }
+    else if (valiswhite(gval(n))) {
+      marked = 1;
+      reallymarkobject(g, gcvalue(gval(n)));
+    }
+  }
+  if (pending)
+    linkweak(&g->ephemeron, h, KEYWEAK);
+  else if (clears)
+    linkweak(&g->allweak, h, KEYWEAK);
+  if (marked)
+    g->weakmarked = 1;
+  return marked;
+}
+
+
+static void traverseallweak (global_State *g, Table *h) {
+  int clears = 0;  /* true if some entry may be cleared */
+  int i = h->sizearray;
+  while (i--)
+    clears |= weakref(&h->array[i]);
+  i = sizenode(h);
+  while (i--) {
+    Node *n = gnode(h, i);
+    if (ttisnil(gval(n)))
+      removeentry(n);  /* remove empty entries */
+    else {
+      clears |= weakref(key2tval(n));
+      clears |= weakref(gval(n));
+    }
+  }
+  if (clears)
+    linkweak(&g->allweak, h, KEYWEAK | VALUEWEAK);
+}
+
+
+/*
+** Weak tables are made black like any other object. Those holding
+** references that may be cleared are put in one of the weak lists, with
+** bits KEYWEAK/VALUEWEAK telling its mode; new entries stored in them
+** while propagating are marked by the write barrier
+*/
+/* bits KEYWEAK/VALUEWEAK of the current `__mode' of a table */
+static int weakmode (global_State *g, Table *h) {
+  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  int bits = 0;
+  if (mode && ttisstring(mode)) {  /* is there a weak mode? */
+    if (strchr(svalue(mode), 'k') != NULL) bits |= KEYWEAK;
+    if (strchr(svalue(mode), 'v') != NULL) bits |= VALUEWEAK;
+  }
+  return bits;
+}
+
+
+static void traversetable (global_State *g, Table *h) {
+  int mode;
+  h->marked &= ~(KEYWEAK | VALUEWEAK);  /* clear bits */
+  if (h->metatable)
+    markobject(g, h->metatable);
+  mode = weakmode(g, h);
+  if (mode == (KEYWEAK | VALUEWEAK))
+    traverseallweak(g, h);
+  else if (mode == KEYWEAK)
+    traverseephemeron(g, h);
+  else if (mode == VALUEWEAK)
+    traverseweakvalue(g, h);
+  else
+    traversestrongtable(g, h);
+}
+
+
+/*
+** a weak table is not traversed again after its entries were looked at,
+** so it may have changed its mode since (`setmetatable(t, nil)'). Those
+** tables leave list `l' and are traversed again with their current mode
+*/
+static void checkweakmodes (global_State *g, GCObject **l) {
+  while (*l) {
+    Table *h = gco2h(*l);
+    if (weakmode(g, h) != (h->marked & (KEYWEAK | VALUEWEAK))) {
+      *l = h->gclist;  /* remove it */
+      traversetable(g, h);  /* (may put it back at the head of a list) */
     }
+    else
+      l = &h->gclist;
   }
-  return weakkey || weakvalue;
 }
 
 
@@ -243,11 +381,11 @@ static void checkstacksizes (lua_State *L, StkId max) {
   int s_used = cast_int(max - L->stack);  /* part of stack in use */
   if (L->size_ci > LUAI_MAXCALLS)  /* handling overflow? */
     return;  /* do not touch the stacks */
-  if (4*ci_used < L->size_ci && 2*BASIC_CI_SIZE < L->size_ci)
+  if (4*ci_used < L->size_ci && 2*G(L)->cisize < L->size_ci)
     luaD_reallocCI(L, L->size_ci/2);  /* still big enough... */
   condhardstacktests(luaD_reallocCI(L, ci_used + 1));
   if (4*s_used < L->stacksize &&
-      2*(BASIC_STACK_SIZE+EXTRA_STACK) < L->stacksize)
+      2*(G(L)->stacksize+EXTRA_STACK) < L->stacksize)
     luaD_reallocstack(L, L->stacksize/2);  /* still big enough... */
   condhardstacktests(luaD_reallocstack(L, s_used));
 }
@@ -282,8 +420,7 @@ static l_mem propagatemark (global_State *g) {
     case LUA_TTABLE: {
       Table *h = gco2h(o);
       g->gray = h->gclist;
-      if (traversetable(g, h))  /* table is weak? */
-        black2gray(o);  /* keep it gray */
+      traversetable(g, h);
       return sizeof(Table) + sizeof(TValue) * h->sizearray +
                              sizeof(Node) * sizenode(h);
     }
@@ -503,6 +640,9 @@ static void markroot (lua_State *L) {
   g->gray = NULL;
   g->grayagain = NULL;
   g->weak = NULL;
+  g->ephemeron = NULL;
+  g->allweak = NULL;
+  g->weakmarked = 1;
   markobject(g, g->mainthread);
   /* make global table be traversed before main stack */
   markvalue(g, gt(g->mainthread));
@@ -522,6 +662,45 @@ static void remarkupvals (global_State *g) {
 }
 
 
+/*
+** send the tables waiting on ephemeron entries back to the gray list, so
+** that they are visited again by the incremental mark
+*/
+static void regrayephemerons (global_State *g) {
+  GCObject *l = g->ephemeron;
+  g->ephemeron = NULL;
+  g->weakmarked = 0;
+  while (l) {
+    Table *h = gco2h(l);
+    l = h->gclist;
+    black2gray(obj2gco(h));
+    h->gclist = g->gray;
+    g->gray = obj2gco(h);
+  }
+}
+
+
+/*
+** traverse ephemeron tables until no more values get marked
+*/
+static void convergeephemerons (global_State *g) {
+  int changed;
+  do {
+    GCObject *l = g->ephemeron;
+    g->ephemeron = NULL;
+    changed = 0;
+    while (l) {
+      Table *h = gco2h(l);
+      l = h->gclist;
+      if (traverseephemeron(g, h)) {  /* marked some value? */
+        propagateall(g);  /* propagate changes */
+        changed = 1;  /* will have to revisit all ephemeron tables */
+      }
+    }
+  } while (changed);
+}
+
+
 static void atomic (lua_State *L) {
   global_State *g = G(L);
   size_t udsize;  /* total size of userdata to be finalized */
@@ -529,9 +708,6 @@ static void atomic (lua_State *L) {
   remarkupvals(g);
   /* traverse objects cautch by write barrier and by 'remarkupvals' */
   propagateall(g);
-  /* remark weak tables */
-  g->gray = g->weak;
-  g->weak = NULL;
   lua_assert(!iswhite(obj2gco(g->mainthread)));
   markobject(g, L);  /* mark running thread */
   markmt(g);  /* mark basic metatables (again) */
@@ -540,10 +716,20 @@ static void atomic (lua_State *L) {
   g->gray = g->grayagain;
   g->grayagain = NULL;
   propagateall(g);
+  /* weak tables whose mode changed after their traversal */
+  checkweakmodes(g, &g->weak);
+  checkweakmodes(g, &g->ephemeron);
+  checkweakmodes(g, &g->allweak);
+  propagateall(g);
+  convergeephemerons(g);
   udsize = luaC_separateudata(L, 0);  /* separate userdata to be finalized */
   marktmu(g);  /* mark `preserved' userdata */
   udsize += propagateall(g);  /* remark, to propagate `preserveness' */
-  cleartable(g->weak);  /* remove collected objects from weak tables */
+  convergeephemerons(g);
+  /* remove collected objects from weak tables */
+  cleartable(g->weak);
+  cleartable(g->ephemeron);
+  cleartable(g->allweak);
   /* flip current white */
   g->currentwhite = cast_byte(otherwhite(g));
   g->sweepstrgc = 0;
@@ -564,6 +750,10 @@ static l_mem singlestep (lua_State *L) {
     case GCSpropagate: {
       if (g->gray)
         return propagatemark(g);
+      else if (g->ephemeron && g->weakmarked) {  /* keys may be marked now */
+        regrayephemerons(g);
+        return 0;
+      }
       else {  /* no more `gray' objects */
         atomic(L);  /* finish mark phase */
         return 0;
@@ -643,6 +833,8 @@ void luaC_fullgc (lua_State *L) {
     g->gray = NULL;
     g->grayagain = NULL;
     g->weak = NULL;
+    g->ephemeron = NULL;
+    g->allweak = NULL;
     g->gcstate = GCSsweepstring;
   }
   lua_assert(g->gcstate != GCSpause && g->gcstate != GCSpropagate);
@@ -659,6 +851,53 @@ void luaC_fullgc (lua_State *L) {
 }
 
 
+static void shrinkstack (lua_State *L) {
+  CallInfo *ci;
+  StkId lim = L->top;
+  int ci_used = cast_int(L->ci - L->base_ci);  /* number of `ci' in use */
+  int s_used;
+  if (L->size_ci > LUAI_MAXCALLS)  /* handling overflow? */
+    return;  /* do not touch the stacks */
+  for (ci = L->base_ci; ci <= L->ci; ci++) {
+    if (lim < ci->top) lim = ci->top;
+  }
+  s_used = cast_int(lim - L->stack);  /* part of stack in use */
+  if (s_used < G(L)->stacksize)  /* not below the size it started with */
+    s_used = G(L)->stacksize;
+  if (s_used + 1 + EXTRA_STACK < L->stacksize)
+    luaD_reallocstack(L, s_used);
+  if (ci_used + 1 < G(L)->cisize)
+    ci_used = G(L)->cisize - 1;
+  if (ci_used + 1 < L->size_ci)
+    luaD_reallocCI(L, ci_used + 1);
+}
+
+
+/*
+** give back the slack left by peak usage: shrink the string table, the
+** shared buffer, the stack of every thread and every table to the least
+** sizes able to hold their current contents. Called after a full cycle
+*/
+void luaC_compact (lua_State *L) {
+  global_State *g = G(L);
+  GCObject *o;
+  int strtsize = MINSTRTABSIZE;
+  lua_assert(g->gcstate == GCSpause);
+  while (cast(lu_int32, strtsize) < g->strt.nuse && strtsize <= MAX_INT/2)
+    strtsize *= 2;
+  if (strtsize < g->strt.size)
+    luaS_resize(L, strtsize);
+  luaZ_resizebuffer(L, &g->buff, 0);
+  for (o = g->rootgc; o != NULL; o = o->gch.next) {
+    switch (o->gch.tt) {
+      case LUA_TTHREAD: shrinkstack(gco2th(o)); break;
+      case LUA_TTABLE: luaH_compact(L, gco2h(o)); break;
+      default: break;
+    }
+  }
+}
+
+
 void luaC_barrierf (lua_State *L, GCObject *o, GCObject *v) {
   global_State *g = G(L);
   lua_assert(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o));
@@ -672,11 +911,16 @@ void luaC_barrierf (lua_State *L, GCObject *o, GCObject *v) {
 }
 
 
-void luaC_barrierback (lua_State *L, Table *t) {
+void luaC_barrierback (lua_State *L, Table *t, GCObject *v) {
   global_State *g = G(L);
   GCObject *o = obj2gco(t);
   lua_assert(isblack(o) && !isdead(g, o));
   lua_assert(g->gcstate != GCSfinalize && g->gcstate != GCSpause);
+  if (g->gcstate == GCSpropagate && (t->marked & (KEYWEAK | VALUEWEAK))) {
+    /* weak tables are not traversed again; keep new entry for this cycle */
+    reallymarkobject(g, v);
+    return;
+  }
   black2gray(o);  /* make table gray (again) */
   t->gclist = g->grayagain;
   g->grayagain = o;
@@ -5,6 +5,11 @@
 */
 
 
+#if defined(LUA_USE_POSIX) && defined(__STRICT_ANSI__) && \
+    !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE	600	/* fileno, popen under -std=c89 */
+#endif
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +23,16 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#if defined(LUA_USE_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(LUA_WIN)
+#include <sys/stat.h>
+#include <windows.h>
+#endif
+
 
 
 #define IO_INPUT	1
@@ -228,27 +243,179 @@ static int io_output (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** LINE SCANNER
+** =======================================================
+*/
+
+
+#define LUA_VIEWHANDLE		"VIEW*"
+
+/* initial size of the buffer of a line scanner */
+#define SCAN_BUFFERSIZE		(64*1024)
+
+/* iterator results (other than lines as strings) */
+#define SCAN_STRINGS	0
+#define SCAN_VIEWS	(-1)  /* positive values are batch sizes */
+
+
+/*
+** chars read ahead by a scanner; lines are found in place with `memchr'
+*/
+typedef struct ScanBuffer {
+  size_t size;  /* capacity of `data' */
+  size_t pos;  /* first char not returned yet */
+  size_t len;  /* number of chars in `data' */
+  char data[1];
+} ScanBuffer;
+
+
+static ScanBuffer *newscanbuffer (lua_State *L, size_t size) {
+  ScanBuffer *b = (ScanBuffer *)lua_newuserdata(L,
+                                   sizeof(ScanBuffer) + size - 1);
+  b->size = size;
+  b->pos = b->len = 0;
+  return b;
+}
+
+
+/*
+** state of a scanner: a table with the buffer at [1] and, for views
+** and batches, the reused view or table at [2]. Views have the state
+** as environment, so the buffer they point into lives as long as they
+*/
+static void newscanstate (lua_State *L, int mode) {
+  lua_createtable(L, 2, 0);
+  newscanbuffer(L, SCAN_BUFFERSIZE);
+  lua_rawseti(L, -2, 1);
+  if (mode == SCAN_VIEWS) {
+    lua_Array *a = lua_newarray(L, LUA_ARRAYUINT8, 0);
+    a->readonly = 1;
+    luaL_getmetatable(L, LUA_VIEWHANDLE);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -2);
+    lua_setfenv(L, -2);
+    lua_rawseti(L, -2, 2);
+  }
+  else if (mode > 0) {
+    lua_createtable(L, mode, 0);
+    lua_rawseti(L, -2, 2);
+  }
+}
+
+
+/*
+** next line from the scanner with state at `st', reading more from
+** `f' as needed; the line is not copied. Returns NULL at end of file
+*/
+static const char *scanline (lua_State *L, FILE *f, int st, size_t *l) {
+  ScanBuffer *b;
+  lua_rawgeti(L, st, 1);
+  b = (ScanBuffer *)lua_touserdata(L, -1);
+  lua_pop(L, 1);  /* buffer is kept by the state */
+  for (;;) {
+    const char *line = b->data + b->pos;
+    const char *nl = (const char *)memchr(line, '\n', b->len - b->pos);
+    size_t nr;
+    if (nl != NULL) {
+      *l = nl - line;
+      b->pos += *l + 1;  /* skip `eol' */
+      return line;
+    }
+    if (b->pos > 0) {  /* move incomplete line to the beginning */
+      memmove(b->data, line, b->len - b->pos);
+      b->len -= b->pos;
+      b->pos = 0;
+    }
+    if (b->len == b->size) {  /* line does not fit? */
+      ScanBuffer *nb = newscanbuffer(L, 2 * b->size);
+      memcpy(nb->data, b->data, b->len);
+      nb->len = b->len;
+      lua_rawseti(L, st, 1);
+      b = nb;
+    }
+    nr = fread(b->data + b->len, sizeof(char), b->size - b->len, f);
+    if (nr == 0) {  /* eof? */
+      if (b->len == 0) return NULL;
+      *l = b->len;  /* last line has no `eol' */
+      b->pos = b->len;
+      return b->data;
+    }
+    b->len += nr;
+  }
+}
+
+
+static int view_tostring (lua_State *L) {
+  lua_Array *a = (lua_Array *)luaL_checkudata(L, 1, LUA_VIEWHANDLE);
+  lua_pushlstring(L, (const char *)a->data, a->n);
+  return 1;
+}
+
+
+static int view_newindex (lua_State *L) {
+  luaL_checkudata(L, 1, LUA_VIEWHANDLE);
+  return luaL_error(L, "attempt to modify a line view");
+}
+
+
+static const luaL_Reg viewlib[] = {
+  {"__newindex", view_newindex},
+  {"__tostring", view_tostring},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+
 static int io_readline (lua_State *L);
+static int io_scanline (lua_State *L);
 
 
-static void aux_lines (lua_State *L, int idx, int toclose) {
+/*
+** iterator over the lines of the file at `idx'. The optional format at
+** `how' asks for line views (`*v') or tables of up to n lines (a number
+** n). These, and files owned by the iterator, are read ahead through a
+** scanner; other files are read line by line, so that `read' calls may
+** be interleaved with the iteration
+*/
+static void aux_lines (lua_State *L, int idx, int toclose, int how) {
+  int mode = SCAN_STRINGS;
+  if (lua_type(L, how) == LUA_TNUMBER) {
+    mode = lua_tointeger(L, how);
+    luaL_argcheck(L, mode > 0, how, "invalid batch size");
+  }
+  else if (!lua_isnoneornil(L, how)) {
+    const char *p = luaL_checkstring(L, how);
+    luaL_argcheck(L, p[0] == '*' && p[1] == 'v', how, "invalid format");
+    mode = SCAN_VIEWS;
+  }
   lua_pushvalue(L, idx);
   lua_pushboolean(L, toclose);  /* close/not close file when finished */
-  lua_pushcclosure(L, io_readline, 2);
+  if (mode == SCAN_STRINGS && !toclose)
+    lua_pushcclosure(L, io_readline, 2);
+  else {
+    newscanstate(L, mode);
+    lua_pushinteger(L, mode);
+    lua_pushcclosure(L, io_scanline, 4);
+  }
 }
 
 
 static int f_lines (lua_State *L) {
   tofile(L);  /* check that it's a valid file handle */
-  aux_lines(L, 1, 0);
+  aux_lines(L, 1, 0, 2);
   return 1;
 }
 
 
 static int io_lines (lua_State *L) {
-  if (lua_isnoneornil(L, 1)) {  /* no arguments? */
+  lua_settop(L, 2);  /* file name and format */
+  if (lua_isnil(L, 1)) {  /* no file name? */
     /* will iterate over default input */
     lua_rawgeti(L, LUA_ENVIRONINDEX, IO_INPUT);
+    lua_replace(L, 1);
     return f_lines(L);
   }
   else {
@@ -257,7 +424,7 @@ static int io_lines (lua_State *L) {
     *pf = fopen(filename, "r");
     if (*pf == NULL)
       fileerror(L, 1, filename);
-    aux_lines(L, lua_gettop(L), 1);
+    aux_lines(L, lua_gettop(L), 1, 2);
     return 1;
   }
 }
@@ -310,6 +477,30 @@ static int read_line (lua_State *L, FILE *f) {
 }
 
 
+/*
+** number of bytes from the current position to the end of `f', if it
+** is a regular file; 0 if unknown
+*/
+static size_t filerest (FILE *f) {
+#if defined(LUA_USE_MMAP)
+  struct stat st;
+  long pos;
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) &&
+      (pos = ftell(f)) >= 0 && st.st_size > pos)
+    return (size_t)(st.st_size - pos);
+#elif defined(LUA_WIN)
+  struct _stat st;
+  long pos;
+  if (_fstat(_fileno(f), &st) == 0 && (st.st_mode & _S_IFREG) &&
+      (pos = ftell(f)) >= 0 && st.st_size > pos)
+    return (size_t)(st.st_size - pos);
+#else
+  (void)f;
+#endif
+  return 0;
+}
+
+
 static int read_chars (lua_State *L, FILE *f, size_t n) {
   size_t rlen;  /* how much to read */
   size_t nr;  /* number of chars actually read */
@@ -328,6 +519,25 @@ static int read_chars (lua_State *L, FILE *f, size_t n) {
 }
 
 
+/*
+** read the rest of the file; a regular file is read with a single
+** `fread' into a buffer sized from its length
+*/
+static void read_all (lua_State *L, FILE *f) {
+  size_t n = filerest(f);
+  if (n > 0) {
+    char *p = (char *)lua_newuserdata(L, n);
+    size_t nr = fread(p, sizeof(char), n, f);
+    lua_pushlstring(L, p, nr);
+    lua_remove(L, -2);  /* remove buffer */
+    if (nr < n) return;  /* eof (e.g. text mode) or error */
+    read_chars(L, f, ~((size_t)0));  /* file may have grown */
+    lua_concat(L, 2);
+  }
+  else read_chars(L, f, ~((size_t)0));  /* read MAX_SIZE_T chars */
+}
+
+
 static int g_read (lua_State *L, FILE *f, int first) {
   int nargs = lua_gettop(L) - 1;
   int success;
@@ -356,7 +566,7 @@ static int g_read (lua_State *L, FILE *f, int first) {
             success = read_line(L, f);
             break;
           case 'a':  /* file */
-            read_chars(L, f, ~((size_t)0));  /* read MAX_SIZE_T chars */
+            read_all(L, f);
             success = 1; /* always success */
             break;
           default:
@@ -404,6 +614,194 @@ static int io_readline (lua_State *L) {
   }
 }
 
+static int io_scanline (lua_State *L) {
+  FILE *f = *(FILE **)lua_touserdata(L, lua_upvalueindex(1));
+  int st = lua_upvalueindex(3);
+  int mode = lua_tointeger(L, lua_upvalueindex(4));
+  const char *line;
+  size_t l;
+  if (f == NULL)  /* file is already closed? */
+    luaL_error(L, "file is already closed");
+  if (mode > 0) {  /* batch of lines? */
+    int n = 0;
+    lua_rawgeti(L, st, 2);
+    while (n < mode && (line = scanline(L, f, st, &l)) != NULL) {
+      lua_pushlstring(L, line, l);
+      lua_rawseti(L, -2, ++n);
+    }
+    if (n > 0) {
+      int i;
+      for (i = n + 1; i <= mode; i++) {  /* clear rest of last batch */
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i);
+      }
+      return 1;
+    }
+  }
+  else if ((line = scanline(L, f, st, &l)) != NULL) {
+    if (mode == SCAN_VIEWS) {
+      lua_Array *a;
+      lua_rawgeti(L, st, 2);
+      a = lua_toarray(L, -1, NULL);
+      a->data = (void *)line;
+      a->n = l;
+    }
+    else
+      lua_pushlstring(L, line, l);
+    return 1;
+  }
+  if (ferror(f))
+    return luaL_error(L, "%s", strerror(errno));
+  /* EOF */
+  if (lua_toboolean(L, lua_upvalueindex(2))) {  /* generator created file? */
+    lua_settop(L, 0);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    aux_close(L);  /* close it */
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** MMAP
+** =======================================================
+*/
+
+
+#define LUA_MMAPHANDLE		"MMAP*"
+
+
+#if defined(LUA_USE_MMAP)
+
+static void *mapfile (const char *filename, size_t *n) {
+  void *p = NULL;
+  struct stat st;
+  int en;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return NULL;
+  if (fstat(fd, &st) == 0) {
+    if ((off_t)(size_t)st.st_size != st.st_size)
+      errno = EFBIG;  /* does not fit in the address space */
+    else if (st.st_size == 0) {  /* cannot map an empty file */
+      p = (void *)"";
+      *n = 0;
+    }
+    else {
+      p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) p = NULL;
+      else *n = (size_t)st.st_size;
+    }
+  }
+  en = errno;
+  close(fd);
+  errno = en;
+  return p;
+}
+
+
+#define unmapfile(p,n)	munmap(p, n)
+
+#elif defined(LUA_WIN)
+
+static void *mapfile (const char *filename, size_t *n) {
+  void *p = NULL;
+  LARGE_INTEGER size;
+  HANDLE m;
+  HANDLE h = CreateFileA(filename, GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE) {
+    errno = (GetLastError() == ERROR_ACCESS_DENIED) ? EACCES : ENOENT;
+    return NULL;
+  }
+  if (!GetFileSizeEx(h, &size) ||
+      (ULONGLONG)size.QuadPart != (size_t)size.QuadPart)
+    errno = EFBIG;
+  else if (size.QuadPart == 0) {  /* cannot map an empty file */
+    p = (void *)"";
+    *n = 0;
+  }
+  else if ((m = CreateFileMappingA(h, NULL, PAGE_READONLY, 0, 0, NULL))
+           == NULL)
+    errno = EACCES;
+  else {
+    p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (p == NULL) errno = ENOMEM;
+    else *n = (size_t)size.QuadPart;
+    CloseHandle(m);
+  }
+  CloseHandle(h);
+  return p;
+}
+
+
+#define unmapfile(p,n)	((void)(n), UnmapViewOfFile(p))
+
+#endif
+
+
+#if defined(LUA_USE_MMAP) || defined(LUA_WIN)
+
+/*
+** a mapped file is a read-only uint8 array over the mapping, so it can
+** be indexed like a buffer and searched in place by the string library
+** (io.mmap is left out where files cannot be mapped)
+*/
+static int io_mmap (lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  lua_Array *a = lua_newarray(L, LUA_ARRAYUINT8, 0);
+  size_t n;
+  void *p;
+  a->readonly = 1;
+  luaL_getmetatable(L, LUA_MMAPHANDLE);
+  lua_setmetatable(L, -2);
+  p = mapfile(filename, &n);
+  if (p == NULL) return pushresult(L, 0, filename);
+  a->data = p;
+  a->n = n;
+  return 1;
+}
+
+#endif
+
+
+static int mmap_close (lua_State *L) {
+  lua_Array *a = (lua_Array *)luaL_checkudata(L, 1, LUA_MMAPHANDLE);
+#if defined(LUA_USE_MMAP) || defined(LUA_WIN)
+  if (a->n > 0)  /* anything mapped? */
+    unmapfile(a->data, a->n);
+#endif
+  a->data = (void *)"";  /* mark mapping as closed */
+  a->n = 0;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int mmap_newindex (lua_State *L) {
+  luaL_checkudata(L, 1, LUA_MMAPHANDLE);
+  return luaL_error(L, "attempt to modify a mapped file");
+}
+
+
+static int mmap_tostring (lua_State *L) {
+  lua_Array *a = (lua_Array *)luaL_checkudata(L, 1, LUA_MMAPHANDLE);
+  lua_pushfstring(L, "mapped file (%p)", a->data);
+  return 1;
+}
+
+
+static const luaL_Reg mmaplib[] = {
+  {"close", mmap_close},
+  {"__gc", mmap_close},
+  {"__newindex", mmap_newindex},
+  {"__tostring", mmap_tostring},
+  {NULL, NULL}
+};
+
 /* }====================================================== */
 
 
@@ -479,6 +877,9 @@ static const luaL_Reg iolib[] = {
   {"flush", io_flush},
   {"input", io_input},
   {"lines", io_lines},
+#if defined(LUA_USE_MMAP) || defined(LUA_WIN)
+  {"mmap", io_mmap},
+#endif
   {"open", io_open},
   {"output", io_output},
   {"popen", io_popen},
@@ -509,6 +910,14 @@ static void createmeta (lua_State *L) {
   lua_pushvalue(L, -1);  /* push metatable */
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_register(L, NULL, flib);  /* file methods */
+  luaL_newmetatable(L, LUA_MMAPHANDLE);  /* metatable for mapped files */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, mmaplib);  /* mapped-file methods */
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LUA_VIEWHANDLE);  /* metatable for line views */
+  luaL_register(L, NULL, viewlib);
+  lua_pop(L, 1);
 }
 
 
@@ -0,0 +1,1328 @@
+/*
+** $Id: ljit.c $
+** Trace compiler for hot loops (x86-64)
+** See Copyright Notice in lua.h
+*/
+
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#define ljit_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#if defined(LUA_USE_JIT)
+
+#include <sys/mman.h>
+
+#include "lgc.h"
+#include "ljit.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "ltable.h"
+#include "lvm.h"
+
+#if !defined(MAP_ANONYMOUS)
+#if defined(MAP_ANON)
+#define MAP_ANONYMOUS	MAP_ANON
+#else
+#define MAP_ANONYMOUS	0x20	/* Linux value, hidden by strict feature macros */
+#endif
+#endif
+
+
+/*
+** A loop whose back-edge is taken JIT_HOTLOOP times is recorded: the
+** recorder runs one iteration itself, opcode by opcode, and writes down
+** each one specialized to the types it sees (the IR), with guards for
+** the types and branch directions it relies on. The IR is assembled
+** into a function that keeps every value in its stack slot, so a failed
+** guard only has to return the pc where the interpreter resumes (a side
+** exit). Opcodes that may call, allocate or raise errors end the
+** recording, and the loop is left to the interpreter.
+*/
+
+#define JIT_HOTLOOP	56	/* back-edges before a loop is recorded */
+#define JIT_HOTSIZE	64	/* slots of the hot-loop table (power of 2) */
+#define JIT_MAXABORT	4	/* failed recordings before giving up a loop */
+#define JIT_MAXRECORD	200	/* opcodes recorded in a trace */
+#define JIT_MAXIR	512	/* IR instructions of a trace */
+#define JIT_MAXEXIT	256	/* side exits of a trace */
+#define JIT_MAXTRACE	64	/* traces alive at once */
+#define JIT_MCBUF	(64*1024)	/* assembler buffer */
+#define JIT_AREA	(512*1024)	/* executable memory of a state */
+
+
+typedef struct jit_State jit_State;
+typedef struct RecState RecState;
+
+typedef const Instruction *(*jit_MCode) (lua_State *L, StkId base,
+                                         LClosure *cl);
+
+
+typedef struct Trace {
+  Proto *p;  /* function of the loop (NULL if the slot is free) */
+  jit_MCode mcode;
+} Trace;
+
+
+typedef struct HotLoop {
+  const Instruction *pc;  /* loop header */
+  Trace *trace;  /* its compiled trace, if any */
+  unsigned short count;  /* back-edges left before recording */
+  lu_byte aborts;  /* failed recordings */
+} HotLoop;
+
+
+/*
+** IR operations; operands are stack slots, or constants encoded by IRK
+*/
+enum {
+  IR_HEAD,	/* slot `a' has tag `t' (checked when entering the loop) */
+  IR_TAG,	/* slot `a' has tag `t' */
+  IR_MOV,	/* a = b */
+  IR_NIL,	/* a = nil */
+  IR_BOOL,	/* a = (boolean)v */
+  IR_ADD, IR_SUB, IR_MUL, IR_DIV, IR_MOD, IR_POW,  /* a = b op c (numbers) */
+  IR_UNM,	/* a = -b */
+  IR_NOT,	/* a = not b (b has tag `t') */
+  IR_LENS,	/* a = #b (string) */
+  IR_LENT,	/* a = #b (table) */
+  IR_LENA,	/* a = #b (typed array) */
+  IR_GETT,	/* a = b[c] (table, c has tag `t') */
+  IR_GETA,	/* a = b[c] (typed array of kind `t') */
+  IR_SETT,	/* a[b] = c (table, b has tag `v', c has tag `t') */
+  IR_SETA,	/* a[b] = c (typed array of kind `t') */
+  IR_GETG,	/* a = env[b] */
+  IR_SETG,	/* env[b] = a */
+  IR_GETUV,	/* a = upvalue b */
+  IR_SETUV,	/* upvalue b = a */
+  IR_EQ,	/* (b == c) is v (both have tag `t') */
+  IR_LT,	/* (b < c) is v */
+  IR_LE,	/* (b <= c) is v */
+  IR_TRUTH,	/* boolean a is v */
+  IR_FORL,	/* numeric for loop step on a..a+3; step > 0 is v */
+  IR_LOOP	/* back to the loop header (to its guards if v) */
+};
+
+
+typedef struct IRIns {
+  lu_byte op;
+  lu_byte t;  /* type tag or array kind */
+  lu_byte v;  /* expected outcome */
+  lu_byte keep;  /* destination already tagged as a number */
+  int a, b, c;
+  int pc;  /* side exit: resume at this pc */
+} IRIns;
+
+
+#define IRK(i)		(-1-(i))
+#define irisk(o)	((o) < 0)
+#define irk(o)		(-1-(o))
+
+
+typedef struct ExitRef {
+  size_t at;  /* end of the jump to patch */
+  size_t stub;  /* code returning `pc' */
+  int pc;
+} ExitRef;
+
+
+struct jit_State {
+  HotLoop hot[JIT_HOTSIZE];
+  Trace trace[JIT_MAXTRACE];
+  unsigned char *area;  /* executable memory (mapped by the first trace) */
+  size_t areatop;
+};
+
+
+/* buffers of the trace being compiled (only allocated while recording) */
+struct RecState {
+  /* recorder */
+  Proto *p;
+  int start;  /* pc of the loop header */
+  int nir;
+  signed char known[MAXSTACK];  /* tag of each slot, or LUA_TNONE */
+  lu_byte written[MAXSTACK];  /* slot written in the current iteration */
+  IRIns ir[JIT_MAXIR];
+  /* assembler */
+  size_t nmc;
+  int overflow;
+  int nexit;
+  ExitRef exit[JIT_MAXEXIT];
+  unsigned char mc[JIT_MCBUF];
+};
+
+
+
+/*
+** {======================================================
+** Helpers called from the traces
+** =======================================================
+*/
+
+static int jit_gettable (lua_State *L, Table *h, const TValue *key,
+                         TValue *ra) {
+  const TValue *res = luaH_get(h, key);
+  UNUSED(L);  /* same signature as `jit_settable' */
+  if (ttisnil(res) && h->metatable != NULL)
+    return 0;  /* let the VM look for `__index' */
+  setobj2s(L, ra, res);
+  return 1;
+}
+
+
+static int jit_settable (lua_State *L, Table *h, const TValue *key,
+                         const TValue *val) {
+  TValue *old = cast(TValue *, luaH_get(h, key));
+  if (old == luaO_nilobject || (ttisnil(old) && h->metatable != NULL))
+    return 0;  /* new key or maybe `__newindex': let the VM do it */
+  h->flags = 0;
+  setobj2t(L, old, val);
+  luaC_barriert(L, h, val);
+  return 1;
+}
+
+
+static lua_Number jit_mod (lua_Number a, lua_Number b) {
+  return luai_nummod(a, b);
+}
+
+
+static lua_Number jit_pow (lua_Number a, lua_Number b) {
+  return luai_numpow(a, b);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** x86-64 assembler
+** =======================================================
+*/
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R12 = 12, R13 };
+
+/* condition codes */
+enum { CC_B = 2, CC_AE, CC_E, CC_NE, CC_BE, CC_A, CC_P = 10, CC_NP, CC_L,
+       CC_GE, CC_LE, CC_G };
+
+/* opcodes: mandatory prefix in bits 16-23, 0x0F escape in bits 8-15 */
+#define XO_MOV		0x8b
+#define XO_MOVTO	0x89
+#define XO_MOVB		0x0fb6	/* movzx r32, byte */
+#define XO_LEA		0x8d
+#define XO_ADD		0x03
+#define XO_CMP		0x3b
+#define XO_TEST		0x85
+#define XO_MOVSD	0xf20f10
+#define XO_MOVSDTO	0xf20f11
+#define XO_MOVUPS	0x0f10
+#define XO_MOVUPSTO	0x0f11
+#define XO_ARITHSD	0xf20f00	/* plus 0x58, 0x5c, 0x59, 0x5e */
+#define XO_UCOMISD	0x660f2e
+#define XO_CVTTSD2SI	0xf20f2c
+#define XO_CVTSI2SD	0xf20f2a
+#define XO_MOVQX	0x660f6e	/* movq xmm, r64 */
+#define XO_XORPS	0x0f57
+
+#define TVSIZE		cast_int(sizeof(TValue))
+#define TTOFS		cast_int(offsetof(TValue, tt))
+#define slotofs(s)	((s)*TVSIZE)
+#define ARRAYOFS	cast_int(sizeof(Udata))
+
+
+static void asm_byte (RecState *R, int b) {
+  if (R->nmc < JIT_MCBUF)
+    R->mc[R->nmc++] = cast(unsigned char, b);
+  else
+    R->overflow = 1;
+}
+
+
+static void asm_u32 (RecState *R, unsigned int v) {
+  int i;
+  for (i = 0; i < 4; i++, v >>= 8)
+    asm_byte(R, cast_int(v & 0xff));
+}
+
+
+static void asm_op (RecState *R, int op, int w, int reg, int rm) {
+  int rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+  if (op >> 16) asm_byte(R, op >> 16);
+  if (rex != 0x40) asm_byte(R, rex);
+  if (op & 0xff00) asm_byte(R, (op >> 8) & 0xff);
+  asm_byte(R, op & 0xff);
+}
+
+
+/* op reg, [base+disp32] */
+static void asm_mrm (RecState *R, int op, int w, int reg, int base,
+                     int disp) {
+  asm_op(R, op, w, reg, base);
+  asm_byte(R, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) asm_byte(R, 0x24);  /* SIB for rsp and r12 */
+  asm_u32(R, cast(unsigned int, disp));
+}
+
+
+/* op reg, rm */
+static void asm_rr (RecState *R, int op, int w, int reg, int rm) {
+  asm_op(R, op, w, reg, rm);
+  asm_byte(R, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+/* op [base+disp32], imm (group opcodes 0x81, 0xc7, 0x80, 0xc6) */
+static void asm_mi (RecState *R, int op, int w, int ext, int base,
+                    int disp, int imm) {
+  asm_mrm(R, op, w, ext, base, disp);
+  if (op == 0x80 || op == 0xc6) asm_byte(R, imm);
+  else asm_u32(R, cast(unsigned int, imm));
+}
+
+
+static void asm_imm64 (RecState *R, int r, size_t v) {
+  int i;
+  asm_byte(R, 0x48 | ((r & 8) ? 1 : 0));
+  asm_byte(R, 0xb8 | (r & 7));
+  for (i = 0; i < 8; i++, v >>= 8)
+    asm_byte(R, cast_int(v & 0xff));
+}
+
+
+static void asm_call (RecState *R, void (*f) (void)) {
+  asm_imm64(R, RAX, cast(size_t, f));
+  asm_byte(R, 0xff); asm_byte(R, 0xd0);  /* call rax */
+}
+
+
+/* jump with a rel32 to be patched; returns the position after it */
+static size_t asm_jcc (RecState *R, int cc) {
+  asm_byte(R, 0x0f); asm_byte(R, 0x80 | cc);
+  asm_u32(R, 0);
+  return R->nmc;
+}
+
+
+static size_t asm_jmp (RecState *R) {
+  asm_byte(R, 0xe9);
+  asm_u32(R, 0);
+  return R->nmc;
+}
+
+
+static void asm_patch (RecState *R, size_t at, size_t target) {
+  unsigned int rel = cast(unsigned int, target - at);
+  int i;
+  if (R->overflow) return;
+  for (i = 0; i < 4; i++, rel >>= 8)
+    R->mc[at - 4 + i] = cast(unsigned char, rel & 0xff);
+}
+
+
+static void asm_exit (RecState *R, int cc, int pc) {
+  size_t at = asm_jcc(R, cc);
+  if (R->nexit < JIT_MAXEXIT) {
+    R->exit[R->nexit].at = at;
+    R->exit[R->nexit++].pc = pc;
+  }
+  else R->overflow = 1;
+}
+
+
+/* register `r' = address of operand `o' */
+static void asm_addr (RecState *R, int r, int o) {
+  if (irisk(o))
+    asm_imm64(R, r, cast(size_t, R->p->k + irk(o)));
+  else
+    asm_mrm(R, XO_LEA, 1, r, RBX, slotofs(o));
+}
+
+
+/* xmm register `x' = number operand `o' (may use rax) */
+static void asm_num (RecState *R, int x, int o) {
+  if (irisk(o)) {
+    size_t bits;
+    lua_Number n = nvalue(R->p->k + irk(o));
+    memcpy(&bits, &n, sizeof(bits));
+    asm_imm64(R, RAX, bits);
+    asm_rr(R, XO_MOVQX, 1, x, RAX);
+  }
+  else
+    asm_mrm(R, XO_MOVSD, 0, x, RBX, slotofs(o));
+}
+
+
+static void asm_setnum (RecState *R, int x, int s, int keep) {
+  asm_mrm(R, XO_MOVSDTO, 0, x, RBX, slotofs(s));
+  if (!keep)
+    asm_mi(R, 0xc7, 0, 0, RBX, slotofs(s) + TTOFS, LUA_TNUMBER);
+}
+
+
+/* xmm0 = whole value of operand `o' (`r' is scratch for constants) */
+static void asm_loadtv (RecState *R, int o, int r) {
+  if (irisk(o)) {
+    asm_addr(R, r, o);
+    asm_mrm(R, XO_MOVUPS, 0, 0, r, 0);
+  }
+  else
+    asm_mrm(R, XO_MOVUPS, 0, 0, RBX, slotofs(o));
+}
+
+
+/* register `r' = value field of operand `o' */
+static void asm_loadval (RecState *R, int r, int o, int w) {
+  if (irisk(o)) {
+    size_t bits;
+    memcpy(&bits, &(R->p->k + irk(o))->value, sizeof(bits));
+    asm_imm64(R, r, bits);
+  }
+  else
+    asm_mrm(R, XO_MOV, w, r, RBX, slotofs(o));
+}
+
+
+/*
+** ecx = integer value of the number in xmm0; when it is not an integer,
+** jumps to `notint' (if given) or exits to `pc'
+*/
+static void asm_toint (RecState *R, size_t *notint, int pc) {
+  asm_rr(R, XO_CVTTSD2SI, 0, RCX, 0);
+  asm_rr(R, XO_CVTSI2SD, 0, 1, RCX);
+  asm_rr(R, XO_UCOMISD, 0, 0, 1);
+  if (notint) {
+    notint[0] = asm_jcc(R, CC_NE);
+    notint[1] = asm_jcc(R, CC_P);
+  }
+  else {
+    asm_exit(R, CC_NE, pc);
+    asm_exit(R, CC_P, pc);
+  }
+}
+
+
+/*
+** rax = address of element xmm0 of the array part of the table in rdx;
+** the returned jumps are taken when it is not there
+*/
+static void asm_arraypart (RecState *R, size_t *miss) {
+  asm_toint(R, miss, 0);
+  asm_byte(R, 0x83); asm_byte(R, 0xe9); asm_byte(R, 1);  /* sub ecx, 1 */
+  asm_mrm(R, XO_CMP, 0, RCX, RDX, cast_int(offsetof(Table, sizearray)));
+  miss[2] = asm_jcc(R, CC_AE);
+  asm_mrm(R, XO_MOV, 1, RAX, RDX, cast_int(offsetof(Table, array)));
+  asm_op(R, 0x6b, 1, RCX, RCX);  /* imul rcx, rcx, TVSIZE */
+  asm_byte(R, 0xc0 | (RCX << 3) | RCX); asm_byte(R, TVSIZE);
+  asm_rr(R, XO_ADD, 1, RAX, RCX);
+}
+
+
+/*
+** rax = address of element xmm0 of the typed array in rdx (kind `kind');
+** exits to `pc' when there is no such element
+*/
+static void asm_arrayelem (RecState *R, int kind, int pc, int store) {
+  int size = (kind == LUA_ARRAYUINT8) ? 1 :
+             (kind == LUA_ARRAYINT32) ? 4 : 8;
+  asm_mi(R, 0x80, 0, 7, RDX, cast_int(offsetof(Udata, uv.array)), kind);
+  asm_exit(R, CC_NE, pc);
+  if (store) {
+    asm_mi(R, 0x81, 0, 7, RDX,
+           ARRAYOFS + cast_int(offsetof(lua_Array, readonly)), 0);
+    asm_exit(R, CC_NE, pc);
+  }
+  asm_toint(R, NULL, pc);
+  asm_rr(R, XO_TEST, 0, RCX, RCX);
+  asm_exit(R, CC_LE, pc);
+  asm_byte(R, 0x83); asm_byte(R, 0xe9); asm_byte(R, 1);  /* sub ecx, 1 */
+  asm_mrm(R, XO_CMP, 1, RCX, RDX,
+          ARRAYOFS + cast_int(offsetof(lua_Array, n)));
+  asm_exit(R, CC_AE, pc);
+  asm_mrm(R, XO_MOV, 1, RAX, RDX,
+          ARRAYOFS + cast_int(offsetof(lua_Array, data)));
+  if (size > 1) {
+    asm_op(R, 0x6b, 1, RCX, RCX);  /* imul rcx, rcx, size */
+    asm_byte(R, 0xc0 | (RCX << 3) | RCX); asm_byte(R, size);
+  }
+  asm_rr(R, XO_ADD, 1, RAX, RCX);
+}
+
+
+static void asm_guard (RecState *R, IRIns *ins, int pc) {
+  asm_mi(R, 0x81, 0, 7, RBX, slotofs(ins->a) + TTOFS, ins->t);
+  asm_exit(R, CC_NE, pc);
+}
+
+
+static void asm_gett (RecState *R, IRIns *ins) {
+  size_t miss[3], done = 0;
+  asm_mrm(R, XO_MOV, 1, RDX, RBX, slotofs(ins->b));
+  if (ins->t == LUA_TNUMBER) {  /* try the array part */
+    size_t found;
+    int i;
+    asm_num(R, 0, ins->c);
+    asm_arraypart(R, miss);
+    asm_mi(R, 0x81, 0, 7, RAX, TTOFS, LUA_TNIL);
+    found = asm_jcc(R, CC_NE);
+    asm_mi(R, 0x81, 1, 7, RDX, cast_int(offsetof(Table, metatable)), 0);
+    asm_exit(R, CC_NE, ins->pc);
+    asm_patch(R, found, R->nmc);
+    asm_mrm(R, XO_MOVUPS, 0, 0, RAX, 0);
+    asm_mrm(R, XO_MOVUPSTO, 0, 0, RBX, slotofs(ins->a));
+    done = asm_jmp(R);
+    for (i = 0; i < 3; i++) asm_patch(R, miss[i], R->nmc);
+  }
+  asm_rr(R, XO_MOVTO, 1, RDX, RSI);
+  asm_rr(R, XO_MOVTO, 1, R13, RDI);
+  asm_addr(R, RDX, ins->c);
+  asm_mrm(R, XO_LEA, 1, RCX, RBX, slotofs(ins->a));
+  asm_call(R, cast(void (*) (void), jit_gettable));
+  asm_rr(R, XO_TEST, 0, RAX, RAX);
+  asm_exit(R, CC_E, ins->pc);
+  if (done) asm_patch(R, done, R->nmc);
+}
+
+
+static void asm_sett (RecState *R, IRIns *ins) {
+  size_t miss[3], done = 0;
+  asm_mrm(R, XO_MOV, 1, RDX, RBX, slotofs(ins->a));
+  if (ins->v == LUA_TNUMBER && ins->t < LUA_TSTRING) {
+    /* plain value at a number key: try the array part (no barrier) */
+    size_t found;
+    int i;
+    asm_num(R, 0, ins->b);
+    asm_arraypart(R, miss);
+    asm_mi(R, 0x81, 0, 7, RAX, TTOFS, LUA_TNIL);
+    found = asm_jcc(R, CC_NE);
+    asm_mi(R, 0x81, 1, 7, RDX, cast_int(offsetof(Table, metatable)), 0);
+    asm_exit(R, CC_NE, ins->pc);
+    asm_patch(R, found, R->nmc);
+    asm_mi(R, 0xc6, 0, 0, RDX, cast_int(offsetof(Table, flags)), 0);
+    asm_loadtv(R, ins->c, RCX);
+    asm_mrm(R, XO_MOVUPSTO, 0, 0, RAX, 0);
+    done = asm_jmp(R);
+    for (i = 0; i < 3; i++) asm_patch(R, miss[i], R->nmc);
+  }
+  asm_rr(R, XO_MOVTO, 1, RDX, RSI);
+  asm_rr(R, XO_MOVTO, 1, R13, RDI);
+  asm_addr(R, RDX, ins->b);
+  asm_addr(R, RCX, ins->c);
+  asm_call(R, cast(void (*) (void), jit_settable));
+  asm_rr(R, XO_TEST, 0, RAX, RAX);
+  asm_exit(R, CC_E, ins->pc);
+  if (done) asm_patch(R, done, R->nmc);
+}
+
+
+static void asm_geta (RecState *R, IRIns *ins) {
+  asm_mrm(R, XO_MOV, 1, RDX, RBX, slotofs(ins->b));
+  asm_num(R, 0, ins->c);
+  asm_arrayelem(R, ins->t, ins->pc, 0);
+  switch (ins->t) {
+    case LUA_ARRAYUINT8:
+      asm_mrm(R, XO_MOVB, 0, RCX, RAX, 0);
+      asm_rr(R, XO_CVTSI2SD, 0, 0, RCX);
+      break;
+    case LUA_ARRAYINT32:
+      asm_mrm(R, XO_CVTSI2SD, 0, 0, RAX, 0);
+      break;
+    default:
+      asm_mrm(R, XO_MOVSD, 0, 0, RAX, 0);
+      break;
+  }
+  asm_setnum(R, 0, ins->a, ins->keep);
+}
+
+
+static void asm_seta (RecState *R, IRIns *ins) {
+  asm_num(R, 2, ins->c);
+  asm_mrm(R, XO_MOV, 1, RDX, RBX, slotofs(ins->a));
+  asm_num(R, 0, ins->b);
+  asm_arrayelem(R, ins->t, ins->pc, 1);
+  if (ins->t == LUA_ARRAYFLOAT64)
+    asm_mrm(R, XO_MOVSDTO, 0, 2, RAX, 0);
+  else {
+    asm_rr(R, XO_CVTTSD2SI, 1, RCX, 2);  /* lua_number2integer */
+    if (ins->t == LUA_ARRAYUINT8) {
+      asm_byte(R, 0x88); asm_byte(R, 0x80 | (RCX << 3) | RAX);  /* mov [rax], cl */
+      asm_u32(R, 0);
+    }
+    else
+      asm_mrm(R, XO_MOVTO, 0, RCX, RAX, 0);
+  }
+}
+
+
+static void asm_arith (RecState *R, IRIns *ins) {
+  static const int sdop[] = {0x58, 0x5c, 0x59, 0x5e};  /* add sub mul div */
+  asm_num(R, 0, ins->b);
+  asm_num(R, 1, ins->c);
+  if (ins->op <= IR_DIV)
+    asm_rr(R, XO_ARITHSD | sdop[ins->op - IR_ADD], 0, 0, 1);
+  else if (ins->op == IR_MOD)
+    asm_call(R, cast(void (*) (void), jit_mod));
+  else
+    asm_call(R, cast(void (*) (void), jit_pow));
+  asm_setnum(R, 0, ins->a, ins->keep);
+}
+
+
+static void asm_len (RecState *R, IRIns *ins) {
+  asm_mrm(R, XO_MOV, 1, RDI, RBX, slotofs(ins->b));
+  switch (ins->op) {
+    case IR_LENS:
+      asm_mrm(R, XO_MOV, 1, RAX, RDI, cast_int(offsetof(TString, tsv.len)));
+      asm_rr(R, XO_CVTSI2SD, 1, 0, RAX);
+      break;
+    case IR_LENA:
+      asm_mi(R, 0x80, 0, 7, RDI, cast_int(offsetof(Udata, uv.array)), 0);
+      asm_exit(R, CC_E, ins->pc);
+      asm_mrm(R, XO_MOV, 1, RAX, RDI,
+              ARRAYOFS + cast_int(offsetof(lua_Array, n)));
+      asm_rr(R, XO_CVTSI2SD, 1, 0, RAX);
+      break;
+    default:
+      asm_call(R, cast(void (*) (void), luaH_getn));
+      asm_rr(R, XO_CVTSI2SD, 0, 0, RAX);
+      break;
+  }
+  asm_setnum(R, 0, ins->a, ins->keep);
+}
+
+
+static void asm_not (RecState *R, IRIns *ins) {
+  int s = slotofs(ins->a);
+  if (ins->t == LUA_TBOOLEAN) {
+    asm_rr(R, 0x31, 0, RCX, RCX);  /* xor ecx, ecx */
+    asm_mi(R, 0x81, 0, 7, RBX, slotofs(ins->b), 0);
+    asm_byte(R, 0x0f); asm_byte(R, 0x94); asm_byte(R, 0xc1);  /* sete cl */
+    asm_mrm(R, XO_MOVTO, 0, RCX, RBX, s);
+  }
+  else
+    asm_mi(R, 0xc7, 0, 0, RBX, s, ins->t == LUA_TNIL);
+  asm_mi(R, 0xc7, 0, 0, RBX, s + TTOFS, LUA_TBOOLEAN);
+}
+
+
+static void asm_eq (RecState *R, IRIns *ins) {
+  if (ins->t == LUA_TNUMBER) {
+    asm_num(R, 0, ins->b);
+    asm_num(R, 1, ins->c);
+    asm_rr(R, XO_UCOMISD, 0, 0, 1);
+    if (ins->v) {
+      asm_exit(R, CC_NE, ins->pc);
+      asm_exit(R, CC_P, ins->pc);
+    }
+    else {
+      size_t unordered = asm_jcc(R, CC_P);
+      asm_exit(R, CC_E, ins->pc);
+      asm_patch(R, unordered, R->nmc);
+    }
+  }
+  else {
+    int w = (ins->t != LUA_TBOOLEAN);
+    asm_loadval(R, RAX, ins->b, w);
+    asm_loadval(R, RCX, ins->c, w);
+    asm_rr(R, XO_CMP, w, RAX, RCX);
+    asm_exit(R, ins->v ? CC_NE : CC_E, ins->pc);
+  }
+}
+
+
+static void asm_comp (RecState *R, IRIns *ins) {
+  /* b < c <=> c above b; b <= c <=> c above or equal b (false if NaN) */
+  asm_num(R, 0, ins->b);
+  asm_num(R, 1, ins->c);
+  asm_rr(R, XO_UCOMISD, 0, 1, 0);
+  if (ins->op == IR_LT)
+    asm_exit(R, ins->v ? CC_BE : CC_A, ins->pc);
+  else
+    asm_exit(R, ins->v ? CC_B : CC_AE, ins->pc);
+}
+
+
+static void asm_forl (RecState *R, IRIns *ins) {
+  int a = ins->a;
+  asm_mrm(R, XO_MOVSD, 0, 0, RBX, slotofs(a));
+  asm_mrm(R, XO_MOVSD, 0, 1, RBX, slotofs(a+2));
+  asm_rr(R, XO_XORPS, 0, 2, 2);
+  asm_rr(R, XO_UCOMISD, 0, 1, 2);  /* sign of the step */
+  asm_exit(R, ins->v ? CC_BE : CC_A, ins->pc);
+  asm_rr(R, XO_ARITHSD | 0x58, 0, 0, 1);  /* idx += step */
+  asm_mrm(R, XO_MOVSD, 0, 1, RBX, slotofs(a+1));
+  if (ins->v)
+    asm_rr(R, XO_UCOMISD, 0, 1, 0);  /* idx <= limit */
+  else
+    asm_rr(R, XO_UCOMISD, 0, 0, 1);  /* limit <= idx */
+  asm_exit(R, CC_B, ins->c);
+  asm_mrm(R, XO_MOVSDTO, 0, 0, RBX, slotofs(a));
+  asm_setnum(R, 0, a+3, ins->keep);
+}
+
+
+static void asm_ins (RecState *R, IRIns *ins, size_t head, size_t loop) {
+  switch (ins->op) {
+    case IR_HEAD: break;  /* already checked */
+    case IR_TAG: asm_guard(R, ins, ins->pc); break;
+    case IR_MOV: {
+      asm_loadtv(R, ins->b, RAX);
+      asm_mrm(R, XO_MOVUPSTO, 0, 0, RBX, slotofs(ins->a));
+      break;
+    }
+    case IR_NIL: {
+      asm_mi(R, 0xc7, 0, 0, RBX, slotofs(ins->a) + TTOFS, LUA_TNIL);
+      break;
+    }
+    case IR_BOOL: {
+      asm_mi(R, 0xc7, 0, 0, RBX, slotofs(ins->a), ins->v);
+      asm_mi(R, 0xc7, 0, 0, RBX, slotofs(ins->a) + TTOFS, LUA_TBOOLEAN);
+      break;
+    }
+    case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
+    case IR_MOD: case IR_POW: asm_arith(R, ins); break;
+    case IR_UNM: {
+      asm_loadval(R, RAX, ins->b, 1);
+      asm_op(R, 0x0fba, 1, 7, RAX);  /* btc rax, 63 */
+      asm_byte(R, 0xc0 | (7 << 3) | RAX); asm_byte(R, 63);
+      asm_mrm(R, XO_MOVTO, 1, RAX, RBX, slotofs(ins->a));
+      if (!ins->keep)
+        asm_mi(R, 0xc7, 0, 0, RBX, slotofs(ins->a) + TTOFS, LUA_TNUMBER);
+      break;
+    }
+    case IR_NOT: asm_not(R, ins); break;
+    case IR_LENS: case IR_LENT: case IR_LENA: asm_len(R, ins); break;
+    case IR_GETT: asm_gett(R, ins); break;
+    case IR_GETA: asm_geta(R, ins); break;
+    case IR_SETT: asm_sett(R, ins); break;
+    case IR_SETA: asm_seta(R, ins); break;
+    case IR_GETG: case IR_SETG: {
+      asm_mrm(R, XO_MOV, 1, RSI, R12, cast_int(offsetof(LClosure, env)));
+      asm_rr(R, XO_MOVTO, 1, R13, RDI);
+      asm_addr(R, RDX, ins->b);
+      asm_mrm(R, XO_LEA, 1, RCX, RBX, slotofs(ins->a));
+      asm_call(R, ins->op == IR_GETG ? cast(void (*) (void), jit_gettable) :
+                                       cast(void (*) (void), jit_settable));
+      asm_rr(R, XO_TEST, 0, RAX, RAX);
+      asm_exit(R, CC_E, ins->pc);
+      break;
+    }
+    case IR_GETUV: case IR_SETUV: {
+      asm_mrm(R, XO_MOV, 1, RAX, R12, cast_int(offsetof(LClosure, upvals)) +
+              ins->b * cast_int(sizeof(UpVal *)));
+      asm_mrm(R, XO_MOV, 1, RAX, RAX, cast_int(offsetof(UpVal, v)));
+      if (ins->op == IR_GETUV) {
+        asm_mrm(R, XO_MOVUPS, 0, 0, RAX, 0);
+        asm_mrm(R, XO_MOVUPSTO, 0, 0, RBX, slotofs(ins->a));
+      }
+      else {
+        asm_mrm(R, XO_MOVUPS, 0, 0, RBX, slotofs(ins->a));
+        asm_mrm(R, XO_MOVUPSTO, 0, 0, RAX, 0);
+      }
+      break;
+    }
+    case IR_EQ: asm_eq(R, ins); break;
+    case IR_LT: case IR_LE: asm_comp(R, ins); break;
+    case IR_TRUTH: {
+      asm_mi(R, 0x81, 0, 7, RBX, slotofs(ins->a), 0);
+      asm_exit(R, ins->v ? CC_E : CC_NE, ins->pc);
+      break;
+    }
+    case IR_FORL: asm_forl(R, ins); break;
+    case IR_LOOP: {  /* a hook set meanwhile is run by the interpreter */
+      asm_mrm(R, XO_MOVB, 0, RAX, R13, cast_int(offsetof(lua_State, hookmask)));
+      asm_rr(R, XO_TEST, 0, RAX, RAX);
+      asm_exit(R, CC_NE, R->start);
+      asm_byte(R, 0xe9);
+      asm_u32(R, 0);
+      asm_patch(R, R->nmc, ins->v ? head : loop);
+      break;
+    }
+    default: lua_assert(0);
+  }
+}
+
+
+/*
+** machine code of the trace in R->ir, as a function of (L, base, cl)
+** returning the pc where the interpreter resumes
+*/
+static int asm_trace (RecState *R) {
+  size_t head, loop, epilogue;
+  int i, j;
+  R->nmc = 0;
+  R->overflow = 0;
+  R->nexit = 0;
+  asm_byte(R, 0x53);  /* push rbx */
+  asm_byte(R, 0x41); asm_byte(R, 0x54);  /* push r12 */
+  asm_byte(R, 0x41); asm_byte(R, 0x55);  /* push r13 */
+  asm_rr(R, XO_MOVTO, 1, RDI, R13);
+  asm_rr(R, XO_MOVTO, 1, RSI, RBX);
+  asm_rr(R, XO_MOVTO, 1, RDX, R12);
+  head = R->nmc;
+  for (i = 0; i < R->nir; i++)  /* type checks of the loop inputs */
+    if (R->ir[i].op == IR_HEAD) asm_guard(R, &R->ir[i], R->start);
+  loop = R->nmc;
+  for (i = 0; i < R->nir; i++)
+    asm_ins(R, &R->ir[i], head, loop);
+  epilogue = R->nmc;
+  asm_byte(R, 0x41); asm_byte(R, 0x5d);  /* pop r13 */
+  asm_byte(R, 0x41); asm_byte(R, 0x5c);  /* pop r12 */
+  asm_byte(R, 0x5b);  /* pop rbx */
+  asm_byte(R, 0xc3);  /* ret */
+  for (i = 0; i < R->nexit; i++) {  /* one stub per exit pc */
+    ExitRef *e = &R->exit[i];
+    for (j = 0; j < i && R->exit[j].pc != e->pc; j++) ;
+    if (j < i)
+      e->stub = R->exit[j].stub;
+    else {
+      e->stub = R->nmc;
+      asm_imm64(R, RAX, cast(size_t, R->p->code + e->pc));
+      asm_patch(R, asm_jmp(R), epilogue);
+    }
+    asm_patch(R, e->at, e->stub);
+  }
+  return !R->overflow;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Recorder
+** =======================================================
+*/
+
+static IRIns *rec_emit (RecState *R, int op, int a, int b, int c) {
+  IRIns *ins = &R->ir[R->nir++];
+  lua_assert(R->nir <= JIT_MAXIR);
+  ins->op = cast_byte(op);
+  ins->t = ins->v = ins->keep = 0;
+  ins->a = a; ins->b = b; ins->c = c;
+  ins->pc = 0;
+  return ins;
+}
+
+
+/* the trace relies on operand `o' having tag `t' */
+static void rec_guard (RecState *R, int o, int t, int pc) {
+  IRIns *ins;
+  if (irisk(o) || R->known[o] == t) return;
+  if (!R->written[o])  /* value from the previous iteration? */
+    ins = rec_emit(R, IR_HEAD, o, 0, 0);  /* check it on entry */
+  else
+    ins = rec_emit(R, IR_TAG, o, 0, 0);
+  ins->t = cast_byte(t);
+  ins->pc = pc;
+  R->known[o] = cast(signed char, t);
+}
+
+
+static void rec_write (RecState *R, int s, int t) {
+  R->known[s] = cast(signed char, t);
+  R->written[s] = 1;
+}
+
+
+/* number result in slot `s' */
+static IRIns *rec_num (RecState *R, IRIns *ins, int s) {
+  ins->keep = (R->known[s] == LUA_TNUMBER);
+  rec_write(R, s, LUA_TNUMBER);
+  return ins;
+}
+
+
+static int rec_operand (int x) {
+  return ISK(x) ? IRK(INDEXK(x)) : x;
+}
+
+
+/* element `key' of typed array `t' exists? */
+static int rec_arrayindex (const TValue *t, const TValue *key) {
+  lua_Array *a = arrayvalue(rawuvalue(t));
+  lua_Number k;
+  int i;
+  if (!ttisnumber(key)) return 0;
+  k = nvalue(key);
+  lua_number2int(i, k);
+  return (cast_num(i) == k && i >= 1 && cast(size_t, i) <= a->n);
+}
+
+
+/* branch to `target': 1 closes the loop, -1 leaves the trace */
+static int rec_branch (RecState *R, const Instruction *target,
+                       const Instruction *from) {
+  if (target == R->p->code + R->start) return 1;
+  return (target <= from) ? -1 : 0;  /* inner loop? */
+}
+
+
+/*
+** run and record one iteration of the loop at `*ppc'; returns 1 when
+** the iteration got back to the loop header, 0 when it stopped before an
+** instruction that cannot be compiled (left in `*ppc')
+*/
+static int rec_trace (lua_State *L, RecState *R, const Instruction **ppc) {
+  LClosure *cl = &clvalue(L->ci->func)->l;
+  StkId base = L->base;
+  TValue *k = R->p->k;
+  const Instruction *pc = *ppc;
+  int n;
+  for (n = 0; n < JIT_MAXRECORD && R->nir + 8 <= JIT_MAXIR; n++) {
+    const Instruction i = *pc;
+    int at = cast_int(pc - R->p->code);
+    int a = GETARG_A(i);
+    StkId ra = base + a;
+    int go = 0;  /* result of a branch */
+    *ppc = pc;  /* nothing done yet for this instruction */
+    switch (GET_OPCODE(i)) {
+      case OP_MOVE: {
+        int b = GETARG_B(i);
+        setobjs2s(L, ra, base + b);
+        rec_emit(R, IR_MOV, a, b, 0);
+        rec_write(R, a, R->known[b]);
+        pc++;
+        break;
+      }
+      case OP_LOADK: {
+        TValue *kb = k + GETARG_Bx(i);
+        setobj2s(L, ra, kb);
+        rec_emit(R, IR_MOV, a, IRK(GETARG_Bx(i)), 0);
+        rec_write(R, a, ttype(kb));
+        pc++;
+        break;
+      }
+      case OP_LOADBOOL: {
+        setbvalue(ra, GETARG_B(i));
+        rec_emit(R, IR_BOOL, a, 0, 0)->v = cast_byte(GETARG_B(i) != 0);
+        rec_write(R, a, LUA_TBOOLEAN);
+        pc += GETARG_C(i) ? 2 : 1;
+        break;
+      }
+      case OP_LOADNIL: {
+        int s;
+        if (R->nir + GETARG_B(i) - a + 8 > JIT_MAXIR) return 0;
+        for (s = a; s <= GETARG_B(i); s++) {
+          setnilvalue(base + s);
+          rec_emit(R, IR_NIL, s, 0, 0);
+          rec_write(R, s, LUA_TNIL);
+        }
+        pc++;
+        break;
+      }
+      case OP_GETUPVAL: {
+        setobj2s(L, ra, cl->upvals[GETARG_B(i)]->v);
+        rec_emit(R, IR_GETUV, a, GETARG_B(i), 0);
+        rec_write(R, a, LUA_TNONE);
+        pc++;
+        break;
+      }
+      case OP_SETUPVAL: {
+        UpVal *uv = cl->upvals[GETARG_B(i)];
+        if (iscollectable(ra)) return 0;  /* would need a barrier */
+        rec_guard(R, a, ttype(ra), at);
+        setobj(L, uv->v, ra);
+        rec_emit(R, IR_SETUV, a, GETARG_B(i), 0);
+        pc++;
+        break;
+      }
+      case OP_GETGLOBAL: {
+        TValue *kb = k + GETARG_Bx(i);
+        const TValue *res = luaH_getstr(cl->env, rawtsvalue(kb));
+        if (ttisnil(res) && cl->env->metatable != NULL) return 0;
+        setobj2s(L, ra, res);
+        rec_emit(R, IR_GETG, a, IRK(GETARG_Bx(i)), 0)->pc = at;
+        rec_write(R, a, LUA_TNONE);
+        pc++;
+        break;
+      }
+      case OP_SETGLOBAL: {
+        TValue *kb = k + GETARG_Bx(i);
+        const TValue *old = luaH_getstr(cl->env, rawtsvalue(kb));
+        TValue g;
+        if (old == luaO_nilobject ||
+            (ttisnil(old) && cl->env->metatable != NULL))
+          return 0;  /* new global or maybe `__newindex' */
+        rec_emit(R, IR_SETG, a, IRK(GETARG_Bx(i)), 0)->pc = at;
+        sethvalue(L, &g, cl->env);
+        luaV_settable(L, &g, kb, ra);  /* an existing slot: no allocation */
+        pc++;
+        break;
+      }
+      case OP_GETTABLE: {
+        int b = GETARG_B(i), c = rec_operand(GETARG_C(i));
+        StkId rb = base + b;
+        TValue *rc = ISK(GETARG_C(i)) ? k + irk(c) : base + c;
+        IRIns *ins;
+        if (ttistable(rb)) {
+          const TValue *res = luaH_get(hvalue(rb), rc);
+          if (ttisnil(res) && hvalue(rb)->metatable != NULL) return 0;
+          rec_guard(R, b, LUA_TTABLE, at);
+          rec_guard(R, c, ttype(rc), at);
+          ins = rec_emit(R, IR_GETT, a, b, c);
+          ins->t = cast_byte(ttype(rc));
+          ins->pc = at;
+          setobj2s(L, ra, res);
+          rec_write(R, a, LUA_TNONE);
+        }
+        else if (ttisuserdata(rb) && uvalue(rb)->array &&
+                 rec_arrayindex(rb, rc)) {
+          rec_guard(R, b, LUA_TUSERDATA, at);
+          rec_guard(R, c, LUA_TNUMBER, at);
+          ins = rec_emit(R, IR_GETA, a, b, c);
+          ins->t = uvalue(rb)->array;
+          ins->pc = at;
+          luaV_gettable(L, rb, rc, ra);  /* takes the typed array path */
+          rec_num(R, ins, a);
+        }
+        else return 0;
+        pc++;
+        break;
+      }
+      case OP_SETTABLE: {
+        int b = rec_operand(GETARG_B(i)), c = rec_operand(GETARG_C(i));
+        TValue *rb = irisk(b) ? k + irk(b) : base + b;
+        TValue *rc = irisk(c) ? k + irk(c) : base + c;
+        IRIns *ins;
+        if (ttistable(ra)) {
+          const TValue *old = luaH_get(hvalue(ra), rb);
+          if (old == luaO_nilobject ||
+              (ttisnil(old) && hvalue(ra)->metatable != NULL))
+            return 0;  /* new key or maybe `__newindex' */
+          rec_guard(R, a, LUA_TTABLE, at);
+          rec_guard(R, b, ttype(rb), at);
+          rec_guard(R, c, ttype(rc), at);
+          ins = rec_emit(R, IR_SETT, a, b, c);
+          ins->t = cast_byte(ttype(rc));
+          ins->v = cast_byte(ttype(rb));
+        }
+        else if (ttisuserdata(ra) && uvalue(ra)->array &&
+                 !arrayvalue(rawuvalue(ra))->readonly &&
+                 rec_arrayindex(ra, rb) && ttisnumber(rc)) {
+          rec_guard(R, a, LUA_TUSERDATA, at);
+          rec_guard(R, b, LUA_TNUMBER, at);
+          rec_guard(R, c, LUA_TNUMBER, at);
+          ins = rec_emit(R, IR_SETA, a, b, c);
+          ins->t = uvalue(ra)->array;
+        }
+        else return 0;
+        ins->pc = at;
+        luaV_settable(L, ra, rb, rc);  /* an existing slot: no allocation */
+        pc++;
+        break;
+      }
+      case OP_ADD: case OP_SUB: case OP_MUL:
+      case OP_DIV: case OP_MOD: case OP_POW: {
+        int b = rec_operand(GETARG_B(i)), c = rec_operand(GETARG_C(i));
+        TValue *rb = irisk(b) ? k + irk(b) : base + b;
+        TValue *rc = irisk(c) ? k + irk(c) : base + c;
+        lua_Number nb, nc, r;
+        if (!ttisnumber(rb) || !ttisnumber(rc)) return 0;
+        nb = nvalue(rb); nc = nvalue(rc);
+        switch (GET_OPCODE(i)) {
+          case OP_ADD: r = luai_numadd(nb, nc); break;
+          case OP_SUB: r = luai_numsub(nb, nc); break;
+          case OP_MUL: r = luai_nummul(nb, nc); break;
+          case OP_DIV: r = luai_numdiv(nb, nc); break;
+          case OP_MOD: r = luai_nummod(nb, nc); break;
+          default: r = luai_numpow(nb, nc); break;
+        }
+        rec_guard(R, b, LUA_TNUMBER, at);
+        rec_guard(R, c, LUA_TNUMBER, at);
+        rec_num(R, rec_emit(R, IR_ADD + (GET_OPCODE(i) - OP_ADD), a, b, c), a);
+        setnvalue(ra, r);
+        pc++;
+        break;
+      }
+      case OP_UNM: {
+        int b = GETARG_B(i);
+        if (!ttisnumber(base + b)) return 0;
+        rec_guard(R, b, LUA_TNUMBER, at);
+        rec_num(R, rec_emit(R, IR_UNM, a, b, 0), a);
+        setnvalue(ra, luai_numunm(nvalue(base + b)));
+        pc++;
+        break;
+      }
+      case OP_NOT: {
+        int b = GETARG_B(i);
+        int res = l_isfalse(base + b);
+        rec_guard(R, b, ttype(base + b), at);
+        rec_emit(R, IR_NOT, a, b, 0)->t = cast_byte(ttype(base + b));
+        rec_write(R, a, LUA_TBOOLEAN);
+        setbvalue(ra, res);
+        pc++;
+        break;
+      }
+      case OP_LEN: {
+        int b = GETARG_B(i);
+        StkId rb = base + b;
+        int op;
+        lua_Number len;
+        switch (ttype(rb)) {
+          case LUA_TSTRING: {
+            op = IR_LENS;
+            len = cast_num(tsvalue(rb)->len);
+            break;
+          }
+          case LUA_TTABLE: {
+            op = IR_LENT;
+            len = cast_num(luaH_getn(hvalue(rb)));
+            break;
+          }
+          case LUA_TUSERDATA: {
+            if (!uvalue(rb)->array) return 0;  /* `__len' */
+            op = IR_LENA;
+            len = cast_num(arrayvalue(rawuvalue(rb))->n);
+            break;
+          }
+          default: return 0;
+        }
+        rec_guard(R, b, ttype(rb), at);
+        rec_num(R, rec_emit(R, op, a, b, 0), a)->pc = at;
+        setnvalue(ra, len);
+        pc++;
+        break;
+      }
+      case OP_JMP: {
+        pc += 1 + GETARG_sBx(i);
+        go = rec_branch(R, pc, pc - 1 - GETARG_sBx(i));
+        break;
+      }
+      case OP_EQ: case OP_LT: case OP_LE: {
+        int b = rec_operand(GETARG_B(i)), c = rec_operand(GETARG_C(i));
+        TValue *rb = irisk(b) ? k + irk(b) : base + b;
+        TValue *rc = irisk(c) ? k + irk(c) : base + c;
+        const Instruction *taken = pc + 2 + GETARG_sBx(*(pc + 1));
+        int res;
+        IRIns *ins = NULL;
+        if (GET_OPCODE(i) == OP_EQ) {
+          if (ttype(rb) != ttype(rc)) res = 0;
+          else if (ttistable(rb) || ttisuserdata(rb)) return 0;  /* `__eq' */
+          else res = luaO_rawequalObj(rb, rc);
+          rec_guard(R, b, ttype(rb), at);
+          rec_guard(R, c, ttype(rc), at);
+          if (ttype(rb) == ttype(rc) && !ttisnil(rb)) {
+            ins = rec_emit(R, IR_EQ, 0, b, c);
+            ins->t = cast_byte(ttype(rb));
+          }
+        }
+        else {
+          if (!ttisnumber(rb) || !ttisnumber(rc)) return 0;
+          res = (GET_OPCODE(i) == OP_LT) ?
+                luai_numlt(nvalue(rb), nvalue(rc)) :
+                luai_numle(nvalue(rb), nvalue(rc));
+          rec_guard(R, b, LUA_TNUMBER, at);
+          rec_guard(R, c, LUA_TNUMBER, at);
+          ins = rec_emit(R, GET_OPCODE(i) == OP_LT ? IR_LT : IR_LE, 0, b, c);
+        }
+        if (ins) {
+          ins->v = cast_byte(res);
+          ins->pc = cast_int(((res == a) ? pc + 2 : taken) - R->p->code);
+        }
+        pc = (res == a) ? taken : pc + 2;
+        go = rec_branch(R, pc, R->p->code + at);
+        break;
+      }
+      case OP_TEST: case OP_TESTSET: {
+        int s = (GET_OPCODE(i) == OP_TEST) ? a : GETARG_B(i);
+        int t = ttype(base + s);
+        int truth = !l_isfalse(base + s);
+        const Instruction *taken = pc + 2 + GETARG_sBx(*(pc + 1));
+        int jump = (truth == GETARG_C(i));
+        rec_guard(R, s, t, at);
+        if (t == LUA_TBOOLEAN) {
+          IRIns *ins = rec_emit(R, IR_TRUTH, s, 0, 0);
+          ins->v = cast_byte(truth);
+          ins->pc = cast_int((jump ? pc + 2 : taken) - R->p->code);
+        }
+        if (jump && GET_OPCODE(i) == OP_TESTSET) {
+          setobjs2s(L, ra, base + s);
+          rec_emit(R, IR_MOV, a, s, 0);
+          rec_write(R, a, t);
+        }
+        pc = jump ? taken : pc + 2;
+        go = rec_branch(R, pc, R->p->code + at);
+        break;
+      }
+      case OP_FORLOOP: {
+        lua_Number step = nvalue(ra+2);
+        lua_Number idx = luai_numadd(nvalue(ra), step);
+        lua_Number limit = nvalue(ra+1);
+        int up = luai_numlt(0, step);
+        IRIns *ins;
+        if (pc + 1 + GETARG_sBx(i) != R->p->code + R->start ||
+            !(up ? luai_numle(idx, limit) : luai_numle(limit, idx)))
+          return 0;  /* another loop, or the last iteration */
+        rec_guard(R, a, LUA_TNUMBER, at);
+        rec_guard(R, a+1, LUA_TNUMBER, at);
+        rec_guard(R, a+2, LUA_TNUMBER, at);
+        ins = rec_emit(R, IR_FORL, a, 0, at + 1);
+        ins->v = cast_byte(up);
+        ins->pc = at;
+        rec_num(R, ins, a+3);
+        rec_write(R, a, LUA_TNUMBER);
+        setnvalue(ra, idx);
+        setnvalue(ra+3, idx);
+        pc += 1 + GETARG_sBx(i);
+        go = 1;
+        break;
+      }
+      default: return 0;  /* calls, allocations, nested loops... */
+    }
+    if (go != 0) {
+      *ppc = pc;
+      return (go > 0);
+    }
+  }
+  *ppc = pc;
+  return 0;
+}
+
+/* }====================================================== */
+
+
+
+static jit_State *jit_new (lua_State *L) {
+  jit_State *J = luaM_new(L, jit_State);
+  memset(J->hot, 0, sizeof(J->hot));
+  memset(J->trace, 0, sizeof(J->trace));
+  J->area = NULL;
+  J->areatop = 0;
+  G(L)->jitstate = J;
+  return J;
+}
+
+
+static void jit_flush (jit_State *J) {
+  memset(J->hot, 0, sizeof(J->hot));
+  memset(J->trace, 0, sizeof(J->trace));
+  J->areatop = 0;
+}
+
+
+/* copy the assembled trace to executable memory */
+static Trace *jit_install (jit_State *J, RecState *R) {
+  size_t size = (R->nmc + 15) & ~cast(size_t, 15);
+  Trace *t = NULL;
+  int i;
+  union { void *p; jit_MCode f; } mcode;
+  if (size > JIT_AREA) return NULL;
+  if (J->area == NULL) {
+    void *area = mmap(NULL, JIT_AREA, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) return NULL;
+    J->area = cast(unsigned char *, area);
+  }
+  for (i = 0; i < JIT_MAXTRACE && t == NULL; i++)
+    if (J->trace[i].p == NULL) t = &J->trace[i];
+  if (t == NULL || J->areatop + size > JIT_AREA) {
+    jit_flush(J);  /* start over */
+    t = &J->trace[0];
+  }
+  if (mprotect(J->area, JIT_AREA, PROT_READ | PROT_WRITE) != 0)
+    return NULL;
+  memcpy(J->area + J->areatop, R->mc, R->nmc);
+  if (mprotect(J->area, JIT_AREA, PROT_READ | PROT_EXEC) != 0)
+    return NULL;
+  mcode.p = J->area + J->areatop;
+  J->areatop += size;
+  t->p = R->p;
+  t->mcode = mcode.f;
+  return t;
+}
+
+
+static const Instruction *jit_run (lua_State *L, Trace *t,
+                                   const Instruction *pc) {
+  LClosure *cl = &clvalue(L->ci->func)->l;
+  if (t->p != cl->p) return pc;  /* same code in another function */
+  return (*t->mcode)(L, L->base, cl);
+}
+
+
+static const Instruction *jit_record (lua_State *L, jit_State *J,
+                                      HotLoop *h, const Instruction *pc) {
+  const Instruction *start = pc;
+  RecState *R = luaM_new(L, RecState);
+  Trace *t = NULL;
+  R->p = clvalue(L->ci->func)->l.p;
+  R->start = cast_int(pc - R->p->code);
+  R->nir = 0;
+  memset(R->known, LUA_TNONE, sizeof(R->known));
+  memset(R->written, 0, sizeof(R->written));
+  if (rec_trace(L, R, &pc)) {
+    int i, reenter = 0;
+    for (i = 0; i < R->nir; i++) {  /* loop inputs still of their types? */
+      IRIns *ins = &R->ir[i];
+      if (ins->op == IR_HEAD && R->known[ins->a] != ins->t) reenter = 1;
+    }
+    rec_emit(R, IR_LOOP, 0, 0, 0)->v = cast_byte(reenter);
+    if (asm_trace(R)) t = jit_install(J, R);
+  }
+  luaM_free(L, R);
+  if (t != NULL) {
+    h->trace = t;
+    h->pc = start;  /* the table may have been flushed */
+    return jit_run(L, t, pc);
+  }
+  if (++h->aborts < JIT_MAXABORT)
+    h->count = cast(unsigned short, JIT_HOTLOOP << h->aborts);
+  return pc;
+}
+
+
+const Instruction *luaJ_loop (lua_State *L, const Instruction *pc) {
+  jit_State *J = G(L)->jitstate;
+  HotLoop *h;
+  if (J == NULL) J = jit_new(L);
+  h = &J->hot[(cast(size_t, pc) / sizeof(Instruction)) & (JIT_HOTSIZE - 1)];
+  if (h->pc != pc) {
+    if (h->trace != NULL) return pc;  /* slot of another compiled loop */
+    h->pc = pc;
+    h->count = JIT_HOTLOOP;
+    h->aborts = 0;
+  }
+  if (h->trace != NULL)
+    return jit_run(L, h->trace, pc);
+  if (h->aborts >= JIT_MAXABORT || --h->count > 0)
+    return pc;
+  return jit_record(L, J, h, pc);
+}
+
+
+void luaJ_freeproto (lua_State *L, Proto *f) {
+  jit_State *J = G(L)->jitstate;
+  int i;
+  if (J == NULL) return;
+  for (i = 0; i < JIT_HOTSIZE; i++) {
+    HotLoop *h = &J->hot[i];
+    if ((h->trace != NULL && h->trace->p == f) ||
+        (h->pc >= f->code && h->pc < f->code + f->sizecode)) {
+      h->pc = NULL;
+      h->trace = NULL;
+    }
+  }
+  for (i = 0; i < JIT_MAXTRACE; i++)
+    if (J->trace[i].p == f) J->trace[i].p = NULL;
+}
+
+
+void luaJ_close (lua_State *L) {
+  jit_State *J = G(L)->jitstate;
+  if (J == NULL) return;
+  if (J->area != NULL) munmap(J->area, JIT_AREA);
+  luaM_free(L, J);
+  G(L)->jitstate = NULL;
+}
+
+#endif
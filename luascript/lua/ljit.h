@@ -0,0 +1,22 @@
+/*
+** $Id: ljit.h $
+** Trace compiler for hot loops
+** See Copyright Notice in lua.h
+*/
+
+#ifndef ljit_h
+#define ljit_h
+
+#include "lobject.h"
+
+
+#if defined(LUA_USE_JIT)
+
+/* back-edge to `pc' taken: count it, record it or run its trace */
+LUAI_FUNC const Instruction *luaJ_loop (lua_State *L, const Instruction *pc);
+LUAI_FUNC void luaJ_freeproto (lua_State *L, Proto *f);
+LUAI_FUNC void luaJ_close (lua_State *L);
+
+#endif
+
+#endif
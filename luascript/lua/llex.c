@@ -33,6 +33,77 @@
 #define currIsNewline(ls)	(ls->current == '\n' || ls->current == '\r')
 
 
+/*
+** character classes, indexed by character + 1 (so that EOZ has one);
+** ASCII only, whatever the locale
+*/
+#define ALPHABIT	1	/* letters and `_' */
+#define DIGITBIT	2
+#define BLANKBIT	4	/* white space but newlines */
+#define LINEBIT		8	/* in a line: all but newlines */
+#define PLAINBIT	16	/* in a string as is: all but newlines, `\' and quotes */
+
+static const lu_byte lexclass[UCHAR_MAX + 2] = {
+  0x00,  /* EOZ */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 00 */
+  0x18, 0x1c, 0x00, 0x1c, 0x1c, 0x00, 0x18, 0x18,  /* 08 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 10 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 18 */
+  0x1c, 0x18, 0x08, 0x18, 0x18, 0x18, 0x18, 0x08,  /* 20 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 28 */
+  0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,  /* 30 */
+  0x1a, 0x1a, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 38 */
+  0x18, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,  /* 40 */
+  0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,  /* 48 */
+  0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,  /* 50 */
+  0x19, 0x19, 0x19, 0x18, 0x08, 0x18, 0x18, 0x19,  /* 58 */
+  0x18, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,  /* 60 */
+  0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,  /* 68 */
+  0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,  /* 70 */
+  0x19, 0x19, 0x19, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 78 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 80 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 88 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 90 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* 98 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* a0 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* a8 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* b0 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* b8 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* c0 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* c8 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* d0 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* d8 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* e0 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* e8 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,  /* f0 */
+  0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18   /* f8 */
+};
+
+#define inclass(c,cls)	(lexclass[(c)+1] & (cls))
+#define lisalpha(c)	inclass(c, ALPHABIT)
+#define lisdigit(c)	inclass(c, DIGITBIT)
+#define lisalnum(c)	inclass(c, ALPHABIT | DIGITBIT)
+#define lisblank(c)	inclass(c, BLANKBIT)
+
+
+/*
+** When the current character did not come at the end of the input
+** buffer, it is at `z->p[-1]' and the rest of the buffer follows it:
+** the lexer then scans the buffer in place instead of one character at
+** a time.
+*/
+#define bufstart(ls)	((ls)->z->p - 1)
+#define bufend(ls)	((ls)->z->p + (ls)->z->n)
+
+/* skip the buffered characters before `p' and read the one at `p' */
+static void skipto (LexState *ls, const char *p) {
+  ZIO *z = ls->z;
+  z->n -= p - z->p;
+  z->p = p;
+  next(ls);
+}
+
+
 /* ORDER RESERVED */
 const char *const luaX_tokens [] = {
     "and", "break", "do", "else", "elseif",
@@ -61,6 +132,50 @@ static void save (LexState *ls, int c) {
 }
 
 
+/* saves a token scanned in place, for error messages */
+static void saveblock (LexState *ls, const char *s, size_t l) {
+  Mbuffer *b = ls->buff;
+  if (b->n + l > b->buffsize) {
+    size_t newsize = b->buffsize;
+    while (b->n + l > newsize) {
+      if (newsize >= MAX_SIZET/2)
+        luaX_lexerror(ls, "lexical element too long", 0);
+      newsize *= 2;
+    }
+    luaZ_resizebuffer(ls->L, b, newsize);
+  }
+  memcpy(b->buffer + b->n, s, l);
+  b->n += l;
+}
+
+
+/*
+** perfect hash of the reserved words, on their length and their first and
+** last characters; entries are 1 + the index of the word in `luaX_tokens'
+*/
+#define kwhash(s,l) \
+	((char2int((s)[0]) + char2int((s)[(l)-1]) + ((l) << 3)) & 63)
+
+static const lu_byte kwtable[64] = {
+  12,  0, 18,  0, 21,  0,  0,  0,  0, 20,  0,  0,  0,  0,  0,  0,
+  17,  0,  0,  0,  9,  0, 16,  0,  0,  0,  0,  0,  0,  1,  0, 10,
+   0,  6,  0,  3,  0,  0,  0, 11,  0,  0,  4,  0,  0,  0,  0,  0,
+   8, 15, 13,  7,  0,  2,  0,  0,  0, 19, 14,  5,  0,  0,  0,  0
+};
+
+
+/* returns the token of a reserved word, or 0 for other names */
+static int reserved (const char *s, size_t l) {
+  int i;
+  const char *w;
+  if (l < 2 || l >= TOKEN_LEN) return 0;
+  i = kwtable[kwhash(s, l)];
+  if (i == 0) return 0;
+  w = luaX_tokens[i - 1];
+  return (strncmp(w, s, l) == 0 && w[l] == '\0') ? i - 1 + FIRST_RESERVED : 0;
+}
+
+
 void luaX_init (lua_State *L) {
   int i;
   for (i=0; i<NUM_RESERVED; i++) {
@@ -190,13 +305,13 @@ static void trydecpoint (LexState *ls, SemInfo *seminfo) {
 
 /* LUA_NUMBER */
 static void read_numeral (LexState *ls, SemInfo *seminfo) {
-  lua_assert(isdigit(ls->current));
+  lua_assert(lisdigit(ls->current));
   do {
     save_and_next(ls);
-  } while (isdigit(ls->current) || ls->current == '.');
+  } while (lisdigit(ls->current) || ls->current == '.');
   if (check_next(ls, "Ee"))  /* `E'? */
     check_next(ls, "+-");  /* optional exponent sign */
-  while (isalnum(ls->current) || ls->current == '_')
+  while (lisalnum(ls->current))
     save_and_next(ls);
   save(ls, '\0');
   buffreplace(ls, '.', ls->decpoint);  /* follow locale for decimal point */
@@ -273,7 +388,30 @@ static void read_long_string (LexState *ls, SemInfo *seminfo, int sep) {
 }
 
 
+/* a string without escapes, all in the buffer, is taken in place */
+static int read_plain_string (LexState *ls, int del, SemInfo *seminfo) {
+  const char *s = ls->z->p;  /* after the opening delimiter */
+  const char *e = bufend(ls);
+  const char *p;
+  for (p = s; p < e; p++) {
+    int c = char2int(*p);
+    if (!inclass(c, PLAINBIT)) {
+      if (c == del) {
+        saveblock(ls, s - 1, p - s + 2);  /* with the delimiters */
+        seminfo->ts = luaX_newstring(ls, s, p - s);
+        skipto(ls, p + 1);
+        return 1;
+      }
+      else if (c != '"' && c != '\'') break;  /* escape or newline */
+    }
+  }
+  return 0;
+}
+
+
 static void read_string (LexState *ls, int del, SemInfo *seminfo) {
+  if (read_plain_string(ls, del, seminfo))
+    return;
   save_and_next(ls);
   while (ls->current != del) {
     switch (ls->current) {
@@ -299,7 +437,7 @@ static void read_string (LexState *ls, int del, SemInfo *seminfo) {
           case '\r': save(ls, '\n'); inclinenumber(ls); continue;
           case EOZ: continue;  /* will raise an error next loop */
           default: {
-            if (!isdigit(ls->current))
+            if (!lisdigit(ls->current))
               save_and_next(ls);  /* handles \\, \", \', and \? */
             else {  /* \xxx */
               int i = 0;
@@ -307,7 +445,7 @@ static void read_string (LexState *ls, int del, SemInfo *seminfo) {
               do {
                 c = 10*c + (ls->current-'0');
                 next(ls);
-              } while (++i<3 && isdigit(ls->current));
+              } while (++i<3 && lisdigit(ls->current));
               if (c > UCHAR_MAX)
                 luaX_lexerror(ls, "escape sequence too large", TK_STRING);
               save(ls, c);
@@ -352,9 +490,12 @@ static int llex (LexState *ls, SemInfo *seminfo) {
             continue;
           }
         }
-        /* else short comment */
-        while (!currIsNewline(ls) && ls->current != EOZ)
-          next(ls);
+        /* else short comment: skip it a buffer at a time */
+        while (!currIsNewline(ls) && ls->current != EOZ) {
+          const char *p = ls->z->p, *e = bufend(ls);
+          while (p < e && inclass(char2int(*p), LINEBIT)) p++;
+          skipto(ls, p);
+        }
         continue;
       }
       case '[': {
@@ -398,7 +539,7 @@ static int llex (LexState *ls, SemInfo *seminfo) {
             return TK_DOTS;   /* ... */
           else return TK_CONCAT;   /* .. */
         }
-        else if (!isdigit(ls->current)) return '.';
+        else if (!lisdigit(ls->current)) return '.';
         else {
           read_numeral(ls, seminfo);
           return TK_NUMBER;
@@ -408,29 +549,39 @@ static int llex (LexState *ls, SemInfo *seminfo) {
         return TK_EOS;
       }
       default: {
-        if (isspace(ls->current)) {
-          lua_assert(!currIsNewline(ls));
-          next(ls);
+        if (lisblank(ls->current)) {
+          const char *p = ls->z->p, *e = bufend(ls);
+          while (p < e && lisblank(char2int(*p))) p++;
+          skipto(ls, p);
           continue;
         }
-        else if (isdigit(ls->current)) {
+        else if (lisdigit(ls->current)) {
           read_numeral(ls, seminfo);
           return TK_NUMBER;
         }
-        else if (isalpha(ls->current) || ls->current == '_') {
+        else if (lisalpha(ls->current)) {
           /* identifier or reserved word */
-          TString *ts;
-          do {
-            save_and_next(ls);
-          } while (isalnum(ls->current) || ls->current == '_');
-          ts = luaX_newstring(ls, luaZ_buffer(ls->buff),
-                                  luaZ_bufflen(ls->buff));
-          if (ts->tsv.reserved > 0)  /* reserved word? */
-            return ts->tsv.reserved - 1 + FIRST_RESERVED;
-          else {
-            seminfo->ts = ts;
-            return TK_NAME;
+          const char *s = bufstart(ls), *p = ls->z->p, *e = bufend(ls);
+          size_t l;
+          int token;
+          while (p < e && lisalnum(char2int(*p))) p++;
+          if (p < e) {  /* name in the buffer */
+            l = p - s;
+            saveblock(ls, s, l);
+            skipto(ls, p);
+          }
+          else {  /* may go on in the next buffer */
+            do {
+              save_and_next(ls);
+            } while (lisalnum(ls->current));
+            s = luaZ_buffer(ls->buff);
+            l = luaZ_bufflen(ls->buff);
           }
+          token = reserved(s, l);
+          if (token != 0)
+            return token;
+          seminfo->ts = luaX_newstring(ls, s, l);
+          return TK_NAME;
         }
         else {
           int c = ls->current;
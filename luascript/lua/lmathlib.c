@@ -88,6 +88,12 @@ static int math_floor (lua_State *L) {
   return 1;
 }
 
+static int math_floor_light (lua_State *L) {  /* see lua_setlight */
+  if (lua_type(L, 1) != LUA_TNUMBER) return LUA_LIGHTFAIL;
+  lua_pushnumber(L, floor(lua_tonumber(L, 1)));
+  return 1;
+}
+
 static int math_fmod (lua_State *L) {
   lua_pushnumber(L, fmod(luaL_checknumber(L, 1), luaL_checknumber(L, 2)));
   return 1;
@@ -245,11 +251,19 @@ static const luaL_Reg mathlib[] = {
 };
 
 
+static const luaL_Light mathlight[] = {
+  {"floor", math_floor_light, 1},
+  {NULL, NULL, 0}
+};
+
+
 /*
 ** Open math library
 */
 LUALIB_API int luaopen_math (lua_State *L) {
   luaL_register(L, LUA_MATHLIBNAME, mathlib);
+  luaL_setlights(L, mathlight);
+  lua_setbuiltins(L, -1, LUA_MATHLIBNAME);
   lua_pushnumber(L, PI);
   lua_setfield(L, -2, "pi");
   lua_pushnumber(L, HUGE_VAL);
@@ -0,0 +1,188 @@
+/*
+** $Id: lnative.c $
+** Functions translated to C by luac -c
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stddef.h>
+
+#define lnative_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lnative.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "ltable.h"
+#include "lvm.h"
+
+
+
+/*
+** the helpers below are the slow paths of their opcodes in luaV_execute,
+** for code that cannot reach the statics of lvm.c
+*/
+
+static void native_concat (lua_State *L, int b, int c) {
+  luaV_concat(L, c-b+1, c);
+  luaC_checkGC(L);
+}
+
+
+static void native_newtable (lua_State *L, StkId ra, int b, int c) {
+  sethvalue(L, ra, luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
+  luaC_checkGC(L);
+}
+
+
+/* `pc' points to the pseudo-instructions that follow the OP_CLOSURE */
+static void native_closure (lua_State *L, StkId ra, int bx,
+                            const Instruction *pc) {
+  LClosure *cl = &clvalue(L->ci->func)->l;
+  Proto *p = cl->p->p[bx];
+  int nup = p->nups;
+  Closure *ncl = luaF_newLclosure(L, nup, cl->env);
+  int j;
+  ncl->l.p = p;
+  for (j=0; j<nup; j++, pc++) {
+    if (GET_OPCODE(*pc) == OP_GETUPVAL)
+      ncl->l.upvals[j] = cl->upvals[GETARG_B(*pc)];
+    else {
+      lua_assert(GET_OPCODE(*pc) == OP_MOVE);
+      ncl->l.upvals[j] = luaF_findupval(L, L->base + GETARG_B(*pc));
+    }
+  }
+  setclvalue(L, ra, ncl);
+  luaC_checkGC(L);
+}
+
+
+static void native_vararg (lua_State *L, int a, int b) {
+  CallInfo *ci = L->ci;
+  Proto *p = clvalue(ci->func)->l.p;
+  int n = cast_int(ci->base - ci->func) - p->numparams - 1;
+  StkId ra;
+  int j;
+  b--;
+  if (b == LUA_MULTRET) {
+    luaD_checkstack(L, n);
+    b = n;
+    L->top = L->base + a + n;
+  }
+  ra = L->base + a;  /* the stack may have moved */
+  for (j = 0; j < b; j++) {
+    if (j < n) {
+      setobjs2s(L, ra + j, ci->base - n + j);
+    }
+    else {
+      setnilvalue(ra + j);
+    }
+  }
+}
+
+
+static void native_forprep (lua_State *L, StkId ra) {
+  const TValue *init = ra;
+  const TValue *plimit = ra+1;
+  const TValue *pstep = ra+2;
+  if (!tonumber(init, ra))
+    luaG_runerror(L, LUA_QL("for") " initial value must be a number");
+  else if (!tonumber(plimit, ra+1))
+    luaG_runerror(L, LUA_QL("for") " limit must be a number");
+  else if (!tonumber(pstep, ra+2))
+    luaG_runerror(L, LUA_QL("for") " step must be a number");
+}
+
+
+static void native_setlist (lua_State *L, StkId ra, int n, int c) {
+  int last;
+  Table *h;
+  if (n == 0) {
+    n = cast_int(L->top - ra) - 1;
+    L->top = L->ci->top;
+  }
+  lua_assert(ttistable(ra));
+  h = hvalue(ra);
+  last = ((c-1)*LFIELDS_PER_FLUSH) + n;
+  if (last > h->sizearray)  /* needs more space? */
+    luaH_resizearray(L, h, last);  /* pre-alloc it at once */
+  for (; n > 0; n--) {
+    TValue *val = ra+n;
+    setobj2t(L, luaH_setnum(L, h, last--), val);
+    luaC_barriert(L, h, val);
+  }
+}
+
+
+static void native_call (lua_State *L, StkId func, int nresults) {
+  if (!luaD_canlight(L, func) || !luaD_lightcall(L, func, nresults))
+    luaD_call(L, func, nresults);
+}
+
+
+static void native_close (lua_State *L, StkId level) {
+  luaF_close(L, level);
+}
+
+
+static int native_poscall (lua_State *L, StkId firstResult) {
+  if (L->openupval) luaF_close(L, L->base);
+  return luaD_poscall(L, firstResult);
+}
+
+
+const luaN_VM luaN_vm = {
+  luaV_gettable,
+  luaV_settable,
+  luaV_arith,
+  luaV_equalval,
+  luaV_lessthan,
+  luaV_lessequal,
+  luaV_objlen,
+  native_concat,
+  native_newtable,
+  native_closure,
+  native_vararg,
+  native_forprep,
+  native_setlist,
+  native_call,
+  native_close,
+  native_poscall,
+  luaC_barrierf,
+  luaC_barrierback
+};
+
+
+static int countprotos (const Proto *f) {
+  int i, n = 1;
+  for (i = 0; i < f->sizep; i++)
+    n += countprotos(f->p[i]);
+  return n;
+}
+
+
+static const lua_CFunction *bindprotos (Proto *f, const lua_CFunction *code) {
+  int i;
+  f->native = *code++;
+  for (i = 0; i < f->sizep; i++)
+    code = bindprotos(f->p[i], code);
+  return code;
+}
+
+
+/*
+** returns 0 when the chunk has not `ncode' functions, and thus is not
+** the one the code was translated from
+*/
+int luaN_bind (Proto *f, const lua_CFunction *code, int ncode) {
+  if (countprotos(f) != ncode) return 0;
+  bindprotos(f, code);
+  return 1;
+}
@@ -0,0 +1,255 @@
+/*
+** $Id: lnative.h $
+** Functions translated to C by luac -c
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lnative_h
+#define lnative_h
+
+#include "lua.h"
+
+#include "lgc.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "ltable.h"
+#include "ltm.h"
+
+
+/*
+** what the translated code calls back into the VM for. It is handed to
+** the code by lua_loadnative, so that the code needs no other symbol
+** than the API: it links alike into the host or into a module loaded by
+** loadlib. Each entry does what the interpreter does for its opcode
+*/
+struct lua_NativeVM {
+  void (*gettable) (lua_State *L, const TValue *t, TValue *key, StkId val);
+  void (*settable) (lua_State *L, const TValue *t, TValue *key, StkId val);
+  void (*arith) (lua_State *L, StkId ra, const TValue *rb, const TValue *rc,
+                 TMS op);
+  int (*equalval) (lua_State *L, const TValue *t1, const TValue *t2);
+  int (*lessthan) (lua_State *L, const TValue *l, const TValue *r);
+  int (*lessequal) (lua_State *L, const TValue *l, const TValue *r);
+  void (*objlen) (lua_State *L, StkId ra, const TValue *rb);
+  void (*concat) (lua_State *L, int b, int c);
+  void (*newtable) (lua_State *L, StkId ra, int b, int c);
+  void (*closure) (lua_State *L, StkId ra, int bx, const Instruction *pc);
+  void (*vararg) (lua_State *L, int a, int b);
+  void (*forprep) (lua_State *L, StkId ra);
+  void (*setlist) (lua_State *L, StkId ra, int n, int c);
+  void (*call) (lua_State *L, StkId func, int nresults);
+  void (*close) (lua_State *L, StkId level);
+  int (*poscall) (lua_State *L, StkId firstResult);
+  void (*barrierf) (lua_State *L, GCObject *o, GCObject *v);
+  void (*barrierback) (lua_State *L, Table *t, GCObject *v);
+};
+
+typedef struct lua_NativeVM luaN_VM;
+
+
+/*
+** `p' runs its native code when entered at its start, without hooks, and
+** with room left for the C calls that code makes: deeper recursions go
+** on in the interpreter. Native code makes its calls through luaD_call,
+** which cannot yield, so coroutines are always interpreted (the main
+** thread never yields)
+*/
+#define luaN_canrun(L,p,pc) \
+	((p)->native != NULL && (pc) == (p)->code && !(L)->hookmask && \
+	 (L) == G(L)->mainthread && (L)->nCcalls < LUAI_MAXCCALLS/2)
+
+/* returned by native code instead of the results of luaD_poscall when it
+   stops at a tail call, for the interpreter to do it from L->savedpc */
+#define NATIVE_TAILCALL	(-1)
+
+
+LUAI_DATA const luaN_VM luaN_vm;
+
+/* sets the native code of `f' and its nested functions, in dump order */
+LUAI_FUNC int luaN_bind (Proto *f, const lua_CFunction *code, int ncode);
+
+
+#if defined(LUA_NATIVECODE)
+
+/*
+** macros used by the code that luac -c writes. A translated function
+** runs over the same stack frame as the interpreter would, with `pc'
+** turned into labels; `vm' is the table of helpers of its file
+*/
+
+#define nat_prologue() \
+  LClosure *cl = &clvalue(L->ci->func)->l; \
+  StkId base = L->base; \
+  TValue *k = cl->p->k; \
+  const Instruction *code = cl->p->code; \
+  UNUSED(k); UNUSED(code)
+
+#define R(x)	(base+(x))
+#define K(x)	(k+(x))
+
+/* what the interpreter's `pc' would be after instruction `n' */
+#define savepc(n)	(L->savedpc = code+(n)+1)
+
+#define protect(n,x)	{ savepc(n); {x;}; base = L->base; }
+
+
+/* `slot' := value of number `nk' in the array part of `h', or NULL */
+#define arrayslot(h,nk,slot) { int i_; lua_Number n_ = (nk); \
+  lua_number2int(i_, n_); \
+  slot = (cast(unsigned int, i_-1) < cast(unsigned int, (h)->sizearray) && \
+          luai_numeq(cast_num(i_), n_)) ? &(h)->array[i_-1] : NULL; }
+
+/* `slot' := value of string `ks' in the hash part of `h', or NULL */
+#define strslot(h,ks,slot) { Node *n_ = gnode(h, lmod((ks)->tsv.hash, \
+                                                       sizenode(h))); \
+  slot = NULL; \
+  do { \
+    if (ttisstring(gkey(n_)) && rawtsvalue(gkey(n_)) == (ks)) { \
+      slot = gval(n_); break; } \
+    n_ = gnext(n_); \
+  } while (n_); }
+
+/* `slot' := existing slot of key `kv' in table `h', or NULL */
+#define rawslot(h,kv,slot) { \
+  if (ttisnumber(kv)) arrayslot(h, nvalue(kv), slot) \
+  else if (ttisstring(kv)) strslot(h, rawtsvalue(kv), slot) \
+  else slot = NULL; \
+  if (slot != NULL && ttisnil(slot)) slot = NULL; }
+
+
+#define nat_move(a,b)	setobjs2s(L, R(a), R(b))
+#define nat_loadk(a,bx)	setobj2s(L, R(a), K(bx))
+#define nat_loadbool(a,b)	setbvalue(R(a), b)
+#define nat_loadnil(a)	setnilvalue(R(a))
+#define nat_getupval(a,b)	setobj2s(L, R(a), cl->upvals[b]->v)
+
+#define nat_setupval(a,b) { UpVal *uv_ = cl->upvals[b]; \
+  setobj(L, uv_->v, R(a)); \
+  if (valiswhite(R(a)) && isblack(obj2gco(uv_))) \
+    vm->barrierf(L, obj2gco(uv_), gcvalue(R(a))); }
+
+#define nat_gettable(n,a,t,kv) { \
+  TValue *t_ = (t), *k_ = (kv); const TValue *s_ = NULL; \
+  if (ttistable(t_)) rawslot(hvalue(t_), k_, s_) \
+  if (s_ != NULL) { setobj2s(L, R(a), s_); } \
+  else protect(n, vm->gettable(L, t_, k_, R(a))); }
+
+#define nat_settable(n,t,kv,v) { \
+  TValue *t_ = (t), *k_ = (kv), *v_ = (v); TValue *s_ = NULL; \
+  if (ttistable(t_)) rawslot(hvalue(t_), k_, s_) \
+  if (s_ != NULL) { \
+    setobj2t(L, s_, v_); \
+    if (valiswhite(v_) && isblack(obj2gco(hvalue(t_)))) \
+      vm->barrierback(L, hvalue(t_), gcvalue(v_)); \
+  } \
+  else protect(n, vm->settable(L, t_, k_, v_)); }
+
+#define nat_getglobal(n,a,bx) { TValue g_; \
+  sethvalue(L, &g_, cl->env); nat_gettable(n, a, &g_, K(bx)) }
+
+#define nat_setglobal(n,a,bx) { TValue g_; \
+  sethvalue(L, &g_, cl->env); nat_settable(n, &g_, K(bx), R(a)) }
+
+#define nat_newtable(n,a,b,c)	protect(n, vm->newtable(L, R(a), b, c))
+
+#define nat_self(n,a,b,c) { setobjs2s(L, R(a)+1, R(b)); \
+  nat_gettable(n, a, R(b), c) }
+
+/* arithmetic, with operands `b' and `c' known to be numbers if `nb'/`nc' */
+#define nat_arith(n,a,b,c,nb,nc,op,tm) { \
+  TValue *b_ = (b), *c_ = (c); \
+  if ((nb || ttisnumber(b_)) && (nc || ttisnumber(c_))) { \
+    lua_Number x_ = nvalue(b_), y_ = nvalue(c_); \
+    setnvalue(R(a), op(x_, y_)); \
+  } \
+  else protect(n, vm->arith(L, R(a), b_, c_, tm)); }
+
+#define nat_unm(n,a,b) { TValue *b_ = R(b); \
+  if (ttisnumber(b_)) { lua_Number x_ = nvalue(b_); \
+    setnvalue(R(a), luai_numunm(x_)); } \
+  else protect(n, vm->arith(L, R(a), b_, b_, TM_UNM)); }
+
+#define nat_not(a,b) { int res_ = l_isfalse(R(b)); setbvalue(R(a), res_); }
+
+#define nat_len(n,a,b) { TValue *b_ = R(b); \
+  if (ttisstring(b_)) { setnvalue(R(a), cast_num(tsvalue(b_)->len)); } \
+  else protect(n, vm->objlen(L, R(a), b_)); }
+
+#define nat_concat(n,a,b,c) { protect(n, vm->concat(L, b, c)); \
+  setobjs2s(L, R(a), R(b)); }
+
+#define nat_jmp(t)	{ luai_threadyield(L); goto t; }
+
+/* comparisons skip the jump that follows them unless `res' == `a' */
+#define nat_eq(n,a,b,c,skip) { TValue *b_ = (b), *c_ = (c); int res_; \
+  if (ttype(b_) != ttype(c_)) res_ = 0; \
+  else if (ttisnumber(b_)) res_ = luai_numeq(nvalue(b_), nvalue(c_)); \
+  else if (ttistable(b_) || ttisuserdata(b_)) \
+    protect(n, res_ = vm->equalval(L, b_, c_)) \
+  else if (ttisnil(b_)) res_ = 1; \
+  else if (ttisboolean(b_)) res_ = (bvalue(b_) == bvalue(c_)); \
+  else if (ttislightuserdata(b_)) res_ = (pvalue(b_) == pvalue(c_)); \
+  else res_ = (gcvalue(b_) == gcvalue(c_)); \
+  if (res_ != (a)) goto skip; }
+
+#define nat_lt(n,a,b,c,skip) { TValue *b_ = (b), *c_ = (c); int res_; \
+  if (ttisnumber(b_) && ttisnumber(c_)) \
+    res_ = luai_numlt(nvalue(b_), nvalue(c_)); \
+  else protect(n, res_ = vm->lessthan(L, b_, c_)) \
+  if (res_ != (a)) goto skip; }
+
+#define nat_le(n,a,b,c,skip) { TValue *b_ = (b), *c_ = (c); int res_; \
+  if (ttisnumber(b_) && ttisnumber(c_)) \
+    res_ = luai_numle(nvalue(b_), nvalue(c_)); \
+  else protect(n, res_ = vm->lessequal(L, b_, c_)) \
+  if (res_ != (a)) goto skip; }
+
+#define nat_test(a,c,skip)	{ if (l_isfalse(R(a)) == (c)) goto skip; }
+
+#define nat_testset(a,b,c,skip) { if (l_isfalse(R(b)) == (c)) goto skip; \
+  setobjs2s(L, R(a), R(b)); }
+
+#define nat_call(n,a,b,c) { if (b) L->top = R(a)+(b); \
+  protect(n, vm->call(L, R(a), (c)-1)); \
+  if ((c)-1 != LUA_MULTRET) L->top = L->ci->top; }
+
+/* the interpreter does tail calls, so that they do not pile C frames */
+#define nat_tailcall(n)	{ L->savedpc = code+(n); return NATIVE_TAILCALL; }
+
+#define nat_return(n,a,b) { if (b) L->top = R(a)+(b)-1; \
+  savepc(n); return vm->poscall(L, R(a)); }
+
+#define nat_forloop(a,t) { \
+  lua_Number step_ = nvalue(R(a)+2); \
+  lua_Number idx_ = luai_numadd(nvalue(R(a)), step_); \
+  lua_Number limit_ = nvalue(R(a)+1); \
+  if (luai_numlt(0, step_) ? luai_numle(idx_, limit_) \
+                           : luai_numle(limit_, idx_)) { \
+    setnvalue(R(a), idx_); setnvalue(R(a)+3, idx_); \
+    nat_jmp(t) } }
+
+#define nat_forprep(n,a,t) { \
+  if (!ttisnumber(R(a)) || !ttisnumber(R(a)+1) || !ttisnumber(R(a)+2)) { \
+    savepc(n); vm->forprep(L, R(a)); } \
+  setnvalue(R(a), luai_numsub(nvalue(R(a)), nvalue(R(a)+2))); \
+  nat_jmp(t) }
+
+#define nat_tforloop(n,a,c,skip) { StkId cb_ = R(a)+3; \
+  setobjs2s(L, cb_+2, R(a)+2); setobjs2s(L, cb_+1, R(a)+1); \
+  setobjs2s(L, cb_, R(a)); \
+  L->top = cb_+3; \
+  protect(n, vm->call(L, cb_, c)); \
+  L->top = L->ci->top; \
+  if (ttisnil(R(a)+3)) goto skip; \
+  setobjs2s(L, R(a)+2, R(a)+3); }
+
+#define nat_setlist(n,a,b,c)	protect(n, vm->setlist(L, R(a), b, c))
+#define nat_close(a)	vm->close(L, R(a))
+#define nat_closure(n,a,bx) \
+  protect(n, vm->closure(L, R(a), bx, code+(n)+1))
+#define nat_vararg(n,a,b)	protect(n, vm->vararg(L, a, b))
+
+#endif
+
+#endif
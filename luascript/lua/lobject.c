@@ -87,8 +87,165 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
 }
 
 
+#if defined(LUA_FASTNUMCONV)
+
+/* powers of 10 that are exact in a double */
+static const lua_Number powersof10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAXPOW10	22
+/* most significant digits read exactly (10^15 < 2^53) */
+#define MAXDIGITS	15
+/* most hexadecimal digits read exactly */
+#define MAXXDIGITS	13
+
+
+/*
+** reads a decimal with up to MAXDIGITS significant digits and an
+** exponent below MAXPOW10, or a short hexadecimal integer; returns 0
+** for anything else (left to lua_str2number). The decimal is the
+** integer of its digits scaled by an exact power of 10, which one
+** multiplication or division rounds correctly.
+*/
+static int readnumber (const char *s, lua_Number *result) {
+  const unsigned char *p = cast(const unsigned char *, s);
+  lua_Number m = 0;
+  int neg, nd = 0;
+  while (isspace(*p)) p++;
+  neg = (*p == '-');
+  if (*p == '-' || *p == '+') p++;
+  if (*p == '0' && (*(p+1) == 'x' || *(p+1) == 'X')) {
+    for (p += 2; isxdigit(*p); p++) {
+      if (++nd > MAXXDIGITS) return 0;
+      m = m*16 + (isdigit(*p) ? *p - '0' : tolower(*p) - 'a' + 10);
+    }
+    if (nd == 0) return 0;
+  }
+  else {
+    int e = 0, point = 0, digits = 0;
+    for (; isdigit(*p) || (*p == '.' && !point); p++) {
+      if (*p == '.') point = 1;
+      else {
+        digits++;
+        e -= point;
+        if (m == 0 && *p == '0') continue;  /* leading zero */
+        if (++nd > MAXDIGITS) return 0;
+        m = m*10 + (*p - '0');
+      }
+    }
+    if (digits == 0) return 0;
+    if (*p == 'e' || *p == 'E') {
+      int x = 0, xneg;
+      p++;
+      xneg = (*p == '-');
+      if (*p == '-' || *p == '+') p++;
+      if (!isdigit(*p)) return 0;
+      for (; isdigit(*p); p++) {
+        x = x*10 + (*p - '0');
+        if (x > 2*MAXPOW10) return 0;
+      }
+      e += xneg ? -x : x;
+    }
+    if (m == 0) e = 0;
+    if (e < -MAXPOW10 || e > MAXPOW10) return 0;
+    if (e < 0) m /= powersof10[-e];
+    else m *= powersof10[e];
+  }
+  while (isspace(*p)) p++;
+  if (*p != '\0') return 0;
+  *result = neg ? -m : m;
+  return 1;
+}
+
+
+/* writes the digits of integral `v' (0 <= v < 1e14) */
+static char *writeint (char *s, lua_Number v) {
+  char buff[14];
+  char *e = buff + sizeof(buff), *b = e;
+  unsigned long hi = cast(unsigned long, v / 1e7);
+  unsigned long x = cast(unsigned long, v - cast_num(hi) * 1e7);
+  if (hi > 0) {  /* 7 low digits, with their zeros */
+    for (; b > e - 7; x /= 10) *--b = cast(char, '0' + x % 10);
+    x = hi;
+  }
+  do { *--b = cast(char, '0' + x % 10); x /= 10; } while (x != 0);
+  memcpy(s, b, e - b);
+  return s + (e - b);
+}
+
+
+/*
+** writes `n' as "%.14g" when it is integral and below 1e14, or when it
+** goes in fixed notation and is not too close to a tie between its two
+** nearest 14-digit decimals; returns the length, or 0 if it must be left
+** to lua_number2str
+*/
+static int writenumber (char *s, lua_Number n) {
+  char *p = s;
+  lua_Number a = (n < 0) ? -n : n;
+  if (!(a < 1e14) || (n == 0 && 1/n < 0))  /* too large, NaN or -0? */
+    return 0;
+  if (n < 0) *p++ = '-';
+  if (a == floor(a))
+    p = writeint(p, a);
+  else if (a >= 1e-4) {
+    char d[14];
+    lua_Number m, f;
+    int k, x, nd;
+    if (a >= 1)  /* scale `a' to 14 integral digits */
+      for (k = 13; k > 0 && a >= powersof10[14 - k]; k--) ;
+    else
+      for (k = 14; a * powersof10[k] < 1e13; k++) ;
+    m = a * powersof10[k];  /* (within 2^-7 of the exact product) */
+    f = m - floor(m);
+    if (f > 0.49 && f < 0.51) return 0;
+    m = floor(m) + (f > 0.5);
+    if (m < 1e13 || m >= 1e14) return 0;
+    writeint(d, m);
+    for (nd = 14; d[nd - 1] == '0'; nd--) ;
+    x = 13 - k;  /* decimal exponent */
+    if (x >= 0) {
+      memcpy(p, d, x + 1);
+      p += x + 1;
+      if (nd > x + 1) {
+        *p++ = '.';
+        memcpy(p, d + x + 1, nd - x - 1);
+        p += nd - x - 1;
+      }
+    }
+    else {
+      *p++ = '0'; *p++ = '.';
+      for (; x < -1; x++) *p++ = '0';
+      memcpy(p, d, nd);
+      p += nd;
+    }
+  }
+  else return 0;
+  *p = '\0';
+  return cast_int(p - s);
+}
+
+#endif
+
+
+/* converts `n' to a string as lua_number2str; returns its length */
+int luaO_num2str (char *s, lua_Number n) {
+#if defined(LUA_FASTNUMCONV)
+  int l = writenumber(s, n);
+  if (l > 0) return l;
+#endif
+  lua_number2str(s, n);
+  return cast_int(strlen(s));
+}
+
+
 int luaO_str2d (const char *s, lua_Number *result) {
   char *endptr;
+#if defined(LUA_FASTNUMCONV)
+  if (readnumber(s, result)) return 1;
+#endif
   *result = lua_str2number(s, &endptr);
   if (endptr == s) return 0;  /* conversion failed */
   if (*endptr == 'x' || *endptr == 'X')  /* maybe an hexadecimal constant? */
@@ -216,6 +216,7 @@ typedef union Udata {
   L_Umaxalign dummy;  /* ensures maximum alignment for `local' udata */
   struct {
     CommonHeader;
+    lu_byte array;  /* element type of a typed array (LUA_ARRAY*) or 0 */
     struct Table *metatable;
     struct Table *env;
     size_t len;
@@ -223,6 +224,9 @@ typedef union Udata {
 } Udata;
 
 
+#define arrayvalue(u)	cast(lua_Array *, (u) + 1)
+
+
 
 
 /*
@@ -246,17 +250,25 @@ typedef struct Proto {
   int linedefined;
   int lastlinedefined;
   GCObject *gclist;
+  lua_CFunction native;  /* code translated to C by luac -c, or NULL */
   lu_byte nups;  /* number of upvalues */
   lu_byte numparams;
   lu_byte is_vararg;
   lu_byte maxstacksize;
+  lu_byte shared;  /* PROTO_SHARED* bits: arrays owned by a loaded image */
 } Proto;
 
 
+/* bits of `shared' in Proto */
+#define PROTO_SHAREDCODE	1
+#define PROTO_SHAREDLINEINFO	2
+
+
 /* masks for new-style vararg */
 #define VARARG_HASARG		1
 #define VARARG_ISVARARG		2
 #define VARARG_NEEDSARG		4
+#define VARARG_UNUSED		8  /* `...' is never read */
 
 
 typedef struct LocVar {
@@ -294,7 +306,10 @@ typedef struct UpVal {
 
 typedef struct CClosure {
   ClosureHeader;
+  lu_byte nlight;  /* number of arguments of `light' */
+  lu_byte builtin;  /* builtin of OP_CALLB that it is (see lopcodes.h) */
   lua_CFunction f;
+  lua_CFunction light;  /* entry called without a frame (see luaD_lightcall) */
   TValue upvalue[1];
 } CClosure;
 
@@ -371,6 +386,7 @@ LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
 LUAI_FUNC int luaO_rawequalObj (const TValue *t1, const TValue *t2);
 LUAI_FUNC int luaO_str2d (const char *s, lua_Number *result);
+LUAI_FUNC int luaO_num2str (char *s, lua_Number n);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
 LUAI_FUNC const char *luaO_pushfstring (lua_State *L, const char *fmt, ...);
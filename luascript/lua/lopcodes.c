@@ -52,6 +52,10 @@ const char *const luaP_opnames[NUM_OPCODES+1] = {
   "CLOSE",
   "CLOSURE",
   "VARARG",
+  "CALLB",
+  "RETURN0",
+  "RETURN1",
+  "SELECT",
   NULL
 };
 
@@ -98,5 +102,23 @@ const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 0, OpArgN, OpArgN, iABC)		/* OP_CLOSE */
  ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_CLOSURE */
  ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_VARARG */
+ ,opmode(0, 1, OpArgU, OpArgU, iABC)		/* OP_CALLB */
+ ,opmode(0, 0, OpArgN, OpArgN, iABC)		/* OP_RETURN0 */
+ ,opmode(0, 0, OpArgN, OpArgN, iABC)		/* OP_RETURN1 */
+ ,opmode(0, 1, OpArgN, OpArgU, iABC)		/* OP_SELECT */
+};
+
+
+
+/* ORDER BUILTIN */
+
+const Builtin luaP_builtins[NUM_BUILTINS] = {
+  {"", "", 0, 0},
+  {"math", "floor", 1, 1},
+  {"string", "byte", 1, 2},
+  {"string", "char", 1, 1},
+  {"string", "len", 1, 1},
+  {"string", "sub", 2, 3},
+  {"_G", "select", 1, 0}  /* (not by OP_CALLB) */
 };
 
@@ -204,11 +204,18 @@ OP_SETLIST,/*	A B C	R(A)[(C-1)*FPF+i] := R(A+i), 1 <= i <= B	*/
 OP_CLOSE,/*	A 	close all variables in the stack up to (>=) R(A)*/
 OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx], R(A), ... ,R(A+n))	*/
 
-OP_VARARG/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
+OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
+
+OP_CALLB,/*	A B C	R(A) := builtin C(R(A+1), ... ,R(A+B-1))	*/
+
+OP_RETURN0,/*		return						*/
+OP_RETURN1,/*	A	return R(A)					*/
+
+OP_SELECT/*	A C	R(A), ... ,R(A+C-2) := R(A)(R(A+1), vararg)	*/
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_VARARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_SELECT) + 1)
 
 
 
@@ -230,6 +237,19 @@ OP_VARARG/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
       (true or false).
 
   (*) All `skips' (pc++) assume that next instruction is a jump
+
+  (*) OP_CALLB is OP_CALL for one result of what the compiler took for a
+      builtin. It runs the builtin in place only when R(A) is the function
+      of the builtin and the arguments are its usual ones; it calls R(A)
+      otherwise.
+
+  (*) OP_RETURN0 and OP_RETURN1 are OP_RETURN with B == 1 and B == 2:
+      they return no value and one value without the general loop of
+      luaD_poscall.
+
+  (*) OP_SELECT is the call select(x, ...). When R(A) is select, it reads
+      the varargs in place; otherwise it passes them to R(A) as OP_VARARG
+      and OP_CALL would. C is as in OP_CALL.
 ===========================================================================*/
 
 
@@ -261,6 +281,33 @@ LUAI_DATA const lu_byte luaP_opmodes[NUM_OPCODES];
 LUAI_DATA const char *const luaP_opnames[NUM_OPCODES+1];  /* opcode names */
 
 
+/*
+** builtins of OP_CALLB: library functions that their library tags (see
+** lua_setbuiltins), and that the VM runs in place. select is only run
+** by OP_SELECT
+*/
+enum BuiltinId {
+  BUILTIN_NONE,
+  BUILTIN_FLOOR,
+  BUILTIN_BYTE,
+  BUILTIN_CHAR,
+  BUILTIN_LEN,
+  BUILTIN_SUB,
+  BUILTIN_SELECT
+};
+
+#define NUM_BUILTINS	(cast(int, BUILTIN_SELECT) + 1)
+
+typedef struct Builtin {
+  const char *lib;
+  const char *name;
+  lu_byte minargs;  /* range of arguments run in place */
+  lu_byte maxargs;
+} Builtin;
+
+LUAI_DATA const Builtin luaP_builtins[NUM_BUILTINS];
+
+
 /* number of list items to accumulate before a SETLIST instruction */
 #define LFIELDS_PER_FLUSH	50
 
@@ -0,0 +1,538 @@
+/*
+** $Id: lopt.c $
+** Optimizer of the code generated by the parser
+** See Copyright Notice in lua.h
+*/
+
+
+#include <string.h>
+
+#define lopt_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lopt.h"
+#include "lzio.h"
+
+
+/*
+** The optimizer rewrites the code of a prototype fresh from the parser:
+** it propagates locals assigned a constant once, threads jumps to jumps,
+** removes unreachable code and stores into dead registers, then compacts
+** the code, its line info and the ranges of the locals. The result is
+** code the parser could have generated, which luaG_checkcode accepts.
+*/
+
+
+#define REGWORDS	((MAXSTACK + 31) / 32)  /* words in a set of registers */
+
+/* flags of the instructions */
+#define REACHED		1
+#define PSEUDO		2	/* data of the previous instruction, not code */
+#define PINNED		4	/* cannot be removed */
+#define TARGET		8	/* some jump lands here */
+#define REMOVED		16
+
+
+typedef struct OptState {
+  Proto *f;
+  int n;  /* number of instructions */
+  int nw;  /* words in the sets of registers of `f' */
+  lu_byte *flags;
+  int *pcs;  /* work list, then new positions of the instructions */
+  unsigned int *live;  /* registers live before each instruction */
+  unsigned int captured[REGWORDS];  /* registers shared with closures */
+} OptState;
+
+
+#define liveset(os,pc)	((os)->live + (pc) * (os)->nw)
+#define jumpdest(i,pc)	((pc) + 1 + GETARG_sBx(i))
+
+#define testreg(s,r)	((s)[(r) >> 5] & (1u << ((r) & 31)))
+
+
+static void addregs (OptState *os, unsigned int *s, int from, int to) {
+  if (to >= os->f->maxstacksize) to = os->f->maxstacksize - 1;
+  for (; from <= to; from++)
+    s[from >> 5] |= 1u << (from & 31);
+}
+
+
+static void addrk (OptState *os, unsigned int *s, int x) {
+  if (!ISK(x)) addregs(os, s, x, x);
+}
+
+
+/*
+** registers read by an instruction, registers it may write and registers
+** it writes for sure, whatever the path it takes
+*/
+static void effects (OptState *os, Instruction i, unsigned int *use,
+                     unsigned int *def, unsigned int *kill) {
+  int top = os->f->maxstacksize - 1;
+  int a = GETARG_A(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  int w;
+  memset(use, 0, os->nw * sizeof(unsigned int));
+  memset(def, 0, os->nw * sizeof(unsigned int));
+  memset(kill, 0, os->nw * sizeof(unsigned int));
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: case OP_UNM: case OP_NOT: case OP_LEN: {
+      addregs(os, use, b, b);
+      addregs(os, kill, a, a);
+      break;
+    }
+    case OP_LOADK: case OP_LOADBOOL: case OP_GETUPVAL: case OP_GETGLOBAL:
+    case OP_NEWTABLE: case OP_CLOSURE: {
+      addregs(os, kill, a, a);
+      break;
+    }
+    case OP_LOADNIL: {
+      addregs(os, kill, a, b);
+      break;
+    }
+    case OP_GETTABLE: {
+      addregs(os, use, b, b);
+      addrk(os, use, c);
+      addregs(os, kill, a, a);
+      break;
+    }
+    case OP_SETGLOBAL: case OP_SETUPVAL: case OP_TEST: case OP_RETURN1: {
+      addregs(os, use, a, a);
+      break;
+    }
+    case OP_SETTABLE: {
+      addregs(os, use, a, a);
+      addrk(os, use, b);
+      addrk(os, use, c);
+      break;
+    }
+    case OP_SELF: {
+      addregs(os, use, b, b);
+      addrk(os, use, c);
+      addregs(os, kill, a, a+1);
+      break;
+    }
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+    case OP_POW: {
+      addrk(os, use, b);
+      addrk(os, use, c);
+      addregs(os, kill, a, a);
+      break;
+    }
+    case OP_EQ: case OP_LT: case OP_LE: {
+      addrk(os, use, b);
+      addrk(os, use, c);
+      break;
+    }
+    case OP_CONCAT: {
+      addregs(os, use, b, c);
+      addregs(os, def, b, c);  /* works in place */
+      addregs(os, kill, a, a);
+      break;
+    }
+    case OP_TESTSET: {
+      addregs(os, use, b, b);
+      addregs(os, def, a, a);  /* only when it jumps */
+      break;
+    }
+    case OP_CALL: {
+      addregs(os, use, a, (b != 0) ? a+b-1 : top);
+      addregs(os, def, a, top);  /* the frame of the callee */
+      addregs(os, kill, a, a+c-2);
+      break;
+    }
+    case OP_CALLB: {
+      addregs(os, use, a, a+b-1);
+      addregs(os, def, a, top);  /* the frame of the callee, if called */
+      addregs(os, kill, a, a);
+      break;
+    }
+    case OP_SELECT: {
+      addregs(os, use, a, a+1);
+      addregs(os, def, a, top);  /* the frame of the callee, if called */
+      addregs(os, kill, a, a+c-2);
+      break;
+    }
+    case OP_TAILCALL: {
+      addregs(os, use, a, (b != 0) ? a+b-1 : top);
+      addregs(os, def, a, top);
+      break;
+    }
+    case OP_RETURN: {
+      addregs(os, use, a, (b != 0) ? a+b-2 : top);
+      break;
+    }
+    case OP_FORLOOP: {
+      addregs(os, use, a, a+2);
+      addregs(os, def, a+3, a+3);  /* only when it loops */
+      addregs(os, kill, a, a);
+      break;
+    }
+    case OP_FORPREP: {
+      addregs(os, use, a, a+2);
+      addregs(os, kill, a, a);
+      break;
+    }
+    case OP_TFORLOOP: {
+      addregs(os, use, a, a+2);
+      addregs(os, def, a+2, top);
+      addregs(os, kill, a+3, a+2+c);
+      break;
+    }
+    case OP_SETLIST: {
+      addregs(os, use, a, (b != 0) ? a+b : top);
+      break;
+    }
+    case OP_VARARG: {
+      if (b != 0) addregs(os, kill, a, a+b-2);
+      else addregs(os, def, a, top);
+      break;
+    }
+    default: break;  /* OP_JMP, OP_CLOSE, OP_RETURN0 */
+  }
+  for (w = 0; w < os->nw; w++)
+    def[w] |= kill[w];
+}
+
+
+/* instructions without effects other than writing their registers */
+static int ispure (Instruction i) {
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: case OP_LOADK: case OP_LOADNIL: case OP_GETUPVAL:
+    case OP_NEWTABLE:
+      return 1;
+    case OP_LOADBOOL:
+      return GETARG_C(i) == 0;
+    default:
+      return 0;
+  }
+}
+
+
+/* instructions that do not always go on with the next one */
+static int isbranch (Instruction i) {
+  switch (GET_OPCODE(i)) {
+    case OP_JMP: case OP_FORLOOP: case OP_FORPREP: case OP_RETURN:
+    case OP_RETURN0: case OP_RETURN1: case OP_TAILCALL:
+      return 1;
+    case OP_LOADBOOL:
+      return GETARG_C(i) != 0;
+    default:
+      return testTMode(GET_OPCODE(i));
+  }
+}
+
+
+static int successors (OptState *os, int pc, int *s) {
+  Instruction i = os->f->code[pc];
+  switch (GET_OPCODE(i)) {
+    case OP_JMP: case OP_FORPREP:
+      s[0] = jumpdest(i, pc);
+      return 1;
+    case OP_FORLOOP:
+      s[0] = pc+1; s[1] = jumpdest(i, pc);
+      return 2;
+    case OP_RETURN: case OP_RETURN0: case OP_RETURN1:
+      return 0;
+    case OP_LOADBOOL:
+      s[0] = (GETARG_C(i) != 0) ? pc+2 : pc+1;
+      return 1;
+    case OP_CLOSURE:
+      s[0] = pc + 1 + os->f->p[GETARG_Bx(i)]->nups;
+      return 1;
+    case OP_SETLIST:
+      s[0] = (GETARG_C(i) == 0) ? pc+2 : pc+1;
+      return 1;
+    default:
+      s[0] = pc+1;
+      if (!testTMode(GET_OPCODE(i))) return 1;
+      s[1] = pc+2;  /* skip the jump */
+      return 2;
+  }
+}
+
+
+/*
+** marks pseudo-instructions, instructions bound to their position,
+** jump targets and the registers closures capture
+*/
+static void scan (OptState *os) {
+  Proto *f = os->f;
+  int pc;
+  memset(os->captured, 0, sizeof(os->captured));
+  os->flags[os->n - 1] |= PINNED;  /* the final return */
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction i = f->code[pc];
+    OpCode op = GET_OPCODE(i);
+    int s[2];
+    int j, ns;
+    if (os->flags[pc] & PSEUDO) continue;
+    if (op == OP_CLOSURE) {
+      int nup = f->p[GETARG_Bx(i)]->nups;
+      for (j = 1; j <= nup; j++) {
+        Instruction u = f->code[pc + j];
+        os->flags[pc + j] |= PSEUDO | PINNED;
+        if (GET_OPCODE(u) == OP_MOVE)
+          addregs(os, os->captured, GETARG_B(u), GETARG_B(u));
+      }
+    }
+    else if (op == OP_SETLIST && GETARG_C(i) == 0)
+      os->flags[pc + 1] |= PSEUDO | PINNED;
+    else if ((op == OP_LOADBOOL && GETARG_C(i) != 0) || testTMode(op))
+      os->flags[pc + 1] |= PINNED;  /* skipped or jumped through */
+    if (isbranch(i)) {
+      ns = successors(os, pc, s);
+      for (j = 0; j < ns; j++) os->flags[s[j]] |= TARGET;
+    }
+  }
+}
+
+
+/*
+** a local assigned a constant once, before any branch, and not shared
+** with closures holds that constant wherever it is read: its reads take
+** the constant instead, except by operations whose errors name it
+*/
+static void propagate (OptState *os) {
+  Proto *f = os->f;
+  unsigned int use[REGWORDS], def[REGWORDS], kill[REGWORDS];
+  int writes[MAXSTACK], writer[MAXSTACK];
+  int entry, pc, r;
+  int nfixed = f->numparams + ((f->is_vararg & VARARG_NEEDSARG) ? 1 : 0);
+  for (entry = 0; entry < os->n; entry++)  /* end of the first block */
+    if ((os->flags[entry] & TARGET) || isbranch(f->code[entry])) break;
+  memset(writes, 0, sizeof(writes));
+  for (pc = 0; pc < os->n; pc++) {
+    if (os->flags[pc] & PSEUDO) continue;
+    effects(os, f->code[pc], use, def, kill);
+    for (r = 0; r < f->maxstacksize; r++)
+      if (testreg(def, r)) { writes[r]++; writer[r] = pc; }
+  }
+  for (r = nfixed; r < f->maxstacksize; r++) {
+    int d = writer[r];
+    int k;
+    if (writes[r] != 1 || d >= entry || testreg(os->captured, r) ||
+        GET_OPCODE(f->code[d]) != OP_LOADK)
+      continue;
+    k = GETARG_Bx(f->code[d]);
+    for (pc = d + 1; pc < os->n; pc++) {
+      Instruction *i = &f->code[pc];
+      OpCode op = GET_OPCODE(*i);
+      if (os->flags[pc] & PSEUDO) continue;
+      switch (op) {  /* (not where errors would name the local) */
+        case OP_MOVE: {
+          if (GETARG_B(*i) == r)
+            *i = CREATE_ABx(OP_LOADK, GETARG_A(*i), k);
+          break;
+        }
+        case OP_SETTABLE: case OP_EQ: {
+          if (GETARG_B(*i) == r && k <= MAXINDEXRK) SETARG_B(*i, RKASK(k));
+        }  /* FALLTHROUGH */
+        case OP_GETTABLE: case OP_SELF: {
+          if (GETARG_C(*i) == r && k <= MAXINDEXRK) SETARG_C(*i, RKASK(k));
+          break;
+        }
+        default: break;
+      }
+    }
+  }
+}
+
+
+/* jumps to unconditional jumps go straight to their final target */
+static void thread (OptState *os) {
+  Proto *f = os->f;
+  int pc;
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction i = f->code[pc];
+    int dest, hops;
+    if ((os->flags[pc] & PSEUDO) || GET_OPCODE(i) != OP_JMP) continue;
+    dest = jumpdest(i, pc);
+    for (hops = 0; hops < 16; hops++) {  /* (cycles of jumps stop here) */
+      Instruction d = f->code[dest];
+      if (GET_OPCODE(d) != OP_JMP || dest == pc) break;
+      dest = jumpdest(d, dest);
+    }
+    SETARG_sBx(f->code[pc], dest - pc - 1);
+  }
+}
+
+
+/* marks reachable code and removes the rest */
+static void reach (OptState *os) {
+  Proto *f = os->f;
+  int *stack = os->pcs;
+  int top = 0;
+  int pc;
+  os->flags[0] |= REACHED;
+  stack[top++] = 0;
+  while (top > 0) {
+    Instruction i;
+    int s[3];
+    int j, ns;
+    pc = stack[--top];
+    i = f->code[pc];
+    ns = successors(os, pc, s);
+    switch (GET_OPCODE(i)) {
+      case OP_CLOSURE: case OP_SETLIST: {  /* with their data */
+        for (j = pc + 1; j < s[0]; j++) os->flags[j] |= REACHED;
+        break;
+      }
+      case OP_LOADBOOL: {  /* the instruction it skips stays in place */
+        if (GETARG_C(i) != 0) s[ns++] = pc + 1;
+        break;
+      }
+      default: break;
+    }
+    for (j = 0; j < ns; j++) {
+      if (!(os->flags[s[j]] & REACHED)) {
+        os->flags[s[j]] |= REACHED;
+        stack[top++] = s[j];
+      }
+    }
+  }
+  for (pc = 0; pc < os->n; pc++)
+    if (!(os->flags[pc] & REACHED) && pc != os->n - 1)
+      os->flags[pc] |= REMOVED;
+}
+
+
+/* computes the registers live before each instruction */
+static void liveness (OptState *os) {
+  unsigned int use[REGWORDS], def[REGWORDS], kill[REGWORDS];
+  unsigned int out[REGWORDS];
+  int changed = 1;
+  memset(os->live, 0, os->n * os->nw * sizeof(unsigned int));
+  while (changed) {
+    int pc;
+    changed = 0;
+    for (pc = os->n - 1; pc >= 0; pc--) {
+      unsigned int *in = liveset(os, pc);
+      int s[2];
+      int j, w, ns;
+      if ((os->flags[pc] & (REACHED|PSEUDO)) != REACHED) continue;
+      memset(out, 0, os->nw * sizeof(unsigned int));
+      ns = successors(os, pc, s);
+      for (j = 0; j < ns; j++)
+        for (w = 0; w < os->nw; w++) out[w] |= liveset(os, s[j])[w];
+      if (os->flags[pc] & REMOVED)
+        memset(use, 0, sizeof(use)), memset(kill, 0, sizeof(kill));
+      else
+        effects(os, os->f->code[pc], use, def, kill);
+      for (w = 0; w < os->nw; w++) {
+        unsigned int v = use[w] | (out[w] & ~kill[w]);
+        if (v != in[w]) { in[w] = v; changed = 1; }
+      }
+    }
+  }
+}
+
+
+/*
+** removes jumps to the next instruction, moves of a register to itself
+** and stores of values nobody reads, until there are none left
+*/
+static void deadstores (OptState *os) {
+  unsigned int use[REGWORDS], def[REGWORDS], kill[REGWORDS];
+  int changed = 1;
+  while (changed) {
+    int pc;
+    changed = 0;
+    liveness(os);
+    for (pc = 0; pc < os->n; pc++) {
+      Instruction i = os->f->code[pc];
+      OpCode op = GET_OPCODE(i);
+      int dead;
+      if ((os->flags[pc] & (REACHED|PSEUDO|PINNED|REMOVED)) != REACHED)
+        continue;
+      if (op == OP_JMP)
+        dead = (GETARG_sBx(i) == 0);
+      else if (op == OP_MOVE && GETARG_A(i) == GETARG_B(i))
+        dead = 1;
+      else if (ispure(i)) {
+        const unsigned int *out = liveset(os, pc + 1);
+        int w;
+        effects(os, i, use, def, kill);
+        dead = 1;
+        for (w = 0; w < os->nw; w++)
+          if (kill[w] & (out[w] | os->captured[w])) dead = 0;
+      }
+      else
+        dead = 0;
+      if (dead) {
+        os->flags[pc] |= REMOVED;
+        changed = 1;
+      }
+    }
+  }
+}
+
+
+/* drops the removed instructions, fixing jumps, line info and locals */
+static void compact (lua_State *L, OptState *os) {
+  Proto *f = os->f;
+  int *newpc = os->pcs;
+  int pc, n = 0;
+  for (pc = 0; pc < os->n; pc++) {
+    newpc[pc] = n;
+    if (!(os->flags[pc] & REMOVED)) n++;
+  }
+  newpc[os->n] = n;
+  if (n == os->n) return;
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction i = f->code[pc];
+    OpCode op = GET_OPCODE(i);
+    if (os->flags[pc] & REMOVED) continue;
+    if (!(os->flags[pc] & PSEUDO) &&
+        (op == OP_JMP || op == OP_FORLOOP || op == OP_FORPREP))
+      SETARG_sBx(i, newpc[jumpdest(i, pc)] - newpc[pc] - 1);
+    f->code[newpc[pc]] = i;
+    if (f->sizelineinfo > 0)
+      f->lineinfo[newpc[pc]] = f->lineinfo[pc];
+  }
+  for (pc = 0; pc < f->sizelocvars; pc++) {
+    f->locvars[pc].startpc = newpc[f->locvars[pc].startpc];
+    f->locvars[pc].endpc = newpc[f->locvars[pc].endpc];
+  }
+  luaM_reallocvector(L, f->code, f->sizecode, n, Instruction);
+  f->sizecode = n;
+  if (f->sizelineinfo > 0) {
+    luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, n, int);
+    f->sizelineinfo = n;
+  }
+}
+
+
+void luaK_optimize (lua_State *L, Proto *f, Mbuffer *buff) {
+  OptState os;
+  size_t size;
+  int i;
+  for (i = 0; i < f->sizep; i++)
+    luaK_optimize(L, f->p[i], buff);
+  lua_assert(!f->shared);  /* only code fresh from the parser */
+  os.f = f;
+  os.n = f->sizecode;
+  os.nw = (f->maxstacksize + 31) / 32;
+  size = os.n * os.nw * sizeof(unsigned int) + (os.n + 1) * sizeof(int) +
+         os.n;
+  if (luaZ_sizebuffer(buff) < size)
+    luaZ_resizebuffer(L, buff, size);
+  os.live = cast(unsigned int *, luaZ_buffer(buff));
+  os.pcs = cast(int *, os.live + os.n * os.nw);
+  os.flags = cast(lu_byte *, os.pcs + os.n + 1);
+  memset(os.flags, 0, os.n);
+  scan(&os);
+  propagate(&os);
+  thread(&os);
+  reach(&os);
+  deadstores(&os);
+  compact(L, &os);
+  lua_assert(luaG_checkcode(f));
+}
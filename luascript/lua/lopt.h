@@ -0,0 +1,17 @@
+/*
+** $Id: lopt.h $
+** Optimizer of the code generated by the parser
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lopt_h
+#define lopt_h
+
+#include "lobject.h"
+#include "lzio.h"
+
+
+/* optimize a function and its nested functions, with `buff' as scratch */
+LUAI_FUNC void luaK_optimize (lua_State *L, Proto *f, Mbuffer *buff);
+
+#endif
@@ -386,7 +386,8 @@ Proto *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff, const char *name) {
   lexstate.buff = buff;
   luaX_setinput(L, &lexstate, z, luaS_new(L, name));
   open_func(&lexstate, &funcstate);
-  funcstate.f->is_vararg = VARARG_ISVARARG;  /* main func. is always vararg */
+  /* main func. is always vararg */
+  funcstate.f->is_vararg = VARARG_ISVARARG | VARARG_UNUSED;
   luaX_next(&lexstate);  /* read first token */
   chunk(&lexstate);
   check(&lexstate, TK_EOS);
@@ -559,6 +560,8 @@ static void parlist (LexState *ls) {
           /* use `arg' as default name */
           new_localvarliteral(ls, "arg", nparams++);
           f->is_vararg = VARARG_HASARG | VARARG_NEEDSARG;
+#else
+          f->is_vararg = VARARG_UNUSED;  /* until `...' is read */
 #endif
           f->is_vararg |= VARARG_ISVARARG;
           break;
@@ -606,10 +609,11 @@ static int explist1 (LexState *ls, expdesc *v) {
 }
 
 
-static void funcargs (LexState *ls, expdesc *f) {
+static void funcargs (LexState *ls, expdesc *f, int builtin) {
   FuncState *fs = ls->fs;
   expdesc args;
   int base, nparams;
+  int nargs = 0;
   int line = ls->linenumber;
   switch (ls->t.token) {
     case '(': {  /* funcargs -> `(' [ explist1 ] `)' */
@@ -619,8 +623,9 @@ static void funcargs (LexState *ls, expdesc *f) {
       if (ls->t.token == ')')  /* arg list is empty? */
         args.k = VVOID;
       else {
-        explist1(ls, &args);
-        luaK_setmultret(fs, &args);
+        nargs = explist1(ls, &args);
+        if (!(builtin == BUILTIN_SELECT && nargs == 2 && args.k == VVARARG))
+          luaK_setmultret(fs, &args);
       }
       check_match(ls, ')', '(', line);
       break;
@@ -641,14 +646,23 @@ static void funcargs (LexState *ls, expdesc *f) {
   }
   lua_assert(f->k == VNONRELOC);
   base = f->u.s.info;  /* base register for call */
-  if (hasmultret(args.k))
-    nparams = LUA_MULTRET;  /* open call */
+  if (builtin == BUILTIN_SELECT && nargs == 2 && args.k == VVARARG) {
+    /* select(x, ...): its OP_VARARG becomes an OP_SELECT */
+    getcode(fs, &args) = CREATE_ABC(OP_SELECT, base, 0, 2);
+    init_exp(f, VCALL, args.u.s.info);
+    f->u.s.aux = BUILTIN_NONE;
+  }
   else {
-    if (args.k != VVOID)
-      luaK_exp2nextreg(fs, &args);  /* close last argument */
-    nparams = fs->freereg - (base+1);
+    if (hasmultret(args.k))
+      nparams = LUA_MULTRET;  /* open call */
+    else {
+      if (args.k != VVOID)
+        luaK_exp2nextreg(fs, &args);  /* close last argument */
+      nparams = fs->freereg - (base+1);
+    }
+    init_exp(f, VCALL, luaK_codeABC(fs, OP_CALL, base, nparams+1, 2));
+    f->u.s.aux = builtin;  /* the function called may be it (see lcode.c) */
   }
-  init_exp(f, VCALL, luaK_codeABC(fs, OP_CALL, base, nparams+1, 2));
   luaK_fixline(fs, line);
   fs->freereg = base+1;  /* call remove function and arguments and leaves
                             (unless changed) one result */
@@ -691,11 +705,21 @@ static void primaryexp (LexState *ls, expdesc *v) {
   /* primaryexp ->
         prefixexp { `.' NAME | `[' exp `]' | `:' NAME funcargs | funcargs } */
   FuncState *fs = ls->fs;
+  int builtin = BUILTIN_NONE;  /* `v' may be this library function */
   prefixexp(ls, v);
+  if (v->k == VGLOBAL)
+    builtin = luaK_builtin("_G", rawtsvalue(&fs->f->k[v->u.s.info]));
   for (;;) {
     switch (ls->t.token) {
       case '.': {  /* field */
+        const char *lib = NULL;
+        if (v->k == VGLOBAL) lib = svalue(&fs->f->k[v->u.s.info]);
         field(ls, v);
+        builtin = BUILTIN_NONE;
+        if (lib != NULL && ISK(v->u.s.aux)) {
+          TString *name = rawtsvalue(&fs->f->k[INDEXK(v->u.s.aux)]);
+          builtin = luaK_builtin(lib, name);
+        }
         break;
       }
       case '[': {  /* `[' exp1 `]' */
@@ -703,19 +727,23 @@ static void primaryexp (LexState *ls, expdesc *v) {
         luaK_exp2anyreg(fs, v);
         yindex(ls, &key);
         luaK_indexed(fs, v, &key);
+        builtin = BUILTIN_NONE;
         break;
       }
       case ':': {  /* `:' NAME funcargs */
         expdesc key;
         luaX_next(ls);
         checkname(ls, &key);
+        builtin = luaK_builtin("string", rawtsvalue(&fs->f->k[key.u.s.info]));
         luaK_self(fs, v, &key);
-        funcargs(ls, v);
+        funcargs(ls, v, builtin);
+        builtin = BUILTIN_NONE;
         break;
       }
       case '(': case TK_STRING: case '{': {  /* funcargs */
         luaK_exp2nextreg(fs, v);
-        funcargs(ls, v);
+        funcargs(ls, v, builtin);
+        builtin = BUILTIN_NONE;
         break;
       }
       default: return;
@@ -753,7 +781,7 @@ static void simpleexp (LexState *ls, expdesc *v) {
       FuncState *fs = ls->fs;
       check_condition(ls, fs->f->is_vararg,
                       "cannot use " LUA_QL("...") " outside a vararg function");
-      fs->f->is_vararg &= ~VARARG_NEEDSARG;  /* don't need 'arg' */
+      fs->f->is_vararg &= ~(VARARG_NEEDSARG | VARARG_UNUSED);  /* no 'arg' */
       init_exp(v, VVARARG, luaK_codeABC(fs, OP_VARARG, 0, 1, 0));
       break;
     }
@@ -1247,7 +1275,8 @@ static void retstat (LexState *ls) {
     nret = explist1(ls, &e);  /* optional return values */
     if (hasmultret(e.k)) {
       luaK_setmultret(fs, &e);
-      if (e.k == VCALL && nret == 1) {  /* tail call? */
+      if (e.k == VCALL && nret == 1 &&  /* tail call? */
+          GET_OPCODE(getcode(fs,&e)) == OP_CALL) {
         SET_OPCODE(getcode(fs,&e), OP_TAILCALL);
         lua_assert(GETARG_A(getcode(fs,&e)) == fs->nactvar);
       }
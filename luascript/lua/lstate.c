@@ -6,6 +6,7 @@
 
 
 #include <stddef.h>
+#include <string.h>
 
 #define lstate_c
 #define LUA_CORE
@@ -16,6 +17,7 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "llex.h"
 #include "lmem.h"
 #include "lstate.h"
@@ -40,14 +42,19 @@ typedef struct LG {
 
 
 static void stack_init (lua_State *L1, lua_State *L) {
+  global_State *g = G(L);
   /* initialize CallInfo array */
-  L1->base_ci = luaM_newvector(L, BASIC_CI_SIZE, CallInfo);
+  L1->base_ci = luaM_newvector(L, g->cisize, CallInfo);
   L1->ci = L1->base_ci;
-  L1->size_ci = BASIC_CI_SIZE;
+  L1->size_ci = g->cisize;
   L1->end_ci = L1->base_ci + L1->size_ci - 1;
   /* initialize stack array */
-  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE + EXTRA_STACK, TValue);
-  L1->stacksize = BASIC_STACK_SIZE + EXTRA_STACK;
+  L1->stack = luaM_newvector(L, g->stacksize + EXTRA_STACK, TValue);
+  L1->stacksize = g->stacksize + EXTRA_STACK;
+  if (g->stackstats.maxstack < L1->stacksize)
+    g->stackstats.maxstack = L1->stacksize;
+  if (g->stackstats.maxci < L1->size_ci)
+    g->stackstats.maxci = L1->size_ci;
   L1->top = L1->stack;
   L1->stack_last = L1->stack+(L1->stacksize - EXTRA_STACK)-1;
   /* initialize first ci */
@@ -106,6 +113,9 @@ static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeall(L);  /* collect all objects */
+#if defined(LUA_USE_JIT)
+  luaJ_close(L);
+#endif
   lua_assert(g->rootgc == obj2gco(L));
   lua_assert(g->strt.nuse == 0);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size, TString *);
@@ -173,11 +183,20 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gray = NULL;
   g->grayagain = NULL;
   g->weak = NULL;
+  g->ephemeron = NULL;
+  g->allweak = NULL;
+  g->weakmarked = 0;
+  g->optimize = 0;
+  g->jit = 0;  /* on request (lua_setjit): traces cost memory */
+  g->jitstate = NULL;
   g->tmudata = NULL;
   g->totalbytes = sizeof(LG);
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
   g->gcdept = 0;
+  g->stacksize = BASIC_STACK_SIZE;
+  g->cisize = BASIC_CI_SIZE;
+  memset(&g->stackstats, 0, sizeof(g->stackstats));
   for (i=0; i<NUM_TAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != 0) {
     /* memory allocation error: free partial state */
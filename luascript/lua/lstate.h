@@ -71,12 +71,17 @@ typedef struct global_State {
   void *ud;         /* auxiliary data to `frealloc' */
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
+  lu_byte weakmarked;  /* ephemeron traversal marked some value */
+  lu_byte optimize;  /* optimize the code of loaded chunks? */
+  lu_byte jit;  /* compile hot loops to machine code? */
   int sweepstrgc;  /* position of sweep in `strt' */
   GCObject *rootgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* position of sweep in `rootgc' */
   GCObject *gray;  /* list of gray objects */
   GCObject *grayagain;  /* list of objects to be traversed atomically */
-  GCObject *weak;  /* list of weak tables (to be cleared) */
+  GCObject *weak;  /* list of tables with weak values (to be cleared) */
+  GCObject *ephemeron;  /* list of ephemeron tables with pending entries */
+  GCObject *allweak;  /* list of other weak tables (to be cleared) */
   GCObject *tmudata;  /* last element of list of userdata to be GC */
   Mbuffer buff;  /* temporary buffer for string concatentation */
   lu_mem GCthreshold;
@@ -91,6 +96,10 @@ typedef struct global_State {
   UpVal uvhead;  /* head of double-linked list of all open upvalues */
   struct Table *mt[NUM_TAGS];  /* metatables for basic types */
   TString *tmname[TM_N];  /* array with tag-method names */
+  struct jit_State *jitstate;  /* traces of hot loops */
+  int stacksize;  /* size threads start their stacks with */
+  int cisize;  /* size threads start their `base_ci' with */
+  lua_StackStats stackstats;
 } global_State;
 
 
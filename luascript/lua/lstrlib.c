@@ -19,6 +19,10 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#if defined(LUA_USE_SSE2)
+#include <emmintrin.h>
+#endif
+
 
 /* macro to `unsign' a character */
 #define uchar(c)        ((unsigned char)(c))
@@ -40,9 +44,25 @@ static ptrdiff_t posrelat (ptrdiff_t pos, size_t len) {
 }
 
 
+/*
+** subject of `sub' and of searches: a string, or a uint8 array (such as
+** a mapped file), which is used in place. Unlike strings, arrays are
+** not followed by a `\0'
+*/
+static const char *checksubject (lua_State *L, int narg, size_t *l) {
+  int kind;
+  lua_Array *a = lua_toarray(L, narg, &kind);
+  if (a != NULL && kind == LUA_ARRAYUINT8) {
+    *l = a->n;
+    return (const char *)a->data;
+  }
+  return luaL_checklstring(L, narg, l);
+}
+
+
 static int str_sub (lua_State *L) {
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = checksubject(L, 1, &l);
   ptrdiff_t start = posrelat(luaL_checkinteger(L, 2), l);
   ptrdiff_t end = posrelat(luaL_optinteger(L, 3, -1), l);
   if (start < 1) start = 1;
@@ -199,18 +219,19 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
+/*
+** end of the class item at `p', or NULL if it is malformed
+*/
+static const char *classlimit (const char *p) {
   switch (*p++) {
     case L_ESC: {
-      if (*p == '\0')
-        luaL_error(ms->L, "malformed pattern (ends with " LUA_QL("%%") ")");
+      if (*p == '\0') return NULL;  /* pattern ends with `%' */
       return p+1;
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a `]' */
-        if (*p == '\0')
-          luaL_error(ms->L, "malformed pattern (missing " LUA_QL("]") ")");
+        if (*p == '\0') return NULL;  /* missing `]' */
         if (*(p++) == L_ESC && *p != '\0')
           p++;  /* skip escapes (e.g. `%]') */
       } while (*p != ']');
@@ -223,6 +244,18 @@ static const char *classend (MatchState *ms, const char *p) {
 }
 
 
+static const char *classend (MatchState *ms, const char *p) {
+  const char *ep = classlimit(p);
+  if (ep == NULL) {
+    if (*p == L_ESC)
+      luaL_error(ms->L, "malformed pattern (ends with " LUA_QL("%%") ")");
+    else
+      luaL_error(ms->L, "malformed pattern (missing " LUA_QL("]") ")");
+  }
+  return ep;
+}
+
+
 static int match_class (int c, int cl) {
   int res;
   switch (tolower(cl)) {
@@ -282,7 +315,7 @@ static const char *matchbalance (MatchState *ms, const char *s,
                                    const char *p) {
   if (*p == 0 || *(p+1) == 0)
     luaL_error(ms->L, "unbalanced pattern");
-  if (*s != *p) return NULL;
+  if (s >= ms->src_end || *s != *p) return NULL;
   else {
     int b = *p;
     int e = *(p+1);
@@ -301,8 +334,17 @@ static const char *matchbalance (MatchState *ms, const char *s,
 static const char *max_expand (MatchState *ms, const char *s,
                                  const char *p, const char *ep) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
-  while ((s+i)<ms->src_end && singlematch(uchar(*(s+i)), p, ep))
-    i++;
+  if (*p == '.')  /* matches any char? */
+    i = ms->src_end - s;
+  else if (*p == '[' && *(p+1) == '^' && ep - p == 4 && *(p+2) != L_ESC) {
+    /* `[^c]': runs until the next `c' */
+    const char *c = (const char *)memchr(s, *(p+2), ms->src_end - s);
+    i = (c != NULL) ? c - s : ms->src_end - s;
+  }
+  else {
+    while ((s+i)<ms->src_end && singlematch(uchar(*(s+i)), p, ep))
+      i++;
+  }
   /* keeps trying to match with the maximum repetitions */
   while (i>=0) {
     const char *res = match(ms, (s+i), ep+1);
@@ -382,15 +424,16 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
           p+=4; goto init;  /* else return match(ms, s, p+4); */
         }
         case 'f': {  /* frontier? */
-          const char *ep; char previous;
+          const char *ep; char previous, current;
           p += 2;
           if (*p != '[')
             luaL_error(ms->L, "missing " LUA_QL("[") " after "
                                LUA_QL("%%f") " in pattern");
           ep = classend(ms, p);  /* points to what is next */
           previous = (s == ms->src_init) ? '\0' : *(s-1);
+          current = (s == ms->src_end) ? '\0' : *s;
           if (matchbracketclass(uchar(previous), p, ep-1) ||
-             !matchbracketclass(uchar(*s), p, ep-1)) return NULL;
+             !matchbracketclass(uchar(current), p, ep-1)) return NULL;
           p=ep; goto init;  /* else return match(ms, s, ep); */
         }
         default: {
@@ -441,12 +484,59 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+#if defined(LUA_USE_SSE2)
+
+#if defined(__GNUC__)
+#define lowbit(m)	__builtin_ctz(m)
+#else
+static int lowbit (unsigned int m) {
+  int i = 0;
+  while (!(m & 1)) { m >>= 1; i++; }
+  return i;
+}
+#endif
+
+
+/*
+** compare 16 candidate positions at a time on the first and the last
+** char of `s2'; only positions passing both are checked with `memcmp'
+*/
+static const char *simdfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2, size_t *done) {
+  const __m128i first = _mm_set1_epi8(s2[0]);
+  const __m128i last = _mm_set1_epi8(s2[l2-1]);
+  size_t lim = l1 - l2 + 1;  /* number of candidate positions */
+  size_t i;
+  for (i = 0; i + 16 <= lim; i += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)(s1 + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(s1 + i + l2 - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+    while (mask != 0) {
+      int bit = lowbit(mask);
+      if (memcmp(s1 + i + bit + 1, s2 + 1, l2 - 2) == 0)
+        return s1 + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  *done = i;
+  return NULL;
+}
+
+#endif
+
+
+/* false hits of `memchr' before switching to the SIMD filter */
+#define LMEM_MISSES	8
+
+
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative `l1' */
   else {
     const char *init;  /* to search for a `*s2' inside `s1' */
+    int misses = 0;
     l2--;  /* 1st char will be checked by `memchr' */
     l1 = l1-l2;  /* `s2' cannot be found after that */
     while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
@@ -457,12 +547,549 @@ static const char *lmemfind (const char *s1, size_t l1,
         l1 -= init-s1;
         s1 = init;
       }
+#if defined(LUA_USE_SSE2)
+      if (++misses == LMEM_MISSES && l2 > 0) {
+        /* 1st char is frequent; filter on first and last chars */
+        size_t done;
+        if ((init = simdfind(s1, l1+l2, s2, l2+1, &done)) != NULL)
+          return init;
+        s1 += done;  /* finish the tail with `memchr' */
+        l1 -= done;
+      }
+#endif
     }
     return NULL;  /* not found */
   }
 }
 
 
+/*
+** {======================================================
+** Compiled patterns
+** =======================================================
+*/
+
+/*
+** A pattern is translated once into an array of items, which `cmatch'
+** runs without re-parsing classes: each class becomes a bit set, and
+** runs of plain chars become a single literal. Compiled patterns are
+** cached in the environment of the library functions, keyed on the
+** (interned) pattern string. Patterns that would raise an error while
+** matching are not compiled; the interpreter above handles them, so
+** errors are raised exactly as before. Character classes are resolved
+** in the locale current at compile time.
+*/
+
+#define PI_MATCH	0	/* end of pattern */
+#define PI_END		1	/* `$' at the end of pattern */
+#define PI_STRING	2	/* literal chars */
+#define PI_OPEN		3	/* start capture */
+#define PI_POSITION	4	/* position capture */
+#define PI_CLOSE	5	/* end capture */
+#define PI_BALANCE	6	/* `%bxy' */
+#define PI_FRONTIER	7	/* `%f[set]' */
+#define PI_BACKREF	8	/* `%1'-`%9' */
+#define PI_ANY		9	/* `.' */
+#define PI_CHAR		10	/* single char */
+#define PI_NOTCHAR	11	/* any char but one */
+#define PI_SET		12	/* char class */
+
+/* longest pattern that is compiled */
+#define PAT_MAXLENGTH	256
+/* number of cached patterns (a power of 2) */
+#define PAT_CACHESIZE	64
+
+#define SETBYTES	((UCHAR_MAX+1)/CHAR_BIT)
+#define testset(set,c)	((set)[(c) / CHAR_BIT] & (1 << ((c) % CHAR_BIT)))
+
+typedef struct PatItem {
+  unsigned char op;  /* kind of item */
+  char rep;  /* quantifier: `?', `*', `+', `-' or '\0' (exactly once) */
+  unsigned char c1, c2;  /* char, `%b' delimiters or capture index */
+  size_t len;  /* length of literal */
+  const char *str;  /* literal chars */
+  unsigned char set[SETBYTES];  /* chars in class */
+} PatItem;
+
+
+#define PF_NONE		0	/* every position is a candidate */
+#define PF_LITERAL	1	/* match starts with a literal string */
+#define PF_SET		2	/* match starts with a char from a class */
+
+/* most ranges of chars scanned with SIMD */
+#define PF_MAXRANGES	4
+
+/*
+** Prefilter: skip positions where a match cannot start
+*/
+typedef struct Prefilter {
+  int kind;
+  size_t len;  /* length of literal prefix */
+  const char *literal;
+  int nranges;  /* 0 if set has too many ranges */
+  unsigned char lo[PF_MAXRANGES], hi[PF_MAXRANGES];
+  const unsigned char *set;  /* chars that may start a match */
+} Prefilter;
+
+
+typedef struct Pattern {
+  int anchor;
+  Prefilter pf;  /* for unanchored searches */
+  PatItem item[1];  /* variable size; followed by the literal chars */
+} Pattern;
+
+
+static void addliteral (PatItem **pi, char **lit, int c) {
+  PatItem *last = *pi - 1;
+  if (last->op != PI_STRING) {  /* start a new literal? */
+    last = (*pi)++;
+    last->op = PI_STRING;
+    last->rep = '\0';
+    last->len = 0;
+    last->str = *lit;
+  }
+  *(*lit)++ = (char)c;
+  last->len++;
+}
+
+
+/*
+** translate `p' into items; returns 0 if the pattern may raise an
+** error while matching
+*/
+static int compileitems (Pattern *pat, const char *p, char *lit) {
+  PatItem *pi = pat->item + 1;  /* item[0] is a sentinel */
+  int level = 0;  /* captures opened so far */
+  int closed[LUA_MAXCAPTURES];  /* captures safe to refer back to */
+  int open[LUA_MAXCAPTURES];  /* unfinished captures */
+  int nopen = 0;
+  for (;;) {
+    switch (*p) {
+      case '(': {
+        if (level >= LUA_MAXCAPTURES) return 0;  /* too many captures */
+        if (*(p+1) == ')') {  /* position capture? */
+          pi->op = PI_POSITION;
+          closed[level] = 1;
+          p += 2;
+        }
+        else {
+          pi->op = PI_OPEN;
+          closed[level] = 0;
+          open[nopen++] = level;
+          p++;
+        }
+        (pi++)->c1 = (unsigned char)level++;
+        break;
+      }
+      case ')': {
+        if (nopen == 0) return 0;  /* invalid pattern capture */
+        pi->op = PI_CLOSE;
+        pi->c1 = (unsigned char)open[--nopen];
+        closed[pi->c1] = 1;
+        pi++; p++;
+        break;
+      }
+      case '\0': {
+        pi->op = PI_MATCH;
+        return 1;
+      }
+      case '$': {
+        if (*(p+1) == '\0') {  /* is the `$' the last char in pattern? */
+          pi->op = PI_END;
+          return 1;
+        }
+        goto dflt;
+      }
+      case L_ESC: {
+        switch (*(p+1)) {
+          case 'b': {
+            if (*(p+2) == '\0' || *(p+3) == '\0') return 0;
+            pi->op = PI_BALANCE;
+            pi->c1 = uchar(*(p+2));
+            pi->c2 = uchar(*(p+3));
+            pi++; p += 4;
+            break;
+          }
+          case 'f': {
+            const char *ep;
+            int c;
+            p += 2;
+            if (*p != '[' || (ep = classlimit(p)) == NULL) return 0;
+            pi->op = PI_FRONTIER;
+            memset(pi->set, 0, SETBYTES);
+            for (c = 0; c <= UCHAR_MAX; c++) {
+              if (matchbracketclass(c, p, ep-1))
+                pi->set[c / CHAR_BIT] |= 1 << (c % CHAR_BIT);
+            }
+            pi++; p = ep;
+            break;
+          }
+          default: {
+            if (isdigit(uchar(*(p+1)))) {  /* back reference */
+              int l = *(p+1) - '1';
+              if (l < 0 || l >= level || !closed[l]) return 0;
+              pi->op = PI_BACKREF;
+              (pi++)->c1 = (unsigned char)l;
+              p += 2;
+              break;
+            }
+            goto dflt;
+          }
+        }
+        break;
+      }
+      default: dflt: {  /* single char item */
+        const char *ep = classlimit(p);
+        int c, n = 0, last = 0, nonmember = 0;
+        char rep;
+        if (ep == NULL) return 0;
+        rep = (*ep != '\0' && strchr("?*+-", *ep) != NULL) ? *ep : '\0';
+        memset(pi->set, 0, SETBYTES);
+        for (c = 0; c <= UCHAR_MAX; c++) {
+          if (singlematch(c, p, ep)) {
+            pi->set[c / CHAR_BIT] |= 1 << (c % CHAR_BIT);
+            n++; last = c;
+          }
+          else nonmember = c;
+        }
+        p = (rep != '\0') ? ep+1 : ep;
+        if (n == 1 && rep == '\0') {
+          addliteral(&pi, &lit, last);
+          break;
+        }
+        if (n == UCHAR_MAX+1)
+          pi->op = PI_ANY;
+        else if (n == UCHAR_MAX) {
+          pi->op = PI_NOTCHAR;
+          pi->c1 = (unsigned char)nonmember;
+        }
+        else if (n == 1) {
+          pi->op = PI_CHAR;
+          pi->c1 = (unsigned char)last;
+        }
+        else pi->op = PI_SET;
+        (pi++)->rep = rep;
+        break;
+      }
+    }
+  }
+}
+
+
+static void buildset (Prefilter *pf, const unsigned char *set) {
+  int c;
+  pf->kind = PF_SET;
+  pf->set = set;
+  pf->nranges = 0;
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    if (testset(set, c) && pf->nranges >= 0) {
+      if (c > 0 && testset(set, c-1))  /* extends last range? */
+        pf->hi[pf->nranges-1] = (unsigned char)c;
+      else if (pf->nranges < PF_MAXRANGES) {  /* starts a new range */
+        pf->lo[pf->nranges] = pf->hi[pf->nranges] = (unsigned char)c;
+        pf->nranges++;
+      }
+      else pf->nranges = -1;  /* too many ranges */
+    }
+  }
+  if (pf->nranges < 0)
+    pf->nranges = 0;  /* scan with bit set only */
+}
+
+
+/*
+** leading captures are zero-width; a match then starts either with a
+** literal or with a char from a class that must match at least once
+*/
+static void prefilter (Pattern *pat) {
+  Prefilter *pf = &pat->pf;
+  const PatItem *pi = pat->item + 1;
+  pf->kind = PF_NONE;
+  while (pi->op == PI_OPEN || pi->op == PI_POSITION)
+    pi++;
+  if (pi->op == PI_STRING) {
+    pf->kind = PF_LITERAL;
+    pf->literal = pi->str;
+    pf->len = pi->len;
+  }
+  else if (pi->op >= PI_CHAR && (pi->rep == '\0' || pi->rep == '+'))
+    buildset(pf, pi->set);
+}
+
+
+/*
+** compile pattern `p' into a new userdata on the stack; pushes nil
+** and returns NULL if the pattern is not compiled
+*/
+static const Pattern *compile (lua_State *L, const char *p, size_t l) {
+  Pattern *pat;
+  int anchor = (*p == '^');
+  if (l > PAT_MAXLENGTH) {
+    lua_pushnil(L);
+    return NULL;
+  }
+  pat = (Pattern *)lua_newuserdata(L, sizeof(Pattern) +
+                                      (l + 1) * sizeof(PatItem) + l);
+  pat->anchor = anchor;
+  pat->item[0].op = PI_MATCH;  /* sentinel for `addliteral' */
+  if (!compileitems(pat, p + anchor, (char *)(pat->item + l + 2))) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    return NULL;
+  }
+  prefilter(pat);
+  return pat;
+}
+
+
+/*
+** the environment caches compiled strings: the entry of string `p' in
+** the part of `size' entries after index `base' holds `p' itself at
+** the returned index and its compiled form at the next one
+*/
+static int cacheslot (const char *p, int base, int size) {
+  size_t h = (size_t)p;
+  return base + 2*((int)((h ^ (h >> 11)) >> 3) & (size - 1)) + 1;
+}
+
+
+/* pushes the compiled form of `p' if it is cached at `slot' */
+static void *cacheget (lua_State *L, int slot, const char *p) {
+  lua_rawgeti(L, LUA_ENVIRONINDEX, slot);
+  if (lua_tostring(L, -1) == p) {  /* cached? (strings are interned) */
+    lua_pop(L, 1);
+    lua_rawgeti(L, LUA_ENVIRONINDEX, slot + 1);
+    return lua_touserdata(L, -1);
+  }
+  lua_pop(L, 1);
+  return NULL;
+}
+
+
+/* caches the compiled form on the top of the stack for string `arg' */
+static void cacheput (lua_State *L, int slot, int arg) {
+  lua_pushvalue(L, arg);
+  lua_rawseti(L, LUA_ENVIRONINDEX, slot);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, LUA_ENVIRONINDEX, slot + 1);
+}
+
+
+/*
+** get the compiled form of pattern `p' (at index `arg'), compiling it
+** if needed; it is also pushed on the stack, to keep it alive while in
+** use (callbacks may evict it from the cache)
+*/
+static const Pattern *getpattern (lua_State *L, int arg, const char *p,
+                                  size_t l) {
+  int slot = cacheslot(p, 0, PAT_CACHESIZE);
+  const Pattern *pat = (const Pattern *)cacheget(L, slot, p);
+  if (pat == NULL && (pat = compile(L, p, l)) != NULL)
+    cacheput(L, slot, arg);
+  return pat;
+}
+
+
+static const char *cmatch (MatchState *ms, const char *s, const PatItem *pi);
+
+
+static int itemmatch (int c, const PatItem *pi) {
+  switch (pi->op) {
+    case PI_ANY: return 1;
+    case PI_CHAR: return (c == pi->c1);
+    case PI_NOTCHAR: return (c != pi->c1);
+    default: return testset(pi->set, c);
+  }
+}
+
+
+static const char *cmax_expand (MatchState *ms, const char *s,
+                                  const PatItem *pi) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  const PatItem *next = pi + 1;
+  if (pi->op == PI_ANY)
+    i = ms->src_end - s;
+  else if (pi->op == PI_NOTCHAR) {  /* runs until the next `c1' */
+    const char *c = (const char *)memchr(s, pi->c1, ms->src_end - s);
+    i = (c != NULL) ? c - s : ms->src_end - s;
+  }
+  else {
+    while ((s+i)<ms->src_end && itemmatch(uchar(*(s+i)), pi))
+      i++;
+  }
+  /* keeps trying to match with the maximum repetitions */
+  for (; i >= 0; i--) {
+    const char *res;
+    if (next->op == PI_STRING &&
+        ((s+i) == ms->src_end || *(s+i) != *next->str))
+      continue;  /* literal cannot follow here */
+    if ((res = cmatch(ms, (s+i), next)) != NULL)
+      return res;
+  }
+  return NULL;
+}
+
+
+static const char *cmin_expand (MatchState *ms, const char *s,
+                                  const PatItem *pi) {
+  for (;;) {
+    const char *res = cmatch(ms, s, pi+1);
+    if (res != NULL)
+      return res;
+    else if (s<ms->src_end && itemmatch(uchar(*s), pi))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+/*
+** same as `match', over a compiled pattern
+*/
+static const char *cmatch (MatchState *ms, const char *s, const PatItem *pi) {
+  init: /* using goto's to optimize tail recursion */
+  switch (pi->op) {
+    case PI_MATCH: {  /* end of pattern */
+      return s;  /* match succeeded */
+    }
+    case PI_END: {
+      return (s == ms->src_end) ? s : NULL;  /* check end of string */
+    }
+    case PI_STRING: {
+      if ((size_t)(ms->src_end - s) < pi->len ||
+          memcmp(s, pi->str, pi->len) != 0)
+        return NULL;
+      s += pi->len; pi++; goto init;
+    }
+    case PI_OPEN: case PI_POSITION: {
+      const char *res;
+      int level = pi->c1;
+      ms->capture[level].init = s;
+      ms->capture[level].len = (pi->op == PI_POSITION) ? CAP_POSITION
+                                                       : CAP_UNFINISHED;
+      ms->level = level+1;
+      if ((res=cmatch(ms, s, pi+1)) == NULL)  /* match failed? */
+        ms->level--;  /* undo capture */
+      return res;
+    }
+    case PI_CLOSE: {
+      const char *res;
+      int l = pi->c1;
+      ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+      if ((res = cmatch(ms, s, pi+1)) == NULL)  /* match failed? */
+        ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+      return res;
+    }
+    case PI_BALANCE: {
+      int cont = 1;
+      if (s == ms->src_end || uchar(*s) != pi->c1) return NULL;
+      for (;;) {
+        if (++s >= ms->src_end) return NULL;  /* ends out of balance */
+        if (uchar(*s) == pi->c2) {
+          if (--cont == 0) break;
+        }
+        else if (uchar(*s) == pi->c1) cont++;
+      }
+      s++; pi++; goto init;
+    }
+    case PI_FRONTIER: {
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s-1));
+      int current = (s == ms->src_end) ? '\0' : uchar(*s);
+      if (testset(pi->set, previous) || !testset(pi->set, current))
+        return NULL;
+      pi++; goto init;
+    }
+    case PI_BACKREF: {
+      size_t len = ms->capture[pi->c1].len;
+      if ((size_t)(ms->src_end-s) < len ||
+          memcmp(ms->capture[pi->c1].init, s, len) != 0)
+        return NULL;
+      s += len; pi++; goto init;
+    }
+    default: {  /* single char item */
+      int m = s<ms->src_end && itemmatch(uchar(*s), pi);
+      switch (pi->rep) {
+        case '?': {  /* optional */
+          const char *res;
+          if (m && ((res=cmatch(ms, s+1, pi+1)) != NULL))
+            return res;
+          pi++; goto init;
+        }
+        case '*': {  /* 0 or more repetitions */
+          return cmax_expand(ms, s, pi);
+        }
+        case '+': {  /* 1 or more repetitions */
+          return (m ? cmax_expand(ms, s+1, pi) : NULL);
+        }
+        case '-': {  /* 0 or more repetitions (minimum) */
+          return cmin_expand(ms, s, pi);
+        }
+        default: {
+          if (!m) return NULL;
+          s++; pi++; goto init;
+        }
+      }
+    }
+  }
+}
+
+
+static const char *scanset (const Prefilter *pf, const char *s,
+                              const char *e) {
+#if defined(LUA_USE_SSE2)
+  if (pf->nranges > 0) {
+    __m128i lo[PF_MAXRANGES], width[PF_MAXRANGES];
+    int r;
+    for (r = 0; r < pf->nranges; r++) {
+      lo[r] = _mm_set1_epi8((char)pf->lo[r]);
+      width[r] = _mm_set1_epi8((char)(pf->hi[r] - pf->lo[r]));
+    }
+    for (; e - s >= 16; s += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *)s);
+      __m128i m = _mm_setzero_si128();
+      unsigned int mask;
+      for (r = 0; r < pf->nranges; r++) {  /* (x - lo) <= (hi - lo)? */
+        __m128i d = _mm_sub_epi8(x, lo[r]);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(d, width[r]), d));
+      }
+      mask = (unsigned int)_mm_movemask_epi8(m);
+      if (mask != 0)
+        return s + lowbit(mask);
+    }
+  }
+#endif
+  for (; s < e; s++) {
+    if (testset(pf->set, uchar(*s))) return s;
+  }
+  return NULL;
+}
+
+
+/*
+** first position in [s, e) where a match may start, or NULL if none
+*/
+static const char *nextcandidate (const Prefilter *pf, const char *s,
+                                    const char *e) {
+  switch (pf->kind) {
+    case PF_LITERAL: return lmemfind(s, e - s, pf->literal, pf->len);
+    case PF_SET: return scanset(pf, s, e);
+    default: return s;
+  }
+}
+
+
+/*
+** run a compiled pattern if there is one, otherwise interpret `p'
+*/
+static const char *domatch (MatchState *ms, const char *s, const char *p,
+                              const Pattern *pat) {
+  ms->level = 0;
+  return (pat != NULL) ? cmatch(ms, s, pat->item + 1) : match(ms, s, p);
+}
+
+/* }====================================================== */
+
+
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
@@ -494,7 +1121,7 @@ static int push_captures (MatchState *ms, const char *s, const char *e) {
 
 static int str_find_aux (lua_State *L, int find) {
   size_t l1, l2;
-  const char *s = luaL_checklstring(L, 1, &l1);
+  const char *s = checksubject(L, 1, &l1);
   const char *p = luaL_checklstring(L, 2, &l2);
   ptrdiff_t init = posrelat(luaL_optinteger(L, 3, 1), l1) - 1;
   if (init < 0) init = 0;
@@ -511,6 +1138,7 @@ static int str_find_aux (lua_State *L, int find) {
   }
   else {
     MatchState ms;
+    const Pattern *pat = getpattern(L, 2, p, l2);
     int anchor = (*p == '^') ? (p++, 1) : 0;
     const char *s1=s+init;
     ms.L = L;
@@ -518,8 +1146,10 @@ static int str_find_aux (lua_State *L, int find) {
     ms.src_end = s+l1;
     do {
       const char *res;
-      ms.level = 0;
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if (pat != NULL && !anchor && pat->pf.kind != PF_NONE &&
+          (s1 = nextcandidate(&pat->pf, s1, ms.src_end)) == NULL)
+        break;  /* no more candidates */
+      if ((res=domatch(&ms, s1, p, pat)) != NULL) {
         if (find) {
           lua_pushinteger(L, s1-s+1);  /* start */
           lua_pushinteger(L, res-s);   /* end */
@@ -548,8 +1178,10 @@ static int str_match (lua_State *L) {
 static int gmatch_aux (lua_State *L) {
   MatchState ms;
   size_t ls;
-  const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
+  const char *s = checksubject(L, lua_upvalueindex(1), &ls);
   const char *p = lua_tostring(L, lua_upvalueindex(2));
+  const Pattern *pat = (const Pattern *)lua_touserdata(L,
+                                             lua_upvalueindex(4));
   const char *src;
   ms.L = L;
   ms.src_init = s;
@@ -558,8 +1190,10 @@ static int gmatch_aux (lua_State *L) {
        src <= ms.src_end;
        src++) {
     const char *e;
-    ms.level = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
+    if (pat != NULL && pat->pf.kind != PF_NONE &&
+        (src = nextcandidate(&pat->pf, src, ms.src_end)) == NULL)
+      break;  /* no more candidates */
+    if ((e = domatch(&ms, src, p, pat)) != NULL) {
       lua_Integer newstart = e-s;
       if (e == src) newstart++;  /* empty match? go at least one position */
       lua_pushinteger(L, newstart);
@@ -572,11 +1206,17 @@ static int gmatch_aux (lua_State *L) {
 
 
 static int gmatch (lua_State *L) {
-  luaL_checkstring(L, 1);
-  luaL_checkstring(L, 2);
+  size_t ls, lp;
+  const char *p;
+  checksubject(L, 1, &ls);
+  p = luaL_checklstring(L, 2, &lp);
   lua_settop(L, 2);
   lua_pushinteger(L, 0);
-  lua_pushcclosure(L, gmatch_aux, 3);
+  if (*p == '^')  /* not an anchor here; leave it to `match' */
+    lua_pushnil(L);
+  else
+    getpattern(L, 2, p, lp);
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
@@ -642,26 +1282,36 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
 
 
 static int str_gsub (lua_State *L) {
-  size_t srcl;
+  size_t srcl, lp;
   const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checkstring(L, 2);
+  const char *p = luaL_checklstring(L, 2, &lp);
   int  tr = lua_type(L, 3);
   int max_s = luaL_optint(L, 4, srcl+1);
   int anchor = (*p == '^') ? (p++, 1) : 0;
   int n = 0;
   MatchState ms;
+  const Pattern *pat;
+  const Prefilter *pf = NULL;
   luaL_Buffer b;
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
+  pat = getpattern(L, 2, p - anchor, lp);  /* before the buffer */
+  if (pat != NULL && !anchor && pat->pf.kind != PF_NONE)
+    pf = &pat->pf;
   luaL_buffinit(L, &b);
   ms.L = L;
   ms.src_init = src;
   ms.src_end = src+srcl;
   while (n < max_s) {
     const char *e;
-    ms.level = 0;
-    e = match(&ms, src, p);
+    if (pf != NULL) {
+      const char *c = nextcandidate(pf, src, ms.src_end);
+      if (c == NULL) break;  /* no more matches; copy the rest */
+      luaL_addlstring(&b, src, c - src);  /* copy skipped text at once */
+      src = c;
+    }
+    e = domatch(&ms, src, p, pat);
     if (e) {
       n++;
       add_value(&ms, &b, src, e);
@@ -692,41 +1342,58 @@ static int str_gsub (lua_State *L) {
 */
 #define MAX_FORMAT	(sizeof(FLAGS) + sizeof(LUA_INTFRMLEN) + 10)
 
+/* longest format that is compiled */
+#define FMT_MAXLENGTH	256
+/* number of cached formats (a power of 2), after the patterns */
+#define FMT_CACHESIZE	32
+/* integers formatted without `sprintf' are below this (exact) bound */
+#define FMT_MAXINT	((lua_Number)9007199254740992.0)
+
 
 static void addquoted (lua_State *L, luaL_Buffer *b, int arg) {
   size_t l;
   const char *s = luaL_checklstring(L, arg, &l);
+  const char *e = s + l;
   luaL_addchar(b, '"');
-  while (l--) {
-    switch (*s) {
+  for (;;) {
+    const char *p = s;
+    while (p < e && *p != '"' && *p != '\\' && *p != '\n' && *p != '\r' &&
+           *p != '\0')
+      p++;  /* skip chars that go as they are */
+    luaL_addlstring(b, s, p - s);
+    if (p == e) break;
+    switch (*p) {
       case '"': case '\\': case '\n': {
         luaL_addchar(b, '\\');
-        luaL_addchar(b, *s);
+        luaL_addchar(b, *p);
         break;
       }
       case '\r': {
         luaL_addlstring(b, "\\r", 2);
         break;
       }
-      case '\0': {
+      default: {  /* '\0' */
         luaL_addlstring(b, "\\000", 4);
         break;
       }
-      default: {
-        luaL_addchar(b, *s);
-        break;
-      }
     }
-    s++;
+    s = p + 1;
   }
   luaL_addchar(b, '"');
 }
 
-static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+/*
+** scans the specification after a `%' into `form'; returns NULL, with
+** the reason in `*msg', if it is invalid
+*/
+static const char *checkformat (const char *strfrmt, char *form,
+                                const char **msg) {
   const char *p = strfrmt;
   while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
-  if ((size_t)(p - strfrmt) >= sizeof(FLAGS))
-    luaL_error(L, "invalid format (repeated flags)");
+  if ((size_t)(p - strfrmt) >= sizeof(FLAGS)) {
+    *msg = "invalid format (repeated flags)";
+    return NULL;
+  }
   if (isdigit(uchar(*p))) p++;  /* skip width */
   if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   if (*p == '.') {
@@ -734,8 +1401,10 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
     if (isdigit(uchar(*p))) p++;  /* skip precision */
     if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   }
-  if (isdigit(uchar(*p)))
-    luaL_error(L, "invalid format (width or precision too long)");
+  if (isdigit(uchar(*p))) {
+    *msg = "invalid format (width or precision too long)";
+    return NULL;
+  }
   *(form++) = '%';
   strncpy(form, strfrmt, p - strfrmt + 1);
   form += p - strfrmt + 1;
@@ -744,6 +1413,15 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
 }
 
 
+static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+  const char *msg;
+  const char *p = checkformat(strfrmt, form, &msg);
+  if (p == NULL)
+    luaL_error(L, "%s", msg);
+  return p;
+}
+
+
 static void addintlen (char *form) {
   size_t l = strlen(form);
   char spec = form[l - 1];
@@ -753,75 +1431,357 @@ static void addintlen (char *form) {
 }
 
 
-static int str_format (lua_State *L) {
+#define isintconv(c)	((c) != '\0' && strchr("diouxX", (c)) != NULL)
+
+
+/*
+** formats argument `arg' by `form' (with the length modifier of integer
+** conversions already added) into the buffer; returns 0 if conversion
+** `conv' is invalid
+*/
+static int formatitem (lua_State *L, luaL_Buffer *b, int arg,
+                       const char *form, int conv) {
+  char buff[MAX_ITEM];  /* to store the formatted item */
+  switch (conv) {
+    case 'c': {
+      sprintf(buff, form, (int)luaL_checknumber(L, arg));
+      break;
+    }
+    case 'd':  case 'i': {
+      sprintf(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
+      break;
+    }
+    case 'o':  case 'u':  case 'x':  case 'X': {
+      sprintf(buff, form, (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
+      break;
+    }
+    case 'e':  case 'E': case 'f':
+    case 'g': case 'G': {
+      sprintf(buff, form, (double)luaL_checknumber(L, arg));
+      break;
+    }
+    case 'q': {
+      addquoted(L, b, arg);
+      return 1;  /* skip the 'addsize' at the end */
+    }
+    case 's': {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      if (!strchr(form, '.') && l >= 100) {
+        /* no precision and string is too long to be formatted;
+           keep original string */
+        lua_pushvalue(L, arg);
+        luaL_addvalue(b);
+        return 1;  /* skip the `addsize' at the end */
+      }
+      else {
+        sprintf(buff, form, s);
+        break;
+      }
+    }
+    default: {  /* also treat cases `pnLlh' */
+      return 0;
+    }
+  }
+  luaL_addlstring(b, buff, strlen(buff));
+  return 1;
+}
+
+
+/* formats the arguments by a format that is not compiled */
+static void interpformat (lua_State *L, luaL_Buffer *b, const char *strfrmt,
+                          size_t sfl) {
   int arg = 1;
-  size_t sfl;
-  const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+      luaL_addchar(b, *strfrmt++);
     else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+      luaL_addchar(b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format (`%...') */
-      char buff[MAX_ITEM];  /* to store the formatted item */
       arg++;
       strfrmt = scanformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          sprintf(buff, form, (int)luaL_checknumber(L, arg));
-          break;
-        }
-        case 'd':  case 'i': {
-          addintlen(form);
-          sprintf(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
-          break;
-        }
-        case 'o':  case 'u':  case 'x':  case 'X': {
-          addintlen(form);
-          sprintf(buff, form, (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
-          break;
-        }
-        case 'e':  case 'E': case 'f':
-        case 'g': case 'G': {
-          sprintf(buff, form, (double)luaL_checknumber(L, arg));
-          break;
-        }
-        case 'q': {
-          addquoted(L, &b, arg);
-          continue;  /* skip the 'addsize' at the end */
-        }
-        case 's': {
-          size_t l;
-          const char *s = luaL_checklstring(L, arg, &l);
-          if (!strchr(form, '.') && l >= 100) {
-            /* no precision and string is too long to be formatted;
-               keep original string */
-            lua_pushvalue(L, arg);
-            luaL_addvalue(&b);
-            continue;  /* skip the `addsize' at the end */
-          }
-          else {
-            sprintf(buff, form, s);
-            break;
-          }
-        }
-        default: {  /* also treat cases `pnLlh' */
-          return luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
-                               LUA_QL("format"), *(strfrmt - 1));
-        }
-      }
-      luaL_addlstring(&b, buff, strlen(buff));
+      if (isintconv(*strfrmt))
+        addintlen(form);
+      if (!formatitem(L, b, arg, form, *strfrmt++))
+        luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
+                      LUA_QL("format"), *(strfrmt - 1));
+    }
+  }
+}
+
+
+/*
+** {======================================================
+** Compiled formats: literal text and then a conversion per item
+** =======================================================
+*/
+
+typedef struct FmtItem {
+  size_t len;  /* length of literal text */
+  const char *str;  /* literal text (with `%%' as `%') */
+  char conv;  /* conversion; '\0' ends the format after the text */
+  char fast;  /* formatted here rather than by `sprintf'? */
+  char left;  /* `-' flag */
+  char zero;  /* `0' flag (without `-') */
+  int width;
+  char form[MAX_FORMAT];  /* specification for `formatitem' */
+} FmtItem;
+
+
+typedef struct Format {
+  int nargs;  /* arguments taken by the conversions */
+  FmtItem item[1];  /* variable size; followed by the literal chars */
+} Format;
+
+
+/*
+** translate format `p' (ending at `e') into items; returns 0 if some
+** specification is invalid, so that the format raises its error
+*/
+static int compilespecs (Format *fmt, const char *p, const char *e,
+                         char *lit) {
+  FmtItem *fi;
+  fmt->nargs = 0;
+  for (fi = fmt->item; ; fi++) {
+    const char *s, *msg;
+    int other = 0, prec;
+    fi->str = lit;
+    fi->len = 0;
+    while (p < e && (*p != L_ESC || *(p+1) == L_ESC)) {
+      if (*p == L_ESC) p++;  /* `%%' */
+      *lit++ = *p++;
+      fi->len++;
     }
+    if (p == e) {
+      fi->conv = '\0';
+      return 1;
+    }
+    p++;  /* skip the `%' */
+    if ((s = checkformat(p, fi->form, &msg)) == NULL || *s == '\0' ||
+        strchr("cdiouxXeEfgGqs", *s) == NULL)
+      return 0;
+    fi->conv = *s;
+    fmt->nargs++;
+    fi->left = fi->zero = 0;
+    for (; *p != '\0' && strchr(FLAGS, *p) != NULL; p++) {
+      if (*p == '-') fi->left = 1;
+      else if (*p == '0') fi->zero = 1;
+      else other = 1;
+    }
+    if (fi->left) fi->zero = 0;  /* as in `printf' */
+    for (fi->width = 0; isdigit(uchar(*p)); p++)
+      fi->width = fi->width*10 + (*p - '0');
+    prec = (*p == '.');
+    if (isintconv(fi->conv)) {
+      addintlen(fi->form);
+      fi->fast = !other && !prec;
+    }
+    else fi->fast = (fi->conv == 's' && !other && !prec && !fi->zero);
+    p = s + 1;
+  }
+}
+
+
+/*
+** compile format `p' into a new userdata on the stack; pushes nil and
+** returns NULL if the format is not compiled
+*/
+static const Format *compileformat (lua_State *L, const char *p, size_t l) {
+  Format *fmt;
+  if (l > FMT_MAXLENGTH || strlen(p) != l) {  /* too long or has zeros? */
+    lua_pushnil(L);
+    return NULL;
   }
+  /* each conversion takes at least 2 chars; the last item ends it */
+  fmt = (Format *)lua_newuserdata(L, sizeof(Format) +
+                                     (l/2 + 1) * sizeof(FmtItem) + l);
+  if (!compilespecs(fmt, p, p + l, (char *)(fmt->item + l/2 + 2))) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    return NULL;
+  }
+  return fmt;
+}
+
+
+/* as `getpattern', for format `p' at index 1 */
+static const Format *getformat (lua_State *L, const char *p, size_t l) {
+  int slot = cacheslot(p, 2*PAT_CACHESIZE, FMT_CACHESIZE);
+  const Format *fmt = (const Format *)cacheget(L, slot, p);
+  if (fmt == NULL && (fmt = compileformat(L, p, l)) != NULL)
+    cacheput(L, slot, 1);
+  return fmt;
+}
+
+
+static void addpadding (luaL_Buffer *b, int c, int n) {
+  while (n-- > 0)
+    luaL_addchar(b, c);
+}
+
+
+/* integer `n' (within FMT_MAXINT) by a `fast' item */
+static void addinteger (luaL_Buffer *b, const FmtItem *fi, lua_Number n) {
+  char buff[3 * sizeof(LUA_INTFRM_T)];  /* the digits, backwards */
+  char *e = buff + sizeof(buff), *s = e;
+  const char *digits = (fi->conv == 'X') ? "0123456789ABCDEF"
+                                         : "0123456789abcdef";
+  int base = (fi->conv == 'x' || fi->conv == 'X') ? 16 :
+             (fi->conv == 'o') ? 8 : 10;
+  LUA_INTFRM_T i = (LUA_INTFRM_T)n;
+  unsigned LUA_INTFRM_T u = (unsigned LUA_INTFRM_T)(i < 0 ? -i : i);
+  int pad;
+  do {
+    *--s = digits[u % base];
+    u /= base;
+  } while (u != 0);
+  pad = fi->width - (int)(e - s) - (i < 0);
+  if (!fi->left && !fi->zero) addpadding(b, ' ', pad);
+  if (i < 0) luaL_addchar(b, '-');
+  if (fi->zero) addpadding(b, '0', pad);
+  luaL_addlstring(b, s, e - s);
+  if (fi->left) addpadding(b, ' ', pad);
+}
+
+
+/* string argument `arg' by a `fast' item */
+static void addstring (lua_State *L, luaL_Buffer *b, const FmtItem *fi,
+                       int arg) {
+  size_t l;
+  const char *s = luaL_checklstring(L, arg, &l);
+  int pad;
+  if (l < 100)  /* short strings go as `sprintf' would write them */
+    l = strlen(s);
+  pad = fi->width - (int)l;  /* (no padding for long strings) */
+  if (!fi->left) addpadding(b, ' ', pad);
+  luaL_addlstring(b, s, l);
+  if (fi->left) addpadding(b, ' ', pad);
+}
+
+
+static void cformat (lua_State *L, luaL_Buffer *b, const FmtItem *fi) {
+  int arg = 1;
+  for (;; fi++) {
+    luaL_addlstring(b, fi->str, fi->len);
+    if (fi->conv == '\0') return;
+    arg++;
+    if (!fi->fast)
+      formatitem(L, b, arg, fi->form, fi->conv);
+    else if (fi->conv == 's')
+      addstring(L, b, fi, arg);
+    else {
+      lua_Number n = luaL_checknumber(L, arg);
+      int sign = (fi->conv == 'd' || fi->conv == 'i');
+      if (n < FMT_MAXINT && (sign ? n > -FMT_MAXINT : n >= 0))
+        addinteger(b, fi, n);
+      else  /* out of range or NaN */
+        formatitem(L, b, arg, fi->form, fi->conv);
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+static int str_format (lua_State *L) {
+  size_t sfl;
+  const char *strfrmt = luaL_checklstring(L, 1, &sfl);
+  int top = lua_gettop(L);
+  const Format *fmt = getformat(L, strfrmt, sfl);  /* before the buffer */
+  luaL_Buffer b;
+  if (fmt == NULL || fmt->nargs >= top) {
+    /* not compiled, or arguments missing: their errors must not see
+       the compiled format on the stack */
+    lua_settop(L, top);
+    fmt = NULL;
+  }
+  luaL_buffinit(L, &b);
+  if (fmt != NULL)
+    cformat(L, &b, fmt->item);
+  else
+    interpformat(L, &b, strfrmt, sfl);
   luaL_pushresult(&b);
   return 1;
 }
 
 
+/*
+** light entries of the functions most used in loops (see lua_setlight):
+** anything but strings and numbers goes to the functions above, which
+** raise the errors
+*/
+
+#define optnumber(L,n)	(lua_type(L, n) == LUA_TNUMBER || lua_isnil(L, n))
+
+
+static int str_len_light (lua_State *L) {
+  if (lua_type(L, 1) != LUA_TSTRING) return LUA_LIGHTFAIL;
+  lua_pushinteger(L, lua_objlen(L, 1));
+  return 1;
+}
+
+
+static int str_sub_light (lua_State *L) {
+  size_t l;
+  const char *s;
+  ptrdiff_t start, end;
+  if (lua_type(L, 1) != LUA_TSTRING || lua_type(L, 2) != LUA_TNUMBER ||
+      !optnumber(L, 3))
+    return LUA_LIGHTFAIL;
+  s = lua_tolstring(L, 1, &l);
+  start = posrelat(lua_tointeger(L, 2), l);
+  end = lua_isnil(L, 3) ? (ptrdiff_t)l : posrelat(lua_tointeger(L, 3), l);
+  if (start < 1) start = 1;
+  if (end > (ptrdiff_t)l) end = (ptrdiff_t)l;
+  if (start <= end)
+    lua_pushlstring(L, s+start-1, end-start+1);
+  else lua_pushliteral(L, "");
+  return 1;
+}
+
+
+static int str_byte_light (lua_State *L) {
+  size_t l;
+  const char *s;
+  ptrdiff_t posi, pose;
+  int n, i;
+  if (lua_type(L, 1) != LUA_TSTRING || !optnumber(L, 2) || !optnumber(L, 3))
+    return LUA_LIGHTFAIL;
+  s = lua_tolstring(L, 1, &l);
+  posi = lua_isnil(L, 2) ? 1 : posrelat(lua_tointeger(L, 2), l);
+  pose = lua_isnil(L, 3) ? posi : posrelat(lua_tointeger(L, 3), l);
+  if (posi <= 0) posi = 1;
+  if ((size_t)pose > l) pose = l;
+  if (posi > pose) return 0;  /* empty interval; return no values */
+  if (pose - posi >= LUA_MINSTACK) return LUA_LIGHTFAIL;
+  n = (int)(pose -  posi + 1);
+  for (i=0; i<n; i++)
+    lua_pushinteger(L, uchar(s[posi+i-1]));
+  return n;
+}
+
+
+static int str_char_light (lua_State *L) {
+  char c;
+  if (lua_type(L, 1) != LUA_TNUMBER) return LUA_LIGHTFAIL;
+  c = (char)lua_tointeger(L, 1);
+  if (lua_tointeger(L, 1) != uchar(c)) return LUA_LIGHTFAIL;
+  lua_pushlstring(L, &c, 1);
+  return 1;
+}
+
+
+static const luaL_Light strlight[] = {
+  {"byte", str_byte_light, 3},
+  {"char", str_char_light, 1},
+  {"len", str_len_light, 1},
+  {"sub", str_sub_light, 3},
+  {NULL, NULL, 0}
+};
+
+
 static const luaL_Reg strlib[] = {
   {"byte", str_byte},
   {"char", str_char},
@@ -858,7 +1818,12 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUALIB_API int luaopen_string (lua_State *L) {
+  /* create (private) environment, holding the pattern and format caches */
+  lua_createtable(L, 2*(PAT_CACHESIZE + FMT_CACHESIZE), 0);
+  lua_replace(L, LUA_ENVIRONINDEX);
   luaL_register(L, LUA_STRLIBNAME, strlib);
+  luaL_setlights(L, strlight);
+  lua_setbuiltins(L, -1, LUA_STRLIBNAME);
 #if defined(LUA_COMPAT_GFIND)
   lua_getfield(L, -1, "gmatch");
   lua_setfield(L, -2, "gfind");
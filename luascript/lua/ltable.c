@@ -161,6 +161,7 @@ static int findindex (lua_State *L, Table *t, StkId key) {
 
 int luaH_next (lua_State *L, Table *t, StkId key) {
   int i = findindex(L, t, key);  /* find original element */
+  l_setbit(t->marked, WALKEDBIT);  /* until the traversal ends */
   for (i++; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
       setnvalue(key, cast_num(i+1));
@@ -175,6 +176,7 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
       return 1;
     }
   }
+  resetbit(t->marked, WALKEDBIT);
   return 0;  /* no more elements */
 }
 
@@ -349,6 +351,31 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
 }
 
 
+/*
+** resize `t' to what its current keys need, as `rehash' would. Tables
+** that `next' is walking are left alone, as moving their keys would
+** break the traversal. (A traversal that stops early keeps its table
+** from compacting until another one reaches the end.)
+*/
+void luaH_compact (lua_State *L, Table *t) {
+  int nasize, na, nhsize, lsize;
+  int nums[MAXBITS+1];
+  int i, totaluse;
+  if (testbit(t->marked, WALKEDBIT)) return;
+  for (i=0; i<=MAXBITS; i++) nums[i] = 0;  /* reset counts */
+  nasize = numusearray(t, nums);  /* count keys in array part */
+  totaluse = nasize;  /* all those keys are integer keys */
+  totaluse += numusehash(t, nums, &nasize);  /* count keys in hash part */
+  na = computesizes(nums, &nasize);
+  nhsize = totaluse - na;
+  lsize = (nhsize == 0) ? -1 : ceillog2(nhsize);
+  if (nasize == t->sizearray &&
+      lsize == ((t->node == dummynode) ? -1 : t->lsizenode))
+    return;  /* already of the right sizes */
+  resize(L, t, nasize, nhsize);
+}
+
+
 
 /*
 ** }=============================================================
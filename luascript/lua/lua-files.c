@@ -4,6 +4,11 @@
 
 #define luaall_c
 
+#if defined(LUA_USE_POSIX) && defined(__STRICT_ANSI__) && \
+    !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE	600	/* fileno, popen under -std=c89 */
+#endif
+
 #include "lapi.c"
 #include "lcode.c"
 #include "ldebug.c"
@@ -11,10 +16,13 @@
 #include "ldump.c"
 #include "lfunc.c"
 #include "lgc.c"
+#include "ljit.c"
 #include "llex.c"
 #include "lmem.c"
+#include "lnative.c"
 #include "lobject.c"
 #include "lopcodes.c"
+#include "lopt.c"
 #include "lparser.c"
 #include "lstate.c"
 #include "lstring.c"
@@ -26,6 +34,7 @@
 
 #include "lauxlib.c"
 #include "lbaselib.c"
+#include "lbuflib.c"
 #include "ldblib.c"
 #include "liolib.c"
 #include "linit.c"
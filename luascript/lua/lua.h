@@ -205,6 +205,9 @@ LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                                         const char *chunkname);
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
+LUA_API int (lua_dumpimage) (lua_State *L, lua_Writer writer, void *data);
+LUA_API int   (lua_loadimage) (lua_State *L, const char *image, size_t size,
+                                             const char *chunkname);
 
 
 /*
@@ -213,6 +216,7 @@ LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
 LUA_API int  (lua_yield) (lua_State *L, int nresults);
 LUA_API int  (lua_resume) (lua_State *L, int narg);
 LUA_API int  (lua_status) (lua_State *L);
+LUA_API int  (lua_isyieldable) (lua_State *L);
 
 /*
 ** garbage-collection function and options
@@ -226,6 +230,7 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCSTEP		5
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
+#define LUA_GCCOMPACT		8
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -243,6 +248,81 @@ LUA_API void  (lua_concat) (lua_State *L, int n);
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud);
 
+LUA_API int   (lua_setoptimize) (lua_State *L, int on);
+LUA_API int   (lua_setjit) (lua_State *L, int on);
+
+
+/*
+** stacks of the threads of a state: the sizes they start with, which
+** the collector does not shrink them below, and how often they moved
+*/
+typedef struct lua_StackStats {
+  unsigned long stackreallocs;  /* value stacks reallocated */
+  unsigned long cireallocs;  /* arrays of call frames reallocated */
+  unsigned long fixups;  /* frames and upvalues fixed by moves of stacks */
+  int maxstack;  /* largest value stack, in slots */
+  int maxci;  /* largest array of call frames */
+} lua_StackStats;
+
+LUA_API void  (lua_setstacksizes) (lua_State *L, int stacksize, int cisize);
+LUA_API void  (lua_getstackstats) (lua_State *L, lua_StackStats *stats);
+
+
+/*
+** typed arrays: userdata whose numeric elements are read and written
+** directly by the VM when indexed with an integer in [1, n]
+*/
+#define LUA_ARRAYUINT8		1
+#define LUA_ARRAYINT32		2
+#define LUA_ARRAYFLOAT64	3
+
+typedef struct lua_Array {
+  void *data;  /* first element (may point into another array) */
+  size_t n;  /* number of elements */
+  int readonly;  /* elements cannot be stored (e.g. a mapped file) */
+} lua_Array;
+
+LUA_API lua_Array *(lua_newarray) (lua_State *L, int kind, size_t n);
+LUA_API lua_Array *(lua_toarray) (lua_State *L, int idx, int *kind);
+
+
+/*
+** chunks translated to C by `luac -c': the bytecode of the chunk and the
+** C function running each of its functions, in the order of the dump
+*/
+struct lua_NativeVM;
+
+typedef struct lua_Native {
+  const char *name;  /* chunk name */
+  const unsigned char *image;  /* bytecode, as an image */
+  size_t size;
+  const lua_CFunction *code;  /* one per function of the chunk */
+  int ncode;
+  const struct lua_NativeVM **vm;  /* receives the helpers of the code */
+} lua_Native;
+
+LUA_API int (lua_loadnative) (lua_State *L, const lua_Native *n);
+
+
+/*
+** light entry of a C function: the VM calls it without a call frame,
+** with exactly `nargs' arguments (missing ones are nil), when no call or
+** return hook is set. It must not raise errors other than memory errors,
+** call or yield, use upvalues or LUA_ENVIRONINDEX, nor push more than
+** LUA_MINSTACK values. It returns the number of results, or LUA_LIGHTFAIL
+** with its arguments unchanged to have the function called as usual
+*/
+#define LUA_LIGHTFAIL	(-1)
+
+LUA_API void (lua_setlight) (lua_State *L, int idx, lua_CFunction light,
+                             int nargs);
+
+/*
+** tags the functions of library `lib' (in the table at `idx') that the
+** VM runs in place when the compiler recognizes their calls
+*/
+LUA_API void (lua_setbuiltins) (lua_State *L, int idx, const char *lib);
+
 
 
 /* 
@@ -56,6 +56,7 @@
 #define LUA_USE_ISATTY
 #define LUA_USE_POPEN
 #define LUA_USE_ULONGJMP
+#define LUA_USE_MMAP
 #endif
 
 
@@ -331,9 +332,13 @@
 /*
 @@ LUA_COMPAT_VARARG controls compatibility with old vararg feature.
 ** CHANGE it to undefined as soon as your programs use only '...' to
-** access vararg parameters (instead of the old 'arg' table).
+** access vararg parameters (instead of the old 'arg' table), or define
+** LUA_FASTVARARG: calls of vararg functions then build no 'arg' table,
+** and those that never read '...' do not move their parameters.
 */
+#if !defined(LUA_FASTVARARG)
 #define LUA_COMPAT_VARARG
+#endif
 
 /*
 @@ LUA_COMPAT_MOD controls compatibility with old math.mod function.
@@ -426,6 +431,28 @@
 #endif
 
 
+/*
+@@ LUA_USE_SSE2 enables the SSE2 fast paths of the string library.
+** CHANGE it (undefine it) if your compiler cannot include <emmintrin.h>.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUA_USE_SSE2
+#endif
+
+
+/*
+@@ LUA_USE_JIT enables the trace compiler of hot loops (ljit.c).
+** CHANGE it (undefine it, or define LUA_NOJIT) to get a pure interpreter.
+** It needs an x86-64 target with the System V calling convention and
+** mmap.
+*/
+#if defined(__x86_64__) && !defined(_WIN64) && defined(LUA_USE_MMAP) && \
+    !defined(LUA_NOJIT)
+#define LUA_USE_JIT
+#endif
+
+
 /*
 @@ LUAI_MAXCALLS limits the number of nested calls.
 ** CHANGE it if you need really deep recursive calls. This limit is
@@ -524,6 +551,14 @@
 #define LUAI_MAXNUMBER2STR	32 /* 16 digits, sign, point, and \0 */
 #define lua_str2number(s,p)	strtod((s), (p))
 
+/*
+@@ LUA_FASTNUMCONV enables the conversions of lobject.c that read
+@* common decimals and write integral and short numbers without strtod
+@* and sprintf, with the same results as the two macros above.
+** CHANGE it (undefine it) if you change lua_Number or LUA_NUMBER_FMT.
+*/
+#define LUA_FASTNUMCONV
+
 
 /*
 @@ The luai_num* macros define the primitive operations over numbers.
@@ -20,11 +20,17 @@
 #include "lundump.h"
 #include "lzio.h"
 
+/* strings remembered by a load (a power of 2) */
+#define LOADCACHE	256
+
 typedef struct {
  lua_State* L;
  ZIO* Z;
  Mbuffer* b;
  const char* name;
+ TString* cache[LOADCACHE];	/* strings loaded so far, by LoadHash */
+ size_t pos;			/* bytes read so far */
+ int image;			/* reading the LUAC_IMAGE format? */
 } LoadState;
 
 #ifdef LUAC_TRUST_BINARIES
@@ -47,8 +53,19 @@ static void error(LoadState* S, const char* why)
 
 static void LoadBlock(LoadState* S, void* b, size_t size)
 {
- size_t r=luaZ_read(S->Z,b,size);
- IF (r!=0, "unexpected end");
+ ZIO* z=S->Z;
+ if (size<=z->n)			/* in the current buffer? */
+ {
+  memcpy(b,z->p,size);
+  z->p+=size;
+  z->n-=size;
+ }
+ else
+ {
+  size_t r=luaZ_read(z,b,size);
+  IF (r!=0, "unexpected end");
+ }
+ S->pos+=size;
 }
 
 static int LoadChar(LoadState* S)
@@ -73,6 +90,24 @@ static lua_Number LoadNumber(LoadState* S)
  return x;
 }
 
+/*
+** cheap hash for the load cache; names and common constants repeat
+** across the functions of a chunk
+*/
+static unsigned int LoadHash(const char* s, size_t l)
+{
+ unsigned int h=(unsigned int)l;
+ h=h*31+(unsigned char)s[0];		/* s[l] exists: the chunk's '\0' */
+ h=h*31+(unsigned char)s[l>>1];
+ if (l>0) h=h*31+(unsigned char)s[l-1];
+ return h&(LOADCACHE-1);
+}
+
+/*
+** strings are interned straight from the chunk when it is in the current
+** buffer (always, with luaL_loadbuffer). The collector doesn't run during
+** the undump, so cached strings stay alive.
+*/
 static TString* LoadString(LoadState* S)
 {
  size_t size;
@@ -81,17 +116,72 @@ static TString* LoadString(LoadState* S)
   return NULL;
  else
  {
-  char* s=luaZ_openspace(S->L,S->b,size);
-  LoadBlock(S,s,size);
-  return luaS_newlstr(S->L,s,size-1);		/* remove trailing '\0' */
+  ZIO* z=S->Z;
+  const char* s;
+  TString** c;
+  if (size<=z->n)
+  {
+   s=z->p;
+   z->p+=size;
+   z->n-=size;
+   S->pos+=size;
+  }
+  else
+  {
+   char* b=luaZ_openspace(S->L,S->b,size);
+   LoadBlock(S,b,size);
+   s=b;
+  }
+  size--;					/* remove trailing '\0' */
+  c=&S->cache[LoadHash(s,size)];
+  if (*c==NULL || (*c)->tsv.len!=size || memcmp(getstr(*c),s,size)!=0)
+   *c=luaS_newlstr(S->L,s,size);
+  return *c;
  }
 }
 
+static void LoadPadding(LoadState* S, size_t size)
+{
+ char pad[8];
+ size_t i,n=(size-S->pos%size)%size;
+ lua_assert(n<sizeof(pad));
+ LoadBlock(S,pad,n);
+ for (i=0; i<n; i++) IF (pad[i]!=0, "bad padding");
+}
+
+/*
+** the vectors of an image are aligned in the stream; when the image stays
+** in memory (lua_loadimage) and is aligned there too, they are used in
+** place and shared by all the states loading the image
+*/
+static void* LoadInPlace(LoadState* S, int n, size_t size)
+{
+ ZIO* z=S->Z;
+ void* v;
+ if (!S->image) return NULL;
+ LoadPadding(S,size);
+ if (!z->inplace) return NULL;
+ IF ((size_t)n>z->n/size, "unexpected end");	/* it's all in the buffer */
+ if (((size_t)z->p&(size-1))!=0) return NULL;	/* misaligned: copy */
+ v=(void*)z->p;
+ z->p+=n*size;
+ z->n-=n*size;
+ S->pos+=n*size;
+ return v;
+}
+
 static void LoadCode(LoadState* S, Proto* f)
 {
  int n=LoadInt(S);
- f->code=luaM_newvector(S->L,n,Instruction);
+ Instruction* code=(Instruction*)LoadInPlace(S,n,sizeof(Instruction));
  f->sizecode=n;
+ if (code!=NULL)
+ {
+  f->code=code;
+  f->shared|=PROTO_SHAREDCODE;
+  return;
+ }
+ f->code=luaM_newvector(S->L,n,Instruction);
  LoadVector(S,f->code,n,sizeof(Instruction));
 }
 
@@ -138,9 +228,15 @@ static void LoadDebug(LoadState* S, Proto* f)
 {
  int i,n;
  n=LoadInt(S);
- f->lineinfo=luaM_newvector(S->L,n,int);
+ f->lineinfo=(int*)LoadInPlace(S,n,sizeof(int));
  f->sizelineinfo=n;
- LoadVector(S,f->lineinfo,n,sizeof(int));
+ if (f->lineinfo!=NULL)
+  f->shared|=PROTO_SHAREDLINEINFO;
+ else
+ {
+  f->lineinfo=luaM_newvector(S->L,n,int);
+  LoadVector(S,f->lineinfo,n,sizeof(int));
+ }
  n=LoadInt(S);
  f->locvars=luaM_newvector(S->L,n,LocVar);
  f->sizelocvars=n;
@@ -186,6 +282,8 @@ static void LoadHeader(LoadState* S)
  char s[LUAC_HEADERSIZE];
  luaU_header(h);
  LoadBlock(S,s,LUAC_HEADERSIZE);
+ S->image=(s[sizeof(LUA_SIGNATURE)]==LUAC_IMAGE);	/* format */
+ if (S->image) h[sizeof(LUA_SIGNATURE)]=(char)LUAC_IMAGE;
  IF (memcmp(h,s,LUAC_HEADERSIZE)!=0, "bad header");
 }
 
@@ -204,6 +302,9 @@ Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
  S.L=L;
  S.Z=Z;
  S.b=buff;
+ memset(S.cache,0,sizeof(S.cache));
+ S.pos=0;
+ S.image=0;
  LoadHeader(&S);
  return LoadFunction(&S,luaS_newliteral(L,"=?"));
 }
@@ -19,9 +19,15 @@ LUAI_FUNC void luaU_header (char* h);
 /* dump one chunk; from ldump.c */
 LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip);
 
+/* dump one chunk as an image (see LUAC_IMAGE); from ldump.c */
+LUAI_FUNC int luaU_dumpimage (lua_State* L, const Proto* f, lua_Writer w, void* data);
+
 #ifdef luac_c
 /* print one chunk; from print.c */
 LUAI_FUNC void luaU_print (const Proto* f, int full);
+
+/* translate one chunk to C; from native.c */
+LUAI_FUNC int luaU_native (lua_State* L, const Proto* f, const char* name, lua_Writer w, void* data);
 #endif
 
 /* for header of binary files -- this is Lua 5.1 */
@@ -30,6 +36,13 @@ LUAI_FUNC void luaU_print (const Proto* f, int full);
 /* for header of binary files -- this is the official format */
 #define LUAC_FORMAT		0
 
+/*
+** format of images: the official one, with the code and line vectors
+** padded with zeros to be aligned in the stream, so that they can be
+** used in place when the whole image is in memory
+*/
+#define LUAC_IMAGE		1
+
 /* size of header of binary files */
 #define LUAC_HEADERSIZE		12
 
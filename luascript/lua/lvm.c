@@ -18,6 +18,8 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
+#include "lnative.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
@@ -50,8 +52,8 @@ int luaV_tostring (lua_State *L, StkId obj) {
   else {
     char s[LUAI_MAXNUMBER2STR];
     lua_Number n = nvalue(obj);
-    lua_number2str(s, n);
-    setsvalue2s(L, obj, luaS_new(L, s));
+    int l = luaO_num2str(s, n);
+    setsvalue2s(L, obj, luaS_newlstr(L, s, l));
     return 1;
   }
 }
@@ -105,6 +107,65 @@ static void callTM (lua_State *L, const TValue *f, const TValue *p1,
 }
 
 
+/*
+** direct access to the elements of typed arrays. Return 0 when `key' is
+** not an index inside the array (or, when storing, `val' is not a
+** number or the array is read-only), so that the caller falls back to
+** metamethods
+*/
+static int arrayget (const TValue *t, const TValue *key, StkId val) {
+  lua_Array *a = arrayvalue(rawuvalue(t));
+  lua_Number k;
+  int i;
+  if (!ttisnumber(key)) return 0;
+  k = nvalue(key);
+  lua_number2int(i, k);
+  if (cast_num(i) != k || i < 1 || cast(size_t, i) > a->n) return 0;
+  switch (uvalue(t)->array) {
+    case LUA_ARRAYUINT8:
+      setnvalue(val, cast_num(cast(unsigned char *, a->data)[i-1]));
+      break;
+    case LUA_ARRAYINT32:
+      setnvalue(val, cast_num(cast(LUAI_INT32 *, a->data)[i-1]));
+      break;
+    default:
+      setnvalue(val, cast_num(cast(double *, a->data)[i-1]));
+      break;
+  }
+  return 1;
+}
+
+
+static int arrayset (const TValue *t, const TValue *key, const TValue *val) {
+  lua_Array *a = arrayvalue(rawuvalue(t));
+  lua_Number k, v;
+  int i;
+  if (a->readonly || !ttisnumber(key) || !ttisnumber(val)) return 0;
+  k = nvalue(key);
+  lua_number2int(i, k);
+  if (cast_num(i) != k || i < 1 || cast(size_t, i) > a->n) return 0;
+  v = nvalue(val);
+  switch (uvalue(t)->array) {
+    case LUA_ARRAYUINT8: {
+      lua_Integer e;
+      lua_number2integer(e, v);
+      cast(unsigned char *, a->data)[i-1] = cast(unsigned char, e);
+      break;
+    }
+    case LUA_ARRAYINT32: {
+      lua_Integer e;
+      lua_number2integer(e, v);
+      cast(LUAI_INT32 *, a->data)[i-1] = cast(LUAI_INT32, e);
+      break;
+    }
+    default:
+      cast(double *, a->data)[i-1] = cast(double, v);
+      break;
+  }
+  return 1;
+}
+
+
 void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
   int loop;
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
@@ -119,6 +180,8 @@ void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
       }
       /* else will try the tag method */
     }
+    else if (ttisuserdata(t) && uvalue(t)->array && arrayget(t, key, val))
+      return;  /* element of a typed array */
     else if (ttisnil(tm = luaT_gettmbyobj(L, t, TM_INDEX)))
       luaG_typeerror(L, t, "index");
     if (ttisfunction(tm)) {
@@ -146,6 +209,8 @@ void luaV_settable (lua_State *L, const TValue *t, TValue *key, StkId val) {
       }
       /* else will try the tag method */
     }
+    else if (ttisuserdata(t) && uvalue(t)->array && arrayset(t, key, val))
+      return;  /* element of a typed array */
     else if (ttisnil(tm = luaT_gettmbyobj(L, t, TM_NEWINDEX)))
       luaG_typeerror(L, t, "index");
     if (ttisfunction(tm)) {
@@ -232,7 +297,7 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
 }
 
 
-static int lessequal (lua_State *L, const TValue *l, const TValue *r) {
+int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r) {
   int res;
   if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
@@ -310,8 +375,8 @@ void luaV_concat (lua_State *L, int total, int last) {
 }
 
 
-static void Arith (lua_State *L, StkId ra, const TValue *rb,
-                   const TValue *rc, TMS op) {
+void luaV_arith (lua_State *L, StkId ra, const TValue *rb,
+                 const TValue *rc, TMS op) {
   TValue tempb, tempc;
   const TValue *b, *c;
   if ((b = luaV_tonumber(rb, &tempb)) != NULL &&
@@ -334,6 +399,248 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 
 
 
+/* length of values other than tables and strings */
+void luaV_objlen (lua_State *L, StkId ra, const TValue *rb) {
+  if (ttisuserdata(rb) && uvalue(rb)->array) {  /* typed array? */
+    setnvalue(ra, cast_num(arrayvalue(rawuvalue(rb))->n));
+  }
+  else if (ttistable(rb)) {
+    setnvalue(ra, cast_num(luaH_getn(hvalue(rb))));
+  }
+  else if (ttisstring(rb)) {
+    setnvalue(ra, cast_num(tsvalue(rb)->len));
+  }
+  else if (!call_binTM(L, rb, luaO_nilobject, ra, TM_LEN))
+    luaG_typeerror(L, rb, "get length of");
+}
+
+
+#define isbuiltin(L,f,b)	(iscfunction(f) && clvalue(f)->c.builtin == (b) && \
+	!((L)->hookmask & (LUA_MASKCALL | LUA_MASKRET)))
+
+
+/*
+** runs builtin `b' of OP_CALLB (see luaP_builtins) on the `nargs'
+** arguments above `ra', as the library function would for one result.
+** Returns 0 when they are not its usual arguments (numbers and strings):
+** then the function must be called, to convert them or raise the error
+*/
+static int runbuiltin (lua_State *L, StkId ra, int nargs, int b) {
+  const TValue *arg = ra+1;
+  lua_Integer l, i, j;
+  switch (b) {
+    case BUILTIN_FLOOR: {  /* math.floor(x) */
+      if (!ttisnumber(arg)) return 0;
+      setnvalue(ra, floor(nvalue(arg)));
+      return 1;
+    }
+    case BUILTIN_BYTE: {  /* string.byte(s [, i]) */
+      if (!ttisstring(arg) || (nargs == 2 && !ttisnumber(arg+1))) return 0;
+      l = cast(lua_Integer, tsvalue(arg)->len);
+      i = 1;
+      if (nargs == 2) {
+        lua_number2integer(i, nvalue(arg+1));
+        if (i < 0) i += l+1;  /* relative position */
+      }
+      if (1 <= i && i <= l) {
+        setnvalue(ra, cast_num(cast(unsigned char, svalue(arg)[i-1])));
+      }
+      else setnilvalue(ra);  /* no byte */
+      return 1;
+    }
+    case BUILTIN_CHAR: {  /* string.char(c) */
+      char c;
+      if (!ttisnumber(arg)) return 0;
+      lua_number2integer(i, nvalue(arg));
+      c = cast(char, i);
+      if (cast(int, i) != cast(unsigned char, c)) return 0;
+      setsvalue2s(L, ra, luaS_newlstr(L, &c, 1));
+      return 1;
+    }
+    case BUILTIN_LEN: {  /* string.len(s) */
+      if (!ttisstring(arg)) return 0;
+      setnvalue(ra, cast_num(tsvalue(arg)->len));
+      return 1;
+    }
+    case BUILTIN_SUB: {  /* string.sub(s, i [, j]) */
+      if (!ttisstring(arg) || !ttisnumber(arg+1) ||
+          (nargs == 3 && !ttisnumber(arg+2)))
+        return 0;
+      l = cast(lua_Integer, tsvalue(arg)->len);
+      lua_number2integer(i, nvalue(arg+1));
+      j = -1;
+      if (nargs == 3) lua_number2integer(j, nvalue(arg+2));
+      if (i < 0) i += l+1;  /* relative positions */
+      if (j < 0) j += l+1;
+      if (i < 1) i = 1;
+      if (j > l) j = l;
+      if (i <= j) {
+        const char *s = svalue(arg)+i-1;
+        setsvalue2s(L, ra, luaS_newlstr(L, s, cast(size_t, j-i+1)));
+      }
+      else setsvalue2s(L, ra, luaS_newliteral(L, ""));
+      return 1;
+    }
+    default: return 0;
+  }
+}
+
+
+/*
+** calls of Lua functions, when no call hook is set, skip luaD_precall:
+** `enterlua' and `tailenterlua' set up the frame in place, for the
+** functions that take no varargs or leave them where they are
+*/
+#define isfastcall(L,f)	(isLfunction(f) && !((L)->hookmask & LUA_MASKCALL))
+
+
+/*
+** returns 0 when the stack or the CallInfos must grow, or when the
+** varargs must be adjusted: see luaD_precall
+*/
+static int enterlua (lua_State *L, StkId func, int nresults) {
+  Proto *p = clvalue(func)->l.p;
+  StkId base;
+  CallInfo *ci;
+  StkId st;
+  if (luaD_fixedargs(p))
+    base = func + 1;
+  else if (p->numparams == 0 && !(p->is_vararg & VARARG_NEEDSARG))
+    base = L->top;  /* above the varargs, with no parameter to move */
+  else
+    return 0;
+  if (L->stack_last - base <= p->maxstacksize || L->ci == L->end_ci)
+    return 0;
+  L->ci->savedpc = L->savedpc;
+  ci = ++L->ci;
+  ci->func = func;
+  L->base = ci->base = base;
+  ci->top = base + p->maxstacksize;
+  L->savedpc = p->code;
+  ci->tailcalls = 0;
+  ci->nresults = nresults;
+  if (L->top > base + p->numparams)
+    L->top = base + p->numparams;
+  for (st = L->top; st < ci->top; st++)
+    setnilvalue(st);
+  L->top = ci->top;
+  return 1;
+}
+
+
+/* moves `func' and its arguments down to the frame of the caller */
+static int tailenterlua (lua_State *L, StkId func) {
+  CallInfo *ci = L->ci;
+  Proto *p = clvalue(func)->l.p;
+  StkId dest = ci->func;
+  int n = cast_int(L->top - func);  /* function and arguments */
+  int j;
+  if (!luaD_fixedargs(p) || L->stack_last - (dest + 1) <= p->maxstacksize)
+    return 0;
+  if (L->openupval) luaF_close(L, ci->base);
+  if (n > p->numparams + 1)
+    n = p->numparams + 1;
+  for (j = 0; j < n; j++)
+    setobjs2s(L, dest + j, func + j);
+  L->base = ci->base = dest + 1;
+  ci->top = ci->base + p->maxstacksize;
+  for (func = dest + n; func < ci->top; func++)
+    setnilvalue(func);
+  L->top = ci->top;
+  L->savedpc = ci->savedpc = p->code;
+  ci->tailcalls++;  /* one more call lost */
+  return 1;
+}
+
+
+/*
+** luaD_poscall of the `nres' results (0 or 1) of OP_RETURN0 and OP_RETURN1,
+** when no return hook is set
+*/
+static int leavelua (lua_State *L, StkId ra, int nres) {
+  CallInfo *ci = L->ci--;
+  StkId res = ci->func;
+  int wanted = ci->nresults;
+  int b = (wanted != LUA_MULTRET);
+  L->base = (ci - 1)->base;
+  L->savedpc = (ci - 1)->savedpc;
+  if (!b) wanted = nres;
+  if (wanted != 0) {
+    if (nres) {
+      setobjs2s(L, res, ra);
+    }
+    else {
+      setnilvalue(res);
+    }
+    res++;
+    while (--wanted > 0)
+      setnilvalue(res++);
+  }
+  L->top = res;
+  return b;
+}
+
+
+/*
+** copies the varargs of the running function from the `first'th one on
+** (counting from 0) to register `a', as `wanted' values or as all of them
+** up to a new top when `wanted' is LUA_MULTRET
+*/
+static void getvarargs (lua_State *L, int a, int first, int wanted) {
+  CallInfo *ci = L->ci;
+  int n = cast_int(ci->base - ci->func) - ci_func(ci)->l.p->numparams - 1;
+  StkId ra;
+  int j;
+  n = (first < n) ? n - first : 0;
+  if (wanted == LUA_MULTRET) {
+    luaD_checkstack(L, n);
+    wanted = n;
+    L->top = L->base + a + n;
+  }
+  ra = L->base + a;  /* the stack may have moved */
+  for (j = 0; j < wanted; j++) {
+    if (j < n) {
+      setobjs2s(L, ra + j, ci->base - n + j);
+    }
+    else {
+      setnilvalue(ra + j);
+    }
+  }
+}
+
+
+/*
+** runs select(R(A+1), ...) of OP_SELECT on the varargs, where they are.
+** Returns 0 when R(A+1) is not a number or "#", or is out of range: then
+** select must be called, to convert it or raise the error
+*/
+static int runselect (lua_State *L, StkId ra, int nresults) {
+  CallInfo *ci = L->ci;
+  const TValue *x = ra+1;
+  int n = cast_int(ci->base - ci->func) - ci_func(ci)->l.p->numparams - 1;
+  lua_Integer k;
+  int j;
+  if (ttisstring(x) && *svalue(x) == '#') {
+    setnvalue(ra, cast_num(n));
+    if (nresults == LUA_MULTRET)
+      L->top = ra+1;
+    else {
+      while (--nresults > 0)
+        setnilvalue(++ra);
+    }
+    return 1;
+  }
+  if (!ttisnumber(x)) return 0;
+  lua_number2integer(k, nvalue(x));
+  j = cast_int(k);  /* as luaL_checkint */
+  if (j < 0) j += n+1;  /* relative position */
+  else if (j > n) j = n+1;  /* no value */
+  if (j < 1) return 0;
+  getvarargs(L, cast_int(ra - L->base), j - 1, nresults);
+  return 1;
+}
+
+
 /*
 ** some macros for common tasks in `luaV_execute'
 */
@@ -357,6 +664,15 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 #define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; }
 
 
+#if defined(LUA_USE_JIT)
+/* back-edge to `pc': may run the trace of the loop instead */
+#define jitloop(L,pc) \
+	{ if (G(L)->jit && !L->hookmask) Protect(pc = luaJ_loop(L, pc)); }
+#else
+#define jitloop(L,pc)	((void)0)
+#endif
+
+
 #define arith_op(op,tm) { \
         TValue *rb = RKB(i); \
         TValue *rc = RKC(i); \
@@ -365,7 +681,7 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
           setnvalue(ra, op(nb, nc)); \
         } \
         else \
-          Protect(Arith(L, ra, rb, rc, tm)); \
+          Protect(luaV_arith(L, ra, rb, rc, tm)); \
       }
 
 
@@ -379,6 +695,16 @@ void luaV_execute (lua_State *L, int nexeccalls) {
   lua_assert(isLua(L->ci));
   pc = L->savedpc;
   cl = &clvalue(L->ci->func)->l;
+  if (luaN_canrun(L, cl->p, pc)) {  /* translated to C (see lnative.c)? */
+    int b = (*cl->p->native)(L);  /* runs up to its return... */
+    if (b != NATIVE_TAILCALL) {
+      if (--nexeccalls == 0)  /* was previous function running `here'? */
+        return;  /* no: return */
+      if (b) L->top = L->ci->top;
+      goto reentry;
+    }
+    pc = L->savedpc;  /* ...or up to a tail call, left to the interpreter */
+  }
   base = L->base;
   k = cl->p->k;
   /* main loop of interpreter */
@@ -498,7 +824,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           setnvalue(ra, luai_numunm(nb));
         }
         else {
-          Protect(Arith(L, ra, rb, rb, TM_UNM));
+          Protect(luaV_arith(L, ra, rb, rb, TM_UNM));
         }
         continue;
       }
@@ -518,11 +844,8 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             setnvalue(ra, cast_num(tsvalue(rb)->len));
             break;
           }
-          default: {  /* try metamethod */
-            Protect(
-              if (!call_binTM(L, rb, luaO_nilobject, ra, TM_LEN))
-                luaG_typeerror(L, rb, "get length of");
-            )
+          default: {  /* typed array or metamethod */
+            Protect(luaV_objlen(L, ra, rb));
           }
         }
         continue;
@@ -536,6 +859,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
       }
       case OP_JMP: {
         dojump(L, pc, GETARG_sBx(i));
+        if (GETARG_sBx(i) < 0) jitloop(L, pc);
         continue;
       }
       case OP_EQ: {
@@ -558,7 +882,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
       }
       case OP_LE: {
         Protect(
-          if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
+          if (luaV_lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
@@ -579,11 +903,40 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         pc++;
         continue;
       }
+      case OP_SELECT: {
+        L->savedpc = pc;
+        if (isbuiltin(L, ra, BUILTIN_SELECT) &&
+            runselect(L, ra, GETARG_C(i) - 1)) {
+          base = L->base;
+          continue;
+        }
+        /* else call the function with the varargs, up to top */
+        Protect(getvarargs(L, GETARG_A(i) + 2, 0, LUA_MULTRET));
+        ra = RA(i);
+      }  /* FALLTHROUGH */
+      case OP_CALLB: {
+        L->savedpc = pc;
+        if (GET_OPCODE(i) == OP_CALLB && isbuiltin(L, ra, GETARG_C(i)) &&
+            runbuiltin(L, ra, GETARG_B(i) - 1, GETARG_C(i))) {
+          Protect(luaC_checkGC(L));
+          continue;
+        }
+        /* else call the function, for one result */
+      }  /* FALLTHROUGH */
       case OP_CALL: {
         int b = GETARG_B(i);
-        int nresults = GETARG_C(i) - 1;
+        int nresults = (GET_OPCODE(i) != OP_CALLB) ? GETARG_C(i) - 1 : 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
+        if (isfastcall(L, ra) && enterlua(L, ra, nresults)) {
+          nexeccalls++;
+          goto reentry;  /* restart luaV_execute over new Lua function */
+        }
+        if (luaD_canlight(L, ra) && luaD_lightcall(L, ra, nresults)) {
+          if (nresults >= 0) L->top = L->ci->top;
+          base = L->base;
+          continue;
+        }
         switch (luaD_precall(L, ra, nresults)) {
           case PCRLUA: {
             nexeccalls++;
@@ -605,6 +958,8 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
         lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);
+        if (isfastcall(L, ra) && tailenterlua(L, ra))
+          goto reentry;
         switch (luaD_precall(L, ra, LUA_MULTRET)) {
           case PCRLUA: {
             /* tail call: put new frame in place of previous one */
@@ -632,18 +987,27 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           }
         }
       }
+      case OP_RETURN0:
+      case OP_RETURN1: {
+        L->top = ra + (GET_OPCODE(i) - OP_RETURN0);  /* B == 0: up to top */
+      }  /* FALLTHROUGH */
       case OP_RETURN: {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b-1;
         if (L->openupval) luaF_close(L, base);
         L->savedpc = pc;
-        b = luaD_poscall(L, ra);
+        if (GET_OPCODE(i) != OP_RETURN && !(L->hookmask & LUA_MASKRET))
+          b = leavelua(L, ra, GET_OPCODE(i) - OP_RETURN0);
+        else
+          b = luaD_poscall(L, ra);
         if (--nexeccalls == 0)  /* was previous function running `here'? */
           return;  /* no: return */
         else {  /* yes: continue its execution */
           if (b) L->top = L->ci->top;
           lua_assert(isLua(L->ci));
-          lua_assert(GET_OPCODE(*((L->ci)->savedpc - 1)) == OP_CALL);
+          lua_assert(GET_OPCODE(*((L->ci)->savedpc - 1)) == OP_CALL ||
+                     GET_OPCODE(*((L->ci)->savedpc - 1)) == OP_CALLB ||
+                     GET_OPCODE(*((L->ci)->savedpc - 1)) == OP_SELECT);
           goto reentry;
         }
       }
@@ -656,6 +1020,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           dojump(L, pc, GETARG_sBx(i));  /* jump back */
           setnvalue(ra, idx);  /* update internal index... */
           setnvalue(ra+3, idx);  /* ...and external index */
+          jitloop(L, pc);
         }
         continue;
       }
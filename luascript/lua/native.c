@@ -0,0 +1,326 @@
+/*
+** $Id: native.c $
+** translate bytecodes to C (see lnative.h)
+** See Copyright Notice in lua.h
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define luac_c
+#define LUA_CORE
+
+#include "lauxlib.h"
+#include "ldebug.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lundump.h"
+
+#define TranslateChunk	luaU_native
+
+typedef struct {
+ lua_State* L;
+ lua_Writer writer;
+ void* data;
+ int status;
+ int nf;				/* functions written so far */
+ size_t size;				/* size of the image */
+} NativeState;
+
+static void Write(NativeState* N, const char* s, size_t size)
+{
+ if (N->status==0) N->status=(*N->writer)(N->L,s,size,N->data);
+}
+
+#define Text(N,s)	Write(N,s,strlen(s))
+
+/* short formatted output; longer strings go through Write or Text */
+static void Emit(NativeState* N, const char* fmt, ...)
+{
+ char s[128];
+ va_list argp;
+ va_start(argp,fmt);
+ vsprintf(s,fmt,argp);
+ va_end(argp);
+ Write(N,s,strlen(s));
+}
+
+static void EmitRK(NativeState* N, int x)
+{
+ if (ISK(x)) Emit(N,"K(%d)",INDEXK(x)); else Emit(N,"R(%d)",x);
+}
+
+/* instructions that are targets of jumps get a label */
+static char* Targets(lua_State* L, const Proto* f)
+{
+ const Instruction* code=f->code;
+ int pc,n=f->sizecode;
+ char* t=luaM_newvector(L,n+1,char);
+ memset(t,0,n+1);
+ for (pc=0; pc<n; pc++)
+ {
+  Instruction i=code[pc];
+  switch (GET_OPCODE(i))
+  {
+   case OP_JMP:
+   case OP_FORLOOP:
+   case OP_FORPREP:
+    t[pc+1+GETARG_sBx(i)]=1;
+    break;
+   case OP_LOADBOOL:
+    if (GETARG_C(i)) t[pc+2]=1;
+    break;
+   case OP_EQ:
+   case OP_LT:
+   case OP_LE:
+   case OP_TEST:
+   case OP_TESTSET:
+   case OP_TFORLOOP:
+    t[pc+2]=1;
+    break;
+   case OP_SETLIST:
+    if (GETARG_C(i)==0) pc++;
+    break;
+   case OP_CLOSURE:
+    pc+=f->p[GETARG_Bx(i)]->nups;
+    break;
+   default:
+    break;
+  }
+ }
+ return t;
+}
+
+static const char* const arith[]={
+ "luai_numadd,TM_ADD", "luai_numsub,TM_SUB", "luai_nummul,TM_MUL",
+ "luai_numdiv,TM_DIV", "luai_nummod,TM_MOD", "luai_numpow,TM_POW"
+};
+
+static int IsNumberK(const Proto* f, int x)
+{
+ return ISK(x) && ttisnumber(&f->k[INDEXK(x)]);
+}
+
+static void TranslateCode(NativeState* N, const Proto* f, const char* t)
+{
+ const Instruction* code=f->code;
+ int pc,n=f->sizecode;
+ for (pc=0; pc<n; pc++)
+ {
+  Instruction i=code[pc];
+  OpCode o=GET_OPCODE(i);
+  int a=GETARG_A(i);
+  int b=GETARG_B(i);
+  int c=GETARG_C(i);
+  int bx=GETARG_Bx(i);
+  int sbx=GETARG_sBx(i);
+  if (t[pc]) Emit(N,"i%d:\n",pc);
+  Emit(N,"  ");
+  switch (o)
+  {
+   case OP_MOVE:
+    Emit(N,"nat_move(%d,%d);",a,b);
+    break;
+   case OP_LOADK:
+    Emit(N,"nat_loadk(%d,%d);",a,bx);
+    break;
+   case OP_LOADBOOL:
+    Emit(N,"nat_loadbool(%d,%d);",a,b);
+    if (c) Emit(N," nat_jmp(i%d)",pc+2);
+    break;
+   case OP_LOADNIL:
+    for (; b>=a; b--) Emit(N,"nat_loadnil(%d);",b);
+    break;
+   case OP_GETUPVAL:
+    Emit(N,"nat_getupval(%d,%d);",a,b);
+    break;
+   case OP_GETGLOBAL:
+    Emit(N,"nat_getglobal(%d,%d,%d)",pc,a,bx);
+    break;
+   case OP_GETTABLE:
+    Emit(N,"nat_gettable(%d,%d,R(%d),",pc,a,b);
+    EmitRK(N,c); Emit(N,")");
+    break;
+   case OP_SETGLOBAL:
+    Emit(N,"nat_setglobal(%d,%d,%d)",pc,a,bx);
+    break;
+   case OP_SETUPVAL:
+    Emit(N,"nat_setupval(%d,%d)",a,b);
+    break;
+   case OP_SETTABLE:
+    Emit(N,"nat_settable(%d,R(%d),",pc,a);
+    EmitRK(N,b); Emit(N,","); EmitRK(N,c); Emit(N,")");
+    break;
+   case OP_NEWTABLE:
+    Emit(N,"nat_newtable(%d,%d,%d,%d)",pc,a,b,c);
+    break;
+   case OP_SELF:
+    Emit(N,"nat_self(%d,%d,%d,",pc,a,b);
+    EmitRK(N,c); Emit(N,")");
+    break;
+   case OP_ADD:
+   case OP_SUB:
+   case OP_MUL:
+   case OP_DIV:
+   case OP_MOD:
+   case OP_POW:
+    Emit(N,"nat_arith(%d,%d,",pc,a);
+    EmitRK(N,b); Emit(N,","); EmitRK(N,c);
+    Emit(N,",%d,%d,%s)",IsNumberK(f,b),IsNumberK(f,c),arith[o-OP_ADD]);
+    break;
+   case OP_UNM:
+    Emit(N,"nat_unm(%d,%d,%d)",pc,a,b);
+    break;
+   case OP_NOT:
+    Emit(N,"nat_not(%d,%d)",a,b);
+    break;
+   case OP_LEN:
+    Emit(N,"nat_len(%d,%d,%d)",pc,a,b);
+    break;
+   case OP_CONCAT:
+    Emit(N,"nat_concat(%d,%d,%d,%d)",pc,a,b,c);
+    break;
+   case OP_JMP:
+    Emit(N,"nat_jmp(i%d)",pc+1+sbx);
+    break;
+   case OP_EQ:
+   case OP_LT:
+   case OP_LE:
+    Emit(N,"nat_%s(%d,%d,",o==OP_EQ ? "eq" : o==OP_LT ? "lt" : "le",pc,a);
+    EmitRK(N,b); Emit(N,","); EmitRK(N,c); Emit(N,",i%d)",pc+2);
+    break;
+   case OP_TEST:
+    Emit(N,"nat_test(%d,%d,i%d)",a,c,pc+2);
+    break;
+   case OP_TESTSET:
+    Emit(N,"nat_testset(%d,%d,%d,i%d)",a,b,c,pc+2);
+    break;
+   case OP_CALL:
+    Emit(N,"nat_call(%d,%d,%d,%d)",pc,a,b,c);
+    break;
+   case OP_CALLB:				/* a call, for now */
+    Emit(N,"nat_call(%d,%d,%d,2)",pc,a,b);
+    break;
+   case OP_SELECT:				/* a call, for now */
+    Emit(N,"nat_vararg(%d,%d,0) nat_call(%d,%d,0,%d)",pc,a+2,pc,a,c);
+    break;
+   case OP_TAILCALL:
+    Emit(N,"nat_tailcall(%d)",pc);
+    break;
+   case OP_RETURN:
+    Emit(N,"nat_return(%d,%d,%d)",pc,a,b);
+    break;
+   case OP_RETURN0:
+    Emit(N,"nat_return(%d,0,1)",pc);
+    break;
+   case OP_RETURN1:
+    Emit(N,"nat_return(%d,%d,2)",pc,a);
+    break;
+   case OP_FORLOOP:
+    Emit(N,"nat_forloop(%d,i%d)",a,pc+1+sbx);
+    break;
+   case OP_FORPREP:
+    Emit(N,"nat_forprep(%d,%d,i%d)",pc,a,pc+1+sbx);
+    break;
+   case OP_TFORLOOP:
+    Emit(N,"nat_tforloop(%d,%d,%d,i%d)",pc,a,c,pc+2);
+    break;
+   case OP_SETLIST:
+    if (c==0) c=(int)code[++pc];
+    Emit(N,"nat_setlist(%d,%d,%d,%d)",pc,a,b,c);
+    break;
+   case OP_CLOSE:
+    Emit(N,"nat_close(%d);",a);
+    break;
+   case OP_CLOSURE:
+    Emit(N,"nat_closure(%d,%d,%d)",pc,a,bx);
+    pc+=f->p[bx]->nups;			/* skip the upvalue pseudo-ops */
+    break;
+   case OP_VARARG:
+    Emit(N,"nat_vararg(%d,%d,%d)",pc,a,b);
+    break;
+  }
+  Emit(N,"\n");
+ }
+}
+
+static void TranslateFunction(NativeState* N, const Proto* f)
+{
+ int i,nf=N->nf++;
+ char* t=Targets(N->L,f);
+ Emit(N,"\n/* %s <",(f->linedefined==0) ? "main" : "function");
+ if (f->source) Write(N,getstr(f->source),f->source->tsv.len);
+ Emit(N,":%d,%d> */\n",f->linedefined,f->lastlinedefined);
+ Emit(N,"static int f%d (lua_State *L) {\n  nat_prologue();\n",nf);
+ TranslateCode(N,f,t);
+ Emit(N,"}\n");
+ luaM_freearray(N->L,t,f->sizecode+1,char);
+ for (i=0; i<f->sizep; i++) TranslateFunction(N,f->p[i]);
+}
+
+static int AddImage(lua_State* L, const void* p, size_t size, void* b)
+{
+ UNUSED(L);
+ luaL_addlstring((luaL_Buffer*)b,(const char*)p,size);
+ return 0;
+}
+
+/* the image, as words so that it is aligned (see lua_loadimage) */
+static void TranslateImage(NativeState* N, const Proto* f)
+{
+ lua_State* L=N->L;
+ luaL_Buffer b;
+ const char* s;
+ size_t i,size;
+ luaL_buffinit(L,&b);
+ luaU_dumpimage(L,f,AddImage,&b);
+ luaL_pushresult(&b);
+ s=lua_tolstring(L,-1,&size);
+ Emit(N,"\nstatic const unsigned int image[] = {");
+ for (i=0; i<size; i+=4)
+ {
+  unsigned int w=0;
+  memcpy(&w,s+i,size-i<4 ? size-i : 4);
+  Emit(N,"%s0x%08x,",(i%24==0) ? "\n  " : " ",w);
+ }
+ Emit(N,"\n};\n");
+ N->size=size;
+ lua_pop(L,1);
+}
+
+/*
+** writes C code for chunk `f' which require(`name') can load: a
+** function per Lua function and luaopen_`name', which binds them to the
+** chunk and runs it
+*/
+int TranslateChunk(lua_State* L, const Proto* f, const char* name,
+		   lua_Writer w, void* data)
+{
+ NativeState N;
+ const char* s;
+ int i;
+ N.L=L; N.writer=w; N.data=data; N.status=0; N.nf=0; N.size=0;
+ Text(&N,"/*\n** Translated to C by luac -c. Do not edit.\n*/\n\n"
+	 "#define LUA_CORE\n#define LUA_NATIVECODE\n\n"
+	 "#include \"lnative.h\"\n\n"
+	 "static const luaN_VM *vm;\n");
+ TranslateFunction(&N,f);
+ Text(&N,"\nstatic const lua_CFunction code[] = {");
+ for (i=0; i<N.nf; i++) Emit(&N,"%s f%d,",(i%10==0) ? "\n " : "",i);
+ Text(&N,"\n};\n");
+ TranslateImage(&N,f);
+ Text(&N,"\nLUALIB_API int luaopen_");
+ for (s=name; *s; s++) Emit(&N,"%c",(*s=='.') ? '_' : *s);
+ Text(&N," (lua_State *L) {\n"
+	 "  static const lua_Native native = {\n    \"=");
+ Write(&N,name,strlen(name));
+ Emit(&N,"\", (const unsigned char *)image, %lu, code, %d, &vm\n  };\n",
+	 (unsigned long)N.size,N.nf);
+ Text(&N,"  if (lua_loadnative(L, &native) != 0) lua_error(L);\n"
+	 "  lua_insert(L, 1);  /* the chunk gets the arguments of luaopen */\n"
+	 "  lua_call(L, lua_gettop(L) - 1, 1);\n"
+	 "  return 1;\n}\n");
+ return N.status;
+}
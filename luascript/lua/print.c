@@ -144,6 +144,9 @@ static void PrintCode(const Proto* f)
    case OP_CLOSURE:
     printf("\t; %p",VOID(f->p[bx]));
     break;
+   case OP_CALLB:
+    printf("\t; %s.%s",luaP_builtins[c].lib,luaP_builtins[c].name);
+    break;
    case OP_SETLIST:
     if (c==0) printf("\t; %d",(int)code[++pc]);
     else printf("\t; %d",c);
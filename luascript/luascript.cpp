@@ -3,13 +3,706 @@
 #include "luascript/luascript.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 
-lua::lua() {
+#if defined(__GLIBC__) || defined(WIN32)
+#include <malloc.h>
+#endif
+
+#if defined(WIN32)
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600  // condition variables
+#endif
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Minimal threading primitives over Win32 and pthreads.
+
+class mutex_t {
+ public:
+#if defined(WIN32)
+  mutex_t() { InitializeCriticalSection(&m_); }
+  ~mutex_t() { DeleteCriticalSection(&m_); }
+  void lock() { EnterCriticalSection(&m_); }
+  void unlock() { LeaveCriticalSection(&m_); }
+#else
+  mutex_t() { pthread_mutex_init(&m_, 0); }
+  ~mutex_t() { pthread_mutex_destroy(&m_); }
+  void lock() { pthread_mutex_lock(&m_); }
+  void unlock() { pthread_mutex_unlock(&m_); }
+#endif
+
+ private:
+  friend class condition_t;
+#if defined(WIN32)
+  CRITICAL_SECTION m_;
+#else
+  pthread_mutex_t m_;
+#endif
+  mutex_t(const mutex_t&);
+  void operator=(const mutex_t&);
+};
+
+class scoped_lock {
+ public:
+  explicit scoped_lock(mutex_t& m) : m_(m) { m_.lock(); }
+  ~scoped_lock() { m_.unlock(); }
+ private:
+  mutex_t& m_;
+  scoped_lock(const scoped_lock&);
+  void operator=(const scoped_lock&);
+};
+
+class condition_t {
+ public:
+#if defined(WIN32)
+  condition_t() { InitializeConditionVariable(&c_); }
+  ~condition_t() {}
+  void notify_one() { WakeConditionVariable(&c_); }
+  void notify_all() { WakeAllConditionVariable(&c_); }
+  void wait(mutex_t& m) { SleepConditionVariableCS(&c_, &m.m_, INFINITE); }
+  // Returns false on timeout. A negative timeout waits forever.
+  bool wait(mutex_t& m, int timeout_ms) {
+    return SleepConditionVariableCS(&c_, &m.m_,
+        timeout_ms < 0 ? INFINITE : static_cast<DWORD>(timeout_ms)) != 0;
+  }
+#else
+  condition_t() { pthread_cond_init(&c_, 0); }
+  ~condition_t() { pthread_cond_destroy(&c_); }
+  void notify_one() { pthread_cond_signal(&c_); }
+  void notify_all() { pthread_cond_broadcast(&c_); }
+  void wait(mutex_t& m) { pthread_cond_wait(&c_, &m.m_); }
+  bool wait(mutex_t& m, int timeout_ms) {
+    if (timeout_ms < 0) {
+      wait(m);
+      return true;
+    }
+    struct timeval now;
+    gettimeofday(&now, 0);
+    long long ns = (now.tv_usec + (timeout_ms % 1000) * 1000LL) * 1000;
+    struct timespec until;
+    until.tv_sec = now.tv_sec + timeout_ms / 1000 + ns / 1000000000;
+    until.tv_nsec = ns % 1000000000;
+    return pthread_cond_timedwait(&c_, &m.m_, &until) == 0;
+  }
+#endif
+
+ private:
+#if defined(WIN32)
+  CONDITION_VARIABLE c_;
+#else
+  pthread_cond_t c_;
+#endif
+  condition_t(const condition_t&);
+  void operator=(const condition_t&);
+};
+
+class thread_t {
+ public:
+  typedef void (*entry_t)(void* arg);
+
+  thread_t(entry_t entry, void* arg) : entry_(entry), arg_(arg) {
+#if defined(WIN32)
+    handle_ = reinterpret_cast<HANDLE>(
+        _beginthreadex(0, 0, &thread_t::start, this, 0, 0));
+#else
+    pthread_create(&handle_, 0, &thread_t::start, this);
+#endif
+  }
+
+  void join() {
+#if defined(WIN32)
+    WaitForSingleObject(handle_, INFINITE);
+    CloseHandle(handle_);
+#else
+    pthread_join(handle_, 0);
+#endif
+  }
+
+ private:
+#if defined(WIN32)
+  static unsigned __stdcall start(void* self) {
+    static_cast<thread_t*>(self)->entry_(static_cast<thread_t*>(self)->arg_);
+    return 0;
+  }
+  HANDLE handle_;
+#else
+  static void* start(void* self) {
+    static_cast<thread_t*>(self)->entry_(static_cast<thread_t*>(self)->arg_);
+    return 0;
+  }
+  pthread_t handle_;
+#endif
+  entry_t entry_;
+  void* arg_;
+  thread_t(const thread_t&);
+  void operator=(const thread_t&);
+};
+
+// Milliseconds from an arbitrary point, not affected by clock changes.
+long long now_ms() {
+#if defined(WIN32)
+  return static_cast<long long>(GetTickCount64());
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+#endif
+}
+
+void sleep_ms(int ms) {
+#if defined(WIN32)
+  Sleep(ms);
+#else
+  struct timespec delay;
+  delay.tv_sec = ms / 1000;
+  delay.tv_nsec = (ms % 1000) * 1000000L;
+  while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {}
+#endif
+}
+
+long atomic_add(volatile long* value, long delta) {
+#if defined(WIN32)
+  return InterlockedExchangeAdd(value, delta) + delta;
+#else
+  return __sync_add_and_fetch(value, delta);
+#endif
+}
+
+int cpu_count() {
+#if defined(WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return static_cast<int>(info.dwNumberOfProcessors);
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? static_cast<int>(n) : 1;
+#endif
+}
+
+// Binds the calling thread to a core. Memory it touches first is then
+// allocated on the core's NUMA node.
+void pin_thread(int core) {
+#if defined(WIN32)
+  const int bits = static_cast<int>(sizeof(DWORD_PTR) * 8);
+  SetThreadAffinityMask(GetCurrentThread(),
+                        static_cast<DWORD_PTR>(1) << (core % bits));
+#elif defined(__linux__)
+  cpu_set_t cores;
+  CPU_ZERO(&cores);
+  CPU_SET(core % CPU_SETSIZE, &cores);
+  pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+#else
+  (void)core;  // no affinity API, leave it to the OS
+#endif
+}
+
+// Number of threads doing asynchronous I/O for one state.
+const int kIoThreads = 4;
+
+// Registry key of the lua object owning a state.
+char kSelfKey;
+
+// Waits on `cond' until `ready' holds, for up to timeout_ms (-1 for no
+// limit). Returns the final value of `ready'.
+template< class pred_t >
+bool wait_until(condition_t& cond, mutex_t& lock, int timeout_ms,
+                pred_t ready) {
+  long long deadline = now_ms() + timeout_ms;
+  while (!ready()) {
+    if (timeout_ms < 0) {
+      cond.wait(lock);
+    } else {
+      long long left = deadline - now_ms();
+      if (left <= 0)
+        return false;
+      cond.wait(lock, static_cast<int>(left));
+    }
+  }
+  return true;
+}
+
+// Binary serialization of Lua values for channel messages. Numbers are
+// in native byte order: messages never leave the process. Tables are
+// numbered as they are met, so that shared tables and cycles are sent
+// once and referred to afterwards.
+
+enum value_tag_t {
+  kNilTag, kFalseTag, kTrueTag, kIntegerTag, kNumberTag, kStringTag,
+  kTableTag, kTableRefTag, kEndTag
+};
+
+// Maximum nesting of tables in a message.
+const int kMaxPackDepth = 200;
+
+void put_varint(std::string& out, size_t v) {
+  while (v >= 0x80) {
+    out += static_cast<char>((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  out += static_cast<char>(v);
+}
+
+void put_raw(std::string& out, const void* p, size_t n) {
+  out.append(static_cast<const char*>(p), n);
+}
+
+// Appends the value at `idx' to `out'. `refs' is the index of a table
+// mapping the tables sent so far to their numbers, `*ntables' their
+// count. Raises a Lua error for values that can't be sent, so nothing
+// here may need a destructor.
+void pack_value(lua_State* L, int idx, std::string& out, int refs,
+                int* ntables, int depth) {
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      out += static_cast<char>(kNilTag);
+      break;
+    case LUA_TBOOLEAN:
+      out += static_cast<char>(lua_toboolean(L, idx) ? kTrueTag : kFalseTag);
+      break;
+    case LUA_TNUMBER: {
+      lua_Number n = lua_tonumber(L, idx);
+      LUAI_INT32 i = 0;
+      if (n >= -2147483648.0 && n <= 2147483647.0)
+        i = static_cast<LUAI_INT32>(n);
+      if (static_cast<lua_Number>(i) == n) {
+        out += static_cast<char>(kIntegerTag);
+        put_raw(out, &i, sizeof(i));
+      } else {
+        out += static_cast<char>(kNumberTag);
+        put_raw(out, &n, sizeof(n));
+      }
+      break;
+    }
+    case LUA_TSTRING: {
+      size_t n;
+      const char* str = lua_tolstring(L, idx, &n);
+      out += static_cast<char>(kStringTag);
+      put_varint(out, n);
+      out.append(str, n);
+      break;
+    }
+    case LUA_TTABLE: {
+      lua_pushvalue(L, idx);
+      lua_rawget(L, refs);
+      if (!lua_isnil(L, -1)) {
+        out += static_cast<char>(kTableRefTag);
+        put_varint(out, static_cast<size_t>(lua_tointeger(L, -1)));
+        lua_pop(L, 1);
+        break;
+      }
+      lua_pop(L, 1);
+      if (depth >= kMaxPackDepth)
+        luaL_error(L, "message nested too deeply");
+      luaL_checkstack(L, 4, "message nested too deeply");
+      lua_pushvalue(L, idx);
+      lua_pushinteger(L, ++*ntables);
+      lua_rawset(L, refs);
+      out += static_cast<char>(kTableTag);
+      put_varint(out, lua_objlen(L, idx));
+      // The number of fields is patched in once they are written.
+      size_t count_at = out.size();
+      LUAI_UINT32 count = 0;
+      put_raw(out, &count, sizeof(count));
+      lua_pushnil(L);
+      while (lua_next(L, idx)) {
+        int top = lua_gettop(L);
+        pack_value(L, top - 1, out, refs, ntables, depth + 1);
+        pack_value(L, top, out, refs, ntables, depth + 1);
+        lua_pop(L, 1);
+        ++count;
+      }
+      out.replace(count_at, sizeof(count),
+                  reinterpret_cast<const char*>(&count), sizeof(count));
+      out += static_cast<char>(kEndTag);
+      break;
+    }
+    default:
+      luaL_error(L, "cannot send a %s", luaL_typename(L, idx));
+  }
+}
+
+class message_reader {
+ public:
+  message_reader(lua_State* L, const std::string& in, int refs)
+      : L_(L), p_(in.data()), end_(in.data() + in.size()), refs_(refs),
+        ntables_(0) {}
+
+  bool done() const { return p_ == end_; }
+
+  // Pushes the next value of the message.
+  void unpack(int depth) {
+    switch (tag()) {
+      case kNilTag:
+        lua_pushnil(L_);
+        break;
+      case kFalseTag:
+      case kTrueTag:
+        lua_pushboolean(L_, p_[-1] == kTrueTag);
+        break;
+      case kIntegerTag: {
+        LUAI_INT32 i;
+        get_raw(&i, sizeof(i));
+        lua_pushinteger(L_, i);
+        break;
+      }
+      case kNumberTag: {
+        lua_Number n;
+        get_raw(&n, sizeof(n));
+        lua_pushnumber(L_, n);
+        break;
+      }
+      case kStringTag: {
+        size_t n = get_varint();
+        check(n);
+        lua_pushlstring(L_, p_, n);
+        p_ += n;
+        break;
+      }
+      case kTableTag: {
+        if (depth >= kMaxPackDepth)
+          corrupt();
+        luaL_checkstack(L_, 4, "message nested too deeply");
+        size_t narray = get_varint();
+        LUAI_UINT32 count;
+        get_raw(&count, sizeof(count));
+        // Sizes come from the sender: cap them by what the bytes left
+        // can hold.
+        size_t left = static_cast<size_t>(end_ - p_);
+        narray = std::min(narray, left / 2);
+        size_t nhash = std::min<size_t>(count, left / 2);
+        nhash = nhash > narray ? nhash - narray : 0;
+        lua_createtable(L_, static_cast<int>(narray), static_cast<int>(nhash));
+        lua_pushvalue(L_, -1);
+        lua_rawseti(L_, refs_, ++ntables_);
+        while (check(1), *p_ != kEndTag) {
+          unpack(depth + 1);
+          if (lua_isnil(L_, -1))
+            corrupt();
+          unpack(depth + 1);
+          lua_rawset(L_, -3);
+        }
+        ++p_;
+        break;
+      }
+      case kTableRefTag: {
+        size_t n = get_varint();
+        if (n < 1 || n > static_cast<size_t>(ntables_))
+          corrupt();
+        lua_rawgeti(L_, refs_, static_cast<int>(n));
+        break;
+      }
+      default:
+        corrupt();
+    }
+  }
+
+ private:
+  void corrupt() { luaL_error(L_, "corrupt message"); }
+
+  void check(size_t n) {
+    if (static_cast<size_t>(end_ - p_) < n)
+      corrupt();
+  }
+
+  int tag() {
+    check(1);
+    return static_cast<unsigned char>(*p_++);
+  }
+
+  void get_raw(void* p, size_t n) {
+    check(n);
+    std::memcpy(p, p_, n);
+    p_ += n;
+  }
+
+  size_t get_varint() {
+    size_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      unsigned char c = static_cast<unsigned char>(tag());
+      v |= static_cast<size_t>(c & 0x7f) << shift;
+      if (!(c & 0x80))
+        return v;
+    }
+    corrupt();
+    return 0;
+  }
+
+  lua_State* L_;
+  const char* p_;
+  const char* end_;
+  int refs_;
+  int ntables_;
+};
+
+// Lua side of a channel: the channel and the buffer messages are built
+// in and received into.
+struct channel_handle_t {
+  lua_channel* channel;
+  std::string* buffer;
+};
+
+const char kChannelHandle[] = "lua_channel";
+
+channel_handle_t* check_channel(lua_State* L) {
+  channel_handle_t* h = static_cast<channel_handle_t*>(
+      luaL_checkudata(L, 1, kChannelHandle));
+  if (!h->channel)
+    luaL_error(L, "attempt to use a released channel");
+  return h;
+}
+
+// channel.open(name [, capacity]) returns the channel with this name,
+// creating it with room for `capacity' (default 64) messages.
+int channel_open(lua_State* L) {
+  const char* name = luaL_checkstring(L, 1);
+  lua_Integer capacity = luaL_optinteger(L, 2, 64);
+  luaL_argcheck(L, capacity > 0, 2, "invalid capacity");
+  channel_handle_t* h = static_cast<channel_handle_t*>(
+      lua_newuserdata(L, sizeof(channel_handle_t)));
+  h->channel = 0;
+  h->buffer = 0;
+  luaL_getmetatable(L, kChannelHandle);
+  lua_setmetatable(L, -2);
+  h->buffer = new std::string();
+  h->channel = lua_channel::open(name, static_cast<size_t>(capacity));
+  return 1;
+}
+
+// ch:send(...) queues the values, waiting while the channel is full.
+// Returns false if the channel is closed.
+int channel_send(lua_State* L) {
+  channel_handle_t* h = check_channel(L);
+  int n = lua_gettop(L);
+  lua_newtable(L);
+  int refs = lua_gettop(L);
+  int ntables = 0;
+  h->buffer->clear();
+  for (int i = 2; i <= n; ++i)
+    pack_value(L, i, *h->buffer, refs, &ntables, 0);
+  lua_pushboolean(L, h->channel->send(*h->buffer));
+  return 1;
+}
+
+// ch:receive([timeout_ms]) returns true and the values of the next
+// message, or false and "timeout" or "closed".
+int channel_receive(lua_State* L) {
+  channel_handle_t* h = check_channel(L);
+  int timeout_ms = static_cast<int>(luaL_optinteger(L, 2, -1));
+  if (!h->channel->receive(*h->buffer, timeout_ms)) {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, h->channel->closed() ? "closed" : "timeout");
+    return 2;
+  }
+  lua_settop(L, 1);
+  lua_newtable(L);
+  lua_pushboolean(L, 1);
+  message_reader reader(L, *h->buffer, 2);
+  while (!reader.done()) {
+    luaL_checkstack(L, 1, "too many values");
+    reader.unpack(0);
+  }
+  return lua_gettop(L) - 2;
+}
+
+int channel_close(lua_State* L) {
+  check_channel(L)->channel->close();
+  return 0;
+}
+
+int channel_gc(lua_State* L) {
+  channel_handle_t* h = static_cast<channel_handle_t*>(
+      luaL_checkudata(L, 1, kChannelHandle));
+  if (h->channel)
+    h->channel->release();
+  delete h->buffer;
+  h->channel = 0;
+  h->buffer = 0;
+  return 0;
+}
+
+void open_channels(lua_State* L) {
+  static const luaL_Reg methods[] = {
+    {"close", channel_close},
+    {"receive", channel_receive},
+    {"send", channel_send},
+    {"__gc", channel_gc},
+    {0, 0}
+  };
+  static const luaL_Reg channellib[] = {
+    {"open", channel_open},
+    {0, 0}
+  };
+  luaL_newmetatable(L, kChannelHandle);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, 0, methods);
+  lua_pop(L, 1);
+  luaL_register(L, "channel", channellib);
+  lua_pop(L, 1);
+}
+
+}  // namespace
+
+// Asynchronous I/O operation. It is filled in by aio.read/aio.write,
+// performed by a pool thread and returned to the task in `co'.
+struct lua::io_request {
+  enum op_t { READ, WRITE, APPEND };
+
+  io_request() : op(READ), offset(0), count(-1), ok(false), errnum(0),
+                 co(0) {}
+
+  void perform();
+  int push_result(lua_State* L);
+
+  op_t op;
+  std::string path;
+  std::string data;  // data to write, or data read
+  long offset;
+  long count;        // bytes to read, -1 for the rest of the file
+  bool ok;
+  std::string error;
+  int errnum;
+  lua_State* co;
+};
+
+void lua::io_request::perform() {
+  FILE* f = std::fopen(path.c_str(), op == READ ? "rb" :
+                                     op == WRITE ? "wb" : "ab");
+  ok = f != 0;
+  if (ok && op == READ) {
+    ok = offset == 0 || std::fseek(f, offset, SEEK_SET) == 0;
+    char buf[LUAL_BUFFERSIZE];
+    while (ok && count != 0) {
+      size_t n = sizeof(buf);
+      if (count > 0 && static_cast<size_t>(count) < n)
+        n = static_cast<size_t>(count);
+      size_t nr = std::fread(buf, 1, n, f);
+      data.append(buf, nr);
+      if (count > 0)
+        count -= static_cast<long>(nr);
+      if (nr < n) {
+        ok = !std::ferror(f);
+        break;
+      }
+    }
+  } else if (ok) {
+    ok = std::fwrite(data.data(), 1, data.size(), f) == data.size();
+  }
+  if (!ok) {
+    errnum = errno;
+    error = path + ": " + std::strerror(errnum);
+  }
+  if (f != 0 && std::fclose(f) != 0 && ok) {
+    ok = false;
+    errnum = errno;
+    error = path + ": " + std::strerror(errnum);
+  }
+}
+
+// Pushes the results of the operation, as the io library would.
+int lua::io_request::push_result(lua_State* L) {
+  if (!ok) {
+    lua_pushnil(L);
+    lua_pushstring(L, error.c_str());
+    lua_pushinteger(L, errnum);
+    return 3;
+  }
+  if (op == READ)
+    lua_pushlstring(L, data.data(), data.size());
+  else
+    lua_pushboolean(L, 1);
+  return 1;
+}
+
+class lua::io_pool {
+ public:
+  io_pool() : stop_(false) {
+    for (int i = 0; i < kIoThreads; ++i)
+      threads_.push_back(new thread_t(&io_pool::worker, this));
+  }
+
+  ~io_pool() {
+    {
+      scoped_lock lock(lock_);
+      stop_ = true;
+      work_.notify_all();
+    }
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      threads_[i]->join();
+      delete threads_[i];
+    }
+    std::for_each(queue_.begin(), queue_.end(), deleter());
+    std::for_each(done_.begin(), done_.end(), deleter());
+  }
+
+  void submit(io_request* r) {
+    scoped_lock lock(lock_);
+    queue_.push_back(r);
+    work_.notify_one();
+  }
+
+  // Moves completed requests to `done', waiting up to timeout_ms for one
+  // if there are none yet.
+  void take(std::deque<io_request*>& done, int timeout_ms) {
+    scoped_lock lock(lock_);
+    if (done_.empty() && timeout_ms != 0)
+      completed_.wait(lock_, timeout_ms);
+    done.insert(done.end(), done_.begin(), done_.end());
+    done_.clear();
+  }
+
+ private:
+  static void worker(void* arg) {
+    io_pool* self = static_cast<io_pool*>(arg);
+    scoped_lock lock(self->lock_);
+    for (;;) {
+      while (self->queue_.empty() && !self->stop_)
+        self->work_.wait(self->lock_);
+      if (self->stop_)
+        return;
+      io_request* r = self->queue_.front();
+      self->queue_.pop_front();
+      self->lock_.unlock();
+      r->perform();
+      self->lock_.lock();
+      self->done_.push_back(r);
+      self->completed_.notify_one();
+    }
+  }
+
+  mutex_t lock_;
+  condition_t work_;
+  condition_t completed_;
+  std::deque<io_request*> queue_;
+  std::deque<io_request*> done_;
+  std::vector<thread_t*> threads_;
+  bool stop_;
+};
+
+lua::lua() : io_(0), pending_(0), timeslice_(0) {
   L_ = lua_open();
   luaL_openlibs(L_);
+  open_aio();
+  open_tasks();
+  open_channels(L_);
 }
 
 lua::~lua() {
+  delete io_;  // waits for the operations in progress
+  std::for_each(completed_.begin(), completed_.end(), deleter());
   lua_close(L_);
 }
 
@@ -111,3 +804,735 @@ void lua::exec(const std::string& script) {
   if (error)
     throw lua::exception(lua_tostring(L_, -1));
 }
+
+void lua::call(const std::string& function, const args_t& in,
+                args_t& out) {
+  int base = lua_gettop(L_);
+  lua_getglobal(L_, function.c_str());
+  for (args_t::const_iterator i = in.begin(); i != in.end(); ++i)
+    (*i)->pack(L_);
+  if (lua_pcall(L_, static_cast<int>(in.size()),
+                static_cast<int>(out.size()), 0) != 0) {
+    std::string msg = lua_tostring(L_, -1);
+    lua_settop(L_, base);
+    throw lua::exception(msg);
+  }
+  try {
+    for (size_t i = 0; i < out.size(); ++i)
+      out[i]->unpack(L_, base + static_cast<int>(i) + 1);
+  } catch(...) {
+    lua_settop(L_, base);
+    throw;
+  }
+  lua_settop(L_, base);
+}
+
+namespace {
+
+int append_chunk(lua_State* L, const void* p, size_t size, void* ud) {
+  (void)L;
+  static_cast<std::string*>(ud)->append(static_cast<const char*>(p), size);
+  return 0;
+}
+
+bool is_bytecode(const void* code, size_t size) {
+  return size > 0 && *static_cast<const char*>(code) == LUA_SIGNATURE[0];
+}
+
+// package.preload loader: undumps the chunk in the upvalues and runs it
+// with the module name.
+int load_preloaded(lua_State* L) {
+  const char* name = lua_tostring(L, lua_upvalueindex(3));
+  if (lua_loadimage(L,
+                    static_cast<const char*>(
+                        lua_touserdata(L, lua_upvalueindex(1))),
+                    static_cast<size_t>(
+                        lua_tointeger(L, lua_upvalueindex(2))),
+                    name) != 0)
+    return lua_error(L);
+  lua_pushstring(L, name + 1);  // skip the '=' of the chunk name
+  lua_call(L, 1, 1);
+  return 1;
+}
+
+}  // namespace
+
+void lua::load_bytecode(const void* code, size_t size) {
+  if (!is_bytecode(code, size))
+    throw lua::exception("load_bytecode(), not a precompiled chunk");
+  int error = luaL_loadbuffer(L_, static_cast<const char*>(code), size,
+                              "=bytecode") || lua_pcall(L_, 0, 0, 0);
+  if (error)
+    throw lua::exception(lua_tostring(L_, -1));
+}
+
+std::string lua::dump(const std::string& function) {
+  lua_getglobal(L_, function.c_str());
+  std::string code;
+  int error = !lua_isfunction(L_, -1) || lua_iscfunction(L_, -1) ||
+              lua_dump(L_, append_chunk, &code) != 0;
+  lua_pop(L_, 1);
+  if (error)
+    throw lua::exception("dump(), '" + function + "' is not a Lua function");
+  return code;
+}
+
+std::string lua::dump_image(const std::string& function) {
+  lua_getglobal(L_, function.c_str());
+  std::string code;
+  int error = !lua_isfunction(L_, -1) || lua_iscfunction(L_, -1) ||
+              lua_dumpimage(L_, append_chunk, &code) != 0;
+  lua_pop(L_, 1);
+  if (error)
+    throw lua::exception("dump_image(), '" + function +
+                         "' is not a Lua function");
+  return code;
+}
+
+void lua::preload(const std::string& module, const void* code,
+                  size_t size) {
+  if (!is_bytecode(code, size))
+    throw lua::exception("preload(), not a precompiled chunk");
+  lua_getglobal(L_, "package");
+  lua_getfield(L_, -1, "preload");
+  lua_pushlightuserdata(L_, const_cast<void*>(code));
+  lua_pushinteger(L_, static_cast<lua_Integer>(size));
+  lua_pushstring(L_, ("=" + module).c_str());
+  lua_pushcclosure(L_, load_preloaded, 3);
+  lua_setfield(L_, -2, module.c_str());
+  lua_pop(L_, 2);
+}
+
+void lua::preload(const std::string& module, lua_CFunction open) {
+  lua_getglobal(L_, "package");
+  lua_getfield(L_, -1, "preload");
+  lua_pushcfunction(L_, open);
+  lua_setfield(L_, -2, module.c_str());
+  lua_pop(L_, 2);
+}
+
+int lua::compact() {
+  int released = lua_gc(L_, LUA_GCCOMPACT, 0);
+#if defined(__GLIBC__)
+  malloc_trim(0);
+#elif defined(WIN32)
+  _heapmin();
+#endif
+  return released;
+}
+
+void lua::set_optimize(bool on) {
+  lua_setoptimize(L_, on);
+}
+
+void lua::set_jit(bool on) {
+  lua_setjit(L_, on);
+}
+
+void lua::set_stack_sizes(int slots, int calls) {
+  lua_setstacksizes(L_, slots, calls);
+}
+
+lua_StackStats lua::stack_stats() {
+  lua_StackStats stats;
+  lua_getstackstats(L_, &stats);
+  return stats;
+}
+
+void lua::open_aio() {
+  static const luaL_Reg aiolib[] = {
+    {"read", aio_read},
+    {"write", aio_write},
+    {0, 0}
+  };
+  lua_newtable(L_);
+  for (const luaL_Reg* f = aiolib; f->name; ++f) {
+    lua_pushlightuserdata(L_, this);
+    lua_pushcclosure(L_, f->func, 1);
+    lua_setfield(L_, -2, f->name);
+  }
+  lua_setglobal(L_, "aio");
+}
+
+// aio.read(path [, offset [, count]]) returns the data read, or nil,
+// message and errno, like the io library.
+int lua::aio_read(lua_State* L) {
+  // The checks raise Lua errors, which would leak a request made before.
+  const char* path = luaL_checkstring(L, 1);
+  long offset = luaL_optlong(L, 2, 0);
+  long count = luaL_optlong(L, 3, -1);
+  io_request* r = new io_request();
+  r->path = path;
+  r->offset = offset;
+  r->count = count;
+  return aio_submit(L, r);
+}
+
+// aio.write(path, data [, "a"]) writes (or appends) data to the file and
+// returns true, or nil, message and errno.
+int lua::aio_write(lua_State* L) {
+  size_t n;
+  const char* path = luaL_checkstring(L, 1);
+  const char* data = luaL_checklstring(L, 2, &n);
+  const char* mode = luaL_optstring(L, 3, "w");
+  luaL_argcheck(L, mode[0] == 'w' || mode[0] == 'a', 3, "invalid mode");
+  io_request* r = new io_request();
+  r->op = mode[0] == 'a' ? io_request::APPEND : io_request::WRITE;
+  r->path = path;
+  r->data.assign(data, n);
+  return aio_submit(L, r);
+}
+
+// Hands the request to the pool and suspends the task; outside tasks
+// the operation is done right away.
+int lua::aio_submit(lua_State* L, io_request* r) {
+  lua* self = static_cast<lua*>(lua_touserdata(L, lua_upvalueindex(1)));
+  task_t* t = self->find_task(L);
+  if (!t) {
+    r->perform();
+    int n = r->push_result(L);
+    delete r;
+    return n;
+  }
+  if (!self->io_)
+    self->io_ = new io_pool();
+  r->co = L;
+  t->waiting = true;
+  ++self->pending_;
+  self->io_->submit(r);
+  return lua_yield(L, 0);
+}
+
+void lua::open_tasks() {
+  static const luaL_Reg tasklib[] = {
+    {"signal", task_signal},
+    {"sleep", task_sleep},
+    {"wait", task_wait},
+    {"yield", task_yield},
+    {0, 0}
+  };
+  lua_newtable(L_);
+  for (const luaL_Reg* f = tasklib; f->name; ++f) {
+    lua_pushlightuserdata(L_, this);
+    lua_pushcclosure(L_, f->func, 1);
+    lua_setfield(L_, -2, f->name);
+  }
+  lua_setglobal(L_, "task");
+  lua_pushlightuserdata(L_, &kSelfKey);
+  lua_pushlightuserdata(L_, this);
+  lua_rawset(L_, LUA_REGISTRYINDEX);
+}
+
+lua* lua::self(lua_State* L) {
+  lua_pushlightuserdata(L, &kSelfKey);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua* self = static_cast<lua*>(lua_touserdata(L, -1));
+  lua_pop(L, 1);
+  return self;
+}
+
+// Returns the task run by L if it can be suspended, that is, if L is
+// not some other coroutine and is not inside a pcall or metamethod.
+lua::task_t* lua::find_task(lua_State* L) {
+  if (!lua_isyieldable(L))
+    return 0;
+  std::map<lua_State*, task_t>::iterator t = tasks_.find(L);
+  return t != tasks_.end() ? &t->second : 0;
+}
+
+// task.sleep(ms) suspends the task for at least ms milliseconds; outside
+// tasks it blocks.
+int lua::task_sleep(lua_State* L) {
+  lua* self = static_cast<lua*>(lua_touserdata(L, lua_upvalueindex(1)));
+  int ms = std::max(0, static_cast<int>(luaL_checkinteger(L, 1)));
+  task_t* t = self->find_task(L);
+  if (!t) {
+    sleep_ms(ms);
+    return 0;
+  }
+  t->waiting = true;
+  self->timers_.insert(std::make_pair(now_ms() + ms, L));
+  return lua_yield(L, 0);
+}
+
+// task.wait(event) suspends the task until the event is signalled and
+// returns the values passed to task.signal.
+int lua::task_wait(lua_State* L) {
+  lua* self = static_cast<lua*>(lua_touserdata(L, lua_upvalueindex(1)));
+  const char* event = luaL_checkstring(L, 1);
+  task_t* t = self->find_task(L);
+  if (!t)
+    return luaL_error(L, "task.wait can only suspend a task");
+  t->waiting = true;
+  self->events_[event].push_back(L);
+  return lua_yield(L, 0);
+}
+
+// task.signal(event, ...) wakes the tasks waiting for the event, passing
+// them the other arguments. Returns the number of tasks woken.
+int lua::task_signal(lua_State* L) {
+  lua* self = static_cast<lua*>(lua_touserdata(L, lua_upvalueindex(1)));
+  const char* event = luaL_checkstring(L, 1);
+  lua_pushinteger(L, self->wake(event, L, 2, lua_gettop(L) - 1));
+  return 1;
+}
+
+// task.yield() lets the other ready tasks run.
+int lua::task_yield(lua_State* L) {
+  lua* self = static_cast<lua*>(lua_touserdata(L, lua_upvalueindex(1)));
+  if (!self->find_task(L))
+    return 0;
+  return lua_yield(L, 0);
+}
+
+// Count hook of tasks: the timeslice is over.
+void lua::preempt(lua_State* L, lua_Debug* ar) {
+  if (ar->event == LUA_HOOKCOUNT && self(L)->find_task(L))
+    lua_yield(L, 0);
+}
+
+int lua::wake(const std::string& event, lua_State* from, int first, int n) {
+  std::map<std::string, std::vector<lua_State*> >::iterator e =
+      events_.find(event);
+  if (e == events_.end())
+    return 0;
+  std::vector<lua_State*> waiters;
+  waiters.swap(e->second);
+  events_.erase(e);
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    lua_State* co = waiters[i];
+    luaL_checkstack(co, n, "too many values");
+    for (int j = 0; j < n; ++j) {
+      lua_pushvalue(from, first + j);
+      lua_xmove(from, co, 1);
+    }
+    tasks_[co].waiting = false;
+    ready_.push_back(resumption_t(co, n));
+  }
+  return static_cast<int>(waiters.size());
+}
+
+int lua::signal(const std::string& event) {
+  return wake(event, L_, 0, 0);
+}
+
+void lua::set_timeslice(int instructions) {
+  timeslice_ = std::max(0, instructions);
+}
+
+void lua::spawn(const std::string& script) {
+  lua_State* co = lua_newthread(L_);
+  task_t task = { luaL_ref(L_, LUA_REGISTRYINDEX), false };
+  if (luaL_loadstring(co, script.c_str()) != 0) {
+    std::string msg = lua_tostring(co, -1);
+    luaL_unref(L_, LUA_REGISTRYINDEX, task.ref);
+    throw lua::exception(msg);
+  }
+  if (timeslice_ > 0)
+    lua_sethook(co, preempt, LUA_MASKCOUNT, timeslice_);
+  tasks_[co] = task;
+  resume(co, 0);
+}
+
+void lua::resume(lua_State* co, int nargs) {
+  int status = lua_resume(co, nargs);
+  std::map<lua_State*, task_t>::iterator t = tasks_.find(co);
+  if (status == LUA_YIELD) {
+    if (!t->second.waiting)
+      ready_.push_back(resumption_t(co, 0));
+    return;
+  }
+  std::string msg;
+  if (status != 0)
+    msg = lua_isstring(co, -1) ? lua_tostring(co, -1) : "(error object)";
+  luaL_unref(L_, LUA_REGISTRYINDEX, t->second.ref);
+  tasks_.erase(t);
+  if (status != 0)
+    throw lua::exception(msg);
+}
+
+int lua::poll(int timeout_ms) {
+  if (ready_.empty()) {
+    // Nothing to run: wait for the first timer or I/O completion.
+    int wait = timeout_ms;
+    if (!timers_.empty()) {
+      long long next = std::max(0LL, timers_.begin()->first - now_ms());
+      if (wait < 0 || next < wait)
+        wait = static_cast<int>(next);
+    }
+    if (pending_ > 0)
+      io_->take(completed_, wait);
+    else if (!timers_.empty() && wait > 0)
+      sleep_ms(wait);
+  } else if (pending_ > 0) {
+    io_->take(completed_, 0);
+  }
+
+  long long now = now_ms();
+  while (!timers_.empty() && timers_.begin()->first <= now) {
+    lua_State* co = timers_.begin()->second;
+    timers_.erase(timers_.begin());
+    tasks_[co].waiting = false;
+    ready_.push_back(resumption_t(co, 0));
+  }
+  while (!completed_.empty()) {
+    io_request* r = completed_.front();
+    completed_.pop_front();
+    --pending_;
+    lua_State* co = r->co;
+    int nresults = r->push_result(co);
+    delete r;
+    tasks_[co].waiting = false;
+    ready_.push_back(resumption_t(co, nresults));
+  }
+
+  // Tasks made ready while these run wait for the next poll.
+  for (size_t n = ready_.size(); n > 0; --n) {
+    resumption_t r = ready_.front();
+    ready_.pop_front();
+    resume(r.first, r.second);
+  }
+  return static_cast<int>(tasks_.size());
+}
+
+void lua::run() {
+  while (!ready_.empty() || !timers_.empty() || pending_ > 0)
+    poll(-1);
+}
+
+struct lua_executor::future::state_t {
+  state_t(const std::string& function, const lua::args_t& in,
+          const lua::args_t& out)
+      : refs(1), done(false), function(function), in(in), out(out) {}
+
+  void release() {
+    bool last;
+    {
+      scoped_lock guard(lock);
+      last = --refs == 0;
+    }
+    if (last)
+      delete this;
+  }
+
+  mutex_t lock;
+  condition_t finished;
+  int refs;
+  bool done;
+  std::string function;
+  lua::args_t in;
+  lua::args_t out;
+  std::string error;
+};
+
+lua_executor::future::future() : state_(0) {}
+
+lua_executor::future::future(state_t* state) : state_(state) {}
+
+lua_executor::future::future(const future& rhs) : state_(rhs.state_) {
+  if (state_) {
+    scoped_lock guard(state_->lock);
+    ++state_->refs;
+  }
+}
+
+lua_executor::future::~future() {
+  if (state_)
+    state_->release();
+}
+
+lua_executor::future& lua_executor::future::operator=(const future& rhs) {
+  future copy(rhs);
+  std::swap(state_, copy.state_);
+  return *this;
+}
+
+bool lua_executor::future::ready() const {
+  if (!state_)
+    return false;
+  scoped_lock guard(state_->lock);
+  return state_->done;
+}
+
+const lua::args_t& lua_executor::future::get() const {
+  if (!state_)
+    throw lua::exception("future has no call");
+  scoped_lock guard(state_->lock);
+  while (!state_->done)
+    state_->finished.wait(state_->lock);
+  if (!state_->error.empty())
+    throw lua::exception(state_->error);
+  return state_->out;
+}
+
+struct lua_executor::worker_t {
+  worker_t(impl_t* owner, int index)
+      : owner(owner), index(index), script(0), thread(0) {}
+
+  future::state_t* pop() {
+    scoped_lock guard(lock);
+    if (calls.empty())
+      return 0;
+    future::state_t* call = calls.front();
+    calls.pop_front();
+    return call;
+  }
+
+  // Thieves take the newest calls, away from the end the owner uses.
+  future::state_t* steal() {
+    scoped_lock guard(lock);
+    if (calls.empty())
+      return 0;
+    future::state_t* call = calls.back();
+    calls.pop_back();
+    return call;
+  }
+
+  impl_t* owner;
+  int index;
+  mutex_t lock;
+  std::deque<future::state_t*> calls;
+  lua* script;
+  std::string error;  // of the setup script
+  thread_t* thread;
+};
+
+struct lua_executor::impl_t {
+  impl_t(const std::string& setup, pinning_t pinning)
+      : setup(setup), pinning(pinning), queued(0), next(0), started(0),
+        stop(false) {}
+
+  future::state_t* take(worker_t* self) {
+    future::state_t* call = self->pop();
+    for (size_t i = 1; !call && i < workers.size(); ++i)
+      call = workers[(self->index + i) % workers.size()]->steal();
+    if (call)
+      atomic_add(&queued, -1);
+    return call;
+  }
+
+  // Lets the workers finish the queued calls, then joins them.
+  void shutdown() {
+    {
+      scoped_lock guard(lock);
+      stop = true;
+      wake.notify_all();
+    }
+    // Workers steal from each other until they stop: join them all
+    // before freeing any.
+    for (size_t i = 0; i < workers.size(); ++i)
+      workers[i]->thread->join();
+    for (size_t i = 0; i < workers.size(); ++i) {
+      delete workers[i]->thread;
+      delete workers[i];
+    }
+    workers.clear();
+  }
+
+  std::string setup;
+  pinning_t pinning;
+  std::vector<worker_t*> workers;
+  volatile long queued;  // calls in the queues
+  volatile long next;    // round-robin counter of submit()
+  mutex_t lock;          // guards `started' and `stop', and idle waits
+  condition_t wake;
+  int started;
+  bool stop;
+};
+
+lua_executor::lua_executor(const std::string& setup, int threads,
+                           pinning_t pinning)
+    : impl_(new impl_t(setup, pinning)) {
+  if (threads <= 0)
+    threads = cpu_count();
+  for (int i = 0; i < threads; ++i)
+    impl_->workers.push_back(new worker_t(impl_, i));
+  for (int i = 0; i < threads; ++i)
+    impl_->workers[i]->thread = new thread_t(&lua_executor::work,
+                                             impl_->workers[i]);
+  std::string error;
+  {
+    scoped_lock guard(impl_->lock);
+    while (impl_->started < threads)
+      impl_->wake.wait(impl_->lock);
+  }
+  for (int i = 0; i < threads && error.empty(); ++i)
+    error = impl_->workers[i]->error;
+  if (!error.empty()) {
+    impl_->shutdown();
+    delete impl_;
+    throw lua::exception(error);
+  }
+}
+
+lua_executor::~lua_executor() {
+  impl_->shutdown();
+  delete impl_;
+}
+
+lua_executor::future lua_executor::submit(const std::string& function,
+                                          const lua::args_t& in,
+                                          const lua::args_t& out) {
+  future::state_t* call = new future::state_t(function, in, out);
+  call->refs = 2;  // the future and the queue
+  long n = atomic_add(&impl_->next, 1);
+  worker_t* w = impl_->workers[static_cast<size_t>(n) %
+                               impl_->workers.size()];
+  {
+    scoped_lock guard(w->lock);
+    w->calls.push_back(call);
+  }
+  atomic_add(&impl_->queued, 1);
+  {
+    scoped_lock guard(impl_->lock);
+    impl_->wake.notify_one();
+  }
+  return future(call);
+}
+
+int lua_executor::threads() const {
+  return static_cast<int>(impl_->workers.size());
+}
+
+void lua_executor::work(void* arg) {
+  worker_t* self = static_cast<worker_t*>(arg);
+  impl_t* owner = self->owner;
+  if (owner->pinning == PIN_TO_CORES)
+    pin_thread(self->index);
+  // The state is created here so that it lives on the thread's node.
+  std::auto_ptr<lua> script(new lua());
+  try {
+    script->exec(owner->setup);
+  } catch(const lua::exception& e) {
+    self->error = e.what();
+  }
+  {
+    scoped_lock guard(owner->lock);
+    ++owner->started;
+    owner->wake.notify_all();
+  }
+  for (;;) {
+    future::state_t* call = owner->take(self);
+    if (!call) {
+      scoped_lock guard(owner->lock);
+      while (atomic_add(&owner->queued, 0) == 0 && !owner->stop)
+        owner->wake.wait(owner->lock);
+      if (atomic_add(&owner->queued, 0) == 0 && owner->stop)
+        break;
+      continue;
+    }
+    std::string error;
+    try {
+      script->call(call->function, call->in, call->out);
+    } catch(const lua::exception& e) {
+      error = e.what();
+    }
+    {
+      scoped_lock guard(call->lock);
+      call->error = error;
+      call->done = true;
+      call->finished.notify_all();
+    }
+    call->release();
+  }
+}
+
+namespace {
+
+mutex_t channels_lock;  // guards the directory and reference counts
+std::map<std::string, lua_channel*> channels;
+
+}  // namespace
+
+struct lua_channel::impl_t {
+  impl_t(const std::string& name, size_t capacity)
+      : name(name), slots(capacity), head(0), count(0), closed(false),
+        refs(0) {}
+
+  // Predicates for wait_until(), called with `lock' held.
+  struct has_room {
+    explicit has_room(impl_t* self) : self(self) {}
+    bool operator()() const {
+      return self->closed || self->count < self->slots.size();
+    }
+    impl_t* self;
+  };
+
+  struct has_message {
+    explicit has_message(impl_t* self) : self(self) {}
+    bool operator()() const { return self->closed || self->count > 0; }
+    impl_t* self;
+  };
+
+  std::string name;
+  mutex_t lock;
+  condition_t not_full;
+  condition_t not_empty;
+  std::vector<std::string> slots;  // ring of `count' messages at `head'
+  size_t head;
+  size_t count;
+  bool closed;
+  int refs;
+};
+
+lua_channel::lua_channel(const std::string& name, size_t capacity)
+    : impl_(new impl_t(name, capacity)) {}
+
+lua_channel::~lua_channel() {
+  delete impl_;
+}
+
+lua_channel* lua_channel::open(const std::string& name, size_t capacity) {
+  scoped_lock guard(channels_lock);
+  lua_channel*& channel = channels[name];
+  if (!channel)
+    channel = new lua_channel(name, std::max<size_t>(capacity, 1));
+  ++channel->impl_->refs;
+  return channel;
+}
+
+void lua_channel::release() {
+  {
+    scoped_lock guard(channels_lock);
+    if (--impl_->refs > 0)
+      return;
+    channels.erase(impl_->name);
+  }
+  delete this;
+}
+
+bool lua_channel::send(std::string& message, int timeout_ms) {
+  scoped_lock guard(impl_->lock);
+  if (!wait_until(impl_->not_full, impl_->lock, timeout_ms,
+                  impl_t::has_room(impl_)) || impl_->closed)
+    return false;
+  size_t tail = (impl_->head + impl_->count) % impl_->slots.size();
+  impl_->slots[tail].swap(message);
+  ++impl_->count;
+  impl_->not_empty.notify_one();
+  return true;
+}
+
+bool lua_channel::receive(std::string& message, int timeout_ms) {
+  scoped_lock guard(impl_->lock);
+  if (!wait_until(impl_->not_empty, impl_->lock, timeout_ms,
+                  impl_t::has_message(impl_)) || impl_->count == 0)
+    return false;
+  impl_->slots[impl_->head].swap(message);
+  impl_->head = (impl_->head + 1) % impl_->slots.size();
+  --impl_->count;
+  impl_->not_full.notify_one();
+  return true;
+}
+
+bool lua_channel::closed() const {
+  scoped_lock guard(impl_->lock);
+  return impl_->closed;
+}
+
+void lua_channel::close() {
+  scoped_lock guard(impl_->lock);
+  impl_->closed = true;
+  impl_->not_full.notify_all();
+  impl_->not_empty.notify_all();
+}
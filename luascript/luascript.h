@@ -5,6 +5,8 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
 #include <sstream>
 #include <exception>
 
@@ -108,6 +110,82 @@ class lua {
 
   void exec(const std::string& script);
 
+  // Calls a global function. `out' gives the types of the results
+  // and receives them.
+  void call(const std::string& function, const args_t& in, args_t& out);
+
+  // Runs a chunk precompiled by luac or dump(). Bytecode isn't
+  // verified: only load what was built from trusted sources.
+  void load_bytecode(const void* code, size_t size);
+
+  // Returns the bytecode of a global Lua function.
+  std::string dump(const std::string& function);
+
+  // Returns the bytecode of a global Lua function as an image: its
+  // code is aligned, so that preload() uses it in place, shared by all
+  // the states, instead of copying it into each of them.
+  std::string dump_image(const std::string& function);
+
+  // Makes require(module) run a precompiled chunk or image. The bytecode
+  // is loaded by the first require and must outlive the state; images
+  // must be 4-byte aligned in memory to be used in place.
+  void preload(const std::string& module, const void* code, size_t size);
+
+  // Makes require(module) call `open', such as the luaopen_ function of a
+  // module translated to C by `luac -c module' and linked into the program.
+  void preload(const std::string& module, lua_CFunction open);
+
+  // Runs a full collection, shrinks stacks, the string table and the
+  // tables to their current contents and hands freed heap pages back to
+  // the OS. Tables that a pairs() loop is walking are skipped, so it is
+  // safe inside such a loop.
+  // Returns the number of Kbytes released by the interpreter.
+  int compact();
+
+  // Optimizes the bytecode of the scripts compiled from source from now
+  // on: exec(), loadstring(), require() of .lua files. Off by default.
+  void set_optimize(bool on);
+
+  // Gives the stack of this state, and of the tasks and coroutines started
+  // from now on, room for `slots' values and `calls' nested calls, so that
+  // deep call chains don't reallocate them. The collector and compact()
+  // don't shrink them below that either.
+  void set_stack_sizes(int slots, int calls);
+
+  // How often the stacks of the threads of this state were reallocated
+  // so far, and their largest sizes: what set_stack_sizes() should give.
+  lua_StackStats stack_stats();
+
+  // Compiles the hot loops of the scripts to machine code. Off by
+  // default, as each state then keeps its traces and 512 KB of executable
+  // memory; a no-op in builds without LUA_USE_JIT (x86-64 only).
+  void set_jit(bool on);
+
+  // Starts a script as a task: a coroutine which runs until it finishes
+  // or waits. Tasks wait on asynchronous I/O (aio.read, aio.write),
+  // which is done by a pool of threads, on timers (task.sleep) and on
+  // events (task.wait, task.signal), or yield to let others run
+  // (task.yield). Errors in a task are thrown from the call that
+  // resumed it.
+  void spawn(const std::string& script);
+
+  // Resumes tasks which are ready to run, waiting up to timeout_ms
+  // (-1 for no limit) for a timer or an I/O completion when none is.
+  // Returns the number of unfinished tasks.
+  int poll(int timeout_ms);
+
+  // Polls until no task can run any more: all have finished or wait
+  // for events only the host can signal.
+  void run();
+
+  // Wakes the tasks waiting for the event. Returns their number.
+  int signal(const std::string& event);
+
+  // Makes tasks yield after running about `instructions' VM
+  // instructions, so that a busy task can't starve the others.
+  // 0 (the default) lets tasks run until they wait or yield.
+  void set_timeslice(int instructions);
+
   template< class T >
   T get_variable(const std::string& name);
 
@@ -130,7 +208,135 @@ class lua {
   void operator=(const lua&);
 
  private:
+  struct io_request;
+  class io_pool;
+
+  struct task_t {
+    int ref;       // registry reference keeping the coroutine alive
+    bool waiting;  // waits for I/O, a timer or an event
+  };
+
+  typedef std::pair<lua_State*, int> resumption_t;  // task and its nargs
+
+  static int aio_read(lua_State* L);
+  static int aio_write(lua_State* L);
+  static int aio_submit(lua_State* L, io_request* r);
+  static int task_sleep(lua_State* L);
+  static int task_wait(lua_State* L);
+  static int task_signal(lua_State* L);
+  static int task_yield(lua_State* L);
+  static void preempt(lua_State* L, lua_Debug* ar);
+  static lua* self(lua_State* L);
+  void open_aio();
+  void open_tasks();
+  task_t* find_task(lua_State* L);
+  int wake(const std::string& event, lua_State* from, int first, int n);
+  void resume(lua_State* co, int nargs);
+
   lua_State* L_;
+  io_pool* io_;
+  int pending_;    // I/O requests submitted by tasks and not yet resumed
+  int timeslice_;
+  std::map<lua_State*, task_t> tasks_;
+  std::deque<resumption_t> ready_;
+  std::deque<io_request*> completed_;
+  std::multimap<long long, lua_State*> timers_;  // by wake-up time, ms
+  std::map<std::string, std::vector<lua_State*> > events_;
+};
+
+// Runs calls to script functions on a pool of threads, each with a state
+// of its own. Calls are queued per thread, and idle threads steal from
+// the queues of the busy ones.
+class lua_executor {
+ public:
+  enum pinning_t {
+    NO_PINNING,
+    PIN_TO_CORES  // thread i runs on core i (modulo the number of cores)
+  };
+
+  // Starts `threads' threads (0 for one per core) and runs `setup' in
+  // each of their states, typically to define the functions to call.
+  // Throws lua::exception if the setup script fails.
+  explicit lua_executor(const std::string& setup, int threads = 0,
+                        pinning_t pinning = NO_PINNING);
+
+  // Waits for the submitted calls to finish.
+  ~lua_executor();
+
+  class future {
+   public:
+    future();
+    future(const future& rhs);
+    ~future();
+    future& operator=(const future& rhs);
+
+    bool ready() const;
+
+    // Waits for the call and returns its results. Throws lua::exception
+    // if the call failed.
+    const lua::args_t& get() const;
+
+   private:
+    friend class lua_executor;
+    struct state_t;
+    explicit future(state_t* state);
+    state_t* state_;
+  };
+
+  // Queues a call of a global function; `out' gives the types of the
+  // results, as in lua::call.
+  future submit(const std::string& function, const lua::args_t& in,
+                const lua::args_t& out);
+
+  int threads() const;
+
+ private:
+  struct impl_t;
+  struct worker_t;
+
+  static void work(void* arg);
+
+  impl_t* impl_;
+
+  lua_executor(const lua_executor&);
+  void operator=(const lua_executor&);
+};
+
+// Bounded queue of messages between threads, with any number of senders
+// and receivers. Scripts reach channels by name through channel.open()
+// and send Lua values, which are serialized into the message buffers.
+// Buffers are swapped in and out of the queue rather than copied, and
+// keep their capacity for the next messages.
+class lua_channel {
+ public:
+  // Returns the channel with this name, creating it with room for
+  // `capacity' messages. Each open() needs a release().
+  static lua_channel* open(const std::string& name, size_t capacity);
+  void release();
+
+  // Waits up to timeout_ms (-1 for no limit) for room and queues the
+  // message, leaving a spare buffer in `message'. Returns false on
+  // timeout or when the channel is closed.
+  bool send(std::string& message, int timeout_ms = -1);
+
+  // Waits up to timeout_ms (-1 for no limit) for a message. Returns
+  // false on timeout, or when the channel is closed and empty.
+  bool receive(std::string& message, int timeout_ms = -1);
+
+  // Fails further sends and wakes everyone waiting.
+  void close();
+  bool closed() const;
+
+ private:
+  struct impl_t;
+
+  lua_channel(const std::string& name, size_t capacity);
+  ~lua_channel();
+
+  impl_t* impl_;
+
+  lua_channel(const lua_channel&);
+  void operator=(const lua_channel&);
 };
 
 template< class impl_t >
@@ -6,6 +6,7 @@
 #include <string>
 
 #include "luascript/luascript.h"
+#include "lib/lualibs.h"
 
 TEST(LuaScript, UrlParsingExample) {
   try {
@@ -69,6 +70,956 @@ TEST(LuaScript, RequirePackageBase64) {
   }
 }
 
+TEST(LuaScript, PrecompiledBytecode) {
+  try {
+    lua script;
+    for (const lualib_t* lib = lualibs; lib->name; ++lib)
+      script.preload(lib->name, lib->code, lib->size);
+    script.exec(
+      "require('base64') require('hex') require('percent') "
+      "require('smart_hex_dump') "
+      "a = base64.encode('test') .. ' ' .. percent.encode('a\\nb') .. ' ' .. "
+      "  tostring(type(smart_dump_fast) == 'function')");
+    EXPECT_EQ("dGVzdA== a%0Ab true",
+              script.get_variable<lua::string_arg_t>("a").value());
+
+    script.exec("function setup() answer = 6 * 7 end");
+    std::string code = script.dump("setup");
+    lua other;
+    other.load_bytecode(code.data(), code.size());
+    EXPECT_EQ(42, other.get_variable<lua::int_arg_t>("answer").value());
+    EXPECT_THROW(other.load_bytecode("answer = 0", 10), lua::exception);
+    EXPECT_THROW(other.dump("print"), lua::exception);
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// io.mmap is only there in builds with LUA_USE_MMAP and on Windows.
+bool has_mmap(lua& script) {
+  script.exec("mapped = io.mmap ~= nil");
+  return script.get_variable<lua::bool_arg_t>("mapped").value();
+}
+
+TEST(LuaScript, MappedBytecodeBundle) {
+  try {
+    lua script;
+    if (!has_mmap(script)) return;
+    script.exec(
+      "local src = {} "
+      "for i = 1, 200 do "
+      "  src[#src + 1] = 'function f' .. i .. '(x) "
+      "    local name = \\'f' .. i .. '\\' return name, x * ' .. i .. ' end' "
+      "end "
+      "local code = string.dump(assert(loadstring(table.concat(src, ' ')))) "
+      "local name = os.tmpname() "
+      "local f = io.open(name, 'wb') f:write(code) f:close() "
+      "local m = assert(io.mmap(name)) "
+      "assert(loadstring(m))() "
+      "local a, b = f123(2) "
+      "res = a .. ' ' .. b "
+      "truncated = select(2, loadstring(buffer.fromstring(code:sub(1, -10)))) "
+      "m:close() "
+      "os.remove(name)");
+    EXPECT_EQ("f123 246",
+              script.get_variable<lua::string_arg_t>("res").value());
+    EXPECT_EQ("(buffer): unexpected end in precompiled chunk",
+              script.get_variable<lua::string_arg_t>("truncated").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Heap of a state with all of lib/*.lua required, in bytes.
+int required_libs_bytes(lua& script) {
+  script.exec(
+    "require('base64') require('hex') require('percent') "
+    "require('smart_hex_dump') "
+    "collectgarbage() bytes = collectgarbage('count') * 1024");
+  return script.get_variable<lua::int_arg_t>("bytes").value();
+}
+
+TEST(LuaScript, SharedPrecompiledImages) {
+  try {
+    lua compiler;
+    std::vector<std::string> plain, misaligned;
+    for (const lualib_t* lib = lualibs; lib->name; ++lib) {
+      compiler.set_variable<lua::string_arg_t>(
+        "path", std::string("lib/") + lib->name + ".lua");
+      compiler.exec("chunk = assert(loadfile(path))");
+      plain.push_back(compiler.dump("chunk"));
+      misaligned.push_back(
+        " " + std::string(reinterpret_cast<const char*>(lib->code),
+                          lib->size));
+    }
+
+    lua first, second, copied, unshared;
+    size_t i = 0;
+    for (const lualib_t* lib = lualibs; lib->name; ++lib, ++i) {
+      first.preload(lib->name, lib->code, lib->size);
+      second.preload(lib->name, lib->code, lib->size);
+      copied.preload(lib->name, misaligned[i].data() + 1, lib->size);
+      unshared.preload(lib->name, plain[i].data(), plain[i].size());
+    }
+    int shared_bytes = required_libs_bytes(first);
+    EXPECT_EQ(shared_bytes, required_libs_bytes(second));
+    int unshared_bytes = required_libs_bytes(unshared);
+    EXPECT_LT(shared_bytes, unshared_bytes);
+    EXPECT_EQ(unshared_bytes, required_libs_bytes(copied));
+
+    const char* check =
+      "a = base64.encode('test') .. ' ' .. hex.dump('ab')";
+    first.exec(check);
+    copied.exec(check);
+    EXPECT_EQ("dGVzdA== 6162",
+              first.get_variable<lua::string_arg_t>("a").value());
+    EXPECT_EQ("dGVzdA== 6162",
+              copied.get_variable<lua::string_arg_t>("a").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, LexerScansBufferedAndStreamedSource) {
+  try {
+    lua script;
+    // The same chunk from one buffer and read a character at a time,
+    // which takes the lexer off its buffered paths.
+    script.exec(
+      "src = [==[ "
+      "local andx, _end, End, nil_ = 1, 2, 3, 4 -- a comment\r\n"
+      "local s = 'tab\\tquote\\'' .. \"\\65\\066\\0677\" .. [[\n"
+      "long]] --[[ long\n comment ]] .. [=[a]]b]=] "
+      "local n = 0x1F + 1e2 + .5 + 3. + 2E-1 "
+      "if not (andx ~= 1) and _end >= 2 and End <= 3 then "
+      "  return s .. '|' .. n .. '|' .. andx + _end + End + nil_ .. '|' .. "
+      "    select('#', ...) "
+      "end ]==] "
+      "local i = 0 "
+      "local function reader() i = i + 1 return src:sub(i, i) end "
+      "a = assert(loadstring(src))(1, 2) "
+      "b = assert(load(reader))(1, 2) "
+      "err = select(2, loadstring('x = \"abc\\ndef\"'))");
+    EXPECT_EQ("tab\tquote'ABC7longa]]b|134.7|10|2",
+              script.get_variable<lua::string_arg_t>("a").value());
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("a").value(),
+              script.get_variable<lua::string_arg_t>("b").value());
+    EXPECT_EQ("[string \"x = \"abc...\"]:1: unfinished string near '\"abc'",
+              script.get_variable<lua::string_arg_t>("err").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// The *Benchmark* tests only time a workload, against a baseline test
+// next to them where there is one, so they are disabled. Run them with
+//   ut --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*
+// and compare the times gtest prints.
+
+// Compiles a generated script of over 10 Mbytes a few times.
+TEST(LuaScript, DISABLED_ParseBenchmarkLargeScript) {
+  try {
+    std::string src = "local t = {}\n";
+    char part[512];
+    for (int i = 0; src.size() < 10 * 1024 * 1024; ++i) {
+      std::sprintf(part,
+        "-- function %d: sums its arguments with a few constants\n"
+        "t[%d] = function(a, b)\n"
+        "  local name, count = \"item %d\", %d.5\n"
+        "  if a ~= nil and b >= count or not a then\n"
+        "    return a + b * 2, name .. 'x'\n"
+        "  elseif a == b then return #name end\n"
+        "  for i = 1, 3 do count = count + i end\n"
+        "  return count\n"
+        "end\n", i, i + 1, i, i);
+      src += part;
+    }
+    src += "return #t\n";
+    lua script;
+    script.set_variable<lua::string_arg_t>("src", src);
+    script.exec(
+      "for i = 1, 3 do f = assert(loadstring(src)) end "
+      "n = f()");
+    EXPECT_LT(30000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// States started with all of lib/*.lua required, from the sources and
+// from the precompiled bytecode.
+const int kStartupStates = 300;
+const char* kRequireLibs =
+  "require('base64') require('hex') require('percent') "
+  "require('smart_hex_dump')";
+
+TEST(LuaScript, DISABLED_StartupBenchmarkSourceLibraries) {
+  try {
+    for (int i = 0; i < kStartupStates; ++i) {
+      lua script;
+      script.exec("package.path = './lib/?.lua'");
+      script.exec(kRequireLibs);
+    }
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_StartupBenchmarkPrecompiledLibraries) {
+  try {
+    for (int i = 0; i < kStartupStates; ++i) {
+      lua script;
+      for (const lualib_t* lib = lualibs; lib->name; ++lib)
+        script.preload(lib->name, lib->code, lib->size);
+      script.exec(kRequireLibs);
+    }
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, OptimizedBytecode) {
+  try {
+    const char* source =
+      "function filter(s) "
+      "  local limit, sep = 3, ',' "
+      "  local out, n = {}, 0 "
+      "  for w in string.gmatch(s, '[^' .. sep .. ']+') do "
+      "    if n == limit then break "
+      "    elseif w == 'skip' then "
+      "    else n = n + 1 out[n] = w end "
+      "  end "
+      "  if n > 0 then return table.concat(out, sep) else return nil end "
+      "end "
+      "ops = 0 "
+      "debug.sethook(function() ops = ops + 1 end, '', 1) "
+      "filter('a,skip,b,c,d') filter('skip') "
+      "debug.sethook() "
+      "res = filter('a,skip,b,c,d') .. ' ' .. tostring(filter('skip')) "
+      "err = select(2, pcall(function() local x, y = 5 return x + y end))";
+    lua plain, optimized;
+    optimized.set_optimize(true);
+    plain.exec(source);
+    optimized.exec(source);
+    EXPECT_EQ("a,b,c nil",
+              optimized.get_variable<lua::string_arg_t>("res").value());
+    EXPECT_LT(optimized.get_variable<lua::int_arg_t>("ops").value(),
+              plain.get_variable<lua::int_arg_t>("ops").value());
+    EXPECT_EQ(plain.get_variable<lua::string_arg_t>("err").value(),
+              optimized.get_variable<lua::string_arg_t>("err").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// The filters of lib/*.lua compiled as is and optimized. Besides the
+// time, each test records the opcodes that one round of the filters
+// executes (the `opcodes' property of --gtest_output=xml).
+const char* kFilterWorkload =
+  "package.path = package.path .. ';./lib/?.lua' "
+  "require('base64') require('hex') require('percent') "
+  "require('smart_hex_dump') "
+  "local s = {} for i = 0, 255 do s[#s + 1] = string.char(i) end "
+  "s = table.concat(s) .. 'host=a.b user=test\\1\\2 live' "
+  "local function round() "
+  "  return #base64.decode(base64.encode(s)) + #hex.smart_dump(s) + "
+  "    #hex.pack(hex.dump(s)) + #percent.decode(percent.encode(s)) + "
+  "    #smart_dump_fast(s) "
+  "end "
+  "ops = 0 "
+  "debug.sethook(function() ops = ops + 1 end, '', 1) "
+  "round() "
+  "debug.sethook() "
+  "n = 0 "
+  "for i = 1, 100 do n = n + round() end";
+
+TEST(LuaScript, DISABLED_FilterBenchmarkPlainBytecode) {
+  try {
+    lua script;
+    script.exec(kFilterWorkload);
+    EXPECT_EQ(148300, script.get_variable<lua::int_arg_t>("n").value());
+    RecordProperty("opcodes",
+                   script.get_variable<lua::int_arg_t>("ops").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_FilterBenchmarkOptimizedBytecode) {
+  try {
+    lua script;
+    script.set_optimize(true);
+    script.exec(kFilterWorkload);
+    EXPECT_EQ(148300, script.get_variable<lua::int_arg_t>("n").value());
+    RecordProperty("opcodes",
+                   script.get_variable<lua::int_arg_t>("ops").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Loops compiled to machine code must give the results of the
+// interpreter, also when their guards fail half way.
+const char* kLoopScript =
+  "local out = {} "
+  "local s = 0 "
+  "for i = 1, 1000 do s = s + i % 7 * 2 - i / 4 end "
+  "out[#out + 1] = s "
+  "local t = {} for i = 1, 300 do t[i] = i end "
+  "for i = 300, 1, -3 do t[i] = t[i] * 2 + #t end "
+  "out[#out + 1] = t[300] + t[299] "
+  "local b = buffer.new('uint8', 256) "
+  "for r = 1, 20 do for i = 1, #b do b[i] = b[i] + i * 3 end end "
+  "out[#out + 1] = b[1] + b[100] + b[256] "
+  "local x, mixed = 0, {} "
+  "for i = 1, 400 do "
+  "  if i == 200 then x = 'str' end "
+  "  if type(x) == 'number' then x = x + 1 else mixed[#mixed + 1] = i end "
+  "  if i == 300 then x = 0 end "
+  "end "
+  "out[#out + 1] = x .. ':' .. #mixed "
+  "local n, c, names = 0, 0, {'a', 'b', 'c'} "
+  "while n < 1000 do "
+  "  n = n + 1 "
+  "  if names[n % 3 + 1] == 'b' then c = c + 1 elseif n % 5 == 0 then "
+  "    c = c - 1 end "
+  "  names[n % 3 + 1] = (n % 100 == 0) and 'b' or names[n % 3 + 1] "
+  "end "
+  "out[#out + 1] = c "
+  "local nan = 0 / 0 "
+  "for i = 1, 100 do if nan == nan or nan < i then c = 0 end end "
+  "for i = 0.5, 100, 0.25 do c = c + i end "
+  "out[#out + 1] = c "
+  "total = 0 "
+  "for i = 1, 500 do total = total + i end "
+  "res = table.concat(out, ' ') .. ' ' .. total";
+
+TEST(LuaScript, JitMatchesInterpreter) {
+  try {
+    lua interpreted, compiled;
+    interpreted.set_jit(false);
+    compiled.set_jit(true);
+    interpreted.exec(kLoopScript);
+    compiled.exec(kLoopScript);
+    EXPECT_EQ(interpreted.get_variable<lua::string_arg_t>("res").value(),
+              compiled.get_variable<lua::string_arg_t>("res").value());
+    EXPECT_EQ("-119119 1199 172 100:101 799 20848.75 125250",
+              compiled.get_variable<lua::string_arg_t>("res").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Numeric and byte loops interpreted and compiled.
+const char* kNumericLoops =
+  "local b = buffer.new('uint8', 4096) "
+  "for r = 1, 300 do "
+  "  for i = 1, #b do b[i] = (b[i] + i * 7) % 256 end "
+  "end "
+  "local t = {} for i = 1, 4096 do t[i] = b[i] end "
+  "sum = 0 "
+  "for r = 1, 300 do "
+  "  for i = 1, #t do if t[i] < 128 then sum = sum + t[i] end end "
+  "end";
+
+TEST(LuaScript, DISABLED_LoopBenchmarkInterpreted) {
+  try {
+    lua script;
+    script.set_jit(false);
+    script.exec(kNumericLoops);
+    EXPECT_EQ(38092800, script.get_variable<lua::int_arg_t>("sum").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_LoopBenchmarkCompiled) {
+  try {
+    lua script;
+    script.set_jit(true);
+    script.exec(kNumericLoops);
+    EXPECT_EQ(38092800, script.get_variable<lua::int_arg_t>("sum").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+#if !defined(_WIN32)
+#include <signal.h>
+#include <sys/time.h>
+
+// A hook set by a signal handler, as lua.c does on Ctrl-C, stops a loop
+// running as machine code.
+static lua_State* alarmed_state;
+
+static void stop_loop(lua_State* L, lua_Debug*) {
+  lua_sethook(L, NULL, 0, 0);
+  luaL_error(L, "interrupted");
+}
+
+static void on_alarm(int) {
+  lua_sethook(alarmed_state, stop_loop,
+              LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+}
+
+static int open_alarm(lua_State* L) {
+  struct itimerval timer = { { 0, 0 }, { 0, 50000 } };
+  alarmed_state = L;
+  signal(SIGALRM, on_alarm);
+  setitimer(ITIMER_REAL, &timer, NULL);
+  return 0;
+}
+
+TEST(LuaScript, JitLoopStopsOnHook) {
+  lua script;
+  script.set_jit(true);
+  script.preload("alarm", open_alarm);
+  std::string error;
+  try {
+    script.exec("require('alarm') n = 0 while n < 1e9 do n = n + 1 end");
+  } catch(const lua::exception& e) {
+    error = e.error();
+  }
+  signal(SIGALRM, SIG_DFL);
+  EXPECT_NE(std::string::npos, error.find("interrupted")) << error;
+  EXPECT_GT(1000000000, script.get_variable<lua::int_arg_t>("n").value());
+}
+#endif
+
+// luascript/native_test.lua, translated to C by luac -c at build time.
+extern "C" int luaopen_native_test(lua_State* L);
+
+// Runs the functions of the module translated to C, of its source and of
+// the translated module under a count hook and in a coroutine, which make
+// it interpreted.
+TEST(LuaScript, NativeModule) {
+  try {
+    lua script;
+    script.preload("native_test", luaopen_native_test);
+    script.exec(
+      "local native = require('native_test') "
+      "local source = dofile('luascript/native_test.lua') "
+      "local function run(m) "
+      "  local r = {} "
+      "  local function add(...) "
+      "    for i = 1, select('#', ...) do "
+      "      r[#r + 1] = tostring((select(i, ...))) "
+      "    end "
+      "  end "
+      "  add(m.fib(20), m.checksum(string.rep('native', 50))) "
+      "  local n, t = m.fields('a=1 b=x c=3') add(n, t.a, t.b, t.c) "
+      "  local n, len, first, last, l = m.list(7, nil, 9) "
+      "  add(n, first, last, #l) "
+      "  local c = m.counter(2) c() c(5) add(c()) "
+      "  add(m.tail(10000), m.depth(1000)) "
+      "  add(m.compare(1, 2)) add(m.compare('b', 'a')) "
+      "  add(m.concat('ab', 3), m.meta()) "
+      "  local ok, err = pcall(m.bad, 1) "
+      "  add(ok, (err:gsub('^.-:(%d+):', '%1:'))) "
+      "  local co = coroutine.wrap(m.produce) "
+      "  add(co(2), co(), co()) "
+      "  return table.concat(r, ' ') "
+      "end "
+      "compiled, interpreted = run(native), run(source) "
+      "resumed = coroutine.wrap(run)(native) "
+      "debug.sethook(function() end, '', 100) "
+      "hooked = run(native) "
+      "debug.sethook() "
+      "loaded = native.loaded");
+    std::string compiled =
+      script.get_variable<lua::string_arg_t>("compiled").value();
+    EXPECT_EQ("6765 20296 106.25 3 1 x 3 3 7 9 6 9 done 1000 "
+              "false true true true false 2 false true false false false "
+              "a ab-3-2 added name! 0 "
+              "false 73: attempt to index local 'x' (a number value) "
+              "1 2 produced",
+              compiled);
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("interpreted").value(),
+              compiled);
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("hooked").value(),
+              compiled);
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("resumed").value(),
+              compiled);
+    EXPECT_EQ("native_test",
+              script.get_variable<lua::string_arg_t>("loaded").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// An argument more than the light entries take has the functions called
+// with a frame; the results must not change.
+TEST(LuaScript, LightFunctions) {
+  try {
+    lua script;
+    script.exec(
+      "local function run(...) "
+      "  local r, s = {}, string.rep('x', 30) "
+      "  local function add(...) "
+      "    for i = 1, select('#', ...) do "
+      "      r[#r + 1] = tostring((select(i, ...))) "
+      "    end "
+      "  end "
+      "  add(string.byte('abc', nil, nil, ...), ('abc'):byte(-1, nil, ...)) "
+      "  add(string.byte('abc', 2, 3, ...), string.byte('abc', 5, nil, ...)) "
+      "  add(select('#', string.byte(s, 1, -1, ...))) "
+      "  add(string.sub('hello', 2, nil, ...), ('hello'):sub(-3, -2, ...)) "
+      "  add(string.sub('hello', 10, nil, ...), string.sub(12345, 2, 3, ...)) "
+      "  add(string.len('abc', ...), string.len(123, ...)) "
+      "  add(math.floor(-2.5, ...), math.floor('3.7', ...)) "
+      "  local x = {...} "
+      "  local function check(f) "
+      "    return (select(2, pcall(f)):gsub('^.-:%d+: ', '')) "
+      "  end "
+      "  add(check(function() "
+      "    return string.byte({}, nil, nil, unpack(x)) end)) "
+      "  add(check(function() return math.floor(nil, unpack(x)) end)) "
+      "  return table.concat(r, ' ') "
+      "end "
+      "light, framed = run(), run(false) "
+      "debug.sethook(function() end, 'cr') "
+      "hooked = run() "
+      "debug.sethook() "
+      "chars = string.char(72) .. string.char() .. ' ' .. "
+      "  select(2, pcall(function() return string.char(256) end))");
+    std::string light = script.get_variable<lua::string_arg_t>("light").value();
+    EXPECT_EQ("97 99 98 30 ello ll  23 3 3 -3 3 "
+              "bad argument #1 to 'byte' (string expected, got table) "
+              "bad argument #1 to 'floor' (number expected, got nil)", light);
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("framed").value(), light);
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("hooked").value(), light);
+    EXPECT_EQ("H [string \"local function run(...)   local r, s = {}, "
+              "...\"]:1: bad argument #1 to 'char' (invalid value)",
+              script.get_variable<lua::string_arg_t>("chars").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Light entries that allocate may run a collection, which must not
+// shrink the stack under the big frame of their caller.
+TEST(LuaScript, LightFunctionsAllocateInBigFrames) {
+  try {
+    lua script;
+    script.exec(
+      "collectgarbage('setpause', 0) "
+      "local src = {'local sub, s, n = string.sub, string.rep(\"ab\", 64), 0', "
+      "  'for i = 1, 20000 do n = n + #sub(s, i % 100, i % 100 + 5) end', "
+      "  'do'} "
+      "for i = 1, 180 do src[#src + 1] = 'local v' .. i .. ' = ' .. i end "
+      "src[#src + 1] = 'n = n + v180 end return n' "
+      "local f = assert(loadstring(table.concat(src, ' '))) "
+      "local function deep(n) "
+      "  if n == 0 then return f() end "
+      "  local r = deep(n - 1) "
+      "  return r "
+      "end "
+      "n = f() + coroutine.wrap(function() deep(1000) return f() end)() "
+      "collectgarbage('setpause', 200)");
+    EXPECT_EQ(239960, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// string.byte and friends called through their light entries, and with a
+// frame because of the extra argument.
+const char* kCallWorkload =
+  "local byte, sub, len, floor = string.byte, string.sub, string.len, "
+  "  math.floor "
+  "local s = string.rep('light', 20) "
+  "local function run(...) "
+  "  local n = 0 "
+  "  for r = 1, 20000 do "
+  "    for i = 1, #s do "
+  "      n = n + byte(s, i, nil, ...) + floor(i / 3, ...) + "
+  "        len(sub(s, i, i + 2, ...), ...) "
+  "    end "
+  "  end "
+  "  return n "
+  "end "
+  "n = run(unpack(extra or {}))";
+
+TEST(LuaScript, DISABLED_CallBenchmarkLightFunctions) {
+  try {
+    lua script;
+    script.exec(kCallWorkload);
+    EXPECT_EQ(253340000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_CallBenchmarkFramedFunctions) {
+  try {
+    lua script;
+    script.exec("extra = {false}");
+    script.exec(kCallWorkload);
+    EXPECT_EQ(253340000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Calls the compiler takes for builtins: in place, and called when the
+// arguments or the functions are not the usual ones.
+TEST(LuaScript, BuiltinCalls) {
+  try {
+    lua script;
+    script.exec(
+      "local function run() "
+      "  local s, t = 'hello', {sub = function() return 'own' end} "
+      "  local r = {} "
+      "  local function add(...) "
+      "    for i = 1, select('#', ...) do "
+      "      r[#r + 1] = tostring((select(i, ...))) "
+      "    end "
+      "  end "
+      "  local x = math.floor(-2.5) "
+      "  add(x, math.floor('3.7'), string.byte(s), string.byte(s, -1)) "
+      "  add(s:byte(0), s:byte(9), s:sub(2), string.sub(s, -3, -2)) "
+      "  add(string.sub(s, 0, 100), s:sub(4, 2), string.sub(12345, 2, 3)) "
+      "  add(string.char(72), string.len(s), s:len(), string.len(123)) "
+      "  add(t:sub(1), (select(2, pcall(function() "
+      "    return math.floor({}) end)):gsub('^.-:%d+: ', ''))) "
+      "  local floor = math.floor "
+      "  math.floor = function() return 'replaced' end "
+      "  add(math.floor(1)) "
+      "  math.floor = floor "
+      "  return table.concat(r, ' ') "
+      "end "
+      "inplace = run() "
+      "debug.sethook(function() end, 'c') "
+      "hooked = run() "
+      "debug.sethook()");
+    std::string inplace =
+      script.get_variable<lua::string_arg_t>("inplace").value();
+    EXPECT_EQ("-3 3 104 111 nil nil ello ll hello  23 H 5 5 3 own "
+              "bad argument #1 to 'floor' (number expected, got table) "
+              "replaced", inplace);
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("hooked").value(),
+              inplace);
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// The loop of kCallWorkload with string.byte and friends run in place, and
+// called through their light entries.
+const char* kBuiltinWorkload =
+  "local s = string.rep('light', 20) "
+  "local function inplace() "
+  "  local n = 0 "
+  "  for r = 1, 20000 do "
+  "    for i = 1, #s do "
+  "      n = n + string.byte(s, i) + math.floor(i / 3) + "
+  "        string.len(string.sub(s, i, i + 2)) "
+  "    end "
+  "  end "
+  "  return n "
+  "end "
+  "local function called(...) "
+  "  local n = 0 "
+  "  for r = 1, 20000 do "
+  "    for i = 1, #s do "
+  "      n = n + string.byte(s, i, ...) + math.floor(i / 3, ...) + "
+  "        string.len(string.sub(s, i, i + 2, ...), ...) "
+  "    end "
+  "  end "
+  "  return n "
+  "end "
+  "n = (called_builtins and called or inplace)()";
+
+TEST(LuaScript, DISABLED_BuiltinBenchmarkInPlace) {
+  try {
+    lua script;
+    script.exec(kBuiltinWorkload);
+    EXPECT_EQ(253340000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_BuiltinBenchmarkCalled) {
+  try {
+    lua script;
+    script.exec("called_builtins = true");
+    script.exec(kBuiltinWorkload);
+    EXPECT_EQ(253340000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// A JSON-like document nested kDepth levels deep, walked recursively by a
+// new coroutine each time.
+const int kDepth = 400;
+const char* kDeepWorkload =
+  "local function build(depth) "
+  "  local node = {name = 'leaf', items = {1, 2, 3}} "
+  "  for i = 1, depth do "
+  "    local tag = {name = 'tag', items = {i}} "
+  "    node = {name = 'node' .. i, items = {i, node, tag}} "
+  "  end "
+  "  return node "
+  "end "
+  "local function walk(node) "
+  "  local sum = #node.name "
+  "  for _, item in ipairs(node.items) do "
+  "    if type(item) == 'table' then sum = sum + walk(item) "
+  "    else sum = sum + item end "
+  "  end "
+  "  return sum "
+  "end "
+  "local doc = build(depth) "
+  "n = 0 "
+  "for i = 1, runs do "
+  "  n = n + coroutine.wrap(function() return walk(doc) end)() "
+  "end";
+
+TEST(LuaScript, StackSizes) {
+  try {
+    lua grown, presized;
+    presized.set_stack_sizes(20 * kDepth, 2 * kDepth);
+    lua_StackStats before = presized.stack_stats();
+    EXPECT_LE(2 * kDepth, before.maxci);
+    const char* settings = "depth, runs = 400, 3";
+    grown.exec(settings);
+    grown.exec(kDeepWorkload);
+    grown.exec("collectgarbage()");
+    presized.exec(settings);
+    presized.exec(kDeepWorkload);
+    presized.exec("collectgarbage()");
+    presized.compact();
+    EXPECT_EQ(grown.get_variable<lua::int_arg_t>("n").value(),
+              presized.get_variable<lua::int_arg_t>("n").value());
+    lua_StackStats stats = grown.stack_stats();
+    EXPECT_LT(3u, stats.stackreallocs);
+    EXPECT_LT(3u, stats.cireallocs);
+    EXPECT_LT(0u, stats.fixups);
+    EXPECT_LE(kDepth, stats.maxci);
+    stats = presized.stack_stats();
+    EXPECT_EQ(before.stackreallocs, stats.stackreallocs);
+    EXPECT_EQ(before.cireallocs, stats.cireallocs);
+    EXPECT_EQ(before.maxstack, stats.maxstack);
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_DeepCallBenchmarkGrownStacks) {
+  try {
+    lua script;
+    script.exec("depth, runs = 400, 2000");
+    script.exec(kDeepWorkload);
+    EXPECT_EQ(328604000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_DeepCallBenchmarkPresizedStacks) {
+  try {
+    lua script;
+    script.set_stack_sizes(20 * kDepth, 2 * kDepth);
+    script.exec("depth, runs = 400, 2000");
+    script.exec(kDeepWorkload);
+    EXPECT_EQ(328604000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, ReturnsAndTailCalls) {
+  try {
+    lua script;
+    script.exec(
+      "local function run() "
+      "  local r = {} "
+      "  local function add(...) "
+      "    for i = 1, select('#', ...) do "
+      "      r[#r + 1] = tostring((select(i, ...))) "
+      "    end "
+      "  end "
+      "  local function none() end "
+      "  local function one(x) return x end "
+      "  local a, b = one(1, 2) "
+      "  local c, d = none() "
+      "  add(a, b, c, d, (none()), one(), select('#', none()), "
+      "    select('#', one()), #{one(1), one(2)}, #{none(), none()}) "
+      "  local function count(n, acc) "
+      "    if n == 0 then return acc end "
+      "    return count(n - 1, acc + 1, 'extra') "
+      "  end "
+      "  local function cell(n) "
+      "    local v = n "
+      "    if n > 0 then return cell(n - 1) end "
+      "    return function() return v end "
+      "  end "
+      "  local function varargs(...) return select('#', ...) end "
+      "  local function pass(...) return varargs(...) end "
+      "  add(count(50000, 0), cell(3)(), pass(1, nil, 3), pass()) "
+      "  local function fail() error('failed') end "
+      "  local function tail() return fail() end "
+      "  local trace = select(2, xpcall(tail, debug.traceback)) "
+      "  add(trace:find('(tail call)', 1, true) ~= nil) "
+      "  local co = coroutine.wrap(function(x) "
+      "    local function yield(v) return coroutine.yield(v) end "
+      "    return one(yield(yield(x) + 1)) "
+      "  end) "
+      "  add(co(1), co(10), co(20)) "
+      "  return table.concat(r, ' ') "
+      "end "
+      "plain = run() "
+      "debug.sethook(function() end, 'cr') "
+      "hooked = run() "
+      "debug.sethook()");
+    std::string plain = script.get_variable<lua::string_arg_t>("plain").value();
+    EXPECT_EQ("1 nil nil nil nil nil 0 1 2 0 50000 0 3 0 true 1 11 20", plain);
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("hooked").value(), plain);
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Recursive fib, method calls and tail calls. With `vararg_calls' set the
+// functions take varargs, which sends their calls through luaD_precall.
+const char* kLuaCallWorkload =
+  "local src = [[ "
+  "  local fib "
+  "  fib = function(x ARGS) "
+  "    if x < 2 then return x end "
+  "    return fib(x - 1) + fib(x - 2) "
+  "  end "
+  "  local Counter = {} "
+  "  Counter.__index = Counter "
+  "  function Counter.get(self ARGS) return self.n end "
+  "  function Counter.tick(self ARGS) end "
+  "  function Counter.add(self, d ARGS) self.n = self.n + d:get() end "
+  "  local function walk(c, d, k ARGS) "
+  "    if k == 0 then return c:get() end "
+  "    c:tick() "
+  "    c:add(d) "
+  "    return walk(c, d, k - 1) "
+  "  end "
+  "  local c = setmetatable({n = 0}, Counter) "
+  "  local d = setmetatable({n = 2}, Counter) "
+  "  local n = fib(27) "
+  "  for r = 1, 1000 do n = n + walk(c, d, 1000) end "
+  "  return n "
+  "]] "
+  "src = src:gsub('ARGS', vararg_calls and ', ...' or '') "
+  "n = assert(loadstring(src))()";
+
+TEST(LuaScript, DISABLED_CallBenchmarkLuaFunctions) {
+  try {
+    lua script;
+    script.exec(kLuaCallWorkload);
+    EXPECT_EQ(1001196418, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_CallBenchmarkVarargFunctions) {
+  try {
+    lua script;
+    script.exec("vararg_calls = true");
+    script.exec(kLuaCallWorkload);
+    EXPECT_EQ(1001196418, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, VarargsAndSelect) {
+  try {
+    lua script;
+    script.exec(
+      "local function run() "
+      "  local r = {} "
+      "  local function add(...) "
+      "    for i = 1, select('#', ...) do "
+      "      r[#r + 1] = tostring((select(i, ...))) "
+      "    end "
+      "  end "
+      "  local function count(...) return select('#', ...) end "
+      "  local function from(n, ...) return select(n, ...) end "
+      "  local function check(...) "
+      "    return (select(2, pcall(from, ...)):gsub('^.-:%d+: ', '')) "
+      "  end "
+      "  add(count(), count(nil, nil), from(2, 'a', 'b', 'c')) "
+      "  add(from(-1, 'a', 'b'), from(3, 'a'), from('1', 'a')) "
+      "  add(check(0), check({})) "
+      "  local function unused(a, ...) return a end "
+      "  add(unused(1, 2, 3), arg) "
+      "  local select = select "
+      "  add(count(1, 2), select('#', 1, 2, 3)) "
+      "  return table.concat(r, ' ') "
+      "end "
+      "plain = run() "
+      "debug.sethook(function() end, 'c') "
+      "hooked = run() "
+      "debug.sethook() "
+      "local real = select "
+      "select = function(...) return 'replaced' end "
+      "local function count(...) return select('#', ...) end "
+      "replaced = count(1, 2) "
+      "select = real");
+    std::string plain = script.get_variable<lua::string_arg_t>("plain").value();
+    EXPECT_EQ("0 2 b c b nil a "
+              "bad argument #1 to 'select' (index out of range) "
+              "bad argument #1 to 'select' (number expected, got table) "
+              "1 nil 2 3", plain);
+    EXPECT_EQ(script.get_variable<lua::string_arg_t>("hooked").value(), plain);
+    EXPECT_EQ("replaced",
+              script.get_variable<lua::string_arg_t>("replaced").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Logging helpers that count and sum their varargs with select, which
+// reads them in place, and with a call of select through a local.
+const char* kVarargWorkload =
+  "local src = [[ "
+  "  local select_ = select "
+  "  local function count(...) return SELECT('#', ...) end "
+  "  local function sum(...) "
+  "    local s = 0 "
+  "    for i = 1, SELECT('#', ...) do s = s + SELECT(i, ...) end "
+  "    return s "
+  "  end "
+  "  local function log(level, ...) return level + count(...) + sum(...) end "
+  "  local function info(...) return log(1, ...) end "
+  "  local n = 0 "
+  "  for r = 1, 300000 do n = n + info(r % 7, 2, 3, 4) end "
+  "  return n "
+  "]] "
+  "src = src:gsub('SELECT', called_select and 'select_' or 'select') "
+  "n = assert(loadstring(src))()";
+
+TEST(LuaScript, DISABLED_VarargBenchmarkInPlace) {
+  try {
+    lua script;
+    script.exec(kVarargWorkload);
+    EXPECT_EQ(5099998, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_VarargBenchmarkCalled) {
+  try {
+    lua script;
+    script.exec("called_select = true");
+    script.exec(kVarargWorkload);
+    EXPECT_EQ(5099998, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
 class file_exists_func_t {
  public:
   static const lua::args_t* in_args() {
@@ -130,7 +1081,7 @@ class return_list_func_t {
   static const std::string ns() { return "test"; }
   static const std::string name() { return "return_list"; }
 
-  static void calc(const lua::args_t& in, lua::args_t& out) {
+  static void calc(const lua::args_t&, lua::args_t& out) {
     dynamic_cast<lua::bool_arg_t&>(*out[0]).value() = true;
     dynamic_cast<lua::int_arg_t&>(*out[1]).value() = 100;
     dynamic_cast<lua::string_arg_t&>(*out[2]).value() = "test";
@@ -198,3 +1149,661 @@ TEST(LuaScript, MultiReturnEqualFunction) {
     FAIL() << "error: " << e.error() << ", line " << e.line();
   }
 }
+
+TEST(LuaScript, CompactReleasesPeakMemory) {
+  try {
+    lua script;
+    script.exec(
+      "local function deep(n) if n > 0 then return 1 + deep(n - 1) end "
+      "return 0 end "
+      "t = {} for i = 1, 100000 do t[i] = tostring(i) end "
+      "deep(5000) "
+      "for i = 1, 100000 do t[i] = nil end t.x = 'kept' "
+      "collectgarbage('collect') before = collectgarbage('count')");
+    EXPECT_LT(0, script.compact());
+    script.exec("shrunk = collectgarbage('count') < before; x = t.x");
+    EXPECT_EQ(true, script.get_variable<lua::bool_arg_t>("shrunk").value());
+    EXPECT_EQ("kept", script.get_variable<lua::string_arg_t>("x").value());
+    script.exec("t[1] = 'a'; t[2] = 'b'; s = t[1] .. t[2] .. #t");
+    EXPECT_EQ("ab2", script.get_variable<lua::string_arg_t>("s").value());
+    script.exec(
+      "h = {} for i = 1, 200000 do h['k' .. i] = i end "
+      "for i = 1, 200000 do h['k' .. i] = nil end "
+      "collectgarbage('collect') before = collectgarbage('count')");
+    script.compact();
+    script.exec("shrunk = collectgarbage('count') < before / 2; "
+                "h.y = 'y'; y = h.y .. tostring(next(h))");
+    EXPECT_EQ(true, script.get_variable<lua::bool_arg_t>("shrunk").value());
+    EXPECT_EQ("yy", script.get_variable<lua::string_arg_t>("y").value());
+    script.exec(
+      "local u, seen = {}, 0 "
+      "for i = 1, 1000 do u[i] = i; u['k' .. i] = i end "
+      "for k in pairs(u) do "
+      "  seen = seen + 1 "
+      "  u[k] = nil "
+      "  if seen % 100 == 0 then collectgarbage('compact') end "
+      "end "
+      "walked = seen .. ' ' .. tostring(next(u)) .. ' ' .. "
+      "  tostring(pcall(next, {a = 1}, 7))");
+    EXPECT_EQ("2000 nil false",
+              script.get_variable<lua::string_arg_t>("walked").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, WeakKeyedCacheIsEphemeron) {
+  try {
+    lua script;
+    script.exec(
+      "cache = setmetatable({}, {__mode = 'k'}) "
+      "keep = {} cache[keep] = {} "
+      "do local k = {} cache[k] = {ref = k} end "
+      "collectgarbage() collectgarbage() "
+      "n = 0 for k, v in pairs(cache) do n = n + 1 end");
+    EXPECT_EQ(1, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// A table that stops being weak in the middle of a cycle keeps the
+// entries it still had, whenever the cycle is interrupted.
+TEST(LuaScript, WeakTableMadeStrongDuringCycle) {
+  try {
+    lua script;
+    script.exec(
+      "local function count(t) "
+      "  local n = 0 for k in pairs(t) do n = n + 1 end return n "
+      "end "
+      "lost = 0 "
+      "for _, mode in ipairs({'k', 'v', 'kv'}) do "
+      "  for steps = 0, 40 do "
+      "    collectgarbage() collectgarbage('stop') "
+      "    local t = setmetatable({}, {__mode = mode}) "
+      "    for i = 1, 1000 do t[{}] = {} end "
+      "    for i = 1, steps do collectgarbage('step', 1) end "
+      "    local before = count(t) "
+      "    setmetatable(t, nil) "
+      "    repeat until collectgarbage('step', 1) "
+      "    collectgarbage('restart') "
+      "    lost = lost + before - count(t) "
+      "  end "
+      "end");
+    EXPECT_EQ(0, script.get_variable<lua::int_arg_t>("lost").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// A weak-keyed cache of parsed URLs, half of whose keys stay alive, filled
+// with `entries' entries and then updated while an incremental
+// cycle runs.
+const char* kWeakCacheWorkload =
+  "cache = setmetatable({}, {__mode = 'k'}) keys = {} "
+  "for i = 1, entries do "
+  "  local k = {i} cache[k] = {url = 'host=' .. i} "
+  "  if i % 2 == 0 then keys[#keys + 1] = k end "
+  "end ";
+
+TEST(LuaScript, WeakCacheUpdatedDuringIncrementalCycle) {
+  try {
+    lua script;
+    script.exec("entries = 200000");
+    script.exec(kWeakCacheWorkload);
+    script.exec(
+      "collectgarbage('step', 1) "
+      "repeat "
+      "  local k = {} keys[#keys + 1] = k cache[k] = {url = 'new'} "
+      "until collectgarbage('step', 64) "
+      "collectgarbage() "
+      "n = 0 for k, v in pairs(cache) do "
+      "  if v.url then n = n + 1 end "
+      "end "
+      "live = (n == #keys)");
+    EXPECT_EQ(true, script.get_variable<lua::bool_arg_t>("live").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Full collections of the weak cache with 1M entries (the test above
+// keeps to 200K to stay fast); their atomic phase clears the dead entries.
+TEST(LuaScript, DISABLED_WeakCacheBenchmarkMillionEntries) {
+  try {
+    lua script;
+    script.exec("entries = 1000000");
+    script.exec(kWeakCacheWorkload);
+    script.exec(
+      "for r = 1, 3 do "
+      "  for i = 1, 1000 do cache[{}] = {url = 'dead'} end "
+      "  collectgarbage() "
+      "end "
+      "n = 0 for k in pairs(cache) do n = n + 1 end");
+    EXPECT_EQ(500000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, TypedArrayBuffers) {
+  try {
+    lua script;
+    script.exec(
+      "b = buffer.fromstring('URL:host') "
+      "b[1] = b[1] + 32; b[2] = 258 "
+      "s = b:slice(5, -1) s[1] = 72 "
+      "bytes = b:tostring() .. #b .. #s .. s:type() "
+      "i = buffer.new('int32', {1, -2, 3}) i[2] = i[2] * 2^31 "
+      "f = buffer.new('float64', 2) f[2] = 0.5 "
+      "nums = i[1] .. i[3] .. f[1] .. f[2] .. tostring(i[4]) "
+      "ok, err = pcall(function() f[3] = 1 end) "
+      "u = buffer.new('uint8', 4) u:fill(7, 100) u:fill(9, 3, 2) "
+      "u:fill(5, 4, 100) "
+      "ranges = u:tostring(5) .. '|' .. u:slice(100):tostring() .. '|' .. "
+      "  u[1] .. u[4]");
+    EXPECT_EQ(std::string("u\x02L:Host84uint8"),
+              script.get_variable<lua::string_arg_t>("bytes").value());
+    EXPECT_EQ("1300.5nil",
+              script.get_variable<lua::string_arg_t>("nums").value());
+    EXPECT_EQ(false, script.get_variable<lua::bool_arg_t>("ok").value());
+    EXPECT_EQ("||05", script.get_variable<lua::string_arg_t>("ranges").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, PatternFastPathsMatchScalarResults) {
+  try {
+    lua script;
+    script.exec(
+      "local s = string.rep('tattered text; ', 200) .. 'host=a.b.c; test_x' "
+      "local a, b = s:find('test_x', 1, true) "
+      "local long = string.rep('x', 300) .. '\\1\\2' .. string.rep('y', 300) "
+      "local c = long:find('%c+') "
+      "local r = s:gsub('(host=)[^.]*', '%1h') "
+      "local n = 0 for w in s:gmatch('te[xs]t') do n = n + 1 end "
+      "res = a .. ',' .. b .. ',' .. c .. ',' .. r:sub(-18) .. ',' .. n");
+    EXPECT_EQ("3013,3018,301,host=h.b.c; test_x,201",
+              script.get_variable<lua::string_arg_t>("res").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, CompiledPatternCache) {
+  try {
+    lua script;
+    script.exec(
+      "local function churn() "
+      "  for i = 1, 200 do string.find('x', 'y' .. i .. '+') end "
+      "end "
+      "local s = 'URL:host=a\\1\\2b' "
+      "dump = s:gsub('%c+', function(c) churn() "
+      "  return '<' .. c:gsub('.', function(x) "
+      "    return string.format('%02X', x:byte()) end) .. '>' end) "
+      "collectgarbage() "
+      "again = s:gsub('%c+', '') .. s:match('(%w+)=') "
+      "ok, err = pcall(string.match, 'abc', 'b)') "
+      "missing = select(2, pcall(string.find, 'abc', 'a[b'))");
+    EXPECT_EQ("URL:host=a<0102>b",
+              script.get_variable<lua::string_arg_t>("dump").value());
+    EXPECT_EQ("URL:host=abhost",
+              script.get_variable<lua::string_arg_t>("again").value());
+    EXPECT_EQ(false, script.get_variable<lua::bool_arg_t>("ok").value());
+    EXPECT_NE(std::string::npos,
+              script.get_variable<lua::string_arg_t>("missing").value()
+                  .find("missing"));
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, CompiledFormats) {
+  try {
+    lua script;
+    script.exec(
+      "local pad = string.rep('.', 300) "
+      "local specs = {'%d', '%5d', '%-5d|', '%05d', '%-05i', '%+d', '% d', "
+      "  '%.3d', '%x', '%04X', '%-4x|', '%#x', '%o', '%3u', '%c', '%5.1f', "
+      "  '%g', '%e', '%s', '%5s', '%-5s|', '%.2s', '%q', '%%[%s]%%'} "
+      "local values = {0, 7, -7, 255, 65535, -0.5, 3.99, 2^40, -2^52, "
+      "  2^60, 1/0, 0/0, 'ab', 'a\\0b', string.rep('z', 120), "
+      "  'q\"\\\\\\n\\r\\0x'} "
+      "diffs = 0 "
+      "for _, f in ipairs(specs) do "
+      "  for _, v in ipairs(values) do "
+      "    local ok1, r1 = pcall(string.format, f, v) "
+      "    local ok2, r2 = pcall(string.format, f .. pad, v) "
+      "    if ok2 then r2 = r2:sub(1, -301) end "
+      "    if ok1 ~= ok2 or (ok1 and r1 ~= r2) then diffs = diffs + 1 end "
+      "  end "
+      "end "
+      "res = string.format('%02X%02x %-3d|%3s|%s %q %5.2f%%', 10, 171, -4, "
+      "  'ab', 12, 'a\\nb\\0', 1/3) "
+      "local function check(...) "
+      "  local ok, err = pcall(function(...) return string.format(...) end, "
+      "                        ...) "
+      "  return (err:gsub('^.-:%d+: ', '')) "
+      "end "
+      "invalid = check('%d %y', 1) "
+      "badarg = check('%d %y', 'x') "
+      "noarg = check('%d %d', 1)");
+    EXPECT_EQ(0, script.get_variable<lua::int_arg_t>("diffs").value());
+    EXPECT_EQ(std::string("0Aab -4 | ab|12 \"a\\\nb\\000\"  0.33%"),
+              script.get_variable<lua::string_arg_t>("res").value());
+    EXPECT_EQ("invalid option '%y' to 'format'",
+              script.get_variable<lua::string_arg_t>("invalid").value());
+    EXPECT_EQ("bad argument #2 to 'format' (number expected, got string)",
+              script.get_variable<lua::string_arg_t>("badarg").value());
+    EXPECT_EQ("bad argument #3 to 'format' (number expected, got no value)",
+              script.get_variable<lua::string_arg_t>("noarg").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// A hex dump formatted per byte, with formats that are compiled and
+// cached and with the same formats ending in a `\0', which are not
+// compiled.
+const char* kFormatWorkload =
+  "local hex, line = '%02X ', '%08x: %s %q ' "
+  "if interpreted then hex, line = '%02X\\0', '%08x: %s %q\\0' end "
+  "local data = {} "
+  "for i = 1, 256 do data[i] = (i * 37) % 256 end "
+  "n = 0 "
+  "for r = 1, 1000 do "
+  "  local t = {} "
+  "  for i = 1, #data do t[i] = string.format(hex, data[i]) end "
+  "  n = n + #string.format(line, r * 16, table.concat(t), 'ascii') "
+  "end";
+
+TEST(LuaScript, DISABLED_FormatBenchmarkCompiled) {
+  try {
+    lua script;
+    script.exec(kFormatWorkload);
+    EXPECT_EQ(787000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_FormatBenchmarkInterpreted) {
+  try {
+    lua script;
+    script.exec("interpreted = true");
+    script.exec(kFormatWorkload);
+    EXPECT_EQ(787000, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, NumberConversions) {
+  try {
+    lua script;
+    script.exec(
+      "local values = {0, -0, 1, -7, 1e13, 1e14 - 1, 1e14, 2^53, 0.1, -0.5, "
+      "  1/3, 2/3, 123.456, 1e-4, 9.99999999999995e-5, 1e-5, 0.125e-3, "
+      "  12345.678901234567, 0.30000000000000004, 1/0, -1/0, 0/0, 1e300} "
+      "for i = 1, 2000 do "
+      "  values[#values + 1] = (i * 7919 % 100003) / 10 ^ (i % 19 - 6) "
+      "end "
+      "diffs = 0 "
+      "for _, x in ipairs(values) do "
+      "  if tostring(x) ~= string.format('%.14g', x) then "
+      "    diffs = diffs + 1 "
+      "  end "
+      "end "
+      "local strings = {'0.1', ' -12.5e-3 ', '1e22', '5.', '.5', '007', "
+      "  '0x1F', '-0x10', '12345678901234567890', '1e400', '1e', '.', "
+      "  '', '1 2', '0x', '1e5x'} "
+      "local r = {} "
+      "for i, s in ipairs(strings) do "
+      "  r[i] = tostring(tonumber(s)) "
+      "end "
+      "res = table.concat(r, ' ') "
+      "exact = tonumber('0.1') == 1 / 10 and tonumber('4.35') == 435 / 100 "
+      "  and 1 / tonumber('-0') < 0 and tonumber('3e-22') == 3 / 1e22");
+    EXPECT_EQ(0, script.get_variable<lua::int_arg_t>("diffs").value());
+    EXPECT_EQ("0.1 -0.0125 1e+22 5 0.5 7 31 -16 1.2345678901235e+19 inf "
+              "nil nil nil nil nil nil",
+              script.get_variable<lua::string_arg_t>("res").value());
+    EXPECT_EQ(true, script.get_variable<lua::bool_arg_t>("exact").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// 10M conversions between numbers and strings, integral and not, in
+// both directions.
+TEST(LuaScript, DISABLED_NumberConversionBenchmark) {
+  try {
+    lua script;
+    script.exec(
+      "local tostring, tonumber = tostring, tonumber "
+      "n = 0 "
+      "for i = 1, 2500000 do "
+      "  n = n + #tostring(i) + #tostring(i / 8) "
+      "  n = n + tonumber('12.5') + tonumber('0xFF') "
+      "end");
+    EXPECT_EQ(706750021, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, MappedFileSearch) {
+  try {
+    lua script;
+    if (!has_mmap(script)) return;
+    script.exec(
+      "local name = os.tmpname() "
+      "local f = io.open(name, 'wb') "
+      "f:write(string.rep('INFO ok\\n', 1000), 'ERROR disk full\\n') "
+      "f:close() "
+      "local m = assert(io.mmap(name)) "
+      "local n = 0 for w in string.gmatch(m, 'INFO') do n = n + 1 end "
+      "local i = string.find(m, 'ERROR', 1, true) "
+      "found = n .. ' ' .. i .. ' ' .. #m .. ' ' .. m[1] .. ' ' .. "
+      "  string.sub(m, i + 6, -2) .. ' ' .. string.match(m, '(%w+)\\n$') "
+      "readonly = pcall(function() m[1] = 0 end) "
+      "sliced = pcall(getmetatable(buffer.new('uint8', 1)).slice, m, 1, 9) "
+      "m:close() "
+      "closed = #m "
+      "f = io.open(name, 'rb') f:read(8) "
+      "rest = #f:read('*a') "
+      "f:close() "
+      "os.remove(name)");
+    EXPECT_EQ("1000 8001 8016 73 disk full full",
+              script.get_variable<lua::string_arg_t>("found").value());
+    EXPECT_EQ(false, script.get_variable<lua::bool_arg_t>("readonly").value());
+    EXPECT_EQ(false, script.get_variable<lua::bool_arg_t>("sliced").value());
+    EXPECT_EQ(0, script.get_variable<lua::int_arg_t>("closed").value());
+    EXPECT_EQ(8008, script.get_variable<lua::int_arg_t>("rest").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, LineScannerViewsAndBatches) {
+  try {
+    lua script;
+    script.exec(
+      "local name = os.tmpname() "
+      "local f = io.open(name, 'wb') "
+      "f:write('INFO a\\n', string.rep('x', 100000), '\\n', "
+      "        'ERROR b\\n\\nlast') "
+      "f:close() "
+      "local first, errors, long = nil, 0, 0 "
+      "for v in io.lines(name, '*v') do "
+      "  first = first or tostring(v) "
+      "  if string.find(v, 'ERROR', 1, true) then errors = errors + 1 end "
+      "  if #v > long then long = #v end "
+      "end "
+      "local sizes = {} "
+      "for t in io.lines(name, 2) do sizes[#sizes + 1] = #t end "
+      "local n = 0 for l in io.lines(name) do n = n + 1 end "
+      "res = first .. ' ' .. errors .. ' ' .. long .. ' ' .. "
+      "  table.concat(sizes, ',') .. ' ' .. n "
+      "os.remove(name)");
+    EXPECT_EQ("INFO a 1 100000 2,2,1 5",
+              script.get_variable<lua::string_arg_t>("res").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, AsyncFileIoTasks) {
+  try {
+    lua script;
+    script.exec(
+      "base = os.tmpname() "
+      "sync = aio.write(base, 'sync') and aio.read(base, 1, 2) "
+      "missing = select(3, aio.read(base .. '/none')) "
+      "done = {}");
+    for (int i = 1; i <= 8; ++i) {
+      std::ostringstream task;
+      task << "local name = base .. '." << i << "' "
+           << "assert(aio.write(name, string.rep('" << i << "', 5000))) "
+           << "assert(aio.write(name, '!', 'a')) "
+           << "local data = assert(aio.read(name)) "
+           << "os.remove(name) "
+           << "done[" << i << "] = #data .. data:sub(-2)";
+      script.spawn(task.str());
+    }
+    script.run();
+    script.exec(
+      "res = table.concat(done, ' ') "
+      "os.remove(base)");
+    EXPECT_EQ("yn", script.get_variable<lua::string_arg_t>("sync").value());
+    EXPECT_NE(0, script.get_variable<lua::int_arg_t>("missing").value());
+    EXPECT_EQ("50011! 50012! 50013! 50014! 50015! 50016! 50017! 50018!",
+              script.get_variable<lua::string_arg_t>("res").value());
+    EXPECT_EQ(0, script.poll(0));
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, TaskScheduler) {
+  try {
+    lua script;
+    script.exec("log = {} n = 0 spins = 0 other = false");
+    script.spawn("task.sleep(30) log[#log + 1] = 'slow'");
+    script.spawn("task.sleep(10) log[#log + 1] = 'fast'");
+    script.spawn("local v = task.wait('data') log[#log + 1] = 'got ' .. v");
+    script.spawn("task.yield() log[#log + 1] = 'sent ' .. "
+                 "task.signal('data', 42)");
+    script.run();
+    script.exec("res = table.concat(log, ',')");
+    EXPECT_EQ("sent 1,got 42,fast,slow",
+              script.get_variable<lua::string_arg_t>("res").value());
+
+    // A busy task is preempted and lets the other one run.
+    script.set_timeslice(1000);
+    script.spawn("while not other do spins = spins + 1 end");
+    script.spawn("other = true");
+    script.run();
+    EXPECT_LT(0, script.get_variable<lua::int_arg_t>("spins").value());
+
+    // Waiting tasks cost little more than their coroutine.
+    const int kTasks = 20000;
+    script.compact();
+    script.exec("before = collectgarbage('count')");
+    for (int i = 0; i < kTasks; ++i)
+      script.spawn("task.wait('go') n = n + 1");
+    script.run();
+    EXPECT_EQ(kTasks, script.poll(0));
+    script.exec("kb = collectgarbage('count') - before");
+    EXPECT_GT(2 * kTasks, script.get_variable<lua::int_arg_t>("kb").value());
+    EXPECT_EQ(kTasks, script.signal("go"));
+    EXPECT_EQ(0, script.poll(0));
+    EXPECT_EQ(kTasks, script.get_variable<lua::int_arg_t>("n").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+namespace {
+
+const char* kExecutorSetup =
+  "function fib(n) if n < 2 then return n end "
+  "  return fib(n - 1) + fib(n - 2) end "
+  "function check(n) if n < 0 then error('negative') end "
+  "  return n end";
+
+// Calls for the executor benchmarks: a batch of fib(kBenchFib) and one
+// by one round trips of a trivial call.
+const int kBenchCalls = 2000;
+const int kBenchFib = 15;
+const int kBenchRoundTrips = 5000;
+
+}  // namespace
+
+TEST(LuaScript, ExecutorRunsCallsOnWorkerStates) {
+  try {
+    lua_executor executor(kExecutorSetup, 3, lua_executor::PIN_TO_CORES);
+    EXPECT_EQ(3, executor.threads());
+    lua::args_t out;
+    out.add(new lua::int_arg_t());
+    std::vector<lua_executor::future> results;
+    for (int i = 0; i < 20; ++i) {
+      lua::args_t in;
+      in.add(new lua::int_arg_t(i));
+      results.push_back(executor.submit("fib", in, out));
+    }
+    int sum = 0;
+    for (int i = 0; i < 20; ++i)
+      sum += static_cast<lua::int_arg_t*>(results[i].get()[0])->value();
+    EXPECT_EQ(10945, sum);  // fib(21) - 1
+
+    lua::args_t bad;
+    bad.add(new lua::int_arg_t(-1));
+    lua_executor::future failed = executor.submit("check", bad, out);
+    try {
+      failed.get();
+      FAIL() << "error expected";
+    } catch(const lua::exception& e) {
+      EXPECT_EQ("negative", e.error());
+    }
+    EXPECT_TRUE(failed.ready());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+
+  try {
+    lua_executor broken("this is not lua", 2);
+    FAIL() << "error expected";
+  } catch(const lua::exception& e) {
+    EXPECT_EQ(1, e.line());
+  }
+}
+
+// Baseline for the executor benchmark below: the same calls on a single
+// state, one at a time, as they would run behind a mutex.
+TEST(LuaScript, DISABLED_ExecutorBenchmarkSingleState) {
+  try {
+    lua script;
+    script.exec(kExecutorSetup);
+    lua::args_t in, out;
+    in.add(new lua::int_arg_t(kBenchFib));
+    out.add(new lua::int_arg_t());
+    int sum = 0;
+    for (int i = 0; i < kBenchCalls; ++i) {
+      script.call("fib", in, out);
+      sum += static_cast<lua::int_arg_t*>(out[0])->value();
+    }
+    EXPECT_EQ(610 * kBenchCalls, sum);
+    lua::args_t one;
+    one.add(new lua::int_arg_t(1));
+    for (int i = 0; i < kBenchRoundTrips; ++i)
+      script.call("check", one, out);
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, DISABLED_ExecutorBenchmarkWorkStealing) {
+  try {
+    lua_executor executor(kExecutorSetup);
+    lua::args_t in, out;
+    in.add(new lua::int_arg_t(kBenchFib));
+    out.add(new lua::int_arg_t());
+    std::vector<lua_executor::future> results;
+    for (int i = 0; i < kBenchCalls; ++i)
+      results.push_back(executor.submit("fib", in, out));
+    int sum = 0;
+    for (int i = 0; i < kBenchCalls; ++i)
+      sum += static_cast<lua::int_arg_t*>(results[i].get()[0])->value();
+    EXPECT_EQ(610 * kBenchCalls, sum);
+    lua::args_t one;
+    one.add(new lua::int_arg_t(1));
+    for (int i = 0; i < kBenchRoundTrips; ++i)
+      executor.submit("check", one, out).get();
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+TEST(LuaScript, ChannelMessages) {
+  try {
+    lua sender, receiver;
+    sender.exec(
+      "local ch = channel.open('channel-test', 4) "
+      "local t = {1, 2.5, 'three', flag = true, nested = {x = -7}} "
+      "t.self = t t.nested.parent = t "
+      "assert(ch:send(t, nil, 'tail')) "
+      "assert(ch:send()) "
+      "bad = select(2, pcall(ch.send, ch, {print})) "
+      "ch:close() "
+      "after_close = ch:send(1)");
+    receiver.exec(
+      "local ch = channel.open('channel-test') "
+      "local ok, t, none, tail = ch:receive() "
+      "first = table.concat({tostring(ok), t[1], t[2], t[3], "
+      "  tostring(t.flag), t.nested.x, tostring(t.self == t), "
+      "  tostring(t.nested.parent == t), tostring(none), tail}, ' ') "
+      "second = select('#', ch:receive()) "
+      "local ok, why = ch:receive() "
+      "closed = tostring(ok) .. ' ' .. why");
+    EXPECT_EQ("true 1 2.5 three true -7 true true nil tail",
+              receiver.get_variable<lua::string_arg_t>("first").value());
+    EXPECT_EQ(1, receiver.get_variable<lua::int_arg_t>("second").value());
+    EXPECT_EQ("false closed",
+              receiver.get_variable<lua::string_arg_t>("closed").value());
+    EXPECT_EQ("cannot send a function",
+              sender.get_variable<lua::string_arg_t>("bad").value());
+    EXPECT_FALSE(sender.get_variable<lua::bool_arg_t>("after_close").value());
+
+    receiver.exec(
+      "local ch = channel.open('channel-test-2', 1) "
+      "local ok, why = ch:receive(10) "
+      "timeout = tostring(ok) .. ' ' .. why");
+    EXPECT_EQ("false timeout",
+              receiver.get_variable<lua::string_arg_t>("timeout").value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
+
+// Two executor threads pass kChannelMessages small tables through a
+// channel, to time the messages per second.
+TEST(LuaScript, DISABLED_ChannelBenchmarkTwoThreads) {
+  try {
+    const int kChannelMessages = 100000;
+    lua_executor executor(
+      "function produce(n) "
+      "  local ch = channel.open('channel-bench', 256) "
+      "  for i = 1, n do "
+      "    ch:send({id = i, name = 'message', values = {i, i / 2}}) "
+      "  end "
+      "  ch:close() "
+      "  return n "
+      "end "
+      "function consume() "
+      "  local ch = channel.open('channel-bench', 256) "
+      "  local n, sum = 0, 0 "
+      "  while true do "
+      "    local ok, m = ch:receive() "
+      "    if not ok then break end "
+      "    n, sum = n + 1, sum + #m.name "
+      "  end "
+      "  return n, sum "
+      "end", 2);
+    lua::args_t none, in, produced, consumed;
+    in.add(new lua::int_arg_t(kChannelMessages));
+    produced.add(new lua::int_arg_t());
+    consumed.add(new lua::int_arg_t()).add(new lua::int_arg_t());
+    lua_executor::future consumer = executor.submit("consume", none, consumed);
+    lua_executor::future producer = executor.submit("produce", in, produced);
+    EXPECT_EQ(kChannelMessages,
+              static_cast<lua::int_arg_t*>(producer.get()[0])->value());
+    EXPECT_EQ(kChannelMessages,
+              static_cast<lua::int_arg_t*>(consumer.get()[0])->value());
+    EXPECT_EQ(7 * kChannelMessages,
+              static_cast<lua::int_arg_t*>(consumer.get()[1])->value());
+  } catch(const lua::exception& e) {
+    FAIL() << "error: " << e.error() << ", line " << e.line();
+  }
+}
@@ -0,0 +1,83 @@
+-- Module translated to C by `luac -c native_test' at build time for
+-- luascript_unittest.cpp. It goes through every opcode of the VM.
+
+local M = {}
+
+local function fib(n)
+  if n < 2 then return n end
+  return fib(n - 1) + fib(n - 2)
+end
+M.fib = fib
+
+function M.checksum(data)
+  local sum, x = 0, 1
+  for i = 1, #data do
+    local b = data:byte(i)
+    sum = (sum + b * i) % 65521
+    x = x * 2 % 7 - 1 / 4 + 2 ^ 2 - (-b)
+  end
+  return sum, x
+end
+
+function M.fields(s)
+  local t, n = {}, 0
+  for k, v in s:gmatch("(%w+)=(%w+)") do
+    n = n + 1
+    t[k] = tonumber(v) or v
+  end
+  return n, t
+end
+
+function M.list(...)
+  local t = {...}
+  local n = select("#", ...)
+  return n, #t, t[1], t[n], {1, 2, 3, ...}
+end
+
+function M.counter(step)
+  local count = 0
+  return function(d)
+    count = count + (d or step)
+    return count
+  end
+end
+
+function M.tail(n)
+  if n == 0 then return "done" end
+  return M.tail(n - 1)
+end
+
+function M.depth(n)
+  if n == 0 then return 0 end
+  return 1 + M.depth(n - 1)
+end
+
+function M.compare(a, b)
+  return a == b, a ~= b, a < b, a <= b, not a, a and b or "neither"
+end
+
+function M.concat(a, b)
+  return a .. "-" .. b .. "-" .. #a
+end
+
+local V = setmetatable({}, {
+  __add = function(a, b) return "added" end,
+  __index = function(t, k) return k .. "!" end,
+})
+
+function M.meta()
+  return V + 1, V.name, #V
+end
+
+function M.bad(x)
+  return x.field
+end
+
+function M.produce(n)
+  for i = 1, n do coroutine.yield(i) end
+  return "produced"
+end
+
+M.loaded = ...
+
+return M